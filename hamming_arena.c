@@ -0,0 +1,408 @@
+#include "hamming_arena.h"
+#include "hamming_fast_logic.h"
+
+#include <errno.h>
+#include <sys/mman.h>
+
+/**
+ * \file hamming_arena.c
+ * \brief Protected arena allocator for long lived objects
+ *
+ * Every size class keeps a list of partially used pages, and every page keeps
+ * a bitmap of its free objects, so allocating and freeing are a list head
+ * lookup plus a find first set over at most four words. Pages that empty out
+ * go back on a free page stack and can be handed to any size class.
+ *
+ * Code sets are stored in their own table indexed by page number, so a verify
+ * pass streams through codes and data linearly.
+ */
+
+// pages handed to a verify thread at a time
+#define HAMMING_ARENA_VERIFY_CHUNK 64
+
+static uint8_t *hamming_arena_page(hamming_arena_t *arena, size_t page){
+	return arena->base + page*HAMMING_ARENA_PAGE_SIZE;
+}
+
+static pthread_mutex_t *hamming_arena_stripe(hamming_arena_t *arena, size_t page){
+	return &arena->stripe[page % HAMMING_ARENA_STRIPES];
+}
+
+static int hamming_arena_class(size_t size){
+	if(size <= (1 << HAMMING_ARENA_MIN_SHIFT)){
+		return 0;
+	}
+	// ceil(log2(size))
+	return (64 - __builtin_clzll(size - 1)) - HAMMING_ARENA_MIN_SHIFT;
+}
+
+static int hamming_arena_objects(int size_class){
+	return HAMMING_ARENA_PAGE_SIZE >> (size_class + HAMMING_ARENA_MIN_SHIFT);
+}
+
+static void hamming_arena_list_push(hamming_arena_t *arena, uint32_t *head, uint32_t page){
+	arena->pages[page].prev = HAMMING_ARENA_NIL;
+	arena->pages[page].next = *head;
+	if(*head != HAMMING_ARENA_NIL){
+		arena->pages[*head].prev = page;
+	}
+	*head = page;
+}
+
+static void hamming_arena_list_remove(hamming_arena_t *arena, uint32_t *head, uint32_t page){
+	hamming_arena_page_t *meta = &arena->pages[page];
+	if(meta->prev != HAMMING_ARENA_NIL){
+		arena->pages[meta->prev].next = meta->next;
+	}else{
+		*head = meta->next;
+	}
+	if(meta->next != HAMMING_ARENA_NIL){
+		arena->pages[meta->next].prev = meta->prev;
+	}
+}
+
+/**
+ * \brief Hand a page to a size class
+ *
+ * Reused pages still match their codes, since freeing never touches data.
+ * Fresh pages are encoded once here.
+ *
+ * \return Page index, or HAMMING_ARENA_NIL if the arena is full
+ */
+static uint32_t hamming_arena_page_get(hamming_arena_t *arena, int size_class){
+	hamming_arena_page_t *meta;
+	uint32_t page;
+	int objects, i;
+
+	if(arena->free_pages != HAMMING_ARENA_NIL){
+		page = arena->free_pages;
+		arena->free_pages = arena->pages[page].next;
+	}else if(arena->page_count < arena->max_pages){
+		page = arena->page_count;
+		pthread_mutex_lock(hamming_arena_stripe(arena, page));
+		logic_set(&arena->codes[page], (row_t*)hamming_arena_page(arena, page), HAMMING_ARENA_ROWS);
+		pthread_mutex_unlock(hamming_arena_stripe(arena, page));
+		__atomic_store_n(&arena->page_count, page + 1, __ATOMIC_RELEASE);
+	}else{
+		return HAMMING_ARENA_NIL;
+	}
+
+	meta = &arena->pages[page];
+	objects = hamming_arena_objects(size_class);
+	CLEAR_MEM(meta->free);
+	for(i = 0;i < objects/64;i++){
+		meta->free[i] = ~(uint64_t)0;
+	}
+	if(objects % 64){
+		meta->free[0] = ((uint64_t)1 << objects) - 1;
+	}
+	meta->used = 0;
+	__atomic_store_n(&meta->size_class, size_class, __ATOMIC_RELEASE);
+	hamming_arena_list_push(arena, &arena->partial[size_class], page);
+	return page;
+}
+
+/**
+ * \brief Allocate an object
+ *
+ * The contents are whatever was last committed at that spot, write the
+ * object and commit it before relying on protection.
+ *
+ * \param[in] arena			Arena to allocate from
+ * \param[in] size			Object size, up to a page
+ *
+ * \return Pointer to the object, NULL if the arena is full
+ */
+void *hamming_arena_alloc(hamming_arena_t *arena, size_t size){
+	hamming_arena_page_t *meta;
+	uint32_t page;
+	int size_class, i, bit;
+
+	if(size > HAMMING_ARENA_PAGE_SIZE){
+		return NULL;
+	}
+	size_class = hamming_arena_class(size);
+
+	pthread_mutex_lock(&arena->lock);
+	page = arena->partial[size_class];
+	if(page == HAMMING_ARENA_NIL){
+		page = hamming_arena_page_get(arena, size_class);
+		if(page == HAMMING_ARENA_NIL){
+			pthread_mutex_unlock(&arena->lock);
+			return NULL;
+		}
+	}
+	meta = &arena->pages[page];
+	for(i = 0;meta->free[i] == 0;i++);
+	bit = __builtin_ctzll(meta->free[i]);
+	meta->free[i] &= ~((uint64_t)1 << bit);
+	meta->used++;
+	if(meta->used == hamming_arena_objects(size_class)){
+		hamming_arena_list_remove(arena, &arena->partial[size_class], page);
+	}
+	pthread_mutex_unlock(&arena->lock);
+
+	return hamming_arena_page(arena, page) + ((i*64 + bit) << (size_class + HAMMING_ARENA_MIN_SHIFT));
+}
+
+/**
+ * \brief Free an object
+ *
+ * \param[in] arena			Arena the object came from
+ * \param[in] ptr			Object to free
+ *
+ * \return -EFAULT if the arena doesn't own ptr, -EINVAL on a double free,
+ * 0 otherwise
+ */
+int hamming_arena_free(hamming_arena_t *arena, void *ptr){
+	hamming_arena_page_t *meta;
+	size_t offset;
+	uint32_t page;
+	int size_class, index, objects;
+
+	if(ptr == NULL){
+		return 0;
+	}
+	offset = (uint8_t*)ptr - arena->base;
+	page = offset/HAMMING_ARENA_PAGE_SIZE;
+
+	pthread_mutex_lock(&arena->lock);
+	if((uint8_t*)ptr < arena->base || page >= arena->page_count ||
+	   arena->pages[page].size_class == HAMMING_ARENA_CLASS_NONE){
+		pthread_mutex_unlock(&arena->lock);
+		return -EFAULT;
+	}
+	meta = &arena->pages[page];
+	size_class = meta->size_class;
+	index = (offset % HAMMING_ARENA_PAGE_SIZE) >> (size_class + HAMMING_ARENA_MIN_SHIFT);
+	if(meta->free[index/64] & ((uint64_t)1 << (index%64))){
+		pthread_mutex_unlock(&arena->lock);
+		return -EINVAL;
+	}
+	meta->free[index/64] |= (uint64_t)1 << (index%64);
+	objects = hamming_arena_objects(size_class);
+	if(meta->used == objects){
+		hamming_arena_list_push(arena, &arena->partial[size_class], page);
+	}
+	meta->used--;
+	if(meta->used == 0){
+		hamming_arena_list_remove(arena, &arena->partial[size_class], page);
+		__atomic_store_n(&meta->size_class, HAMMING_ARENA_CLASS_NONE, __ATOMIC_RELEASE);
+		meta->next = arena->free_pages;
+		arena->free_pages = page;
+	}
+	pthread_mutex_unlock(&arena->lock);
+	return 0;
+}
+
+/**
+ * \brief Re-encode the page holding an object
+ *
+ * \param[in] arena			Arena the object came from
+ * \param[in] ptr			Any pointer into the object
+ */
+void hamming_arena_commit(hamming_arena_t *arena, void *ptr){
+	size_t page = ((uint8_t*)ptr - arena->base)/HAMMING_ARENA_PAGE_SIZE;
+
+	pthread_mutex_lock(hamming_arena_stripe(arena, page));
+	logic_set(&arena->codes[page], (row_t*)hamming_arena_page(arena, page), HAMMING_ARENA_ROWS);
+	pthread_mutex_unlock(hamming_arena_stripe(arena, page));
+	__atomic_fetch_add(&arena->stats.commits, 1, __ATOMIC_RELAXED);
+}
+
+/**
+ * \brief Verify chunks of pages until there are none left
+ *
+ * Shared by the pool threads and the caller of verify_all, chunks are handed
+ * out through an atomic counter.
+ */
+static void hamming_arena_verify_pages(hamming_arena_t *arena){
+	hamming_code_set_t set;
+	size_t page, end, page_count;
+	uint64_t verified = 0;
+	int corrected = 0;
+	int failed = 0;
+	int ret;
+
+	page_count = __atomic_load_n(&arena->page_count, __ATOMIC_ACQUIRE);
+	while((page = __atomic_fetch_add(&arena->pool.next_page, HAMMING_ARENA_VERIFY_CHUNK,
+					 __ATOMIC_RELAXED)) < page_count){
+		end = page + HAMMING_ARENA_VERIFY_CHUNK;
+		if(end > page_count){
+			end = page_count;
+		}
+		for(;page < end;page++){
+			if(__atomic_load_n(&arena->pages[page].size_class, __ATOMIC_ACQUIRE) == HAMMING_ARENA_CLASS_NONE){
+				continue;
+			}
+			pthread_mutex_lock(hamming_arena_stripe(arena, page));
+			logic_set(&set, (row_t*)hamming_arena_page(arena, page), HAMMING_ARENA_ROWS);
+			if(memcmp(&set, &arena->codes[page], sizeof(set)) != 0){
+				ret = correct_set(&set, &arena->codes[page],
+						  (row_t*)hamming_arena_page(arena, page), HAMMING_ARENA_ROWS);
+				if(ret < 0){
+					failed++;
+				}else{
+					corrected += ret;
+				}
+			}
+			pthread_mutex_unlock(hamming_arena_stripe(arena, page));
+			verified++;
+		}
+	}
+
+	pthread_mutex_lock(&arena->pool.lock);
+	arena->pool.corrected += corrected;
+	arena->pool.failed += failed;
+	arena->stats.verified += verified;
+	pthread_mutex_unlock(&arena->pool.lock);
+}
+
+static void *hamming_arena_pool_main(void *arg){
+	hamming_arena_t *arena = arg;
+	uint64_t seen = 0;
+
+	pthread_mutex_lock(&arena->pool.lock);
+	while(true){
+		while(arena->pool.generation == seen && arena->pool.stop == false){
+			pthread_cond_wait(&arena->pool.start, &arena->pool.lock);
+		}
+		if(arena->pool.stop){
+			break;
+		}
+		seen = arena->pool.generation;
+		pthread_mutex_unlock(&arena->pool.lock);
+
+		hamming_arena_verify_pages(arena);
+
+		pthread_mutex_lock(&arena->pool.lock);
+		arena->pool.running--;
+		if(arena->pool.running == 0){
+			pthread_cond_signal(&arena->pool.done);
+		}
+	}
+	pthread_mutex_unlock(&arena->pool.lock);
+	return NULL;
+}
+
+/**
+ * \brief Verify and correct every page in use
+ *
+ * The caller works alongside the pool threads.
+ *
+ * \return -EIO if any page was uncorrectable, bits corrected otherwise
+ */
+int hamming_arena_verify_all(hamming_arena_t *arena){
+	int ret;
+
+	pthread_mutex_lock(&arena->pool.serial);
+	pthread_mutex_lock(&arena->pool.lock);
+	arena->pool.next_page = 0;
+	arena->pool.corrected = 0;
+	arena->pool.failed = 0;
+	arena->pool.running = arena->pool.count;
+	arena->pool.generation++;
+	pthread_cond_broadcast(&arena->pool.start);
+	pthread_mutex_unlock(&arena->pool.lock);
+
+	hamming_arena_verify_pages(arena);
+
+	pthread_mutex_lock(&arena->pool.lock);
+	while(arena->pool.running){
+		pthread_cond_wait(&arena->pool.done, &arena->pool.lock);
+	}
+	ret = arena->pool.failed ? -EIO : arena->pool.corrected;
+	arena->stats.corrected += arena->pool.corrected;
+	arena->stats.failed += arena->pool.failed;
+	pthread_mutex_unlock(&arena->pool.lock);
+	pthread_mutex_unlock(&arena->pool.serial);
+	return ret;
+}
+
+static void *hamming_arena_map(size_t len){
+	void *ptr = mmap(NULL, len, PROT_READ | PROT_WRITE,
+			 MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+	return ptr == MAP_FAILED ? NULL : ptr;
+}
+
+/**
+ * \brief Create an arena
+ *
+ * Address space for data, codes and bookkeeping is reserved up front, the
+ * kernel only backs what gets touched.
+ *
+ * \param[out] arena		Arena to initialize
+ * \param[in] max_bytes		Most memory the arena can hand out
+ * \param[in] threads		Threads used by verify_all, including the caller
+ *
+ * \return Negative on failure, 0 otherwise
+ */
+int hamming_arena_init(hamming_arena_t *arena, size_t max_bytes, int threads){
+	int i, ret;
+
+	if(threads <= 0 || threads > HAMMING_ARENA_THREADS_MAX + 1){
+		return -EINVAL;
+	}
+	CLEAR_MEM(*arena);
+	arena->max_pages = (max_bytes + HAMMING_ARENA_PAGE_SIZE - 1)/HAMMING_ARENA_PAGE_SIZE;
+	if(arena->max_pages == 0 || arena->max_pages >= HAMMING_ARENA_NIL){
+		return -EINVAL;
+	}
+	arena->base = hamming_arena_map(arena->max_pages*HAMMING_ARENA_PAGE_SIZE);
+	arena->codes = hamming_arena_map(arena->max_pages*sizeof(hamming_code_set_t));
+	arena->pages = hamming_arena_map(arena->max_pages*sizeof(hamming_arena_page_t));
+	if(arena->base == NULL || arena->codes == NULL || arena->pages == NULL){
+		hamming_arena_close(arena);
+		return -ENOMEM;
+	}
+
+	pthread_mutex_init(&arena->lock, NULL);
+	for(i = 0;i < HAMMING_ARENA_CLASSES;i++){
+		arena->partial[i] = HAMMING_ARENA_NIL;
+	}
+	arena->free_pages = HAMMING_ARENA_NIL;
+	for(i = 0;i < HAMMING_ARENA_STRIPES;i++){
+		pthread_mutex_init(&arena->stripe[i], NULL);
+	}
+
+	pthread_mutex_init(&arena->pool.serial, NULL);
+	pthread_mutex_init(&arena->pool.lock, NULL);
+	pthread_cond_init(&arena->pool.start, NULL);
+	pthread_cond_init(&arena->pool.done, NULL);
+	for(i = 0;i < threads - 1;i++){
+		ret = pthread_create(&arena->pool.threads[i], NULL, hamming_arena_pool_main, arena);
+		if(ret){
+			hamming_arena_close(arena);
+			return -ret;
+		}
+		arena->pool.count++;
+	}
+	return 0;
+}
+
+void hamming_arena_close(hamming_arena_t *arena){
+	int i;
+
+	if(arena->pool.count){
+		pthread_mutex_lock(&arena->pool.lock);
+		arena->pool.stop = true;
+		pthread_cond_broadcast(&arena->pool.start);
+		pthread_mutex_unlock(&arena->pool.lock);
+		for(i = 0;i < arena->pool.count;i++){
+			pthread_join(arena->pool.threads[i], NULL);
+		}
+		arena->pool.count = 0;
+	}
+	if(arena->base){
+		munmap(arena->base, arena->max_pages*HAMMING_ARENA_PAGE_SIZE);
+	}
+	if(arena->codes){
+		munmap(arena->codes, arena->max_pages*sizeof(hamming_code_set_t));
+	}
+	if(arena->pages){
+		munmap(arena->pages, arena->max_pages*sizeof(hamming_arena_page_t));
+	}
+	arena->base = NULL;
+	arena->codes = NULL;
+	arena->pages = NULL;
+}
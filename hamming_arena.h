@@ -0,0 +1,94 @@
+#ifndef HAMMING_ARENA_H
+#define HAMMING_ARENA_H
+
+#include "hamming_fast.h"
+#include "hamming_fast_logic.h"
+
+#include <pthread.h>
+
+#define HAMMING_ARENA_PAGE_SIZE 4096
+#define HAMMING_ARENA_ROWS (HAMMING_ARENA_PAGE_SIZE/sizeof(row_t))
+
+// size classes are powers of two from 16 bytes up to a whole page
+#define HAMMING_ARENA_MIN_SHIFT 4
+#define HAMMING_ARENA_CLASSES 9
+#define HAMMING_ARENA_CLASS_NONE 0xFF
+#define HAMMING_ARENA_NIL 0xFFFFFFFF
+
+#define HAMMING_ARENA_STRIPES 64
+#define HAMMING_ARENA_THREADS_MAX 32
+
+/**
+ * \brief Allocator bookkeeping for one protected page
+ *
+ * Kept outside of the page so allocating and freeing never changes protected
+ * data, only commits do.
+ */
+typedef struct{
+	uint64_t free[HAMMING_ARENA_PAGE_SIZE >> HAMMING_ARENA_MIN_SHIFT >> 6]; // bitmap of free objects
+	uint32_t next; // partial list for the size class, or free page stack
+	uint32_t prev;
+	uint16_t used;
+	uint8_t size_class;
+} hamming_arena_page_t;
+
+/**
+ * \brief Arena of protected pages
+ *
+ * Objects live in 4K pages dedicated to one size class, and each page has a
+ * code set in a separate contiguous table. Pages are encoded when they are
+ * handed to a size class and whenever the owner commits an object on them.
+ *
+ * Writes to an object aren't protected until it is committed, and must not
+ * race verify_all, since verify would take them for bit flips.
+ */
+typedef struct{
+	uint8_t *base;
+	size_t max_pages;
+	size_t page_count; // pages handed out so far (bump pointer)
+
+	hamming_code_set_t *codes;
+	hamming_arena_page_t *pages;
+
+	pthread_mutex_t lock; // allocator state
+	uint32_t partial[HAMMING_ARENA_CLASSES];
+	uint32_t free_pages;
+
+	pthread_mutex_t stripe[HAMMING_ARENA_STRIPES]; // commit vs verify, per page
+
+	// verify thread pool
+	struct{
+		pthread_t threads[HAMMING_ARENA_THREADS_MAX];
+		int count;
+		pthread_mutex_t serial; // one verify_all at a time
+		pthread_mutex_t lock;
+		pthread_cond_t start;
+		pthread_cond_t done;
+		uint64_t generation;
+		int running;
+		bool stop;
+		size_t next_page;
+		int corrected;
+		int failed;
+	} pool;
+
+	struct{
+		uint64_t commits;
+		uint64_t verified;
+		uint64_t corrected;
+		uint64_t failed; // pages verify couldn't correct
+	} stats;
+} hamming_arena_t;
+
+extern int hamming_arena_init(hamming_arena_t *arena, size_t max_bytes, int threads);
+extern void hamming_arena_close(hamming_arena_t *arena);
+
+extern void *hamming_arena_alloc(hamming_arena_t *arena, size_t size);
+extern int hamming_arena_free(hamming_arena_t *arena, void *ptr);
+
+// re-encode the page holding ptr
+extern void hamming_arena_commit(hamming_arena_t *arena, void *ptr);
+// verify every page in use with the thread pool, returns bits corrected or -EIO
+extern int hamming_arena_verify_all(hamming_arena_t *arena);
+
+#endif
@@ -0,0 +1,190 @@
+#include "hamming_fast.h"
+#include "hamming_arena.h"
+#include "hamming_check.h"
+
+#include <errno.h>
+
+/*
+  Checks for hamming_arena_t
+
+  Walks every size class, fills a page of small objects and frees it back
+  onto the free page stack, then commits a few hundred whole page objects,
+  flips bits behind the arena's back and has the verify thread pool find
+  and fix them.
+
+  usage: arena_test [pages] [threads]
+ */
+
+static size_t page_of(hamming_arena_t *arena, void *ptr){
+	return ((uint8_t*)ptr - arena->base)/HAMMING_ARENA_PAGE_SIZE;
+}
+
+static uint64_t xorshift(uint64_t *state){
+	uint64_t x = *state;
+	x ^= x << 13;
+	x ^= x >> 7;
+	x ^= x << 17;
+	return *state = x;
+}
+
+static void test_classes(hamming_arena_t *arena){
+	uint8_t *ptr[HAMMING_ARENA_CLASSES], *other;
+	size_t size, page;
+	int i;
+
+	for(i = 0;i < HAMMING_ARENA_CLASSES;i++){
+		// one byte past the next smaller class still lands in this one
+		size = i == 0 ? 1 : ((size_t)1 << (i + HAMMING_ARENA_MIN_SHIFT - 1)) + 1;
+		ptr[i] = hamming_arena_alloc(arena, size);
+		CHECK(ptr[i] != NULL, "no object for %zu bytes", size);
+		if(ptr[i] == NULL){
+			return;
+		}
+		page = page_of(arena, ptr[i]);
+		CHECK(arena->pages[page].size_class == i, "%zu bytes went to class %d instead of %d",
+		      size, arena->pages[page].size_class, i);
+		CHECK((((uintptr_t)ptr[i]) & (((uintptr_t)1 << (i + HAMMING_ARENA_MIN_SHIFT)) - 1)) == 0,
+		      "class %d object isn't aligned to its size", i);
+	}
+	CHECK(hamming_arena_alloc(arena, HAMMING_ARENA_PAGE_SIZE + 1) == NULL, "allocated more than a page");
+	// keeps ptr[0]'s page in use, so freeing it twice is a double free
+	other = hamming_arena_alloc(arena, 1);
+	CHECK(other != NULL && page_of(arena, other) == page_of(arena, ptr[0]),
+	      "second small object didn't share the partial page");
+	for(i = 0;i < HAMMING_ARENA_CLASSES;i++){
+		CHECK(hamming_arena_free(arena, ptr[i]) == 0, "freeing class %d failed", i);
+	}
+	CHECK(hamming_arena_free(arena, ptr[0]) == -EINVAL, "double free not caught");
+	CHECK(hamming_arena_free(arena, other) == 0, "freeing the last object failed");
+	CHECK(hamming_arena_free(arena, other) == -EFAULT, "free of an object on a free page not caught");
+	CHECK(hamming_arena_free(arena, &failures) == -EFAULT, "foreign pointer not caught");
+}
+
+static void test_free_pages(hamming_arena_t *arena){
+	const int objects = HAMMING_ARENA_PAGE_SIZE >> HAMMING_ARENA_MIN_SHIFT;
+	uint8_t **ptr = calloc(objects + 1, sizeof(uint8_t*));
+	size_t first, page_count;
+	uint8_t *big;
+	int i;
+
+	for(i = 0;i <= objects;i++){
+		ptr[i] = hamming_arena_alloc(arena, 16);
+		if(ptr[i] == NULL){
+			CHECK(false, "arena full after %d objects", i);
+			free(ptr);
+			return;
+		}
+	}
+	// the bitmap hands out a whole page before moving on
+	first = page_of(arena, ptr[0]);
+	for(i = 1;i < objects;i++){
+		if(page_of(arena, ptr[i]) != first){
+			CHECK(false, "object %d of a full page spilled onto page %zu", i, page_of(arena, ptr[i]));
+			break;
+		}
+	}
+	CHECK(page_of(arena, ptr[objects]) != first, "more objects than fit on a page");
+
+	// an emptied page goes on the free page stack and can change class
+	for(i = 0;i < objects;i++){
+		hamming_arena_free(arena, ptr[i]);
+	}
+	CHECK(arena->free_pages == first, "emptied page %zu isn't on top of the free page stack", first);
+	page_count = arena->page_count;
+	big = hamming_arena_alloc(arena, HAMMING_ARENA_PAGE_SIZE);
+	CHECK(big != NULL && page_of(arena, big) == first && arena->page_count == page_count,
+	      "page from the free stack wasn't reused");
+	hamming_arena_free(arena, big);
+	hamming_arena_free(arena, ptr[objects]);
+	free(ptr);
+}
+
+static void test_verify(hamming_arena_t *arena, size_t pages){
+	uint8_t **ptr = calloc(pages, sizeof(uint8_t*));
+	hamming_code_set_t *codes;
+	uint64_t state = 0x2545F4914F6CDD1DULL;
+	size_t i, j, flipped = 0;
+	int ret;
+
+	for(i = 0;i < pages;i++){
+		ptr[i] = hamming_arena_alloc(arena, HAMMING_ARENA_PAGE_SIZE);
+		if(ptr[i] == NULL){
+			CHECK(false, "arena full after %zu pages", i);
+			pages = i;
+			break;
+		}
+		for(j = 0;j < HAMMING_ARENA_PAGE_SIZE;j++){
+			ptr[i][j] = (uint8_t)(i ^ j);
+		}
+		hamming_arena_commit(arena, ptr[i]);
+	}
+	ret = hamming_arena_verify_all(arena);
+	CHECK(ret == 0, "verify of committed pages returned %d", ret);
+
+	// one flip on every seventh page
+	for(i = 0;i < pages;i += 7){
+		ptr[i][16 + xorshift(&state) % (HAMMING_ARENA_PAGE_SIZE - 16)] ^= 1 << (i % 8);
+		flipped++;
+	}
+	ret = hamming_arena_verify_all(arena);
+	CHECK(ret == (int)flipped, "verify corrected %d of %zu flips", ret, flipped);
+	for(i = 0;i < pages;i++){
+		for(j = 0;j < HAMMING_ARENA_PAGE_SIZE;j++){
+			if(ptr[i][j] != (uint8_t)(i ^ j)){
+				CHECK(false, "page %zu byte %zu not restored", i, j);
+				i = pages;
+				break;
+			}
+		}
+	}
+	CHECK(hamming_arena_verify_all(arena) == 0, "arena not clean after correcting");
+
+	// stored codes whose redundant copies disagree can't be trusted
+	if(pages){
+		codes = &arena->codes[page_of(arena, ptr[0])];
+		ptr[0][40] ^= 1;
+		((uint8_t*)codes->second_set[1])[0] ^= 1;
+		ret = hamming_arena_verify_all(arena);
+		CHECK(ret == -EIO, "uncorrectable page gave %d", ret);
+		CHECK(arena->stats.failed == 1, "%lu failed pages instead of 1", arena->stats.failed);
+		ptr[0][40] ^= 1;
+		hamming_arena_commit(arena, ptr[0]);
+		CHECK(hamming_arena_verify_all(arena) == 0, "recommitted page still bad");
+	}
+
+	for(i = 0;i < pages;i++){
+		hamming_arena_free(arena, ptr[i]);
+	}
+	free(ptr);
+}
+
+int main(int argc, char **argv){
+	size_t pages = argc > 1 ? strtoull(argv[1], NULL, 0) : 512;
+	int threads = argc > 2 ? atoi(argv[2]) : 4;
+	hamming_arena_t arena;
+	int ret;
+
+	if(pages == 0 || threads <= 0){
+		printf("usage: %s [pages] [threads]\n", argv[0]);
+		return 1;
+	}
+	ret = hamming_arena_init(&arena, (pages + 16)*HAMMING_ARENA_PAGE_SIZE, threads);
+	if(ret < 0){
+		printf("can't create arena (%d)\n", ret);
+		return 1;
+	}
+	test_classes(&arena);
+	test_free_pages(&arena);
+	test_verify(&arena, pages);
+	hamming_arena_close(&arena);
+
+	ret = hamming_arena_init(&arena, HAMMING_ARENA_PAGE_SIZE, 1);
+	CHECK(ret == 0, "can't create one page arena (%d)", ret);
+	if(ret == 0){
+		CHECK(hamming_arena_alloc(&arena, HAMMING_ARENA_PAGE_SIZE) != NULL, "one page arena is empty");
+		CHECK(hamming_arena_alloc(&arena, 16) == NULL, "full arena handed out an object");
+		hamming_arena_close(&arena);
+	}
+
+	return check_done("arena_test");
+}
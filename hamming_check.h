@@ -0,0 +1,23 @@
+#ifndef HAMMING_CHECK_H
+#define HAMMING_CHECK_H
+
+#include <stdio.h>
+
+/*
+  Shared by the tests and benches that check what they run
+
+  CHECK reports a failed condition with its file and line and counts it,
+  check_done prints the verdict. A program exits with what check_done
+  returns, non-zero if anything failed, so make test stops on it.
+ */
+
+static int failures;
+
+#define CHECK(cond, ...) do{ if(!(cond)){ printf("FAIL %s:%d: ", __FILE__, __LINE__); printf(__VA_ARGS__); printf("\n"); failures++; } }while(0)
+
+static int check_done(const char *name){
+	printf("%s: %s\n", name, failures ? "FAILED" : "ok");
+	return failures != 0;
+}
+
+#endif
@@ -19,6 +19,39 @@ void logic_set(hamming_code_set_t *set,
 	memcpy(set->second_set[2], set->second_set[0], sizeof(set->second_set[0]));
 }
 
+// fused memcpy and logic_set, dst and board must not overlap
+void logic_set_copy(hamming_code_set_t *set, row_t *dst,
+		    const row_t *board, int size){
+	const int first_set_len = sizeof(set->first_set)/sizeof(row_t);
+	const int second_set_len = sizeof(set->second_set[0])/sizeof(row_t);
+
+	CLEAR_MEM(*set);
+	logic_copy(set->first_set, first_set_len, dst, board, size);
+	logic(set->second_set[0], second_set_len,
+	      set->first_set, first_set_len);
+	memcpy(set->second_set[1], set->second_set[0], sizeof(set->second_set[0]));
+	memcpy(set->second_set[2], set->second_set[0], sizeof(set->second_set[0]));
+}
+
+// update a set after row changed from old_row to new_row, instead of
+// recomputing it from the whole board
+void logic_set_delta(hamming_code_set_t *set, int row,
+		     row_t old_row, row_t new_row){
+	const int first_set_len = sizeof(set->first_set)/sizeof(row_t);
+	const int second_set_len = sizeof(set->second_set[0])/sizeof(row_t);
+	const row_t delta = old_row ^ new_row;
+	int b;
+
+	for(b = 0;b < first_set_len;b++){
+		if((1 << b) & row) set->first_set[b] ^= delta;
+	}
+	// second set only covers 9 rows, cheaper to redo than to track
+	CLEAR_MEM(set->second_set[0]);
+	logic(set->second_set[0], second_set_len,
+	      set->first_set, first_set_len);
+	memcpy(set->second_set[1], set->second_set[0], sizeof(set->second_set[0]));
+	memcpy(set->second_set[2], set->second_set[0], sizeof(set->second_set[0]));
+}
 
 // Any errors detected with Hamming codes themselves are corrected here
 
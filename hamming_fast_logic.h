@@ -11,8 +11,13 @@ typedef struct{
 // operators on hamming_code_sets (precoded with 256->9->4x3
 extern int get_errors_set(hamming_code_set_t*, hamming_code_set_t*,
 		      int *iter, int *bit, int iter_bit_size);
+// row 0 of the board is in no code (see below), a flip there goes unnoticed
 extern void logic_set(hamming_code_set_t*,
 		      const row_t*, int);
+extern void logic_set_copy(hamming_code_set_t*, row_t*,
+			   const row_t*, int);
+extern void logic_set_delta(hamming_code_set_t*, int,
+			    row_t, row_t);
 extern int correct_set(hamming_code_set_t *first_set,
 			hamming_code_set_t *second_set,
 			row_t *board, int board_size);
@@ -41,6 +41,25 @@ void logic(row_t *codes, int code_length,
 	}
 }
 
+// same as logic, but copies data into dst on the way through, so the data
+// is only read once
+void logic_copy(row_t *codes, int code_length,
+		row_t *dst, const row_t *data, int data_length){
+	int a;
+	int b;
+	if(code_length > 255){
+		printf("data_length is too long\n");
+		raise(SIGINT);
+	}
+	for(a = 0;a < data_length;a++){
+		const row_t tmp_data = data[a];
+		dst[a] = tmp_data;
+		for(b = 0;b < code_length;b++){
+			if((1 << b) & a) codes[b] ^= tmp_data;
+		}
+	}
+}
+
 int get_errors(const row_t *old_codes, const row_t *new_codes, int size,
 	       int *iter, int *bit, int iter_bit_size){
 	int a, b, i, j;
@@ -74,12 +93,12 @@ int get_errors(const row_t *old_codes, const row_t *new_codes, int size,
   4. Return number of total bits corrected
  */
 
-static row_t temp_codes[16];
-static int temp_iter[256];
-static int temp_bit[256];
-
 int correct(row_t *codes, int codes_size,
 	    row_t *board, int board_size){
+	// on the stack so multiple threads can correct different pages
+	row_t temp_codes[16];
+	int temp_iter[256];
+	int temp_bit[256];
 	int error_count = 0;
 	int i;
 	CLEAR_MEM(temp_codes);
@@ -8,6 +8,7 @@
 extern int get_errors(const row_t *first_codes, const row_t *second_codes, int size,
 		      int *iter, int *bit, int iter_bit_size);
 extern void logic(row_t*, int, const row_t*, int);
+extern void logic_copy(row_t*, int, row_t*, const row_t*, int);
 extern int correct(row_t *new_codes, int new_codes_size,
 		    row_t *board, int board_size);
 
@@ -0,0 +1,413 @@
+#include "hamming_lazy.h"
+#include "hamming_fast_logic.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <linux/userfaultfd.h>
+
+/**
+ * \file hamming_lazy.c
+ * \brief Verify on first touch for large mapped datasets
+ *
+ * Registers an anonymous mapping with userfaultfd in MISSING mode, so the
+ * kernel hands us every first access to a page. We fill the page from the
+ * backing file, check it against its stored code set, fix what we can and
+ * UFFDIO_COPY it in, which wakes the faulting thread. A page that can't be
+ * fixed is never handed out, the reader gets a signal instead.
+ *
+ * Startup cost is the two mmap calls and the registration, independent of
+ * the size of the dataset.
+ */
+
+/**
+ * \brief Read one page of the data file
+ *
+ * Short reads at the end of the file leave the tail zeroed, which is what the
+ * encoder saw as well.
+ */
+static int hamming_lazy_read_page(int fd, size_t page, row_t *buf){
+	uint8_t *ptr = (uint8_t*)buf;
+	size_t done = 0;
+	ssize_t ret;
+
+	while(done < HAMMING_LAZY_PAGE_SIZE){
+		ret = pread(fd, ptr + done, HAMMING_LAZY_PAGE_SIZE - done,
+			    page*HAMMING_LAZY_PAGE_SIZE + done);
+		if(ret < 0){
+			if(errno == EINTR){
+				continue;
+			}
+			return -errno;
+		}
+		if(ret == 0){
+			break;
+		}
+		done += ret;
+	}
+	memset(ptr + done, 0, HAMMING_LAZY_PAGE_SIZE - done);
+	return 0;
+}
+
+/**
+ * \brief Generate a code file for a data file
+ *
+ * \param[in] data_path		File to protect
+ * \param[in] code_path		Code file to write, one code set per page
+ *
+ * \return Negative on failure, 0 otherwise
+ */
+int hamming_lazy_encode(const char *data_path, const char *code_path){
+	row_t page[HAMMING_LAZY_ROWS];
+	hamming_code_set_t set;
+	struct stat st;
+	size_t i, page_count;
+	int data_fd, ret = 0;
+	FILE *code_file;
+
+	data_fd = open(data_path, O_RDONLY);
+	if(data_fd < 0){
+		return -errno;
+	}
+	if(fstat(data_fd, &st) < 0){
+		close(data_fd);
+		return -errno;
+	}
+	code_file = fopen(code_path, "wb");
+	if(code_file == NULL){
+		close(data_fd);
+		return -errno;
+	}
+
+	page_count = (st.st_size + HAMMING_LAZY_PAGE_SIZE - 1)/HAMMING_LAZY_PAGE_SIZE;
+	for(i = 0;i < page_count;i++){
+		ret = hamming_lazy_read_page(data_fd, i, page);
+		if(ret < 0){
+			break;
+		}
+		logic_set(&set, page, HAMMING_LAZY_ROWS);
+		if(fwrite(&set, sizeof(set), 1, code_file) != 1){
+			ret = -EIO;
+			break;
+		}
+	}
+	if(fclose(code_file) != 0 && ret == 0){
+		ret = -errno;
+	}
+	close(data_fd);
+	return ret;
+}
+
+/**
+ * \brief Fail a fault instead of serving a bad page
+ *
+ * With UFFDIO_POISON the page reads as a hardware memory error, so the reader
+ * takes SIGBUS just as it would on an uncorrectable ECC error. Older kernels
+ * get a zero page that is made inaccessible before the reader is woken, so
+ * the access raises SIGSEGV instead of returning corrupt data.
+ */
+static int hamming_lazy_fail_page(hamming_lazy_t *lazy, size_t page, row_t *page_data){
+	uint64_t addr = (uintptr_t)lazy->base + page*HAMMING_LAZY_PAGE_SIZE;
+	struct uffdio_copy copy;
+	struct uffdio_range wake;
+#ifdef UFFDIO_POISON
+	struct uffdio_poison poison;
+
+	if(lazy->poison){
+		poison.range.start = addr;
+		poison.range.len = HAMMING_LAZY_PAGE_SIZE;
+		poison.mode = 0;
+		if(ioctl(lazy->uffd, UFFDIO_POISON, &poison) < 0 && errno != EEXIST){
+			return -errno;
+		}
+		return 0;
+	}
+#endif
+	memset(page_data, 0, HAMMING_LAZY_PAGE_SIZE);
+	copy.dst = addr;
+	copy.src = (uintptr_t)page_data;
+	copy.len = HAMMING_LAZY_PAGE_SIZE;
+	copy.mode = UFFDIO_COPY_MODE_DONTWAKE;
+	copy.copy = 0;
+	if(ioctl(lazy->uffd, UFFDIO_COPY, &copy) < 0 && errno != EEXIST){
+		return -errno;
+	}
+	if(mprotect((void*)(uintptr_t)addr, HAMMING_LAZY_PAGE_SIZE, PROT_NONE) < 0){
+		return -errno;
+	}
+	wake.start = addr;
+	wake.len = HAMMING_LAZY_PAGE_SIZE;
+	if(ioctl(lazy->uffd, UFFDIO_WAKE, &wake) < 0){
+		return -errno;
+	}
+	return 0;
+}
+
+/**
+ * \brief Resolve a single missing page fault
+ *
+ * Pages that can't be read or corrected are never mapped in, the fault is
+ * failed through hamming_lazy_fail_page() and the page counted.
+ */
+static void hamming_lazy_fault(hamming_lazy_t *lazy, uint64_t addr){
+	row_t page_data[HAMMING_LAZY_ROWS] __attribute__((aligned(HAMMING_LAZY_PAGE_SIZE)));
+	hamming_code_set_t set;
+	struct uffdio_copy copy;
+	size_t page;
+	int ret;
+
+	page = (addr - (uintptr_t)lazy->base)/HAMMING_LAZY_PAGE_SIZE;
+	ret = hamming_lazy_read_page(lazy->data_fd, page, page_data);
+	if(ret == 0){
+		logic_set(&set, page_data, HAMMING_LAZY_ROWS);
+		if(memcmp(&set, &lazy->codes[page], sizeof(set)) != 0){
+			ret = correct_set(&set, &lazy->codes[page],
+					  page_data, HAMMING_LAZY_ROWS);
+			if(ret >= 0){
+				__atomic_fetch_add(&lazy->stats.corrected, ret, __ATOMIC_RELAXED);
+			}
+		}
+	}
+	if(ret < 0){
+		__atomic_fetch_add(&lazy->stats.uncorrectable, 1, __ATOMIC_RELAXED);
+		if(hamming_lazy_fail_page(lazy, page, page_data) < 0){
+			__atomic_fetch_add(&lazy->stats.errors, 1, __ATOMIC_RELAXED);
+		}
+		return;
+	}
+
+	copy.dst = (uintptr_t)lazy->base + page*HAMMING_LAZY_PAGE_SIZE;
+	copy.src = (uintptr_t)page_data;
+	copy.len = HAMMING_LAZY_PAGE_SIZE;
+	copy.mode = 0;
+	copy.copy = 0;
+	// counted before the copy wakes the faulting thread, which may look right away
+	__atomic_fetch_add(&lazy->stats.loaded, 1, __ATOMIC_RELAXED);
+	if(ioctl(lazy->uffd, UFFDIO_COPY, &copy) < 0){
+		__atomic_fetch_sub(&lazy->stats.loaded, 1, __ATOMIC_RELAXED);
+		if(errno != EEXIST){ // another handler thread beat us to it
+			__atomic_fetch_add(&lazy->stats.errors, 1, __ATOMIC_RELAXED);
+		}
+	}
+}
+
+static void *hamming_lazy_main(void *arg){
+	hamming_lazy_t *lazy = arg;
+	struct uffd_msg msg;
+	struct pollfd fds[2];
+	ssize_t ret;
+
+	fds[0].fd = lazy->uffd;
+	fds[0].events = POLLIN;
+	fds[1].fd = lazy->stop_fd[0];
+	fds[1].events = POLLIN;
+	while(true){
+		if(poll(fds, 2, -1) < 0){
+			if(errno == EINTR){
+				continue;
+			}
+			break;
+		}
+		if(fds[1].revents){
+			break;
+		}
+		ret = read(lazy->uffd, &msg, sizeof(msg));
+		if(ret != sizeof(msg)){
+			// EAGAIN, another handler thread took the message
+			continue;
+		}
+		if(msg.event == UFFD_EVENT_PAGEFAULT){
+			hamming_lazy_fault(lazy, msg.arg.pagefault.address & ~((uint64_t)HAMMING_LAZY_PAGE_SIZE - 1));
+		}
+	}
+	return NULL;
+}
+
+// a uffd that handles kernel faults too, user mode only if we may not have that
+static int hamming_lazy_uffd(hamming_lazy_t *lazy){
+	int fd = syscall(__NR_userfaultfd, O_CLOEXEC | O_NONBLOCK);
+
+	lazy->user_mode_only = false;
+#ifdef UFFD_USER_MODE_ONLY
+	if(fd < 0 && errno == EPERM){
+		fd = syscall(__NR_userfaultfd, O_CLOEXEC | O_NONBLOCK | UFFD_USER_MODE_ONLY);
+		lazy->user_mode_only = fd >= 0;
+	}
+#endif
+	return fd < 0 ? -errno : fd;
+}
+
+/**
+ * \brief Open and handshake a userfaultfd
+ *
+ * Asks for UFFD_FEATURE_POISON first. A uffd only takes one UFFDIO_API call,
+ * so if the kernel doesn't know the feature we start over on a fresh one.
+ */
+static int hamming_lazy_uffd_api(hamming_lazy_t *lazy){
+	struct uffdio_api api;
+
+#ifdef UFFD_FEATURE_POISON
+	lazy->uffd = hamming_lazy_uffd(lazy);
+	if(lazy->uffd < 0){
+		return lazy->uffd;
+	}
+	api.api = UFFD_API;
+	api.features = UFFD_FEATURE_POISON;
+	if(ioctl(lazy->uffd, UFFDIO_API, &api) == 0){
+		lazy->poison = true;
+		return 0;
+	}
+	close(lazy->uffd);
+#endif
+	lazy->uffd = hamming_lazy_uffd(lazy);
+	if(lazy->uffd < 0){
+		return lazy->uffd;
+	}
+	api.api = UFFD_API;
+	api.features = 0;
+	if(ioctl(lazy->uffd, UFFDIO_API, &api) < 0){
+		return -errno;
+	}
+	return 0;
+}
+
+/**
+ * \brief Map a protected file without reading it
+ *
+ * \param[out] lazy			Mapping to initialize
+ * \param[in] data_path		Data file
+ * \param[in] code_path		Code file generated by hamming_lazy_encode
+ * \param[in] threads		Number of fault handler threads
+ *
+ * \return Negative on failure, 0 otherwise
+ */
+int hamming_lazy_open(hamming_lazy_t *lazy, const char *data_path,
+		      const char *code_path, int threads){
+	struct uffdio_register reg;
+	struct stat st;
+	void *codes;
+	int code_fd, ret, i;
+
+	if(threads <= 0 || threads > HAMMING_LAZY_THREADS_MAX){
+		return -EINVAL;
+	}
+	CLEAR_MEM(*lazy);
+	lazy->uffd = -1;
+	lazy->stop_fd[0] = lazy->stop_fd[1] = -1;
+
+	lazy->data_fd = open(data_path, O_RDONLY);
+	if(lazy->data_fd < 0){
+		return -errno;
+	}
+	if(fstat(lazy->data_fd, &st) < 0){
+		ret = -errno;
+		goto fail;
+	}
+	if(st.st_size == 0){
+		ret = -EINVAL;
+		goto fail;
+	}
+	lazy->file_len = st.st_size;
+	lazy->page_count = (lazy->file_len + HAMMING_LAZY_PAGE_SIZE - 1)/HAMMING_LAZY_PAGE_SIZE;
+	lazy->len = lazy->page_count*HAMMING_LAZY_PAGE_SIZE;
+
+	code_fd = open(code_path, O_RDONLY);
+	if(code_fd < 0){
+		ret = -errno;
+		goto fail;
+	}
+	if(fstat(code_fd, &st) < 0 ||
+	   (size_t)st.st_size != lazy->page_count*sizeof(hamming_code_set_t)){
+		// code file doesn't match data file
+		close(code_fd);
+		ret = -EINVAL;
+		goto fail;
+	}
+	// code sets are paged in by the kernel as the pages using them fault,
+	// private and writable since correct_set() fixes up the codes themselves
+	lazy->codes_len = st.st_size;
+	codes = mmap(NULL, lazy->codes_len, PROT_READ | PROT_WRITE, MAP_PRIVATE, code_fd, 0);
+	close(code_fd);
+	if(codes == MAP_FAILED){
+		ret = -errno;
+		goto fail;
+	}
+	lazy->codes = codes;
+
+	lazy->base = mmap(NULL, lazy->len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if(lazy->base == MAP_FAILED){
+		lazy->base = NULL;
+		ret = -errno;
+		goto fail;
+	}
+
+	ret = hamming_lazy_uffd_api(lazy);
+	if(ret < 0){
+		goto fail;
+	}
+	reg.range.start = (uintptr_t)lazy->base;
+	reg.range.len = lazy->len;
+	reg.mode = UFFDIO_REGISTER_MODE_MISSING;
+	if(ioctl(lazy->uffd, UFFDIO_REGISTER, &reg) < 0){
+		ret = -errno;
+		goto fail;
+	}
+
+	if(pipe(lazy->stop_fd) < 0){
+		ret = -errno;
+		goto fail;
+	}
+	for(i = 0;i < threads;i++){
+		ret = pthread_create(&lazy->threads[i], NULL, hamming_lazy_main, lazy);
+		if(ret){
+			ret = -ret;
+			goto fail;
+		}
+		lazy->thread_count++;
+	}
+	return 0;
+fail:
+	hamming_lazy_close(lazy);
+	return ret;
+}
+
+/**
+ * \brief Tear down a lazy mapping
+ *
+ * Nothing may touch the mapping while this runs, faults that aren't resolved
+ * by then never will be.
+ */
+void hamming_lazy_close(hamming_lazy_t *lazy){
+	int i;
+	if(lazy->thread_count){
+		// a full pipe is still readable, so a short write can't strand them
+		(void)!write(lazy->stop_fd[1], "", 1);
+		for(i = 0;i < lazy->thread_count;i++){
+			pthread_join(lazy->threads[i], NULL);
+		}
+		lazy->thread_count = 0;
+	}
+	if(lazy->stop_fd[0] >= 0){
+		close(lazy->stop_fd[0]);
+		close(lazy->stop_fd[1]);
+	}
+	if(lazy->uffd >= 0){
+		close(lazy->uffd);
+	}
+	if(lazy->base){
+		munmap(lazy->base, lazy->len);
+	}
+	if(lazy->codes){
+		munmap(lazy->codes, lazy->codes_len);
+	}
+	if(lazy->data_fd >= 0){
+		close(lazy->data_fd);
+	}
+	CLEAR_MEM(*lazy);
+	lazy->data_fd = lazy->uffd = -1;
+	lazy->stop_fd[0] = lazy->stop_fd[1] = -1;
+}
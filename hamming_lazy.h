@@ -0,0 +1,63 @@
+#ifndef HAMMING_LAZY_H
+#define HAMMING_LAZY_H
+
+#include "hamming_fast.h"
+#include "hamming_fast_logic.h"
+
+#include <pthread.h>
+
+#define HAMMING_LAZY_PAGE_SIZE 4096
+#define HAMMING_LAZY_ROWS (HAMMING_LAZY_PAGE_SIZE/sizeof(row_t))
+#define HAMMING_LAZY_THREADS_MAX 16
+
+/**
+ * \brief Lazily verified mapping of a protected file
+ *
+ * The data file is paired with a code file holding one hamming_code_set_t
+ * per 4K page of data (the last page is zero padded). Nothing is read when
+ * the mapping is created, the first touch of each page faults into
+ * userfaultfd, and a handler thread reads, verifies and corrects that page
+ * before resolving the fault. Pages that are never touched are never read.
+ * Touching a page that can't be corrected raises SIGBUS (or SIGSEGV on
+ * kernels without UFFDIO_POISON) rather than returning bad data.
+ *
+ * Handling faults the kernel takes on our behalf needs CAP_SYS_PTRACE or
+ * vm.unprivileged_userfaultfd. Without either the uffd falls back to
+ * UFFD_USER_MODE_ONLY (user_mode_only is set), and only the process's own
+ * loads and stores bring pages in. A system call given a page that isn't
+ * loaded yet, read(2) into the mapping or write(2) out of it, fails with
+ * EFAULT then, so touch pages before handing them to the kernel.
+ */
+typedef struct{
+	uint8_t *base;
+	size_t len; // rounded up to a whole page
+	size_t file_len;
+	size_t page_count;
+
+	int data_fd;
+	hamming_code_set_t *codes; // mmap'd code file
+	size_t codes_len;
+
+	int uffd;
+	bool poison; // kernel supports UFFDIO_POISON
+	bool user_mode_only; // kernel accesses to pages not loaded yet fail with EFAULT
+	int stop_fd[2]; // pipe, wakes the handlers up on close
+	pthread_t threads[HAMMING_LAZY_THREADS_MAX];
+	int thread_count;
+
+	struct{
+		uint64_t loaded;
+		uint64_t corrected;
+		uint64_t uncorrectable; // faults failed instead of served
+		uint64_t errors; // uffd ioctls that failed
+	} stats;
+} hamming_lazy_t;
+
+// writes a code file for the data file
+extern int hamming_lazy_encode(const char *data_path, const char *code_path);
+
+extern int hamming_lazy_open(hamming_lazy_t *lazy, const char *data_path,
+			     const char *code_path, int threads);
+extern void hamming_lazy_close(hamming_lazy_t *lazy);
+
+#endif
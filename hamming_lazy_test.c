@@ -0,0 +1,156 @@
+#include "hamming_fast.h"
+#include "hamming_lazy.h"
+#include "hamming_check.h"
+
+#include <errno.h>
+#include <setjmp.h>
+#include <stddef.h>
+#include <signal.h>
+
+/*
+  Checks for hamming_lazy_t
+
+  Writes a data file and its code file, then damages both behind the
+  mapping's back: one page gets a single flipped bit, which must be read
+  back corrected, another gets a flipped bit plus stored codes whose
+  redundant copies disagree, so it can't be corrected and must fail the
+  reader with a signal instead of handing it the page. A page not loaded
+  yet is also handed to write(2), which has to see its data, or fail with
+  EFAULT when only user mode faults are ours to handle.
+
+  usage: lazy_test [pages]
+ */
+
+static sigjmp_buf fault_jmp;
+static volatile sig_atomic_t fault_sig;
+
+static void fault_handler(int sig){
+	fault_sig = sig;
+	siglongjmp(fault_jmp, 1);
+}
+
+static uint8_t expected(size_t page, size_t byte){
+	return (uint8_t)((page*31) ^ (byte*7));
+}
+
+static int flip(int fd, off_t off, int bit){
+	uint8_t value;
+
+	if(pread(fd, &value, 1, off) != 1){
+		return -errno;
+	}
+	value ^= 1 << bit;
+	return pwrite(fd, &value, 1, off) == 1 ? 0 : -errno;
+}
+
+// reads one byte of the mapping, returns the signal it raised or 0
+static int touch(volatile uint8_t *addr, uint8_t *value){
+	fault_sig = 0;
+	*value = 0;
+	if(sigsetjmp(fault_jmp, 1) == 0){
+		*value = *addr;
+	}
+	return fault_sig;
+}
+
+int main(int argc, char **argv){
+	size_t pages = argc > 1 ? strtoull(argv[1], NULL, 0) : 64;
+	char data_path[] = "/tmp/lazy_test_data_XXXXXX";
+	char code_path[] = "/tmp/lazy_test_code_XXXXXX";
+	uint8_t buf[HAMMING_LAZY_PAGE_SIZE];
+	struct sigaction sa;
+	hamming_lazy_t lazy;
+	size_t i, j;
+	uint8_t value;
+	int fd, code_fd, ret, sig, pipe_fd[2];
+
+	if(pages < 4){
+		printf("usage: %s [pages, at least 4]\n", argv[0]);
+		return 1;
+	}
+	fd = mkstemp(data_path);
+	code_fd = mkstemp(code_path);
+	if(fd < 0 || code_fd < 0){
+		printf("can't create temporary files\n");
+		return 1;
+	}
+	for(i = 0;i < pages;i++){
+		for(j = 0;j < sizeof(buf);j++){
+			buf[j] = expected(i, j);
+		}
+		if(write(fd, buf, sizeof(buf)) != sizeof(buf)){
+			printf("can't write data file\n");
+			goto out;
+		}
+	}
+	ret = hamming_lazy_encode(data_path, code_path);
+	CHECK(ret == 0, "encode failed (%d)", ret);
+
+	flip(fd, HAMMING_LAZY_PAGE_SIZE + 40, 2);
+	flip(fd, 2*HAMMING_LAZY_PAGE_SIZE + 40, 2);
+	flip(code_fd, 2*sizeof(hamming_code_set_t) + offsetof(hamming_code_set_t, second_set[1]), 0);
+
+	ret = hamming_lazy_open(&lazy, data_path, code_path, 2);
+	if(ret == -EPERM || ret == -ENOSYS){
+		printf("lazy_test: skipped, userfaultfd unavailable (%d)\n", ret);
+		goto out;
+	}
+	CHECK(ret == 0, "open failed (%d)", ret);
+	if(ret < 0){
+		goto out;
+	}
+	CHECK(lazy.stats.loaded == 0, "pages read before they were touched");
+
+	CLEAR_MEM(sa);
+	sa.sa_handler = fault_handler;
+	sigemptyset(&sa.sa_mask);
+	sigaction(SIGBUS, &sa, NULL);
+	sigaction(SIGSEGV, &sa, NULL);
+
+	sig = touch(lazy.base + HAMMING_LAZY_PAGE_SIZE + 40, &value);
+	CHECK(sig == 0 && value == expected(1, 40), "single flip not corrected (signal %d, %02x)", sig, value);
+	CHECK(lazy.stats.corrected == 1, "%lu bits corrected instead of 1", lazy.stats.corrected);
+
+	sig = touch(lazy.base + 2*HAMMING_LAZY_PAGE_SIZE + 40, &value);
+	CHECK(sig == SIGBUS || sig == SIGSEGV, "uncorrectable page was served (%02x)", value);
+	CHECK(lazy.stats.uncorrectable == 1, "%lu uncorrectable pages instead of 1", lazy.stats.uncorrectable);
+	CHECK(lazy.stats.errors == 0, "%lu uffd errors", lazy.stats.errors);
+
+	// the kernel reading page 3 out of the mapping faults it in, or fails when it may not
+	if(pipe(pipe_fd) == 0){
+		ret = write(pipe_fd[1], lazy.base + 3*HAMMING_LAZY_PAGE_SIZE, HAMMING_LAZY_PAGE_SIZE);
+		if(lazy.user_mode_only){
+			CHECK(ret < 0 && errno == EFAULT, "write(2) of a page not loaded returned %d (%d), expected EFAULT", ret, errno);
+		}else{
+			CHECK(ret == HAMMING_LAZY_PAGE_SIZE && read(pipe_fd[0], buf, sizeof(buf)) == sizeof(buf) &&
+			      buf[40] == expected(3, 40), "write(2) of a page not loaded returned %d", ret);
+		}
+		close(pipe_fd[0]);
+		close(pipe_fd[1]);
+	}
+
+	for(i = 0;i < pages;i++){
+		if(i == 2){
+			continue;
+		}
+		for(j = 16;j < HAMMING_LAZY_PAGE_SIZE;j += 97){
+			sig = touch(lazy.base + i*HAMMING_LAZY_PAGE_SIZE + j, &value);
+			if(sig || value != expected(i, j)){
+				CHECK(false, "page %zu byte %zu reads %02x (signal %d)", i, j, value, sig);
+				i = pages;
+				break;
+			}
+		}
+	}
+	CHECK(lazy.stats.loaded == pages - 1, "%lu pages loaded instead of %zu", lazy.stats.loaded, pages - 1);
+
+	signal(SIGBUS, SIG_DFL);
+	signal(SIGSEGV, SIG_DFL);
+	hamming_lazy_close(&lazy);
+out:
+	close(fd);
+	close(code_fd);
+	unlink(data_path);
+	unlink(code_path);
+	return check_done("lazy_test");
+}
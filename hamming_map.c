@@ -0,0 +1,345 @@
+#include "hamming_map.h"
+#include "hamming_fast_logic.h"
+
+/**
+ * \file hamming_map.c
+ * \brief Concurrent hash map with per bucket page ECC
+ *
+ * Reads are optimistic: sample the page's sequence count, probe, verify the
+ * page against its code set and check the count didn't move. A mismatch with
+ * a stable count can only be a bit flip, so the reader takes the page lock,
+ * corrects it and tries again.
+ *
+ * Writes only touch one row, so instead of a second logic_set() the codes
+ * are updated with the XOR delta of that row. The delta would fold a flip in
+ * the old row into the codes, so writers verify and correct the page under
+ * the stripe lock before they probe or change it, unless the page wasn't
+ * written since it was last verified (see hamming_map_t).
+ */
+
+static uint64_t hamming_map_hash(uint64_t key){
+	// splitmix64 finalizer
+	key ^= key >> 30;
+	key *= 0xbf58476d1ce4e5b9ULL;
+	key ^= key >> 27;
+	key *= 0x94d049bb133111ebULL;
+	key ^= key >> 31;
+	return key;
+}
+
+static row_t *hamming_map_page(hamming_map_t *map, size_t page){
+	return map->pages + page*HAMMING_MAP_ROWS;
+}
+
+static hamming_map_header_t *hamming_map_header(row_t *page){
+	return (hamming_map_header_t*)page;
+}
+
+static pthread_mutex_t *hamming_map_stripe(hamming_map_t *map, size_t page){
+	return &map->stripe[page % HAMMING_MAP_STRIPES];
+}
+
+/**
+ * \brief Probe a page for a key
+ *
+ * \param[in] page			Bucket page
+ * \param[in] key			Key to look for
+ * \param[in] start			Slot to start probing from (1..255)
+ * \param[out] free_slot	First reusable slot seen, if not NULL
+ *
+ * \return Slot holding key, 0 if not found
+ */
+static int hamming_map_probe(row_t *page, uint64_t key, int start, int *free_slot){
+	hamming_map_entry_t *entries = (hamming_map_entry_t*)page;
+	uint64_t cur;
+	int i, slot;
+
+	for(i = 0;i < (int)HAMMING_MAP_ROWS - 1;i++){
+		slot = 1 + (start - 1 + i) % (HAMMING_MAP_ROWS - 1);
+		cur = __atomic_load_n(&entries[slot].key, __ATOMIC_RELAXED);
+		if(cur == key){
+			return slot;
+		}
+		if(cur == HAMMING_MAP_EMPTY || cur == HAMMING_MAP_TOMBSTONE){
+			if(free_slot && *free_slot == 0){
+				*free_slot = slot;
+			}
+			if(cur == HAMMING_MAP_EMPTY){
+				return 0;
+			}
+		}
+	}
+	return 0;
+}
+
+static void hamming_map_write_begin(hamming_map_header_t *header){
+	__atomic_store_n(&header->seq, header->seq + 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+static void hamming_map_write_end(hamming_map_header_t *header){
+	__atomic_store_n(&header->seq, header->seq + 1, __ATOMIC_RELEASE);
+}
+
+/**
+ * \brief Replace one row of a page
+ *
+ * The caller holds the stripe lock and has verified the page with
+ * hamming_map_correct_locked(), since the delta takes the old row as good.
+ */
+static void hamming_map_set_row(hamming_map_t *map, size_t index, int slot,
+				uint64_t key, uint64_t value){
+	row_t *page = hamming_map_page(map, index);
+	hamming_map_entry_t *entry = (hamming_map_entry_t*)&page[slot];
+	const row_t old_row = page[slot];
+	row_t new_row;
+
+	hamming_map_write_begin(hamming_map_header(page));
+	__atomic_store_n(&entry->value, value, __ATOMIC_RELAXED);
+	__atomic_store_n(&entry->key, key, __ATOMIC_RELAXED);
+	new_row = page[slot];
+	if(map->protect){
+		logic_set_delta(&map->codes[index], slot, old_row, new_row);
+	}
+	hamming_map_write_end(hamming_map_header(page));
+}
+
+/**
+ * \brief Verify and correct a page, caller holds the stripe lock
+ *
+ * \return -EIO if uncorrectable, number of bits corrected otherwise
+ */
+static int hamming_map_correct_locked(hamming_map_t *map, size_t index){
+	row_t *page = hamming_map_page(map, index);
+	hamming_code_set_t set;
+	int ret = 0;
+
+	logic_set(&set, page, HAMMING_MAP_ROWS);
+	if(memcmp(&set, &map->codes[index], sizeof(set)) != 0){
+		hamming_map_write_begin(hamming_map_header(page));
+		ret = correct_set(&set, &map->codes[index], page, HAMMING_MAP_ROWS);
+		hamming_map_write_end(hamming_map_header(page));
+		if(ret < 0){
+			__atomic_fetch_add(&map->stats.failed, 1, __ATOMIC_RELAXED);
+			return -EIO;
+		}
+		__atomic_fetch_add(&map->stats.corrected, ret, __ATOMIC_RELAXED);
+	}
+	__atomic_store_n(&map->verified[index], hamming_map_header(page)->seq, __ATOMIC_RELAXED);
+	return ret;
+}
+
+/**
+ * \brief Correct a page that failed verification
+ *
+ * \return -EIO if uncorrectable, number of bits corrected otherwise
+ */
+static int hamming_map_correct(hamming_map_t *map, size_t index){
+	int ret;
+
+	pthread_mutex_lock(hamming_map_stripe(map, index));
+	ret = hamming_map_correct_locked(map, index);
+	pthread_mutex_unlock(hamming_map_stripe(map, index));
+	return ret;
+}
+
+/**
+ * \brief Take a page's stripe lock for writing
+ *
+ * The page is verified first, unless that was done less than
+ * map->verify_interval writes ago (a write and a correction both move the
+ * page's seq by 2).
+ *
+ * \return -EIO (and the lock isn't held) if the page is uncorrectable
+ */
+static int hamming_map_write_lock(hamming_map_t *map, size_t index){
+	pthread_mutex_lock(hamming_map_stripe(map, index));
+	if(map->protect == false){
+		return 0;
+	}
+	if((hamming_map_header(hamming_map_page(map, index))->seq -
+	    __atomic_load_n(&map->verified[index], __ATOMIC_RELAXED))/2 < map->verify_interval){
+		__atomic_fetch_add(&map->stats.reused, 1, __ATOMIC_RELAXED);
+		return 0;
+	}
+	if(hamming_map_correct_locked(map, index) < 0){
+		pthread_mutex_unlock(hamming_map_stripe(map, index));
+		return -EIO;
+	}
+	return 0;
+}
+
+/**
+ * \brief Look up a key
+ *
+ * \return 0 when found, -ENOENT when not, -EIO when the page is uncorrectable,
+ * -EINVAL for a reserved key
+ */
+int hamming_map_get(hamming_map_t *map, uint64_t key, uint64_t *value){
+	const uint64_t hash = hamming_map_hash(key);
+	const size_t index = hash & (map->page_count - 1);
+	const int start = 1 + (hash >> 32) % (HAMMING_MAP_ROWS - 1);
+	row_t *page = hamming_map_page(map, index);
+	hamming_map_header_t *header = hamming_map_header(page);
+	hamming_code_set_t set;
+	uint64_t seq, cur = 0;
+	bool valid;
+	int slot;
+
+	if(key == HAMMING_MAP_EMPTY || key == HAMMING_MAP_TOMBSTONE){
+		return -EINVAL;
+	}
+	while(true){
+		seq = __atomic_load_n(&header->seq, __ATOMIC_ACQUIRE);
+		if(seq & 1){
+			__atomic_fetch_add(&map->stats.retries, 1, __ATOMIC_RELAXED);
+			continue;
+		}
+		slot = hamming_map_probe(page, key, start, NULL);
+		if(slot){
+			cur = __atomic_load_n(&((hamming_map_entry_t*)&page[slot])->value, __ATOMIC_RELAXED);
+		}
+		valid = true;
+		if(map->protect){
+			logic_set(&set, page, HAMMING_MAP_ROWS);
+			valid = memcmp(&set, &map->codes[index], sizeof(set)) == 0;
+		}
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+		if(__atomic_load_n(&header->seq, __ATOMIC_RELAXED) != seq){
+			__atomic_fetch_add(&map->stats.retries, 1, __ATOMIC_RELAXED);
+			continue;
+		}
+		if(map->protect){
+			__atomic_fetch_add(&map->stats.verified, 1, __ATOMIC_RELAXED);
+		}
+		if(valid && map->protect){
+			__atomic_store_n(&map->verified[index], seq, __ATOMIC_RELAXED); // the next put can skip it
+		}
+		if(valid == false){
+			if(hamming_map_correct(map, index) < 0){
+				return -EIO;
+			}
+			continue;
+		}
+		break;
+	}
+	if(slot == 0){
+		return -ENOENT;
+	}
+	*value = cur;
+	return 0;
+}
+
+/**
+ * \brief Insert or update a key
+ *
+ * \return 0 on success, -ENOSPC when the key's bucket page is full, -EIO
+ * when it is uncorrectable, -EINVAL for a reserved key
+ */
+int hamming_map_put(hamming_map_t *map, uint64_t key, uint64_t value){
+	const uint64_t hash = hamming_map_hash(key);
+	const size_t index = hash & (map->page_count - 1);
+	const int start = 1 + (hash >> 32) % (HAMMING_MAP_ROWS - 1);
+	row_t *page = hamming_map_page(map, index);
+	int slot, free_slot = 0;
+
+	if(key == HAMMING_MAP_EMPTY || key == HAMMING_MAP_TOMBSTONE){
+		return -EINVAL;
+	}
+	if(hamming_map_write_lock(map, index) < 0){
+		return -EIO;
+	}
+	slot = hamming_map_probe(page, key, start, &free_slot);
+	if(slot == 0){
+		if(free_slot == 0){
+			pthread_mutex_unlock(hamming_map_stripe(map, index));
+			return -ENOSPC;
+		}
+		slot = free_slot;
+		hamming_map_header(page)->used++;
+	}
+	hamming_map_set_row(map, index, slot, key, value);
+	pthread_mutex_unlock(hamming_map_stripe(map, index));
+	return 0;
+}
+
+/**
+ * \brief Remove a key
+ *
+ * \return 0 on success, -ENOENT if it wasn't there, -EIO when its bucket
+ * page is uncorrectable, -EINVAL for a reserved key
+ */
+int hamming_map_remove(hamming_map_t *map, uint64_t key){
+	const uint64_t hash = hamming_map_hash(key);
+	const size_t index = hash & (map->page_count - 1);
+	const int start = 1 + (hash >> 32) % (HAMMING_MAP_ROWS - 1);
+	row_t *page = hamming_map_page(map, index);
+	int slot;
+
+	if(key == HAMMING_MAP_EMPTY || key == HAMMING_MAP_TOMBSTONE){
+		return -EINVAL;
+	}
+	if(hamming_map_write_lock(map, index) < 0){
+		return -EIO;
+	}
+	slot = hamming_map_probe(page, key, start, NULL);
+	if(slot){
+		hamming_map_set_row(map, index, slot, HAMMING_MAP_TOMBSTONE, 0);
+		hamming_map_header(page)->used--;
+	}
+	pthread_mutex_unlock(hamming_map_stripe(map, index));
+	return slot ? 0 : -ENOENT;
+}
+
+/**
+ * \brief Create a map
+ *
+ * \param[out] map			Map to initialize
+ * \param[in] entries		Expected number of entries, pages are sized for 75% load
+ * \param[in] protect		Verify and encode bucket pages
+ *
+ * \return Negative on failure, 0 otherwise
+ */
+int hamming_map_init(hamming_map_t *map, size_t entries, bool protect){
+	void *pages;
+	int i;
+
+	CLEAR_MEM(*map);
+	map->protect = protect;
+	map->verify_interval = 1;
+	map->page_count = 1;
+	while(map->page_count*(HAMMING_MAP_ROWS - 1)*3/4 < entries){
+		map->page_count <<= 1;
+	}
+	if(posix_memalign(&pages, HAMMING_MAP_PAGE_SIZE, map->page_count*HAMMING_MAP_PAGE_SIZE)){
+		return -ENOMEM;
+	}
+	map->pages = pages;
+	memset(map->pages, 0, map->page_count*HAMMING_MAP_PAGE_SIZE);
+	// zeroed codes are the codes of zeroed pages, so they start out verified at seq 0
+	map->codes = calloc(map->page_count, sizeof(hamming_code_set_t));
+	map->verified = calloc(map->page_count, sizeof(uint64_t));
+	if(map->codes == NULL || map->verified == NULL){
+		free(map->pages);
+		free(map->codes);
+		free(map->verified);
+		return -ENOMEM;
+	}
+	for(i = 0;i < HAMMING_MAP_STRIPES;i++){
+		pthread_mutex_init(&map->stripe[i], NULL);
+	}
+	return 0;
+}
+
+void hamming_map_close(hamming_map_t *map){
+	int i;
+	for(i = 0;i < HAMMING_MAP_STRIPES;i++){
+		pthread_mutex_destroy(&map->stripe[i]);
+	}
+	free(map->pages);
+	free(map->codes);
+	free(map->verified);
+	map->pages = NULL;
+	map->codes = NULL;
+	map->verified = NULL;
+}
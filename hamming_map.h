@@ -0,0 +1,89 @@
+#ifndef HAMMING_MAP_H
+#define HAMMING_MAP_H
+
+#include "hamming_fast.h"
+#include "hamming_fast_logic.h"
+
+#include <errno.h>
+#include <pthread.h>
+
+#define HAMMING_MAP_PAGE_SIZE 4096
+#define HAMMING_MAP_ROWS (HAMMING_MAP_PAGE_SIZE/sizeof(row_t))
+#define HAMMING_MAP_STRIPES 64
+
+// reserved keys
+#define HAMMING_MAP_EMPTY 0
+#define HAMMING_MAP_TOMBSTONE (~(uint64_t)0)
+
+/**
+ * \brief One row of a bucket page
+ *
+ * Entries are exactly one row_t wide, so an update changes a single row and
+ * the code set can be fixed up with logic_set_delta().
+ */
+typedef struct{
+	uint64_t key;
+	uint64_t value;
+} hamming_map_entry_t;
+
+/**
+ * \brief Bucket page header
+ *
+ * Lives in row 0, which the vertical code doesn't cover (see
+ * hamming_fast_logic.h), so bumping the sequence count never touches codes.
+ */
+typedef struct{
+	uint64_t seq; // odd while a writer is in the page
+	uint64_t used;
+} hamming_map_header_t;
+
+/**
+ * \brief Hash map with Hamming protected bucket pages
+ *
+ * Keys hash to one 4K page and are linearly probed inside it (255 entries per
+ * page, row 0 is the header). Readers don't lock, they read under the page's
+ * sequence count and verify only that page before trusting the result.
+ * Writers take a striped lock, verify the page and re-encode with the delta
+ * of the one row they changed.
+ *
+ * Verifying is one logic_set() over the whole page, which is nearly all of
+ * what a protected get or put costs (about 4us against 0.1us unprotected in
+ * map_bench on one core). A writer skips it while fewer than verify_interval
+ * writes went to the page since it was last verified, by a get or a writer.
+ * With the default of 1 a put right after a get of the same page pays only
+ * for the delta, and a page written since its last check is verified first.
+ * The price is that a bit flipping in a row between that check and the write
+ * overwriting it is folded into the codes, and the next check "corrects" the
+ * new row instead. A larger interval makes back to back puts cheaper and
+ * that window longer.
+ *
+ * There is no resizing, size the map for its working set up front.
+ */
+typedef struct{
+	row_t *pages;
+	hamming_code_set_t *codes;
+	uint64_t *verified; // header seq every page was last verified at
+	size_t page_count; // power of two
+	bool protect; // false gives the unprotected baseline
+	uint64_t verify_interval; // writes a page may take between checks, 1 after hamming_map_init
+
+	pthread_mutex_t stripe[HAMMING_MAP_STRIPES];
+
+	struct{
+		uint64_t verified;
+		uint64_t reused; // writes that skipped verifying, see above
+		uint64_t corrected;
+		uint64_t retries;
+		uint64_t failed; // uncorrectable pages seen
+	} stats;
+} hamming_map_t;
+
+extern int hamming_map_init(hamming_map_t *map, size_t entries, bool protect);
+extern void hamming_map_close(hamming_map_t *map);
+
+// HAMMING_MAP_EMPTY and HAMMING_MAP_TOMBSTONE are rejected with -EINVAL
+extern int hamming_map_get(hamming_map_t *map, uint64_t key, uint64_t *value);
+extern int hamming_map_put(hamming_map_t *map, uint64_t key, uint64_t value);
+extern int hamming_map_remove(hamming_map_t *map, uint64_t key);
+
+#endif
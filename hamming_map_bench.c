@@ -0,0 +1,163 @@
+#include "hamming_fast.h"
+#include "hamming_map.h"
+
+#include <sys/time.h>
+
+/*
+  Multi-threaded lookup/insert benchmark for hamming_map_t
+
+  Runs the same workload against an unprotected map and a protected one,
+  so the difference is the cost of verify-on-read and delta encoding. Also
+  checks that reserved keys are rejected, that a bit flipped in a row
+  which is then overwritten doesn't end up in the codes, and that a put
+  right after a get of its page doesn't verify it again. Exits non-zero on
+  any miss or failed check
+
+  usage: map_bench [threads] [entries] [ops per thread] [insert percent] [verify interval]
+ */
+
+typedef struct{
+	hamming_map_t *map;
+	uint64_t entries;
+	uint64_t ops;
+	int insert_percent;
+	uint64_t seed;
+	uint64_t misses;
+} bench_thread_t;
+
+static uint64_t get_time_micro_s(){
+	struct timeval tv;
+	gettimeofday(&tv, NULL);
+	return 1000000ULL*tv.tv_sec + tv.tv_usec;
+}
+
+static uint64_t xorshift(uint64_t *state){
+	*state ^= *state << 13;
+	*state ^= *state >> 7;
+	*state ^= *state << 17;
+	return *state;
+}
+
+static void *bench_thread(void *arg){
+	bench_thread_t *thread = arg;
+	uint64_t i, key, value;
+
+	for(i = 0;i < thread->ops;i++){
+		key = 1 + xorshift(&thread->seed) % thread->entries;
+		if((int)(xorshift(&thread->seed) % 100) < thread->insert_percent){
+			hamming_map_put(thread->map, key, key*3);
+		}else if(hamming_map_get(thread->map, key, &value) < 0 || value != key*3){
+			thread->misses++;
+		}
+	}
+	return NULL;
+}
+
+static uint64_t bench(bool protect, int threads, uint64_t entries, uint64_t ops, int insert_percent,
+		      uint64_t verify_interval){
+	bench_thread_t thread[64];
+	pthread_t id[64];
+	hamming_map_t map;
+	uint64_t i, start_time, end_time, misses = 0;
+
+	if(hamming_map_init(&map, entries, protect) < 0){
+		printf("can't allocate map\n");
+		return 1;
+	}
+	map.verify_interval = verify_interval;
+	for(i = 1;i <= entries;i++){
+		hamming_map_put(&map, i, i*3);
+	}
+
+	start_time = get_time_micro_s();
+	for(i = 0;i < (uint64_t)threads;i++){
+		thread[i].map = &map;
+		thread[i].entries = entries;
+		thread[i].ops = ops;
+		thread[i].insert_percent = insert_percent;
+		thread[i].seed = 0x9E3779B97F4A7C15ULL*(i+1);
+		thread[i].misses = 0;
+		pthread_create(&id[i], NULL, bench_thread, &thread[i]);
+	}
+	for(i = 0;i < (uint64_t)threads;i++){
+		pthread_join(id[i], NULL);
+		misses += thread[i].misses;
+	}
+	end_time = get_time_micro_s();
+
+	printf("%s: %d threads, %.1f ns/op, %.2f Mops/s, %lu misses, %lu retries, %lu puts reused a check\n",
+	       protect ? "protected" : "unprotected", threads,
+	       (end_time - start_time)*1000.0/ops,
+	       ops*threads/(double)(end_time - start_time),
+	       misses, map.stats.retries, map.stats.reused);
+	hamming_map_close(&map);
+	return misses;
+}
+
+/**
+ * \brief Flip a bit in a key's row, then overwrite that row
+ *
+ * \return Number of failed checks
+ */
+static int check_flip(void){
+	const uint64_t key = 42;
+	hamming_map_entry_t *entry = NULL;
+	hamming_map_t map;
+	uint64_t value, reused;
+	size_t i;
+	int failed = 0;
+
+	if(hamming_map_init(&map, 1, true) < 0){
+		printf("can't allocate map\n");
+		return 1;
+	}
+	failed += hamming_map_get(&map, HAMMING_MAP_EMPTY, &value) != -EINVAL;
+	failed += hamming_map_get(&map, HAMMING_MAP_TOMBSTONE, &value) != -EINVAL;
+	failed += hamming_map_remove(&map, HAMMING_MAP_TOMBSTONE) != -EINVAL;
+
+	hamming_map_put(&map, key, 1);
+	for(i = 1;i < map.page_count*HAMMING_MAP_ROWS;i++){
+		if(((hamming_map_entry_t*)&map.pages[i])->key == key){
+			entry = (hamming_map_entry_t*)&map.pages[i];
+			break;
+		}
+	}
+	if(entry == NULL){
+		printf("FAIL: key not in map\n");
+		hamming_map_close(&map);
+		return failed + 1;
+	}
+	// the old row is corrupt when put computes its delta
+	entry->value ^= 1 << 5;
+	failed += hamming_map_put(&map, key, 2) != 0;
+	failed += hamming_map_get(&map, key, &value) != 0 || value != 2;
+	failed += map.stats.corrected != 1;
+	// the get above verified the page, the put may skip it, the one after that may not
+	reused = map.stats.reused;
+	failed += hamming_map_put(&map, key, 3) != 0 || map.stats.reused != reused + 1;
+	failed += hamming_map_put(&map, key, 4) != 0 || map.stats.reused != reused + 1;
+	if(failed){
+		printf("FAIL: %d map checks failed (value %lu, %lu corrected, %lu reused)\n",
+		       failed, value, map.stats.corrected, map.stats.reused);
+	}
+	hamming_map_close(&map);
+	return failed;
+}
+
+int main(int argc, char **argv){
+	int threads = argc > 1 ? atoi(argv[1]) : 4;
+	uint64_t entries = argc > 2 ? strtoull(argv[2], NULL, 0) : 1000000;
+	uint64_t ops = argc > 3 ? strtoull(argv[3], NULL, 0) : 1000000;
+	int insert_percent = argc > 4 ? atoi(argv[4]) : 10;
+	uint64_t verify_interval = argc > 5 ? strtoull(argv[5], NULL, 0) : 1;
+	int failed;
+
+	if(threads <= 0 || threads > 64 || entries == 0){
+		printf("usage: %s [threads] [entries] [ops per thread] [insert percent] [verify interval]\n", argv[0]);
+		return 1;
+	}
+	failed = check_flip();
+	failed += bench(false, threads, entries, ops, insert_percent, verify_interval) != 0;
+	failed += bench(true, threads, entries, ops, insert_percent, verify_interval) != 0;
+	return failed != 0;
+}
@@ -0,0 +1,908 @@
+#include "hamming_nbd.h"
+#include "hamming_fast_logic.h"
+
+#include <endian.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+
+/**
+ * \file hamming_nbd.c
+ * \brief Userspace NBD server over a Hamming protected page store
+ *
+ * Same hot path as the block device (verify on read, encode on write), but
+ * unprivileged, so it can be tested and benchmarked without loading the
+ * module.
+ *
+ * Every connection has a reader thread that parses requests and pushes them
+ * onto a shared queue without waiting for replies, so a client can keep a
+ * deep queue of requests in flight. Worker threads pull requests, run them
+ * against the store and send replies, possibly out of order (NBD matches
+ * replies by handle). A connection with HAMMING_NBD_INFLIGHT_MAX requests
+ * (or HAMMING_NBD_INFLIGHT_BYTES of buffers) outstanding isn't read from
+ * until some of them finish, so a client can't queue up unbounded memory and
+ * the socket pushes back on it instead.
+ */
+
+/*
+  Store
+ */
+
+static pthread_mutex_t *hamming_nbd_stripe(hamming_nbd_store_t *store, uint64_t page){
+	return &store->stripe[page % HAMMING_NBD_STRIPES];
+}
+
+/**
+ * \brief Look up a page, caller holds the page's stripe lock
+ *
+ * \param[in] store			Store to look in
+ * \param[in] page			Page number
+ * \param[in] create		Allocate the page (and its directory chunk) if missing
+ * \param[out] code			Code set of the page
+ *
+ * \return Page data, NULL if absent or out of memory
+ */
+static row_t *hamming_nbd_page(hamming_nbd_store_t *store, uint64_t page, bool create,
+			       hamming_code_set_t **code){
+	hamming_nbd_page_t **chunk, **expected, *page_ptr;
+
+	if(store->file_data){
+		*code = &store->file_codes[page];
+		return (row_t*)(store->file_data + page*HAMMING_NBD_PAGE_SIZE);
+	}
+
+	chunk = __atomic_load_n(&store->dir[page >> HAMMING_NBD_DIR_SHIFT], __ATOMIC_ACQUIRE);
+	if(chunk == NULL){
+		if(create == false){
+			return NULL;
+		}
+		// chunks are shared between stripes, so publish with a CAS
+		chunk = calloc(1 << HAMMING_NBD_DIR_SHIFT, sizeof(hamming_nbd_page_t*));
+		if(chunk == NULL){
+			return NULL;
+		}
+		expected = NULL;
+		if(!__atomic_compare_exchange_n(&store->dir[page >> HAMMING_NBD_DIR_SHIFT], &expected, chunk,
+						false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)){
+			free(chunk);
+			chunk = expected;
+		}
+	}
+	page_ptr = chunk[page & ((1 << HAMMING_NBD_DIR_SHIFT) - 1)];
+	if(page_ptr == NULL){
+		if(create == false){
+			return NULL;
+		}
+		if(posix_memalign((void**)&page_ptr, HAMMING_NBD_PAGE_SIZE, sizeof(hamming_nbd_page_t))){
+			return NULL;
+		}
+		// zero data encodes to zero codes
+		memset(page_ptr, 0, sizeof(hamming_nbd_page_t));
+		chunk[page & ((1 << HAMMING_NBD_DIR_SHIFT) - 1)] = page_ptr;
+		__atomic_fetch_add(&store->stats.pages, 1, __ATOMIC_RELAXED);
+	}
+	*code = &page_ptr->code;
+	return page_ptr->data;
+}
+
+/**
+ * \brief Verify and correct a page in place, caller holds its stripe lock
+ *
+ * \return Negative if uncorrectable, 0 otherwise
+ */
+static int hamming_nbd_page_correct(hamming_nbd_store_t *store, row_t *data, hamming_code_set_t *code){
+	hamming_code_set_t set;
+	int ret;
+
+	logic_set(&set, data, HAMMING_NBD_ROWS);
+	if(memcmp(&set, code, sizeof(set)) == 0){
+		return 0;
+	}
+	ret = correct_set(&set, code, data, HAMMING_NBD_ROWS);
+	if(ret < 0){
+		__atomic_fetch_add(&store->stats.uncorrectable, 1, __ATOMIC_RELAXED);
+		return -EIO;
+	}
+	__atomic_fetch_add(&store->stats.corrected, ret, __ATOMIC_RELAXED);
+	return 0;
+}
+
+static int hamming_nbd_store_check(hamming_nbd_store_t *store, uint64_t offset, uint32_t len){
+	if(offset > store->size || len > store->size - offset){
+		return -EINVAL;
+	}
+	return 0;
+}
+
+int hamming_nbd_store_read(hamming_nbd_store_t *store, uint64_t offset, uint32_t len, uint8_t *buf){
+	hamming_code_set_t *code;
+	uint64_t page;
+	uint32_t page_off, chunk;
+	row_t *data;
+	int ret = hamming_nbd_store_check(store, offset, len);
+
+	while(ret == 0 && len){
+		page = offset/HAMMING_NBD_PAGE_SIZE;
+		page_off = offset % HAMMING_NBD_PAGE_SIZE;
+		chunk = HAMMING_NBD_PAGE_SIZE - page_off < len ? HAMMING_NBD_PAGE_SIZE - page_off : len;
+
+		pthread_mutex_lock(hamming_nbd_stripe(store, page));
+		data = hamming_nbd_page(store, page, false, &code);
+		if(data == NULL){
+			memset(buf, 0, chunk);
+		}else{
+			ret = hamming_nbd_page_correct(store, data, code);
+			memcpy(buf, (uint8_t*)data + page_off, chunk);
+		}
+		pthread_mutex_unlock(hamming_nbd_stripe(store, page));
+
+		offset += chunk;
+		buf += chunk;
+		len -= chunk;
+	}
+	__atomic_fetch_add(&store->stats.reads, 1, __ATOMIC_RELAXED);
+	return ret;
+}
+
+/**
+ * \brief Write to the store
+ *
+ * Whole pages are copied in and encoded in one pass. Partial pages are
+ * verified before they are merged, otherwise a flipped bit outside of the
+ * write would be baked into the new codes. An uncorrectable page is left as
+ * it is and fails the write, so it keeps failing reads too.
+ */
+int hamming_nbd_store_write(hamming_nbd_store_t *store, uint64_t offset, uint32_t len, const uint8_t *buf){
+	hamming_code_set_t *code;
+	uint64_t page;
+	uint32_t page_off, chunk;
+	row_t *data;
+	int ret = hamming_nbd_store_check(store, offset, len);
+
+	while(ret == 0 && len){
+		page = offset/HAMMING_NBD_PAGE_SIZE;
+		page_off = offset % HAMMING_NBD_PAGE_SIZE;
+		chunk = HAMMING_NBD_PAGE_SIZE - page_off < len ? HAMMING_NBD_PAGE_SIZE - page_off : len;
+
+		pthread_mutex_lock(hamming_nbd_stripe(store, page));
+		data = hamming_nbd_page(store, page, true, &code);
+		if(data == NULL){
+			ret = -ENOMEM;
+		}else if(chunk == HAMMING_NBD_PAGE_SIZE && ((uintptr_t)buf % sizeof(row_t)) == 0){
+			logic_set_copy(code, data, (const row_t*)buf, HAMMING_NBD_ROWS);
+		}else{
+			ret = hamming_nbd_page_correct(store, data, code);
+			if(ret == 0){
+				memcpy((uint8_t*)data + page_off, buf, chunk);
+				logic_set(code, data, HAMMING_NBD_ROWS);
+			}
+		}
+		pthread_mutex_unlock(hamming_nbd_stripe(store, page));
+
+		offset += chunk;
+		buf += chunk;
+		len -= chunk;
+	}
+	__atomic_fetch_add(&store->stats.writes, 1, __ATOMIC_RELAXED);
+	return ret;
+}
+
+/**
+ * \brief Trim or zero a range
+ *
+ * Whole pages are dropped from the index in RAM mode, partial pages are
+ * zeroed, both read back as zeroes afterwards. Like a partial write, a
+ * partial trim of an uncorrectable page fails without touching it.
+ */
+int hamming_nbd_store_trim(hamming_nbd_store_t *store, uint64_t offset, uint32_t len){
+	hamming_nbd_page_t **chunk;
+	hamming_code_set_t *code;
+	uint64_t page;
+	uint32_t page_off, size;
+	row_t *data;
+	int ret = hamming_nbd_store_check(store, offset, len);
+
+	while(ret == 0 && len){
+		page = offset/HAMMING_NBD_PAGE_SIZE;
+		page_off = offset % HAMMING_NBD_PAGE_SIZE;
+		size = HAMMING_NBD_PAGE_SIZE - page_off < len ? HAMMING_NBD_PAGE_SIZE - page_off : len;
+
+		pthread_mutex_lock(hamming_nbd_stripe(store, page));
+		data = hamming_nbd_page(store, page, false, &code);
+		if(data && size == HAMMING_NBD_PAGE_SIZE && store->file_data == NULL){
+			chunk = store->dir[page >> HAMMING_NBD_DIR_SHIFT];
+			free(chunk[page & ((1 << HAMMING_NBD_DIR_SHIFT) - 1)]);
+			chunk[page & ((1 << HAMMING_NBD_DIR_SHIFT) - 1)] = NULL;
+			__atomic_fetch_sub(&store->stats.pages, 1, __ATOMIC_RELAXED);
+		}else if(data){
+			if(size != HAMMING_NBD_PAGE_SIZE){
+				ret = hamming_nbd_page_correct(store, data, code);
+			}
+			if(ret == 0){
+				memset((uint8_t*)data + page_off, 0, size);
+				logic_set(code, data, HAMMING_NBD_ROWS);
+			}
+		}
+		pthread_mutex_unlock(hamming_nbd_stripe(store, page));
+
+		offset += size;
+		len -= size;
+	}
+	return ret;
+}
+
+int hamming_nbd_store_flush(hamming_nbd_store_t *store){
+	if(store->file_data && msync(store->file_data, store->size, MS_SYNC) < 0){
+		return -errno;
+	}
+	return 0;
+}
+
+static void hamming_nbd_store_init_locks(hamming_nbd_store_t *store){
+	int i;
+	for(i = 0;i < HAMMING_NBD_STRIPES;i++){
+		pthread_mutex_init(&store->stripe[i], NULL);
+	}
+}
+
+/**
+ * \brief Sparse RAM store
+ *
+ * \param[out] store		Store to initialize
+ * \param[in] size			Advertised size in bytes, rounded up to a page
+ *
+ * \return Negative on failure, 0 otherwise
+ */
+int hamming_nbd_store_init_ram(hamming_nbd_store_t *store, uint64_t size){
+	CLEAR_MEM(*store);
+	store->page_count = (size + HAMMING_NBD_PAGE_SIZE - 1)/HAMMING_NBD_PAGE_SIZE;
+	store->size = store->page_count*HAMMING_NBD_PAGE_SIZE;
+	store->dir_count = (store->page_count >> HAMMING_NBD_DIR_SHIFT) + 1;
+	store->dir = calloc(store->dir_count, sizeof(hamming_nbd_page_t**));
+	if(store->dir == NULL){
+		return -ENOMEM;
+	}
+	hamming_nbd_store_init_locks(store);
+	return 0;
+}
+
+/**
+ * \brief File backed store
+ *
+ * \param[out] store		Store to initialize
+ * \param[in] path			File to serve, size must be a multiple of 4K
+ *
+ * \return Negative on failure, 0 otherwise
+ */
+int hamming_nbd_store_init_file(hamming_nbd_store_t *store, const char *path){
+	struct stat st;
+	uint64_t i;
+	int fd;
+
+	CLEAR_MEM(*store);
+	fd = open(path, O_RDWR);
+	if(fd < 0){
+		return -errno;
+	}
+	if(fstat(fd, &st) < 0 || st.st_size == 0 || st.st_size % HAMMING_NBD_PAGE_SIZE){
+		// size must be a non zero multiple of 4K
+		close(fd);
+		return -EINVAL;
+	}
+	store->size = st.st_size;
+	store->page_count = store->size/HAMMING_NBD_PAGE_SIZE;
+	store->file_data = mmap(NULL, store->size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if(store->file_data == MAP_FAILED){
+		store->file_data = NULL;
+		return -ENOMEM;
+	}
+	store->file_codes = malloc(store->page_count*sizeof(hamming_code_set_t));
+	if(store->file_codes == NULL){
+		munmap(store->file_data, store->size);
+		store->file_data = NULL;
+		return -ENOMEM;
+	}
+	for(i = 0;i < store->page_count;i++){
+		logic_set(&store->file_codes[i], (row_t*)(store->file_data + i*HAMMING_NBD_PAGE_SIZE),
+			  HAMMING_NBD_ROWS);
+	}
+	hamming_nbd_store_init_locks(store);
+	return 0;
+}
+
+void hamming_nbd_store_close(hamming_nbd_store_t *store){
+	uint64_t i, j;
+
+	if(store->file_data){
+		munmap(store->file_data, store->size);
+		free(store->file_codes);
+	}
+	if(store->dir){
+		for(i = 0;i < store->dir_count;i++){
+			if(store->dir[i] == NULL){
+				continue;
+			}
+			for(j = 0;j < (1 << HAMMING_NBD_DIR_SHIFT);j++){
+				free(store->dir[i][j]);
+			}
+			free(store->dir[i]);
+		}
+		free(store->dir);
+	}
+	CLEAR_MEM(*store);
+}
+
+/*
+  Server
+ */
+
+struct hamming_nbd_server_s;
+
+typedef struct hamming_nbd_conn_s{
+	struct hamming_nbd_server_s *server;
+	struct hamming_nbd_conn_s *next; // server's list, so it can shut us down
+	struct hamming_nbd_conn_s *prev;
+	int fd;
+	pthread_mutex_t send_lock;
+	pthread_mutex_t lock;
+	pthread_cond_t room; // signalled whenever a request finishes
+	int inflight;
+	uint64_t inflight_bytes;
+	bool dead; // a send failed, stop reading
+} hamming_nbd_conn_t;
+
+typedef struct hamming_nbd_req_s{
+	struct hamming_nbd_req_s *next;
+	hamming_nbd_conn_t *conn;
+	uint16_t type;
+	uint64_t handle; // kept in wire order, it's opaque
+	uint64_t offset;
+	uint32_t len;
+	uint8_t *buf;
+} hamming_nbd_req_t;
+
+typedef struct hamming_nbd_server_s{
+	hamming_nbd_store_t *store;
+	pthread_mutex_t lock;
+	pthread_cond_t wake;
+	hamming_nbd_req_t *head;
+	hamming_nbd_req_t *tail;
+	bool stop; // workers exit once the queue is empty
+
+	pthread_t workers[HAMMING_NBD_THREADS_MAX];
+	int worker_count;
+
+	hamming_nbd_conn_t *conns;
+	int conn_count;
+	pthread_cond_t conn_done;
+} hamming_nbd_server_t;
+
+static int hamming_nbd_read_full(int fd, void *buf, size_t len){
+	uint8_t *ptr = buf;
+	ssize_t ret;
+	while(len){
+		ret = read(fd, ptr, len);
+		if(ret < 0 && errno == EINTR){
+			continue;
+		}
+		if(ret <= 0){
+			return -EIO;
+		}
+		ptr += ret;
+		len -= ret;
+	}
+	return 0;
+}
+
+static int hamming_nbd_write_full(int fd, const void *buf, size_t len){
+	const uint8_t *ptr = buf;
+	ssize_t ret;
+	while(len){
+		ret = write(fd, ptr, len);
+		if(ret < 0 && errno == EINTR){
+			continue;
+		}
+		if(ret <= 0){
+			return -EIO;
+		}
+		ptr += ret;
+		len -= ret;
+	}
+	return 0;
+}
+
+static int hamming_nbd_option_reply(int fd, uint32_t option, uint32_t type,
+				    const void *data, uint32_t len){
+	struct{
+		uint64_t magic;
+		uint32_t option;
+		uint32_t type;
+		uint32_t len;
+	} __attribute__((packed)) reply;
+
+	reply.magic = htobe64(HAMMING_NBD_REP_MAGIC);
+	reply.option = htobe32(option);
+	reply.type = htobe32(type);
+	reply.len = htobe32(len);
+	if(hamming_nbd_write_full(fd, &reply, sizeof(reply)) < 0){
+		return -EIO;
+	}
+	return len ? hamming_nbd_write_full(fd, data, len) : 0;
+}
+
+/**
+ * \brief Fixed newstyle handshake
+ *
+ * There is a single export, whatever name the client asks for. Both
+ * NBD_OPT_EXPORT_NAME and NBD_OPT_GO are understood.
+ *
+ * \return Negative on failure or abort, 0 once we are in transmission
+ */
+static int hamming_nbd_handshake(hamming_nbd_store_t *store, int fd){
+	const uint16_t tflags = HAMMING_NBD_TFLAG_HAS_FLAGS | HAMMING_NBD_TFLAG_SEND_FLUSH |
+		HAMMING_NBD_TFLAG_SEND_TRIM | HAMMING_NBD_TFLAG_SEND_WRITE_ZEROES |
+		HAMMING_NBD_TFLAG_CAN_MULTI_CONN;
+	struct{
+		uint64_t init_magic;
+		uint64_t opts_magic;
+		uint16_t flags;
+	} __attribute__((packed)) hello;
+	struct{
+		uint64_t magic;
+		uint32_t option;
+		uint32_t len;
+	} __attribute__((packed)) opt;
+	struct{
+		uint16_t type;
+		uint64_t size;
+		uint16_t flags;
+	} __attribute__((packed)) info;
+	struct{
+		uint64_t size;
+		uint16_t flags;
+	} __attribute__((packed)) export_reply;
+	uint8_t zeroes[124];
+	uint32_t client_flags, option, len;
+	uint8_t *data;
+
+	hello.init_magic = htobe64(HAMMING_NBD_INIT_MAGIC);
+	hello.opts_magic = htobe64(HAMMING_NBD_OPTS_MAGIC);
+	hello.flags = htobe16(HAMMING_NBD_FLAG_FIXED_NEWSTYLE | HAMMING_NBD_FLAG_NO_ZEROES);
+	if(hamming_nbd_write_full(fd, &hello, sizeof(hello)) < 0 ||
+	   hamming_nbd_read_full(fd, &client_flags, sizeof(client_flags)) < 0){
+		return -EIO;
+	}
+	client_flags = be32toh(client_flags);
+
+	while(true){
+		if(hamming_nbd_read_full(fd, &opt, sizeof(opt)) < 0 ||
+		   be64toh(opt.magic) != HAMMING_NBD_OPTS_MAGIC){
+			return -EIO;
+		}
+		option = be32toh(opt.option);
+		len = be32toh(opt.len);
+		if(len > 4096){
+			return -EIO;
+		}
+		data = malloc(len + 1);
+		if(data == NULL || hamming_nbd_read_full(fd, data, len) < 0){
+			free(data);
+			return -EIO;
+		}
+		free(data);
+
+		switch(option){
+		case HAMMING_NBD_OPT_EXPORT_NAME:
+			export_reply.size = htobe64(store->size);
+			export_reply.flags = htobe16(tflags);
+			if(hamming_nbd_write_full(fd, &export_reply, sizeof(export_reply)) < 0){
+				return -EIO;
+			}
+			if((client_flags & HAMMING_NBD_FLAG_NO_ZEROES) == 0){
+				memset(zeroes, 0, sizeof(zeroes));
+				if(hamming_nbd_write_full(fd, zeroes, sizeof(zeroes)) < 0){
+					return -EIO;
+				}
+			}
+			return 0;
+		case HAMMING_NBD_OPT_INFO:
+		case HAMMING_NBD_OPT_GO:
+			info.type = htobe16(HAMMING_NBD_INFO_EXPORT);
+			info.size = htobe64(store->size);
+			info.flags = htobe16(tflags);
+			if(hamming_nbd_option_reply(fd, option, HAMMING_NBD_REP_INFO, &info, sizeof(info)) < 0 ||
+			   hamming_nbd_option_reply(fd, option, HAMMING_NBD_REP_ACK, NULL, 0) < 0){
+				return -EIO;
+			}
+			if(option == HAMMING_NBD_OPT_GO){
+				return 0;
+			}
+			break;
+		case HAMMING_NBD_OPT_ABORT:
+			hamming_nbd_option_reply(fd, option, HAMMING_NBD_REP_ACK, NULL, 0);
+			return -ECONNABORTED;
+		default:
+			if(hamming_nbd_option_reply(fd, option, HAMMING_NBD_REP_ERR_UNSUP, NULL, 0) < 0){
+				return -EIO;
+			}
+			break;
+		}
+	}
+}
+
+/**
+ * \brief Run one request and reply to it
+ *
+ * Replies are sent with a single writev under the connection's send lock, so
+ * replies from different workers never interleave.
+ */
+static void hamming_nbd_execute(hamming_nbd_store_t *store, hamming_nbd_req_t *req){
+	hamming_nbd_conn_t *conn = req->conn;
+	hamming_nbd_reply_t reply;
+	struct iovec iov[2];
+	int ret, iov_count = 1;
+	ssize_t sent;
+	size_t total;
+
+	switch(req->type){
+	case HAMMING_NBD_CMD_READ:
+		ret = hamming_nbd_store_read(store, req->offset, req->len, req->buf);
+		break;
+	case HAMMING_NBD_CMD_WRITE:
+		ret = hamming_nbd_store_write(store, req->offset, req->len, req->buf);
+		break;
+	case HAMMING_NBD_CMD_TRIM:
+	case HAMMING_NBD_CMD_WRITE_ZEROES:
+		ret = hamming_nbd_store_trim(store, req->offset, req->len);
+		break;
+	case HAMMING_NBD_CMD_FLUSH:
+		ret = hamming_nbd_store_flush(store);
+		break;
+	default:
+		ret = -EINVAL;
+		break;
+	}
+
+	reply.magic = htobe32(HAMMING_NBD_REPLY_MAGIC);
+	reply.error = htobe32(ret < 0 ? -ret : 0);
+	reply.handle = req->handle;
+	iov[0].iov_base = &reply;
+	iov[0].iov_len = sizeof(reply);
+	total = sizeof(reply);
+	if(req->type == HAMMING_NBD_CMD_READ && ret == 0){
+		iov[1].iov_base = req->buf;
+		iov[1].iov_len = req->len;
+		total += req->len;
+		iov_count = 2;
+	}
+
+	pthread_mutex_lock(&conn->send_lock);
+	while(total){
+		sent = writev(conn->fd, iov, iov_count);
+		if(sent < 0 && errno == EINTR){
+			continue;
+		}
+		if(sent <= 0){
+			conn->dead = true;
+			shutdown(conn->fd, SHUT_RDWR);
+			break;
+		}
+		total -= sent;
+		while(iov_count && (size_t)sent >= iov[0].iov_len){
+			sent -= iov[0].iov_len;
+			iov[0] = iov[1];
+			iov_count--;
+		}
+		if(iov_count){
+			iov[0].iov_base = (uint8_t*)iov[0].iov_base + sent;
+			iov[0].iov_len -= sent;
+		}
+	}
+	pthread_mutex_unlock(&conn->send_lock);
+
+	pthread_mutex_lock(&conn->lock);
+	conn->inflight--;
+	conn->inflight_bytes -= req->buf ? req->len : 0;
+	pthread_cond_signal(&conn->room);
+	pthread_mutex_unlock(&conn->lock);
+
+	free(req->buf);
+	free(req);
+}
+
+static void *hamming_nbd_worker(void *arg){
+	hamming_nbd_server_t *server = arg;
+	hamming_nbd_req_t *req;
+
+	while(true){
+		pthread_mutex_lock(&server->lock);
+		while(server->head == NULL && server->stop == false){
+			pthread_cond_wait(&server->wake, &server->lock);
+		}
+		if(server->head == NULL){
+			pthread_mutex_unlock(&server->lock);
+			break;
+		}
+		req = server->head;
+		server->head = req->next;
+		if(server->head == NULL){
+			server->tail = NULL;
+		}
+		pthread_mutex_unlock(&server->lock);
+
+		hamming_nbd_execute(server->store, req);
+	}
+	return NULL;
+}
+
+/**
+ * \brief Wait until a connection can take one more request
+ *
+ * \param[in] conn			Connection, its reader is the only one adding requests
+ * \param[in] bytes			Buffer the request needs
+ * \param[in] max			Requests in flight allowed, 0 to wait for none
+ */
+static void hamming_nbd_room(hamming_nbd_conn_t *conn, uint64_t bytes, int max){
+	pthread_mutex_lock(&conn->lock);
+	while(conn->inflight && (conn->inflight >= max ||
+				 conn->inflight_bytes + bytes > HAMMING_NBD_INFLIGHT_BYTES)){
+		pthread_cond_wait(&conn->room, &conn->lock);
+	}
+	pthread_mutex_unlock(&conn->lock);
+}
+
+/**
+ * \brief Connection reader
+ *
+ * Parses requests and queues them for the workers as fast as the client
+ * sends them, as long as the connection has room in flight, see
+ * hamming_nbd_room. On disconnect, waits for everything in flight before
+ * closing.
+ * The connection was put on the server's list by the accept loop, and is
+ * taken off it and freed here.
+ */
+static void *hamming_nbd_connection(void *arg){
+	hamming_nbd_conn_t *conn = arg;
+	hamming_nbd_server_t *server = conn->server;
+	hamming_nbd_request_t wire;
+	hamming_nbd_req_t *req;
+
+	if(hamming_nbd_handshake(server->store, conn->fd) < 0){
+		goto out;
+	}
+
+	while(conn->dead == false){
+		if(hamming_nbd_read_full(conn->fd, &wire, sizeof(wire)) < 0 ||
+		   be32toh(wire.magic) != HAMMING_NBD_REQUEST_MAGIC){
+			break;
+		}
+		if(be16toh(wire.type) == HAMMING_NBD_CMD_DISC){
+			break;
+		}
+		req = calloc(1, sizeof(hamming_nbd_req_t));
+		if(req == NULL){
+			break;
+		}
+		req->conn = conn;
+		req->type = be16toh(wire.type);
+		req->handle = wire.handle;
+		req->offset = be64toh(wire.offset);
+		req->len = be32toh(wire.len);
+		if(req->len > HAMMING_NBD_MAX_LEN){
+			free(req);
+			break;
+		}
+		if(req->type == HAMMING_NBD_CMD_READ || req->type == HAMMING_NBD_CMD_WRITE){
+			hamming_nbd_room(conn, req->len, HAMMING_NBD_INFLIGHT_MAX);
+			// row aligned so whole page writes can take the fused path
+			if(posix_memalign((void**)&req->buf, sizeof(row_t), req->len ? req->len : 1)){
+				free(req);
+				break;
+			}
+		}
+		if(req->type == HAMMING_NBD_CMD_WRITE &&
+		   hamming_nbd_read_full(conn->fd, req->buf, req->len) < 0){
+			free(req->buf);
+			free(req);
+			break;
+		}
+
+		if(req->buf == NULL){
+			hamming_nbd_room(conn, 0, HAMMING_NBD_INFLIGHT_MAX);
+		}
+		pthread_mutex_lock(&conn->lock);
+		conn->inflight++;
+		conn->inflight_bytes += req->buf ? req->len : 0;
+		pthread_mutex_unlock(&conn->lock);
+
+		pthread_mutex_lock(&server->lock);
+		if(server->tail){
+			server->tail->next = req;
+		}else{
+			server->head = req;
+		}
+		server->tail = req;
+		pthread_cond_signal(&server->wake);
+		pthread_mutex_unlock(&server->lock);
+	}
+
+	hamming_nbd_room(conn, 0, 0);
+out:
+	pthread_mutex_lock(&server->lock);
+	if(conn->prev){
+		conn->prev->next = conn->next;
+	}else{
+		server->conns = conn->next;
+	}
+	if(conn->next){
+		conn->next->prev = conn->prev;
+	}
+	server->conn_count--;
+	pthread_cond_signal(&server->conn_done);
+	pthread_mutex_unlock(&server->lock);
+
+	close(conn->fd);
+	pthread_mutex_destroy(&conn->send_lock);
+	pthread_mutex_destroy(&conn->lock);
+	pthread_cond_destroy(&conn->room);
+	free(conn);
+	return NULL;
+}
+
+/**
+ * \brief Accept clients until stop_fd turns readable or accept fails
+ *
+ * \return Negative errno accept (or poll) failed with, 0 when stopped
+ */
+static int hamming_nbd_accept(hamming_nbd_server_t *server, int fd, int stop_fd){
+	struct pollfd fds[2];
+	hamming_nbd_conn_t *conn;
+	pthread_t thread;
+	int client;
+
+	fds[0].fd = fd;
+	fds[0].events = POLLIN;
+	fds[1].fd = stop_fd; // poll skips it if it's negative
+	fds[1].events = POLLIN;
+	while(true){
+		if(poll(fds, 2, -1) < 0){
+			if(errno == EINTR){
+				continue;
+			}
+			return -errno;
+		}
+		if(fds[1].revents){
+			return 0;
+		}
+		client = accept(fd, NULL, NULL);
+		if(client < 0){
+			if(errno == EINTR){
+				continue;
+			}
+			return -errno;
+		}
+		conn = calloc(1, sizeof(hamming_nbd_conn_t));
+		if(conn == NULL){
+			close(client);
+			continue;
+		}
+		conn->server = server;
+		conn->fd = client;
+		pthread_mutex_init(&conn->send_lock, NULL);
+		pthread_mutex_init(&conn->lock, NULL);
+		pthread_cond_init(&conn->room, NULL);
+
+		pthread_mutex_lock(&server->lock);
+		conn->next = server->conns;
+		if(server->conns){
+			server->conns->prev = conn;
+		}
+		server->conns = conn;
+		server->conn_count++;
+		pthread_mutex_unlock(&server->lock);
+
+		if(pthread_create(&thread, NULL, hamming_nbd_connection, conn)){
+			// nothing else knows it yet, undo what the thread would
+			pthread_mutex_lock(&server->lock);
+			server->conns = conn->next;
+			if(conn->next){
+				conn->next->prev = NULL;
+			}
+			server->conn_count--;
+			pthread_mutex_unlock(&server->lock);
+			close(client);
+			pthread_mutex_destroy(&conn->send_lock);
+			pthread_mutex_destroy(&conn->lock);
+			pthread_cond_destroy(&conn->room);
+			free(conn);
+			continue;
+		}
+		pthread_detach(thread);
+	}
+}
+
+/**
+ * \brief Serve a store on a unix socket
+ *
+ * Any stale socket file at path is replaced. Every client gets its own reader
+ * thread, all of them share the worker pool. Once stop_fd is readable (a
+ * pipe written to or closed, e.g. by a signal handler) or accept fails,
+ * every client is disconnected and drained and the workers are joined
+ * before returning, since all of them use the server on our stack. The
+ * socket file is removed too.
+ *
+ * \param[in] store			Store to export
+ * \param[in] path			Unix socket path
+ * \param[in] threads		Number of worker threads
+ * \param[in] stop_fd		Descriptor that stops the server once readable, -1 for none
+ *
+ * \return Negative on failure, 0 if stopped through stop_fd
+ */
+int hamming_nbd_serve(hamming_nbd_store_t *store, const char *path, int threads, int stop_fd){
+	hamming_nbd_server_t server;
+	hamming_nbd_conn_t *conn;
+	struct sockaddr_un addr;
+	int fd, i, ret;
+
+	if(threads <= 0 || threads > HAMMING_NBD_THREADS_MAX || strlen(path) >= sizeof(addr.sun_path)){
+		return -EINVAL;
+	}
+	signal(SIGPIPE, SIG_IGN);
+
+	fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if(fd < 0){
+		return -errno;
+	}
+	CLEAR_MEM(addr);
+	addr.sun_family = AF_UNIX;
+	strcpy(addr.sun_path, path);
+	unlink(path);
+	if(bind(fd, (struct sockaddr*)&addr, sizeof(addr)) < 0 || listen(fd, 16) < 0){
+		ret = -errno;
+		close(fd);
+		return ret;
+	}
+
+	CLEAR_MEM(server);
+	server.store = store;
+	pthread_mutex_init(&server.lock, NULL);
+	pthread_cond_init(&server.wake, NULL);
+	pthread_cond_init(&server.conn_done, NULL);
+	ret = 0;
+	for(i = 0;i < threads;i++){
+		ret = -pthread_create(&server.workers[i], NULL, hamming_nbd_worker, &server);
+		if(ret < 0){
+			break;
+		}
+		server.worker_count++;
+	}
+	if(ret == 0){
+		ret = hamming_nbd_accept(&server, fd, stop_fd);
+	}
+	close(fd);
+	unlink(path);
+
+	// readers see EOF, wait for what they queued, then let the workers go
+	pthread_mutex_lock(&server.lock);
+	for(conn = server.conns;conn;conn = conn->next){
+		shutdown(conn->fd, SHUT_RDWR);
+	}
+	while(server.conn_count){
+		pthread_cond_wait(&server.conn_done, &server.lock);
+	}
+	server.stop = true;
+	pthread_cond_broadcast(&server.wake);
+	pthread_mutex_unlock(&server.lock);
+	for(i = 0;i < server.worker_count;i++){
+		pthread_join(server.workers[i], NULL);
+	}
+	pthread_mutex_destroy(&server.lock);
+	pthread_cond_destroy(&server.wake);
+	pthread_cond_destroy(&server.conn_done);
+	return ret;
+}
@@ -0,0 +1,116 @@
+#ifndef HAMMING_NBD_H
+#define HAMMING_NBD_H
+
+#include "hamming_fast.h"
+#include "hamming_fast_logic.h"
+
+#include <errno.h>
+#include <pthread.h>
+
+#define HAMMING_NBD_PAGE_SIZE 4096
+#define HAMMING_NBD_ROWS (HAMMING_NBD_PAGE_SIZE/sizeof(row_t))
+#define HAMMING_NBD_DIR_SHIFT 9 // pages per directory chunk, 2MB of data
+#define HAMMING_NBD_STRIPES 256
+#define HAMMING_NBD_THREADS_MAX 64
+#define HAMMING_NBD_MAX_LEN (32*1024*1024)
+#define HAMMING_NBD_INFLIGHT_MAX 64 // requests of one connection queued or running, its reader waits past that
+#define HAMMING_NBD_INFLIGHT_BYTES (64*1024*1024) // and their buffers, one request is always let through
+
+// handshake, see the NBD protocol document
+#define HAMMING_NBD_INIT_MAGIC 0x4e42444d41474943ULL // NBDMAGIC
+#define HAMMING_NBD_OPTS_MAGIC 0x49484156454F5054ULL // IHAVEOPT
+#define HAMMING_NBD_REP_MAGIC 0x3e889045565a9ULL
+
+#define HAMMING_NBD_FLAG_FIXED_NEWSTYLE (1 << 0)
+#define HAMMING_NBD_FLAG_NO_ZEROES (1 << 1)
+
+#define HAMMING_NBD_OPT_EXPORT_NAME 1
+#define HAMMING_NBD_OPT_ABORT 2
+#define HAMMING_NBD_OPT_INFO 6
+#define HAMMING_NBD_OPT_GO 7
+
+#define HAMMING_NBD_REP_ACK 1
+#define HAMMING_NBD_REP_INFO 3
+#define HAMMING_NBD_REP_ERR_UNSUP ((1U << 31) | 1)
+#define HAMMING_NBD_INFO_EXPORT 0
+
+// transmission
+#define HAMMING_NBD_REQUEST_MAGIC 0x25609513
+#define HAMMING_NBD_REPLY_MAGIC 0x67446698
+
+#define HAMMING_NBD_CMD_READ 0
+#define HAMMING_NBD_CMD_WRITE 1
+#define HAMMING_NBD_CMD_DISC 2
+#define HAMMING_NBD_CMD_FLUSH 3
+#define HAMMING_NBD_CMD_TRIM 4
+#define HAMMING_NBD_CMD_WRITE_ZEROES 6
+
+#define HAMMING_NBD_TFLAG_HAS_FLAGS (1 << 0)
+#define HAMMING_NBD_TFLAG_SEND_FLUSH (1 << 2)
+#define HAMMING_NBD_TFLAG_SEND_TRIM (1 << 5)
+#define HAMMING_NBD_TFLAG_SEND_WRITE_ZEROES (1 << 6)
+#define HAMMING_NBD_TFLAG_CAN_MULTI_CONN (1 << 8)
+
+// all fields big endian on the wire
+typedef struct{
+	uint32_t magic;
+	uint16_t flags;
+	uint16_t type;
+	uint64_t handle;
+	uint64_t offset;
+	uint32_t len;
+} __attribute__((packed)) hamming_nbd_request_t;
+
+typedef struct{
+	uint32_t magic;
+	uint32_t error;
+	uint64_t handle;
+} __attribute__((packed)) hamming_nbd_reply_t;
+
+typedef struct{
+	row_t data[HAMMING_NBD_ROWS];
+	hamming_code_set_t code;
+} hamming_nbd_page_t;
+
+/**
+ * \brief Protected page store behind the server
+ *
+ * RAM mode keeps a sparse two level index of pages, allocated on first
+ * write, absent pages read back as zeroes. File mode maps a file and keeps
+ * codes for every page in RAM, computed when the file is opened (like a fresh
+ * binding, whatever is on disk is assumed correct).
+ */
+typedef struct{
+	uint64_t size;
+	uint64_t page_count;
+
+	hamming_nbd_page_t ***dir; // RAM mode
+	uint64_t dir_count;
+
+	uint8_t *file_data; // file mode
+	hamming_code_set_t *file_codes;
+
+	pthread_mutex_t stripe[HAMMING_NBD_STRIPES];
+
+	struct{
+		uint64_t reads;
+		uint64_t writes;
+		uint64_t pages;
+		uint64_t corrected;
+		uint64_t uncorrectable;
+	} stats;
+} hamming_nbd_store_t;
+
+extern int hamming_nbd_store_init_ram(hamming_nbd_store_t *store, uint64_t size);
+extern int hamming_nbd_store_init_file(hamming_nbd_store_t *store, const char *path);
+extern void hamming_nbd_store_close(hamming_nbd_store_t *store);
+
+extern int hamming_nbd_store_read(hamming_nbd_store_t *store, uint64_t offset, uint32_t len, uint8_t *buf);
+extern int hamming_nbd_store_write(hamming_nbd_store_t *store, uint64_t offset, uint32_t len, const uint8_t *buf);
+extern int hamming_nbd_store_trim(hamming_nbd_store_t *store, uint64_t offset, uint32_t len);
+extern int hamming_nbd_store_flush(hamming_nbd_store_t *store);
+
+// serves store on a unix socket with threads workers, until stop_fd turns readable (-1 for never) or a fatal error
+extern int hamming_nbd_serve(hamming_nbd_store_t *store, const char *path, int threads, int stop_fd);
+
+#endif
@@ -0,0 +1,269 @@
+#include "hamming_fast.h"
+#include "hamming_nbd.h"
+
+#include <endian.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/un.h>
+
+/*
+  fio style client for nbd_server
+
+  Keeps depth requests in flight on one connection and reports bandwidth and
+  IOPS for sequential and random writes and reads. Every block carries a
+  pattern derived from its offset, reads are checked against it.
+
+  usage: nbd_bench socket [block size] [depth] [MB to touch] [ops]
+ */
+
+typedef struct{
+	int fd;
+	uint64_t size;
+} bench_conn_t;
+
+static uint64_t get_time_micro_s(){
+	struct timeval tv;
+	gettimeofday(&tv, NULL);
+	return 1000000ULL*tv.tv_sec + tv.tv_usec;
+}
+
+static uint64_t xorshift(uint64_t *state){
+	*state ^= *state << 13;
+	*state ^= *state >> 7;
+	*state ^= *state << 17;
+	return *state;
+}
+
+static int read_full(int fd, void *buf, size_t len){
+	uint8_t *ptr = buf;
+	ssize_t ret;
+	while(len){
+		ret = read(fd, ptr, len);
+		if(ret <= 0){
+			return -1;
+		}
+		ptr += ret;
+		len -= ret;
+	}
+	return 0;
+}
+
+static int write_full(int fd, const void *buf, size_t len){
+	const uint8_t *ptr = buf;
+	ssize_t ret;
+	while(len){
+		ret = write(fd, ptr, len);
+		if(ret <= 0){
+			return -1;
+		}
+		ptr += ret;
+		len -= ret;
+	}
+	return 0;
+}
+
+static int bench_connect(bench_conn_t *conn, const char *path){
+	struct sockaddr_un addr;
+	struct{
+		uint64_t init_magic;
+		uint64_t opts_magic;
+		uint16_t flags;
+	} __attribute__((packed)) hello;
+	struct{
+		uint32_t client_flags;
+		uint64_t magic;
+		uint32_t option;
+		uint32_t len;
+	} __attribute__((packed)) opt;
+	struct{
+		uint64_t size;
+		uint16_t flags;
+	} __attribute__((packed)) export_reply;
+
+	conn->fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	CLEAR_MEM(addr);
+	addr.sun_family = AF_UNIX;
+	strncpy(addr.sun_path, path, sizeof(addr.sun_path) - 1);
+	if(conn->fd < 0 || connect(conn->fd, (struct sockaddr*)&addr, sizeof(addr)) < 0){
+		return -1;
+	}
+	if(read_full(conn->fd, &hello, sizeof(hello)) < 0 ||
+	   be64toh(hello.init_magic) != HAMMING_NBD_INIT_MAGIC){
+		return -1;
+	}
+	opt.client_flags = htobe32(HAMMING_NBD_FLAG_FIXED_NEWSTYLE | HAMMING_NBD_FLAG_NO_ZEROES);
+	opt.magic = htobe64(HAMMING_NBD_OPTS_MAGIC);
+	opt.option = htobe32(HAMMING_NBD_OPT_EXPORT_NAME);
+	opt.len = 0;
+	if(write_full(conn->fd, &opt, sizeof(opt)) < 0 ||
+	   read_full(conn->fd, &export_reply, sizeof(export_reply)) < 0){
+		return -1;
+	}
+	conn->size = be64toh(export_reply.size);
+	return 0;
+}
+
+static int bench_send(bench_conn_t *conn, uint16_t type, uint64_t handle, uint64_t offset,
+		      uint32_t len, const uint8_t *buf){
+	hamming_nbd_request_t req;
+
+	req.magic = htobe32(HAMMING_NBD_REQUEST_MAGIC);
+	req.flags = 0;
+	req.type = htobe16(type);
+	req.handle = handle;
+	req.offset = htobe64(offset);
+	req.len = htobe32(len);
+	if(write_full(conn->fd, &req, sizeof(req)) < 0){
+		return -1;
+	}
+	if(type == HAMMING_NBD_CMD_WRITE){
+		return write_full(conn->fd, buf, len);
+	}
+	return 0;
+}
+
+static void fill_pattern(uint8_t *buf, uint64_t offset, uint32_t len){
+	uint64_t *words = (uint64_t*)buf;
+	uint32_t i;
+	for(i = 0;i < len/sizeof(uint64_t);i++){
+		words[i] = (offset + i*sizeof(uint64_t))*0x9E3779B97F4A7C15ULL;
+	}
+}
+
+/**
+ * \brief One pass of a workload
+ *
+ * Handles are slot numbers, so replies can come back in any order.
+ *
+ * \return Number of read blocks that didn't match the pattern, negative on error
+ */
+static int64_t bench_run(bench_conn_t *conn, const char *name, uint16_t type, bool random,
+			 uint32_t block, int depth, uint64_t span, uint64_t ops){
+	uint8_t *buf = malloc((size_t)block*depth);
+	uint8_t *expect = malloc(block);
+	uint64_t *slot_offset = calloc(depth, sizeof(uint64_t));
+	uint64_t seed = 0x2545F4914F6CDD1DULL, next = 0, issued = 0, done = 0, start_time, end_time;
+	int64_t bad = 0;
+	hamming_nbd_reply_t reply;
+	uint64_t slot;
+	int i;
+
+	if(buf == NULL || expect == NULL || slot_offset == NULL){
+		bad = -1;
+		goto out;
+	}
+
+	start_time = get_time_micro_s();
+	for(i = 0;i < depth && issued < ops;i++, issued++){
+		slot_offset[i] = random ? (xorshift(&seed) % (span/block))*block : next;
+		next = (next + block) % span;
+		if(type == HAMMING_NBD_CMD_WRITE){
+			fill_pattern(buf + (size_t)i*block, slot_offset[i], block);
+		}
+		if(bench_send(conn, type, i, slot_offset[i], block, buf + (size_t)i*block) < 0){
+			bad = -1;
+			goto out;
+		}
+	}
+	while(done < ops){
+		if(read_full(conn->fd, &reply, sizeof(reply)) < 0 ||
+		   be32toh(reply.magic) != HAMMING_NBD_REPLY_MAGIC || reply.handle >= (uint64_t)depth){
+			bad = -1;
+			goto out;
+		}
+		slot = reply.handle;
+		if(reply.error){
+			printf("request at %lu failed with %u\n", slot_offset[slot], be32toh(reply.error));
+			bad++;
+		}else if(type == HAMMING_NBD_CMD_READ){
+			if(read_full(conn->fd, buf + slot*block, block) < 0){
+				bad = -1;
+				goto out;
+			}
+			fill_pattern(expect, slot_offset[slot], block);
+			if(memcmp(expect, buf + slot*block, block) != 0){
+				bad++;
+			}
+		}
+		done++;
+
+		if(issued < ops){
+			slot_offset[slot] = random ? (xorshift(&seed) % (span/block))*block : next;
+			next = (next + block) % span;
+			if(type == HAMMING_NBD_CMD_WRITE){
+				fill_pattern(buf + slot*block, slot_offset[slot], block);
+			}
+			if(bench_send(conn, type, slot, slot_offset[slot], block, buf + slot*block) < 0){
+				bad = -1;
+				goto out;
+			}
+			issued++;
+		}
+	}
+	end_time = get_time_micro_s();
+	if(end_time == start_time){
+		end_time++;
+	}
+
+	printf("%-10s bs=%-7u depth=%-3d %8.1f MB/s %9.0f IOPS\n", name, block, depth,
+	       (double)ops*block/(end_time - start_time),
+	       ops*1000000.0/(end_time - start_time));
+out:
+	free(buf);
+	free(expect);
+	free(slot_offset);
+	return bad;
+}
+
+int main(int argc, char **argv){
+	bench_conn_t conn;
+	uint32_t block = argc > 2 ? strtoul(argv[2], NULL, 0) : 4096;
+	int depth = argc > 3 ? atoi(argv[3]) : 32;
+	uint64_t span = (argc > 4 ? strtoull(argv[4], NULL, 0) : 256) << 20;
+	uint64_t ops = argc > 5 ? strtoull(argv[5], NULL, 0) : 0;
+	int64_t bad = 0, ret;
+	hamming_nbd_request_t disc;
+
+	if(argc < 2 || block == 0 || block % 4096 || block > HAMMING_NBD_MAX_LEN ||
+	   depth <= 0 || depth > 1024){
+		printf("usage: %s socket [block size] [depth] [MB to touch] [ops]\n", argv[0]);
+		return 1;
+	}
+	if(bench_connect(&conn, argv[1]) < 0){
+		printf("can't connect to %s\n", argv[1]);
+		return 1;
+	}
+	if(span > conn.size){
+		span = conn.size;
+	}
+	if(span < block){
+		printf("export too small\n");
+		return 1;
+	}
+	if(ops == 0){
+		ops = span/block;
+	}
+
+	// the sequential write covers the span, so every later read has a pattern
+	ret = bench_run(&conn, "seq write", HAMMING_NBD_CMD_WRITE, false, block, depth, span, span/block);
+	bad += ret < 0 ? 0 : ret;
+	ret = ret < 0 ? ret : bench_run(&conn, "seq read", HAMMING_NBD_CMD_READ, false, block, depth, span, span/block);
+	bad += ret < 0 ? 0 : ret;
+	ret = ret < 0 ? ret : bench_run(&conn, "rand write", HAMMING_NBD_CMD_WRITE, true, block, depth, span, ops);
+	bad += ret < 0 ? 0 : ret;
+	ret = ret < 0 ? ret : bench_run(&conn, "rand read", HAMMING_NBD_CMD_READ, true, block, depth, span, ops);
+	bad += ret < 0 ? 0 : ret;
+	if(ret < 0){
+		printf("connection failed\n");
+		return 1;
+	}
+
+	CLEAR_MEM(disc);
+	disc.magic = htobe32(HAMMING_NBD_REQUEST_MAGIC);
+	disc.type = htobe16(HAMMING_NBD_CMD_DISC);
+	write_full(conn.fd, &disc, sizeof(disc));
+	close(conn.fd);
+
+	printf("%ld bad blocks\n", bad);
+	return bad ? 1 : 0;
+}
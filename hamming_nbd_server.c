@@ -0,0 +1,79 @@
+#include "hamming_fast.h"
+#include "hamming_nbd.h"
+
+/*
+  NBD server for a Hamming protected RAM or file store
+
+  usage: nbd_server -s socket [-S size in MB] [-f file] [-t threads]
+
+  then e.g. nbd-client -unix socket /dev/nbd0, or nbd_bench socket.
+  SIGINT or SIGTERM drain the clients and stop it cleanly.
+ */
+
+static int stop_pipe[2] = {-1, -1};
+
+static void stop(int sig){
+	char byte = (char)sig;
+
+	if(write(stop_pipe[1], &byte, 1) < 0){
+		return; // full, a stop is already on its way
+	}
+}
+
+static void usage(const char *name){
+	printf("usage: %s -s socket [-S size in MB] [-f file] [-t threads]\n", name);
+}
+
+int main(int argc, char **argv){
+	hamming_nbd_store_t store;
+	const char *socket_path = NULL, *file = NULL;
+	uint64_t size_mb = 1024;
+	int threads = 4, opt, ret;
+
+	while((opt = getopt(argc, argv, "s:S:f:t:")) != -1){
+		switch(opt){
+		case 's':
+			socket_path = optarg;
+			break;
+		case 'S':
+			size_mb = strtoull(optarg, NULL, 0);
+			break;
+		case 'f':
+			file = optarg;
+			break;
+		case 't':
+			threads = atoi(optarg);
+			break;
+		default:
+			usage(argv[0]);
+			return 1;
+		}
+	}
+	if(socket_path == NULL || size_mb == 0){
+		usage(argv[0]);
+		return 1;
+	}
+
+	if(file){
+		ret = hamming_nbd_store_init_file(&store, file);
+	}else{
+		ret = hamming_nbd_store_init_ram(&store, size_mb*1024*1024);
+	}
+	if(ret < 0){
+		printf("can't create store: %s\n", strerror(-ret));
+		return 1;
+	}
+	if(pipe(stop_pipe) < 0){
+		printf("can't create the stop pipe: %s\n", strerror(errno));
+		hamming_nbd_store_close(&store);
+		return 1;
+	}
+	signal(SIGINT, stop);
+	signal(SIGTERM, stop);
+	printf("serving %lu MB on %s with %d workers\n", store.size >> 20, socket_path, threads);
+
+	ret = hamming_nbd_serve(&store, socket_path, threads, stop_pipe[0]);
+	printf("server stopped: %s\n", ret < 0 ? strerror(-ret) : "on request");
+	hamming_nbd_store_close(&store);
+	return ret < 0;
+}
@@ -0,0 +1,261 @@
+#include "hamming_fast.h"
+#include "hamming_nbd.h"
+#include "hamming_check.h"
+
+#include <endian.h>
+#include <errno.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+/*
+  Loopback checks for the NBD server
+
+  Serves a RAM store on a unix socket from a thread and talks to it like a
+  client would: pages written with more requests in flight than a connection
+  may have (HAMMING_NBD_INFLIGHT_MAX) all come back, a bit flipped in the
+  store is corrected on the next read, and a page whose codes disagree too
+  fails its read with EIO, and keeps failing it. The server is then stopped
+  through its stop descriptor, which has to drain and return 0.
+
+  usage: nbd_test [pages]
+ */
+
+struct serve{
+	hamming_nbd_store_t *store;
+	const char *path;
+	int stop_fd;
+	int ret;
+};
+
+static void *serve(void *arg){
+	struct serve *serve = arg;
+
+	serve->ret = hamming_nbd_serve(serve->store, serve->path, 2, serve->stop_fd);
+	return NULL;
+}
+
+static int read_full(int fd, void *buf, size_t len){
+	uint8_t *ptr = buf;
+	ssize_t ret;
+	while(len){
+		ret = read(fd, ptr, len);
+		if(ret <= 0){
+			return -1;
+		}
+		ptr += ret;
+		len -= ret;
+	}
+	return 0;
+}
+
+static int write_full(int fd, const void *buf, size_t len){
+	const uint8_t *ptr = buf;
+	ssize_t ret;
+	while(len){
+		ret = write(fd, ptr, len);
+		if(ret <= 0){
+			return -1;
+		}
+		ptr += ret;
+		len -= ret;
+	}
+	return 0;
+}
+
+// connects once the server listens and picks the export with NBD_OPT_EXPORT_NAME
+static int connect_export(const char *path){
+	struct sockaddr_un addr;
+	struct{
+		uint64_t init_magic;
+		uint64_t opts_magic;
+		uint16_t flags;
+	} __attribute__((packed)) hello;
+	struct{
+		uint32_t client_flags;
+		uint64_t magic;
+		uint32_t option;
+		uint32_t len;
+	} __attribute__((packed)) opt;
+	struct{
+		uint64_t size;
+		uint16_t flags;
+	} __attribute__((packed)) export_reply;
+	int fd, tries;
+
+	CLEAR_MEM(addr);
+	addr.sun_family = AF_UNIX;
+	strncpy(addr.sun_path, path, sizeof(addr.sun_path) - 1);
+	for(tries = 0;tries < 1000;tries++){
+		fd = socket(AF_UNIX, SOCK_STREAM, 0);
+		if(fd < 0){
+			return -1;
+		}
+		if(connect(fd, (struct sockaddr*)&addr, sizeof(addr)) == 0){
+			break;
+		}
+		close(fd);
+		fd = -1;
+		usleep(1000);
+	}
+	if(fd < 0 || read_full(fd, &hello, sizeof(hello)) < 0 ||
+	   be64toh(hello.init_magic) != HAMMING_NBD_INIT_MAGIC){
+		return -1;
+	}
+	opt.client_flags = htobe32(HAMMING_NBD_FLAG_FIXED_NEWSTYLE | HAMMING_NBD_FLAG_NO_ZEROES);
+	opt.magic = htobe64(HAMMING_NBD_OPTS_MAGIC);
+	opt.option = htobe32(HAMMING_NBD_OPT_EXPORT_NAME);
+	opt.len = 0;
+	if(write_full(fd, &opt, sizeof(opt)) < 0 || read_full(fd, &export_reply, sizeof(export_reply)) < 0){
+		close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+static int send_request(int fd, uint16_t type, uint64_t handle, uint64_t page, const uint8_t *buf){
+	hamming_nbd_request_t req;
+
+	req.magic = htobe32(HAMMING_NBD_REQUEST_MAGIC);
+	req.flags = 0;
+	req.type = htobe16(type);
+	req.handle = handle;
+	req.offset = htobe64(page*HAMMING_NBD_PAGE_SIZE);
+	req.len = htobe32(HAMMING_NBD_PAGE_SIZE);
+	if(write_full(fd, &req, sizeof(req)) < 0){
+		return -1;
+	}
+	return type == HAMMING_NBD_CMD_WRITE ? write_full(fd, buf, HAMMING_NBD_PAGE_SIZE) : 0;
+}
+
+static uint8_t expected(uint64_t page, size_t byte){
+	return (uint8_t)((page*31) ^ (byte*7));
+}
+
+/**
+ * \brief Send a request per page, all of them before the first reply is read
+ *
+ * Replies may come back in any order, the handle is the page.
+ *
+ * \return Number of pages whose reply carried an error or read back wrong, negative if the connection failed
+ */
+static int pipeline(int fd, uint16_t type, uint64_t pages, uint8_t *buf){
+	hamming_nbd_reply_t reply;
+	uint64_t page;
+	size_t i;
+	int bad = 0;
+
+	for(page = 0;page < pages;page++){
+		for(i = 0;i < HAMMING_NBD_PAGE_SIZE && type == HAMMING_NBD_CMD_WRITE;i++){
+			buf[i] = expected(page, i);
+		}
+		if(send_request(fd, type, page, page, buf) < 0){
+			return -1;
+		}
+	}
+	for(page = 0;page < pages;page++){
+		if(read_full(fd, &reply, sizeof(reply)) < 0 || be32toh(reply.magic) != HAMMING_NBD_REPLY_MAGIC ||
+		   reply.handle >= pages){
+			return -1;
+		}
+		if(reply.error){
+			bad++;
+			continue;
+		}
+		if(type != HAMMING_NBD_CMD_READ){
+			continue;
+		}
+		if(read_full(fd, buf, HAMMING_NBD_PAGE_SIZE) < 0){
+			return -1;
+		}
+		for(i = 0;i < HAMMING_NBD_PAGE_SIZE && buf[i] == expected(reply.handle, i);i++);
+		bad += i != HAMMING_NBD_PAGE_SIZE;
+	}
+	return bad;
+}
+
+// reads one page, returns the error of its reply or -1 if the connection failed
+static int read_page(int fd, uint64_t page, uint8_t *buf){
+	hamming_nbd_reply_t reply;
+
+	if(send_request(fd, HAMMING_NBD_CMD_READ, page, page, NULL) < 0 ||
+	   read_full(fd, &reply, sizeof(reply)) < 0 || be32toh(reply.magic) != HAMMING_NBD_REPLY_MAGIC){
+		return -1;
+	}
+	if(reply.error){
+		return be32toh(reply.error);
+	}
+	return read_full(fd, buf, HAMMING_NBD_PAGE_SIZE);
+}
+
+// flips a bit of a stored page behind the server's back
+static void flip(hamming_nbd_store_t *store, uint64_t page, size_t byte, int bit){
+	pthread_mutex_lock(&store->stripe[page % HAMMING_NBD_STRIPES]);
+	((uint8_t*)store->dir[page >> HAMMING_NBD_DIR_SHIFT][page & ((1 << HAMMING_NBD_DIR_SHIFT) - 1)]->data)[byte] ^= 1 << bit;
+	pthread_mutex_unlock(&store->stripe[page % HAMMING_NBD_STRIPES]);
+}
+
+int main(int argc, char **argv){
+	uint64_t pages = argc > 1 ? strtoull(argv[1], NULL, 0) : 4*HAMMING_NBD_INFLIGHT_MAX;
+	hamming_nbd_store_t store;
+	hamming_nbd_page_t *page;
+	struct serve server;
+	pthread_t thread;
+	uint8_t *buf;
+	char path[64];
+	int stop_pipe[2], fd, ret;
+
+	buf = malloc(HAMMING_NBD_PAGE_SIZE);
+	if(pages < 8 || buf == NULL || pipe(stop_pipe) < 0 ||
+	   hamming_nbd_store_init_ram(&store, pages*HAMMING_NBD_PAGE_SIZE) < 0){
+		printf("usage: %s [pages, at least 8]\n", argv[0]);
+		return 1;
+	}
+	snprintf(path, sizeof(path), "/tmp/nbd_test_%d.sock", (int)getpid());
+	server.store = &store;
+	server.path = path;
+	server.stop_fd = stop_pipe[0];
+	server.ret = 1;
+	pthread_create(&thread, NULL, serve, &server);
+
+	fd = connect_export(path);
+	CHECK(fd >= 0, "can't connect to %s", path);
+	if(fd >= 0){
+		ret = pipeline(fd, HAMMING_NBD_CMD_WRITE, pages, buf);
+		CHECK(ret == 0, "writing %lu pages in one go: %d", pages, ret);
+		ret = pipeline(fd, HAMMING_NBD_CMD_READ, pages, buf);
+		CHECK(ret == 0, "reading %lu pages in one go: %d", pages, ret);
+		CHECK(store.stats.pages == pages, "%lu pages stored instead of %lu", store.stats.pages, pages);
+
+		flip(&store, 3, 40, 2);
+		ret = read_page(fd, 3, buf);
+		CHECK(ret == 0 && buf[40] == expected(3, 40), "single flip not corrected (%d, %02x)", ret, buf[40]);
+		CHECK(store.stats.corrected == 1, "%lu corrected instead of 1", store.stats.corrected);
+
+		flip(&store, 5, 40, 2);
+		page = store.dir[0][5];
+		((uint8_t*)&page->code.second_set[1])[0] ^= 1;
+		ret = read_page(fd, 5, buf);
+		CHECK(ret == EIO, "uncorrectable page read with %d instead of EIO", ret);
+		ret = read_page(fd, 5, buf);
+		CHECK(ret == EIO, "uncorrectable page read with %d the second time", ret);
+		CHECK(store.stats.uncorrectable == 2, "%lu uncorrectable reads instead of 2", store.stats.uncorrectable);
+		ret = read_page(fd, 4, buf);
+		CHECK(ret == 0 && buf[40] == expected(4, 40), "neighbour of the bad page read with %d", ret);
+	}
+
+	// the connection stays open, stopping has to drain it
+	CHECK(write(stop_pipe[1], "", 1) == 1, "can't stop the server");
+	pthread_join(thread, NULL);
+	CHECK(server.ret == 0, "server returned %d", server.ret);
+	CHECK(access(path, F_OK) != 0, "socket file left behind");
+	if(fd >= 0){
+		CHECK(read(fd, buf, 1) <= 0, "connection still open after the server stopped");
+		close(fd);
+	}
+	hamming_nbd_store_close(&store);
+	close(stop_pipe[0]);
+	close(stop_pipe[1]);
+	free(buf);
+
+	return check_done("nbd_test");
+}
@@ -0,0 +1,406 @@
+#include "hamming_region.h"
+#include "hamming_fast_logic.h"
+
+#include <errno.h>
+#include <sys/mman.h>
+
+/**
+ * \file hamming_region.c
+ * \brief Protected memory regions with dirty page tracking
+ *
+ * Writes are tracked with mprotect and a SIGSEGV handler, since it works
+ * unprivileged and on any mapping. Clean pages are read only, so the first
+ * write after a checkpoint costs one fault per page, everything after that
+ * is a plain store.
+ *
+ * The handler only uses atomic builtins and mprotect, both of which are safe
+ * to call from a signal handler.
+ */
+
+// number of pages we write protect and encode per batch in a checkpoint
+#define HAMMING_REGION_BATCH 64
+
+static hamming_region_t *regions[HAMMING_REGION_MAX];
+static int region_count;
+static pthread_mutex_t regions_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct sigaction old_action;
+
+static uint8_t *hamming_region_page(hamming_region_t *region, size_t page){
+	return region->base + page*HAMMING_REGION_PAGE_SIZE;
+}
+
+/**
+ * \brief Mark a page dirty
+ *
+ * Only the first caller to flip the dirty byte pushes the page onto the
+ * ring, so every page is on the ring at most once and the ring can never
+ * hold more than page_count entries
+ *
+ * \param[in] region		Region the page belongs to
+ * \param[in] page			Index of the page in the region
+ */
+static void hamming_region_mark_dirty(hamming_region_t *region, size_t page){
+	size_t slot;
+	if(__atomic_exchange_n(&region->dirty[page], 1, __ATOMIC_SEQ_CST) != 0){
+		return;
+	}
+	slot = __atomic_fetch_add(&region->dirty_tail, 1, __ATOMIC_SEQ_CST) % region->page_count;
+	__atomic_store_n(&region->dirty_ring[slot], page+1, __ATOMIC_RELEASE);
+}
+
+/**
+ * \brief SIGSEGV handler
+ *
+ * Any fault inside of a registered region is a write to a clean page (the
+ * region is always readable), so mark it dirty and open it up. Faults we
+ * don't own are forwarded to whatever handler was installed before us.
+ *
+ * A page may only be writable while it is marked dirty, so the mark is
+ * repeated after the mprotect. If a checkpoint cleared it in between, the
+ * second mark puts the page back on the ring and the next checkpoint
+ * encodes whatever we write now.
+ */
+static void hamming_region_fault(int sig, siginfo_t *info, void *ctx){
+	uint8_t *addr = info->si_addr;
+	hamming_region_t *region;
+	size_t page;
+	int i;
+
+	for(i = 0;i < HAMMING_REGION_MAX;i++){
+		region = __atomic_load_n(&regions[i], __ATOMIC_ACQUIRE);
+		if(region == NULL || addr < region->base || addr >= region->base + region->len){
+			continue;
+		}
+		page = (addr - region->base)/HAMMING_REGION_PAGE_SIZE;
+		__atomic_fetch_add(&region->stats.faults, 1, __ATOMIC_RELAXED);
+		hamming_region_mark_dirty(region, page);
+		// verify may be correcting this page right now, let it finish first
+		while(__atomic_load_n(&region->verifying, __ATOMIC_SEQ_CST) == page+1);
+		mprotect(hamming_region_page(region, page), HAMMING_REGION_PAGE_SIZE,
+			 PROT_READ | PROT_WRITE);
+		// a checkpoint may have taken the page off the ring and protected it
+		// before our mprotect, mark it again so it's never writable but clean
+		hamming_region_mark_dirty(region, page);
+		return;
+	}
+
+	if(old_action.sa_flags & SA_SIGINFO){
+		old_action.sa_sigaction(sig, info, ctx);
+	}else if(old_action.sa_handler == SIG_DFL || old_action.sa_handler == SIG_IGN){
+		// returning re-runs the faulting instruction and kills us properly
+		signal(sig, SIG_DFL);
+	}else{
+		old_action.sa_handler(sig);
+	}
+}
+
+static int hamming_region_add(hamming_region_t *region){
+	struct sigaction action;
+	int i;
+
+	pthread_mutex_lock(&regions_lock);
+	for(i = 0;i < HAMMING_REGION_MAX;i++){
+		if(regions[i] == NULL){
+			break;
+		}
+	}
+	if(i == HAMMING_REGION_MAX){
+		pthread_mutex_unlock(&regions_lock);
+		return -ENOSPC; // more than HAMMING_REGION_MAX regions
+	}
+	if(region_count == 0){
+		CLEAR_MEM(action);
+		action.sa_sigaction = hamming_region_fault;
+		action.sa_flags = SA_SIGINFO | SA_RESTART;
+		sigemptyset(&action.sa_mask);
+		if(sigaction(SIGSEGV, &action, &old_action) < 0){
+			pthread_mutex_unlock(&regions_lock);
+			return -errno;
+		}
+	}
+	region_count++;
+	__atomic_store_n(&regions[i], region, __ATOMIC_RELEASE);
+	pthread_mutex_unlock(&regions_lock);
+	return 0;
+}
+
+static void hamming_region_remove(hamming_region_t *region){
+	int i;
+	pthread_mutex_lock(&regions_lock);
+	for(i = 0;i < HAMMING_REGION_MAX;i++){
+		if(regions[i] == region){
+			__atomic_store_n(&regions[i], NULL, __ATOMIC_RELEASE);
+			region_count--;
+			if(region_count == 0){
+				sigaction(SIGSEGV, &old_action, NULL);
+			}
+			break;
+		}
+	}
+	pthread_mutex_unlock(&regions_lock);
+}
+
+/**
+ * \brief Protect an existing mapping
+ *
+ * Encodes every page once, then write protects the whole mapping. The
+ * caller keeps ownership of the mapping itself.
+ *
+ * \param[out] region		Region to initialize
+ * \param[in] addr			Page aligned start of the mapping
+ * \param[in] len			Length of the mapping, multiple of 4K
+ *
+ * \return -EINVAL if the mapping or the system page size isn't 4K aligned,
+ *         -ENOSPC past HAMMING_REGION_MAX regions, -ENOMEM, 0 otherwise
+ */
+int hamming_region_register(hamming_region_t *region, void *addr, size_t len){
+	size_t i;
+	int ret;
+
+	// writes are tracked per system page, so that has to be our page
+	if(sysconf(_SC_PAGESIZE) != HAMMING_REGION_PAGE_SIZE){
+		return -EINVAL;
+	}
+	if(len == 0 || len % HAMMING_REGION_PAGE_SIZE || (uintptr_t)addr % HAMMING_REGION_PAGE_SIZE){
+		return -EINVAL;
+	}
+
+	CLEAR_MEM(*region);
+	region->base = addr;
+	region->len = len;
+	region->page_count = len/HAMMING_REGION_PAGE_SIZE;
+	pthread_mutex_init(&region->lock, NULL);
+
+	region->codes = malloc(region->page_count*sizeof(hamming_code_set_t));
+	region->dirty = calloc(region->page_count, sizeof(uint8_t));
+	region->dirty_ring = calloc(region->page_count, sizeof(size_t));
+	if(region->codes == NULL || region->dirty == NULL || region->dirty_ring == NULL){
+		ret = -ENOMEM;
+		goto fail;
+	}
+
+	for(i = 0;i < region->page_count;i++){
+		logic_set(&region->codes[i], (row_t*)hamming_region_page(region, i),
+			  HAMMING_REGION_ROWS);
+	}
+	region->stats.encoded = region->page_count;
+
+	ret = hamming_region_add(region);
+	if(ret < 0){
+		goto fail;
+	}
+	if(mprotect(region->base, region->len, PROT_READ) < 0){
+		ret = -errno;
+		hamming_region_remove(region);
+		goto fail;
+	}
+	return 0;
+fail:
+	free(region->codes);
+	free(region->dirty);
+	free(region->dirty_ring);
+	pthread_mutex_destroy(&region->lock);
+	return ret;
+}
+
+/**
+ * \brief Map and protect anonymous memory
+ *
+ * \param[out] region		Region to initialize
+ * \param[in] len			Length to map, multiple of 4K
+ *
+ * \return Negative on failure, 0 otherwise
+ */
+int hamming_region_init(hamming_region_t *region, size_t len){
+	void *addr;
+	int ret;
+
+	addr = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if(addr == MAP_FAILED){
+		return -errno;
+	}
+	ret = hamming_region_register(region, addr, len);
+	if(ret < 0){
+		munmap(addr, len);
+		return ret;
+	}
+	region->owned = true;
+	return 0;
+}
+
+/**
+ * \brief Stop protecting a region
+ *
+ * Nothing may write to the region while this runs. Mappings we don't own
+ * are handed back readable and writable.
+ */
+void hamming_region_close(hamming_region_t *region){
+	hamming_region_timer_stop(region);
+	hamming_region_remove(region);
+	if(region->owned){
+		munmap(region->base, region->len);
+	}else{
+		mprotect(region->base, region->len, PROT_READ | PROT_WRITE);
+	}
+	free(region->codes);
+	free(region->dirty);
+	free(region->dirty_ring);
+	pthread_mutex_destroy(&region->lock);
+	region->base = NULL;
+}
+
+/**
+ * \brief Write protect and encode one batch of pages
+ *
+ * Dirty bytes are already cleared, so we protect before encoding. A write
+ * landing between the two faults again and puts the page back on the ring,
+ * so the next checkpoint picks it up.
+ */
+static void hamming_region_encode_batch(hamming_region_t *region, size_t *batch, int size){
+	int i, run;
+
+	for(i = 0;i < size;i += run){
+		// coalesce sequential pages into one mprotect call
+		for(run = 1;i+run < size && batch[i+run] == batch[i]+run;run++);
+		mprotect(hamming_region_page(region, batch[i]), run*HAMMING_REGION_PAGE_SIZE, PROT_READ);
+	}
+	for(i = 0;i < size;i++){
+		logic_set(&region->codes[batch[i]], (row_t*)hamming_region_page(region, batch[i]),
+			  HAMMING_REGION_ROWS);
+	}
+	region->stats.encoded += size;
+}
+
+/**
+ * \brief Re-encode all dirty pages
+ *
+ * Only walks the dirty ring, clean pages are never looked at.
+ *
+ * \return Number of pages encoded
+ */
+int hamming_region_checkpoint(hamming_region_t *region){
+	size_t batch[HAMMING_REGION_BATCH];
+	size_t head, tail, page, slot;
+	int size = 0;
+	int count = 0;
+
+	pthread_mutex_lock(&region->lock);
+	head = region->dirty_head;
+	tail = __atomic_load_n(&region->dirty_tail, __ATOMIC_SEQ_CST);
+	for(;head != tail;head++){
+		slot = head % region->page_count;
+		// the fault handler may have claimed the slot without filling it yet
+		while((page = __atomic_load_n(&region->dirty_ring[slot], __ATOMIC_ACQUIRE)) == 0);
+		region->dirty_ring[slot] = 0;
+		page--;
+		__atomic_store_n(&region->dirty[page], 0, __ATOMIC_SEQ_CST);
+		batch[size++] = page;
+		if(size == HAMMING_REGION_BATCH){
+			hamming_region_encode_batch(region, batch, size);
+			count += size;
+			size = 0;
+		}
+	}
+	region->dirty_head = head;
+	if(size){
+		hamming_region_encode_batch(region, batch, size);
+		count += size;
+	}
+	pthread_mutex_unlock(&region->lock);
+	return count;
+}
+
+/**
+ * \brief Verify and correct every clean page
+ *
+ * Dirty pages are skipped, since their codes are stale until the next
+ * checkpoint. Corrections are done on a copy and only written back if the
+ * page is correctable, which dirties the page so the next checkpoint encodes
+ * the fixed data. Uncorrectable pages are left alone and counted in
+ * stats.failed.
+ *
+ * \return -EIO if any page was uncorrectable, number of bits corrected otherwise
+ */
+int hamming_region_verify(hamming_region_t *region){
+	hamming_code_set_t set;
+	row_t copy[HAMMING_REGION_ROWS];
+	uint8_t *data;
+	size_t page;
+	int ret;
+	int corrected = 0;
+	bool failed = false;
+
+	pthread_mutex_lock(&region->lock);
+	for(page = 0;page < region->page_count;page++){
+		__atomic_store_n(&region->verifying, page+1, __ATOMIC_SEQ_CST);
+		if(__atomic_load_n(&region->dirty[page], __ATOMIC_SEQ_CST)){
+			continue;
+		}
+		data = hamming_region_page(region, page);
+		logic_set(&set, (row_t*)data, HAMMING_REGION_ROWS);
+		region->stats.verified++;
+		if(memcmp(&set, &region->codes[page], sizeof(set)) == 0){
+			continue;
+		}
+		memcpy(copy, data, sizeof(copy));
+		ret = correct_set(&set, &region->codes[page], copy, HAMMING_REGION_ROWS);
+		if(ret < 0){
+			region->stats.failed++;
+			failed = true;
+			continue;
+		}
+		// writers spin on verifying, so nothing lands while we copy back
+		hamming_region_mark_dirty(region, page);
+		mprotect(data, HAMMING_REGION_PAGE_SIZE, PROT_READ | PROT_WRITE);
+		memcpy(data, copy, sizeof(copy));
+		corrected += ret;
+	}
+	__atomic_store_n(&region->verifying, 0, __ATOMIC_SEQ_CST);
+	region->stats.corrected += corrected;
+	pthread_mutex_unlock(&region->lock);
+	return failed ? -EIO : corrected;
+}
+
+static void *hamming_region_timer_main(void *arg){
+	hamming_region_t *region = arg;
+	struct timespec ts;
+
+	ts.tv_sec = region->timer_ms/1000;
+	ts.tv_nsec = (region->timer_ms%1000)*1000*1000;
+	while(__atomic_load_n(&region->timer_run, __ATOMIC_ACQUIRE)){
+		nanosleep(&ts, NULL);
+		hamming_region_checkpoint(region);
+	}
+	return NULL;
+}
+
+/**
+ * \brief Checkpoint from a background thread
+ *
+ * \param[in] region		Region to checkpoint
+ * \param[in] ms			Interval between checkpoints
+ *
+ * \return Negative on failure, 0 otherwise
+ */
+int hamming_region_timer_start(hamming_region_t *region, int ms){
+	int ret;
+	if(region->timer_run || ms <= 0){
+		return -EINVAL;
+	}
+	region->timer_ms = ms;
+	region->timer_run = true;
+	ret = pthread_create(&region->timer, NULL, hamming_region_timer_main, region);
+	if(ret){
+		region->timer_run = false;
+		return -ret;
+	}
+	return 0;
+}
+
+void hamming_region_timer_stop(hamming_region_t *region){
+	if(region->timer_run == false){
+		return;
+	}
+	__atomic_store_n(&region->timer_run, false, __ATOMIC_RELEASE);
+	pthread_join(region->timer, NULL);
+}
@@ -0,0 +1,73 @@
+#ifndef HAMMING_REGION_H
+#define HAMMING_REGION_H
+
+#include "hamming_fast.h"
+#include "hamming_fast_logic.h"
+
+#include <pthread.h>
+
+#define HAMMING_REGION_PAGE_SIZE 4096
+#define HAMMING_REGION_ROWS (HAMMING_REGION_PAGE_SIZE/sizeof(row_t))
+
+// max number of regions the SIGSEGV handler will search
+#define HAMMING_REGION_MAX 16
+
+/**
+ * \brief Protected region of memory
+ *
+ * Every page in the region is kept PROT_READ while its code set is current.
+ * The first write to a clean page faults, the SIGSEGV handler marks the page
+ * dirty, pushes it onto the dirty ring and opens the page for writing, so any
+ * following writes run at full speed. A page is only ever writable while it
+ * is marked dirty, otherwise writes to it would never be encoded.
+ *
+ * A checkpoint pops the dirty ring, write protects the pages again and
+ * re-encodes only those, so the cost of a checkpoint scales with how many
+ * pages were touched since the last one, not with the size of the region.
+ */
+typedef struct{
+	uint8_t *base;
+	size_t len;
+	size_t page_count;
+	bool owned; // we mmap'd base ourselves
+
+	hamming_code_set_t *codes; // one per page
+
+	// written from the SIGSEGV handler, only atomic builtins touch these
+	uint8_t *dirty;
+	size_t *dirty_ring; // page index + 1, zero means the slot isn't filled yet
+	size_t dirty_head;
+	size_t dirty_tail;
+	size_t verifying; // page index + 1 of the page verify is looking at
+
+	pthread_mutex_t lock; // serializes checkpoints and verify passes
+
+	pthread_t timer;
+	int timer_ms;
+	bool timer_run;
+
+	struct{
+		uint64_t faults;
+		uint64_t encoded;
+		uint64_t verified;
+		uint64_t corrected;
+		uint64_t failed; // pages verify couldn't correct
+	} stats;
+} hamming_region_t;
+
+// maps len bytes of anonymous memory and protects them
+extern int hamming_region_init(hamming_region_t *region, size_t len);
+// protects an existing page aligned mapping (must be PROT_READ|PROT_WRITE)
+extern int hamming_region_register(hamming_region_t *region, void *addr, size_t len);
+extern void hamming_region_close(hamming_region_t *region);
+
+// re-encode all dirty pages, returns number of pages encoded
+extern int hamming_region_checkpoint(hamming_region_t *region);
+// verify and correct all clean pages, returns number of bits corrected or -EIO
+extern int hamming_region_verify(hamming_region_t *region);
+
+// checkpoint every ms milliseconds from a background thread
+extern int hamming_region_timer_start(hamming_region_t *region, int ms);
+extern void hamming_region_timer_stop(hamming_region_t *region);
+
+#endif
@@ -0,0 +1,147 @@
+#include "hamming_fast.h"
+#include "hamming_region.h"
+#include "hamming_check.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <sys/mman.h>
+
+/*
+  Checks for hamming_region_t
+
+  Writes fault once per page and land on the dirty ring, a checkpoint
+  encodes exactly those pages (in batches past HAMMING_REGION_BATCH), and
+  a bit flipped behind the region's back is found and put right by verify.
+  Writers faulting while a checkpoint runs must never leave a page
+  writable but clean, or their stores would go unencoded.
+
+  usage: region_test [pages]
+ */
+
+// flips a bit of a clean page without the fault handler seeing a write
+static void flip(hamming_region_t *region, size_t page, size_t byte, int bit){
+	uint8_t *addr = region->base + page*HAMMING_REGION_PAGE_SIZE;
+
+	mprotect(addr, HAMMING_REGION_PAGE_SIZE, PROT_READ | PROT_WRITE);
+	addr[byte] ^= 1 << bit;
+	mprotect(addr, HAMMING_REGION_PAGE_SIZE, PROT_READ);
+}
+
+struct race{
+	hamming_region_t *region;
+	size_t pages;
+	int rounds;
+	int done;
+};
+
+// writes the round number into every page, faulting once per checkpoint
+static void *race_writer(void *arg){
+	struct race *race = arg;
+	uint64_t *word;
+	size_t i;
+	int round;
+
+	for(round = 1;round <= race->rounds;round++){
+		for(i = 0;i < race->pages;i++){
+			word = (uint64_t*)(race->region->base + i*HAMMING_REGION_PAGE_SIZE + 64);
+			*word = round*race->pages + i;
+		}
+	}
+	__atomic_store_n(&race->done, 1, __ATOMIC_RELEASE);
+	return NULL;
+}
+
+static void race_checkpoint(hamming_region_t *region, size_t pages, int rounds){
+	struct race race = { region, pages, rounds, 0 };
+	pthread_t writer;
+	uint64_t *word;
+	size_t i;
+	int ret;
+
+	pthread_create(&writer, NULL, race_writer, &race);
+	while(!__atomic_load_n(&race.done, __ATOMIC_ACQUIRE)){
+		hamming_region_checkpoint(region);
+	}
+	pthread_join(writer, NULL);
+	hamming_region_checkpoint(region);
+
+	ret = hamming_region_verify(region);
+	CHECK(ret == 0, "verify after racing checkpoints returned %d", ret);
+	for(i = 0;i < pages;i++){
+		word = (uint64_t*)(region->base + i*HAMMING_REGION_PAGE_SIZE + 64);
+		if(*word != rounds*pages + i){
+			CHECK(false, "page %zu holds %llu after racing checkpoints", i, (unsigned long long)*word);
+			break;
+		}
+	}
+}
+
+int main(int argc, char **argv){
+	size_t pages = argc > 1 ? strtoull(argv[1], NULL, 0) : 256;
+	hamming_region_t region;
+	uint8_t *page;
+	size_t i;
+	int ret;
+
+	if(pages < 4){
+		printf("usage: %s [pages, at least 4]\n", argv[0]);
+		return 1;
+	}
+	ret = hamming_region_init(&region, pages*HAMMING_REGION_PAGE_SIZE);
+	if(ret < 0){
+		printf("can't create region (%d)\n", ret);
+		return 1;
+	}
+	CHECK(hamming_region_register(&region, region.base + 1, HAMMING_REGION_PAGE_SIZE) == -EINVAL,
+	      "unaligned mapping accepted");
+
+	// every page written twice, only the first write faults
+	for(i = 0;i < pages;i++){
+		page = region.base + i*HAMMING_REGION_PAGE_SIZE;
+		page[100] = (uint8_t)i;
+		page[200] = (uint8_t)(i*7);
+	}
+	CHECK(region.stats.faults == pages, "%lu faults for %zu pages", region.stats.faults, pages);
+	ret = hamming_region_checkpoint(&region);
+	CHECK(ret == (int)pages, "checkpoint encoded %d of %zu dirty pages", ret, pages);
+	CHECK(hamming_region_checkpoint(&region) == 0, "checkpoint with nothing dirty encoded pages");
+
+	// a page written again faults again, and only it is encoded
+	region.base[3*HAMMING_REGION_PAGE_SIZE + 300] = 0x5A;
+	CHECK(region.stats.faults == pages + 1, "rewriting a clean page didn't fault");
+	CHECK(hamming_region_checkpoint(&region) == 1, "checkpoint didn't encode just the rewritten page");
+
+	ret = hamming_region_verify(&region);
+	CHECK(ret == 0, "verify of clean pages returned %d", ret);
+
+	flip(&region, 2, 100, 3);
+	CHECK(region.base[2*HAMMING_REGION_PAGE_SIZE + 100] != 2, "flip didn't land");
+	ret = hamming_region_verify(&region);
+	CHECK(ret == 1, "verify corrected %d bits instead of 1", ret);
+	CHECK(region.base[2*HAMMING_REGION_PAGE_SIZE + 100] == 2, "flipped byte wasn't restored");
+	CHECK(region.stats.corrected == 1 && region.stats.failed == 0, "corrected %lu, failed %lu",
+	      region.stats.corrected, region.stats.failed);
+	// the corrected page went back on the dirty ring
+	CHECK(hamming_region_checkpoint(&region) == 1, "corrected page wasn't re-encoded");
+	CHECK(hamming_region_verify(&region) == 0, "region not clean after correcting");
+
+	// a dirty page's codes are stale, verify leaves it for the checkpoint
+	region.base[HAMMING_REGION_PAGE_SIZE + 500] = 0xA5;
+	CHECK(hamming_region_verify(&region) == 0, "verify looked at a dirty page");
+	CHECK(hamming_region_checkpoint(&region) == 1, "dirty page wasn't encoded");
+
+	race_checkpoint(&region, pages, 2000);
+	CHECK(region.stats.corrected == 1 && region.stats.failed == 0, "racing corrected %lu, failed %lu",
+	      region.stats.corrected, region.stats.failed);
+
+	for(i = 0;i < pages;i++){
+		page = region.base + i*HAMMING_REGION_PAGE_SIZE;
+		if(page[100] != (uint8_t)i || page[200] != (uint8_t)(i*7)){
+			CHECK(false, "page %zu lost its contents", i);
+			break;
+		}
+	}
+	hamming_region_close(&region);
+
+	return check_done("region_test");
+}
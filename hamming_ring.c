@@ -0,0 +1,273 @@
+#include "hamming_ring.h"
+#include "hamming_fast_logic.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+/**
+ * \file hamming_ring.c
+ * \brief Lock free shared memory ring with per slot Hamming codes
+ *
+ * Slots carry their own sequence number, so the producer knows a slot is
+ * free once the consumer that took it stored the position of the next lap,
+ * and consumers only need head to know a slot is filled. That lets the
+ * producer publish a whole batch with one store to head.
+ *
+ * Data is read exactly once on either side: the producer encodes while
+ * copying into the slot, consumers encode while copying out of it and
+ * compare against the stored codes. The message length sits outside the
+ * coded data, so it is stored three times and voted on like the second
+ * code sets are.
+ */
+
+static size_t hamming_ring_size(uint64_t slot_count){
+	return sizeof(hamming_ring_shm_t) + slot_count*sizeof(hamming_ring_slot_t);
+}
+
+/**
+ * \brief Create a ring in shared memory
+ *
+ * The caller becomes the producer.
+ *
+ * \param[out] ring			Handle to initialize
+ * \param[in] name			shm_open name, must not exist yet
+ * \param[in] slot_count	Number of 4K slots
+ *
+ * \return Negative on failure, 0 otherwise
+ */
+int hamming_ring_create(hamming_ring_t *ring, const char *name, uint64_t slot_count){
+	hamming_ring_shm_t *shm;
+	uint64_t i;
+	int fd, ret;
+
+	if(slot_count == 0){
+		return -EINVAL;
+	}
+	CLEAR_MEM(*ring);
+	ring->len = hamming_ring_size(slot_count);
+
+	fd = shm_open(name, O_CREAT | O_EXCL | O_RDWR, 0600);
+	if(fd < 0){
+		return -errno;
+	}
+	if(ftruncate(fd, ring->len) < 0){
+		ret = -errno;
+		close(fd);
+		shm_unlink(name);
+		return ret;
+	}
+	shm = mmap(NULL, ring->len, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if(shm == MAP_FAILED){
+		shm_unlink(name);
+		return -ENOMEM;
+	}
+
+	shm->slot_count = slot_count;
+	shm->head = 0;
+	shm->tail = 0;
+	for(i = 0;i < slot_count;i++){
+		shm->slots[i].seq = i;
+	}
+	// consumers wait on magic before touching anything else
+	__atomic_store_n(&shm->magic, HAMMING_RING_MAGIC, __ATOMIC_RELEASE);
+	ring->shm = shm;
+	return 0;
+}
+
+/**
+ * \brief Attach to an existing ring as a consumer
+ *
+ * \param[out] ring			Handle to initialize
+ * \param[in] name			shm_open name the producer created
+ *
+ * \return Negative on failure, 0 otherwise
+ */
+int hamming_ring_attach(hamming_ring_t *ring, const char *name){
+	hamming_ring_shm_t *shm;
+	struct stat st;
+	int fd;
+
+	CLEAR_MEM(*ring);
+	fd = shm_open(name, O_RDWR, 0600);
+	if(fd < 0){
+		return -errno;
+	}
+	if(fstat(fd, &st) < 0 || (size_t)st.st_size < sizeof(hamming_ring_shm_t)){
+		close(fd);
+		return -EINVAL;
+	}
+	shm = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if(shm == MAP_FAILED){
+		return -ENOMEM;
+	}
+	if(__atomic_load_n(&shm->magic, __ATOMIC_ACQUIRE) != HAMMING_RING_MAGIC ||
+	   hamming_ring_size(shm->slot_count) != (size_t)st.st_size){
+		munmap(shm, st.st_size);
+		return -EINVAL;
+	}
+	ring->shm = shm;
+	ring->len = st.st_size;
+	return 0;
+}
+
+void hamming_ring_close(hamming_ring_t *ring){
+	if(ring->shm){
+		hamming_ring_flush(ring);
+		munmap(ring->shm, ring->len);
+		ring->shm = NULL;
+	}
+}
+
+int hamming_ring_unlink(const char *name){
+	return shm_unlink(name) < 0 ? -errno : 0;
+}
+
+/**
+ * \brief Publish every slot written so far
+ */
+void hamming_ring_flush(hamming_ring_t *ring){
+	if(ring->pending){
+		__atomic_store_n(&ring->shm->head, ring->pos, __ATOMIC_RELEASE);
+		ring->pending = 0;
+	}
+}
+
+/**
+ * \brief Write one message into the next slot without publishing it
+ *
+ * Short messages are padded with zeroes in a bounce buffer first, so the
+ * code always covers a full 4K slot.
+ */
+static int hamming_ring_write(hamming_ring_t *ring, const void *data, uint32_t len){
+	row_t bounce[HAMMING_RING_ROWS];
+	hamming_ring_slot_t *slot;
+
+	if(len > HAMMING_RING_SLOT_SIZE){
+		return -EMSGSIZE;
+	}
+	slot = &ring->shm->slots[ring->pos % ring->shm->slot_count];
+	if(__atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE) != ring->pos){
+		// the ring is full, let consumers see what we have so they can drain it
+		hamming_ring_flush(ring);
+		return -EAGAIN;
+	}
+	if(len != HAMMING_RING_SLOT_SIZE){
+		memcpy(bounce, data, len);
+		memset((uint8_t*)bounce + len, 0, HAMMING_RING_SLOT_SIZE - len);
+		data = bounce;
+	}
+	logic_set_copy(&slot->code, slot->data, data, HAMMING_RING_ROWS);
+	slot->len[0] = slot->len[1] = slot->len[2] = len;
+	ring->pos++;
+	ring->pending++;
+	return 0;
+}
+
+/**
+ * \brief Enqueue one message
+ *
+ * \param[in] ring			Producer handle
+ * \param[in] data			Message
+ * \param[in] len			Length of message, up to HAMMING_RING_SLOT_SIZE
+ *
+ * \return -EAGAIN when full, other negatives on failure, 0 otherwise
+ */
+int hamming_ring_enqueue(hamming_ring_t *ring, const void *data, uint32_t len){
+	int ret = hamming_ring_write(ring, data, len);
+	if(ret == 0 && ring->pending >= HAMMING_RING_BATCH){
+		hamming_ring_flush(ring);
+	}
+	return ret;
+}
+
+/**
+ * \brief Enqueue several messages and publish them with one store
+ *
+ * \return Number of messages enqueued, or a negative if none were
+ */
+int hamming_ring_enqueue_batch(hamming_ring_t *ring, const void **data,
+			       const uint32_t *len, int count){
+	int i, ret = 0;
+	for(i = 0;i < count;i++){
+		ret = hamming_ring_write(ring, data[i], len[i]);
+		if(ret < 0){
+			break;
+		}
+	}
+	hamming_ring_flush(ring);
+	return i ? i : ret;
+}
+
+/**
+ * \brief Majority vote on the stored message length
+ *
+ * \return Length, or -EIO if no two copies agree or it can't fit a slot
+ */
+static int hamming_ring_len(hamming_ring_t *ring, const hamming_ring_slot_t *slot){
+	uint32_t len;
+
+	if(slot->len[0] == slot->len[1] || slot->len[0] == slot->len[2]){
+		len = slot->len[0];
+	}else if(slot->len[1] == slot->len[2]){
+		len = slot->len[1];
+	}else{
+		return -EIO;
+	}
+	if(slot->len[0] != len || slot->len[1] != len || slot->len[2] != len){
+		ring->stats.corrected++;
+	}
+	return len > HAMMING_RING_SLOT_SIZE ? -EIO : (int)len;
+}
+
+/**
+ * \brief Dequeue one message
+ *
+ * The slot is copied out and verified in one pass, corrections are applied
+ * to the copy, and the slot is handed back to the producer.
+ *
+ * \param[in] ring			Consumer handle
+ * \param[out] buf			HAMMING_RING_SLOT_SIZE bytes
+ *
+ * \return Message length, -EAGAIN when empty, -EIO when uncorrectable
+ */
+int hamming_ring_dequeue(hamming_ring_t *ring, void *buf){
+	hamming_ring_shm_t *shm = ring->shm;
+	hamming_ring_slot_t *slot;
+	hamming_code_set_t set;
+	uint64_t tail;
+	int len, ret = 0;
+
+	tail = __atomic_load_n(&shm->tail, __ATOMIC_RELAXED);
+	do{
+		if(tail >= __atomic_load_n(&shm->head, __ATOMIC_ACQUIRE)){
+			return -EAGAIN;
+		}
+	}while(!__atomic_compare_exchange_n(&shm->tail, &tail, tail + 1, true,
+					    __ATOMIC_ACQUIRE, __ATOMIC_RELAXED));
+
+	slot = &shm->slots[tail % shm->slot_count];
+	logic_set_copy(&set, buf, slot->data, HAMMING_RING_ROWS);
+	len = hamming_ring_len(ring, slot);
+	if(memcmp(&set, &slot->code, sizeof(set)) != 0){
+		ret = correct_set(&set, &slot->code, buf, HAMMING_RING_ROWS);
+		if(ret < 0){
+			ring->stats.uncorrectable++;
+		}else{
+			ring->stats.corrected += ret;
+		}
+	}
+	__atomic_store_n(&slot->seq, tail + shm->slot_count, __ATOMIC_RELEASE);
+
+	if(ret < 0 || len < 0){
+		if(ret >= 0){
+			// the data was fine, its length wasn't
+			ring->stats.uncorrectable++;
+		}
+		return -EIO;
+	}
+	return len;
+}
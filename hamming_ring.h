@@ -0,0 +1,83 @@
+#ifndef HAMMING_RING_H
+#define HAMMING_RING_H
+
+#include "hamming_fast.h"
+#include "hamming_fast_logic.h"
+
+#include <errno.h>
+
+#define HAMMING_RING_SLOT_SIZE 4096
+#define HAMMING_RING_ROWS (HAMMING_RING_SLOT_SIZE/sizeof(row_t))
+#define HAMMING_RING_CACHE_LINE 64
+#define HAMMING_RING_MAGIC 0x48414d52494e4731ULL // HAMRING1
+
+// slots written before the producer publishes them on its own
+#define HAMMING_RING_BATCH 16
+
+/**
+ * \brief One message slot
+ *
+ * len is written once by the producer and published with the data by the
+ * store to head, so the copies are not there for ordering. They are there
+ * because the code covers the full 4K of data, which a message may use up,
+ * and nothing else in the slot covers len. A single copy checked against
+ * seq could only tell that len flipped, not what it was; three copies let
+ * a flip be voted out like one in the data is corrected.
+ */
+typedef struct{
+	row_t data[HAMMING_RING_ROWS];
+	hamming_code_set_t code;
+	uint64_t seq; // position of the next lap the producer may write here
+	uint32_t len[3]; // voted on by the consumer
+} __attribute__((aligned(HAMMING_RING_CACHE_LINE))) hamming_ring_slot_t;
+
+/**
+ * \brief Layout of the ring in shared memory
+ *
+ * head and tail each get a cache line to themselves, since the producer
+ * hammers head and every consumer hammers tail.
+ */
+typedef struct{
+	uint64_t magic;
+	uint64_t slot_count;
+	uint64_t head __attribute__((aligned(HAMMING_RING_CACHE_LINE))); // published by the producer
+	uint64_t tail __attribute__((aligned(HAMMING_RING_CACHE_LINE))); // claimed by consumers
+	hamming_ring_slot_t slots[] __attribute__((aligned(HAMMING_RING_CACHE_LINE)));
+} hamming_ring_shm_t;
+
+/**
+ * \brief Process local handle on a ring
+ *
+ * Single producer, multiple consumers. The producer encodes messages into
+ * slots with a fused copy and encode, and publishes them HAMMING_RING_BATCH
+ * at a time (or on hamming_ring_flush). Consumers claim slots through tail,
+ * copy and verify them in one pass and hand the slot back.
+ */
+typedef struct{
+	hamming_ring_shm_t *shm;
+	size_t len;
+	uint64_t pos; // producer only, next slot to write
+	int pending; // producer only, written but not published
+
+	struct{
+		uint64_t corrected;
+		uint64_t uncorrectable;
+	} stats;
+} hamming_ring_t;
+
+extern int hamming_ring_create(hamming_ring_t *ring, const char *name, uint64_t slot_count);
+extern int hamming_ring_attach(hamming_ring_t *ring, const char *name);
+extern void hamming_ring_close(hamming_ring_t *ring);
+extern int hamming_ring_unlink(const char *name);
+
+// producer, returns -EAGAIN when the ring is full
+extern int hamming_ring_enqueue(hamming_ring_t *ring, const void *data, uint32_t len);
+extern int hamming_ring_enqueue_batch(hamming_ring_t *ring, const void **data,
+				      const uint32_t *len, int count);
+extern void hamming_ring_flush(hamming_ring_t *ring);
+
+// consumer, buf must hold HAMMING_RING_SLOT_SIZE bytes aligned to a row_t, returns message length,
+// -EAGAIN when the ring is empty, -EIO when the message was uncorrectable
+extern int hamming_ring_dequeue(hamming_ring_t *ring, void *buf);
+
+#endif
@@ -0,0 +1,281 @@
+#include "hamming_fast.h"
+#include "hamming_ring.h"
+#include "hamming_check.h"
+
+#include <sched.h>
+#include <sys/mman.h>
+#include <sys/time.h>
+#include <sys/wait.h>
+
+/*
+  Benchmark and cross-process check for hamming_ring_t
+
+  Moves the same number of pages with plain memcpy, through a ring within
+  one process (pure copy and encode/verify cost), and from one producer to
+  forked consumer processes that attach by name and check every message.
+  Also flips bits in slot data and lengths to check they are corrected or
+  reported. Exits non-zero if any message is lost or wrong
+
+  usage: ring_bench [consumers] [messages] [slots]
+ */
+
+typedef struct{
+	uint64_t received;
+	uint64_t bad;
+	uint64_t corrected;
+} __attribute__((aligned(HAMMING_RING_CACHE_LINE))) bench_consumer_t;
+
+static uint64_t get_time_micro_s(){
+	struct timeval tv;
+	gettimeofday(&tv, NULL);
+	return 1000000ULL*tv.tv_sec + tv.tv_usec;
+}
+
+static uint32_t bench_len(uint64_t i){
+	return 64 + (i*97) % (HAMMING_RING_SLOT_SIZE - 63);
+}
+
+static void bench_fill(uint64_t *buf, uint64_t i){
+	uint32_t j, words = bench_len(i)/sizeof(uint64_t);
+	buf[0] = i;
+	for(j = 1;j < words;j++){
+		buf[j] = i*0x9E3779B97F4A7C15ULL + j;
+	}
+}
+
+// message i is recognizable from its first word and its length alone
+static bool bench_check(const uint64_t *buf, int len){
+	uint64_t i = buf[0];
+	uint32_t j;
+
+	if(len < 0 || (uint32_t)len != bench_len(i)){
+		return false;
+	}
+	for(j = 1;j < len/sizeof(uint64_t);j++){
+		if(buf[j] != i*0x9E3779B97F4A7C15ULL + j){
+			return false;
+		}
+	}
+	return true;
+}
+
+static void report(const char *name, uint64_t bytes, uint64_t start_time, uint64_t end_time){
+	uint64_t us = end_time - start_time ? end_time - start_time : 1;
+	printf("%-24s %8.1f MB/s (%lu us)\n", name, (double)bytes/us, us);
+}
+
+static void bench_memcpy(uint64_t messages, uint64_t slots){
+	uint64_t *src = malloc(slots*HAMMING_RING_SLOT_SIZE);
+	uint64_t *dst = malloc(HAMMING_RING_SLOT_SIZE);
+	uint64_t i, bytes = 0, start_time;
+
+	for(i = 0;i < slots;i++){
+		bench_fill(src + i*(HAMMING_RING_SLOT_SIZE/sizeof(uint64_t)), i);
+	}
+	start_time = get_time_micro_s();
+	for(i = 0;i < messages;i++){
+		memcpy(dst, src + (i % slots)*(HAMMING_RING_SLOT_SIZE/sizeof(uint64_t)), bench_len(i));
+		// keep the copy from being optimized away
+		__asm__ volatile("" : : "r"(dst) : "memory");
+		bytes += bench_len(i);
+	}
+	report("memcpy", bytes, start_time, get_time_micro_s());
+	free(src);
+	free(dst);
+}
+
+static void bench_local(const char *name, uint64_t messages, uint64_t slots){
+	uint64_t buf[HAMMING_RING_SLOT_SIZE/sizeof(uint64_t)];
+	uint64_t out[HAMMING_RING_SLOT_SIZE/sizeof(uint64_t)] __attribute__((aligned(sizeof(row_t))));
+	uint64_t sent = 0, received = 0, bytes = 0, start_time;
+	hamming_ring_t ring;
+	int ret;
+
+	hamming_ring_unlink(name);
+	ret = hamming_ring_create(&ring, name, slots);
+	if(ret < 0){
+		printf("can't create ring (%d)\n", ret);
+		failures++;
+		return;
+	}
+	start_time = get_time_micro_s();
+	while(received < messages){
+		// fill the ring, then drain it
+		while(sent < messages){
+			bench_fill(buf, sent);
+			if(hamming_ring_enqueue(&ring, buf, bench_len(sent)) < 0){
+				break;
+			}
+			sent++;
+		}
+		hamming_ring_flush(&ring);
+		while((ret = hamming_ring_dequeue(&ring, out)) != -EAGAIN){
+			if(!bench_check(out, ret)){
+				failures++;
+			}
+			bytes += ret;
+			received++;
+		}
+	}
+	report("ring, one process", bytes, start_time, get_time_micro_s());
+	hamming_ring_close(&ring);
+	hamming_ring_unlink(name);
+}
+
+static void consumer_main(const char *name, bench_consumer_t *stats){
+	uint64_t out[HAMMING_RING_SLOT_SIZE/sizeof(uint64_t)] __attribute__((aligned(sizeof(row_t))));
+	hamming_ring_t ring;
+	int ret;
+
+	if(hamming_ring_attach(&ring, name) < 0){
+		stats->bad++;
+		return;
+	}
+	while(true){
+		ret = hamming_ring_dequeue(&ring, out);
+		if(ret == -EAGAIN){
+			sched_yield();
+			continue;
+		}
+		if(ret == 0){
+			break; // stop message
+		}
+		if(!bench_check(out, ret)){
+			stats->bad++;
+		}
+		stats->received++;
+	}
+	stats->corrected = ring.stats.corrected;
+	hamming_ring_close(&ring);
+}
+
+static void bench_procs(const char *name, int consumers, uint64_t messages, uint64_t slots){
+	uint64_t buf[HAMMING_RING_SLOT_SIZE/sizeof(uint64_t)];
+	uint64_t i, bytes = 0, received = 0, bad = 0, start_time, end_time;
+	bench_consumer_t *stats;
+	hamming_ring_t ring;
+	pid_t pid[64];
+	int ret, status;
+
+	stats = mmap(NULL, consumers*sizeof(*stats), PROT_READ | PROT_WRITE,
+		     MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+	if(stats == MAP_FAILED){
+		printf("can't map consumer stats\n");
+		failures++;
+		return;
+	}
+	memset(stats, 0, consumers*sizeof(*stats));
+	hamming_ring_unlink(name);
+	ret = hamming_ring_create(&ring, name, slots);
+	if(ret < 0){
+		printf("can't create ring (%d)\n", ret);
+		failures++;
+		munmap(stats, consumers*sizeof(*stats));
+		return;
+	}
+
+	start_time = get_time_micro_s();
+	for(i = 0;i < (uint64_t)consumers;i++){
+		pid[i] = fork();
+		if(pid[i] == 0){
+			consumer_main(name, &stats[i]);
+			_exit(0);
+		}
+	}
+	for(i = 0;i < messages + consumers;i++){
+		// one empty message per consumer tells it to stop
+		if(i < messages){
+			bench_fill(buf, i);
+			bytes += bench_len(i);
+		}
+		while(hamming_ring_enqueue(&ring, buf, i < messages ? bench_len(i) : 0) == -EAGAIN){
+			sched_yield();
+		}
+	}
+	hamming_ring_flush(&ring);
+	for(i = 0;i < (uint64_t)consumers;i++){
+		if(waitpid(pid[i], &status, 0) < 0 || !WIFEXITED(status) || WEXITSTATUS(status) != 0){
+			bad++;
+		}
+	}
+	end_time = get_time_micro_s();
+	report("ring, producer+consumers", bytes, start_time, end_time);
+
+	for(i = 0;i < (uint64_t)consumers;i++){
+		printf("  consumer %lu: %lu messages, %lu bad, %lu bits corrected\n",
+		       i, stats[i].received, stats[i].bad, stats[i].corrected);
+		received += stats[i].received;
+		bad += stats[i].bad;
+	}
+	if(received != messages || bad){
+		printf("FAIL: %lu of %lu messages received, %lu bad\n", received, messages, bad);
+		failures++;
+	}
+	hamming_ring_close(&ring);
+	hamming_ring_unlink(name);
+	munmap(stats, consumers*sizeof(*stats));
+}
+
+static void check_inject(const char *name){
+	uint64_t buf[HAMMING_RING_SLOT_SIZE/sizeof(uint64_t)];
+	uint64_t out[HAMMING_RING_SLOT_SIZE/sizeof(uint64_t)] __attribute__((aligned(sizeof(row_t))));
+	hamming_ring_slot_t *slot;
+	hamming_ring_t ring;
+	int i, ret;
+
+	hamming_ring_unlink(name);
+	if(hamming_ring_create(&ring, name, 4) < 0){
+		printf("can't create ring\n");
+		failures++;
+		return;
+	}
+	for(i = 0;i < 3;i++){
+		bench_fill(buf, i);
+		hamming_ring_enqueue(&ring, buf, bench_len(i));
+	}
+	hamming_ring_flush(&ring);
+
+	slot = ring.shm->slots;
+	((uint8_t*)slot[0].data)[40] ^= 0x10;
+	slot[1].len[2] ^= 0x4;
+	slot[2].len[0] ^= 0x1;
+	slot[2].len[1] ^= 0x2;
+
+	ret = hamming_ring_dequeue(&ring, out);
+	if(!bench_check(out, ret) || ring.stats.corrected != 1){
+		printf("FAIL: data flip not corrected (%d)\n", ret);
+		failures++;
+	}
+	ret = hamming_ring_dequeue(&ring, out);
+	if(!bench_check(out, ret) || ring.stats.corrected != 2){
+		printf("FAIL: length flip not corrected (%d)\n", ret);
+		failures++;
+	}
+	ret = hamming_ring_dequeue(&ring, out);
+	if(ret != -EIO || ring.stats.uncorrectable != 1){
+		printf("FAIL: disagreeing lengths gave %d\n", ret);
+		failures++;
+	}
+	hamming_ring_close(&ring);
+	hamming_ring_unlink(name);
+}
+
+int main(int argc, char **argv){
+	int consumers = argc > 1 ? atoi(argv[1]) : 2;
+	uint64_t messages = argc > 2 ? strtoull(argv[2], NULL, 0) : 200000;
+	uint64_t slots = argc > 3 ? strtoull(argv[3], NULL, 0) : 256;
+	char name[64];
+
+	if(consumers <= 0 || consumers > 64 || messages == 0 || slots == 0){
+		printf("usage: %s [consumers] [messages] [slots]\n", argv[0]);
+		return 1;
+	}
+	snprintf(name, sizeof(name), "/hamming_ring_bench_%d", (int)getpid());
+
+	check_inject(name);
+	bench_memcpy(messages, slots);
+	bench_local(name, messages, slots);
+	bench_procs(name, consumers, messages, slots);
+
+	return check_done("ring_bench");
+}
@@ -4,9 +4,11 @@
 #include <linux/bio.h>
 #include <linux/bitops.h>
 #include <linux/blkdev.h>
+#include <linux/blk-mq.h>
 #include <linux/device.h>
 #include <linux/err.h>
 #include <linux/sysfs.h>
+#include <linux/version.h>
 
 /**
  * \file hamming.c
@@ -15,6 +17,11 @@
 
 #include "hamming.h"
 #include "hamming_tree.h"
+#include "hamming_alloc.h"
+#include "hamming_dedup.h"
+#include "hamming_compress.h"
+#include "hamming_writeback.h"
+#include "hamming_persist.h"
 #include "hamming_test.h"
 
 // logic from test program (only different enough to compile, printf->printk and smalls)
@@ -34,20 +41,34 @@ ATTRIBUTE_GROUPS(hamming_control_class);
 
 static struct class hamming_control_class = {
 	.name = "hamming-control",
+#if LINUX_VERSION_CODE < KERNEL_VERSION(6, 4, 0) // classes lost their owner in 6.4
 	.owner = THIS_MODULE,
+#endif
 	.class_groups = hamming_control_class_groups
 };
 
 #include "hamming_blkdev.c"
+#include "hamming_alloc.c"
 #include "hamming_tree.c"
+#include "hamming_dedup.c"
+#include "hamming_compress.c"
+#include "hamming_writeback.c"
+#include "hamming_persist.c"
 #include "hamming_test.c"
+#if LINUX_VERSION_CODE < KERNEL_VERSION(6, 5, 0) // frontswap was removed in 6.5
 #include "hamming_frontswap.c"
+#endif
 #include "hamming_sysfs.c"
 
 static int deinitialize(void){
 	class_unregister(&hamming_control_class);
     idr_remove(&hamming_index_idr, device_id);
     hamming_blkdev_close();
+    hamming_compress_close();
+    hamming_writeback_close();
+    hamming_tree_close();
+    hamming_dedup_close();
+    hamming_alloc_close();
     hamming_sysfs_close_error();
 	if(hamming) { // semaphore lock is out of the scope of this function
 		kfree(hamming);
@@ -91,6 +112,8 @@ static int __init hamming_init(void)
 		return -ENOMEM;
 	}
 
+	init_rwsem(&hamming->lock); // before anything deinitialize() could touch
+
 	// we are initialized at this point
 	ret = idr_alloc(&hamming_index_idr, hamming, 0, 0, GFP_KERNEL);
 	if (ret < 0) {
@@ -100,19 +123,54 @@ static int __init hamming_init(void)
 	}
 	device_id = ret;
 
-	init_rwsem(&hamming->lock);
-
     if(hamming_blkdev_init() < 0){
         printk(KERN_ERR "Can't initialize block device");
         return -EIO;
     }
 	printk(KERN_INFO "Initializing tree structure\n");
-	hamming_tree_init();
+	if(hamming_alloc_init() < 0){
+		printk(KERN_ERR "Can't create tree caches\n");
+		deinitialize();
+		return -ENOMEM;
+	}
+	if(hamming_tree_init() < 0){
+		printk(KERN_ERR "Can't create tree shards\n");
+		deinitialize();
+		return -ENOMEM;
+	}
+	if(hamming_dedup_init() < 0){
+		printk(KERN_ERR "Can't create the dedup index\n");
+		deinitialize();
+		return -ENOMEM;
+	}
+	if(hamming_compress_init() < 0){
+		printk(KERN_ERR "Can't set up compression\n");
+		deinitialize();
+		return -ENOMEM;
+	}
+	ret = hamming_writeback_init();
+	if(ret < 0){
+		printk(KERN_ERR "Can't set up writeback\n");
+		deinitialize();
+		return ret;
+	}
 	if(hamming_tests() != 0){
 		printk(KERN_ERR "hamming_self_test failed\n");
 		deinitialize();
 		return -EINVAL;
 	}
+	ret = hamming_persist_restore();
+	if(ret < 0){
+		printk(KERN_ERR "Can't restore the device\n");
+		deinitialize();
+		return ret;
+	}
+	ret = hamming_blkdev_add();
+	if(ret < 0){
+		printk(KERN_ERR "Can't add the disk\n");
+		deinitialize();
+		return ret;
+	}
 	printk(KERN_INFO "Loaded ECC memory-based block device\n");
 
     // TODO: actually use frontswap
@@ -126,6 +184,7 @@ static int __init hamming_init(void)
 
 static void __exit hamming_exit(void)
 {
+	hamming_persist_dump(); // only here, a load that failed has nothing to dump over the last one
 	deinitialize();
 	printk(KERN_INFO "Unloaded ECC memory-based block device\n");
 }
@@ -1,7 +1,11 @@
 #ifndef _HAMMING_H_
 #define _HAMMING_H_
 
+#include <linux/blk-mq.h>
 #include <linux/rwsem.h>
+#include <linux/spinlock.h>
+#include <linux/workqueue.h>
+#include <linux/atomic.h>
 
 // there's no way these kernels aren't already defined in the Linux source tree
 #define HAMMING_CLEAR(x, y) x &= ~(((__int128)1) << y)
@@ -11,6 +15,46 @@
 
 typedef __int128 hamming_row_t;
 
+/**
+ * \brief Sequential read detection and verification ahead of the reader
+ *
+ * See hamming_blkdev_readahead, the window [next, end) is verified by work
+ * on wq, everything is in sectors
+ */
+typedef struct{
+    spinlock_t lock;
+    struct work_struct work;
+    struct workqueue_struct *wq;
+    sector_t last_sector; // one past the end of the last read
+    u32 streak; // back to back sequential reads
+    sector_t next;
+    sector_t end;
+    atomic64_t verified; // pages verified ahead
+    atomic64_t hits; // reads that didn't have to verify because of it
+} hamming_readahead_t;
+
+#define HAMMING_READAHEAD_TRIGGER 2 // sequential reads before we start
+#define HAMMING_READAHEAD_PAGES 32 // how far ahead of the reader we verify
+#define HAMMING_READAHEAD_PREFETCH 2 // pages past a read pulled into cache
+
+/**
+ * \brief Hardware context of the disk, one per CPU
+ *
+ * See hamming_blkdev_queue_rq, requests the block layer dispatches together
+ * wait on pending until the last of them, then are handled as one batch
+ */
+typedef struct{
+    spinlock_t lock; // of pending, count and max_batch
+    struct list_head pending; // requests of the batch being dispatched
+    u32 count; // on pending
+    u32 max_batch; // largest batch handled
+    atomic64_t requests;
+    atomic64_t batches;
+    atomic64_t errors; // requests that failed
+} hamming_hctx_t;
+
+#define HAMMING_QUEUE_DEPTH 256 // default queue_depth, requests per hardware context
+
 /**
  * \brief Definition of error correcting stack
  *
@@ -32,8 +76,15 @@ typedef struct{
         } mode;
         union{
             struct{
-                struct request_queue *queue;
+                struct blk_mq_tag_set tag_set;
+                hamming_hctx_t *hctx; // nr_cpu_ids of them, a hardware context each
+                struct request_queue *queue; // of disk
                 struct gendisk *disk;
+                bool added; // disk, see hamming_blkdev_add
+                hamming_readahead_t readahead;
+                struct blk_mq_tag_set snap_tag_set;
+                struct request_queue *snap_queue; // read only disk of the snapshot, while there is one
+                struct gendisk *snap_disk;
             } block_io;
             
             struct{
@@ -57,7 +108,8 @@ typedef struct{
             } block_io;
         };
     } backend;
-	struct rw_semaphore lock;
+	sector_t capacity; // in sectors, set at creation
+	struct rw_semaphore lock; // whole tree operations, I/O doesn't take it (see hamming_tree.h)
 } hamming_t;
 
 typedef struct{
@@ -75,7 +127,9 @@ typedef struct{
 #include "hamming_fast_logic.h"
 #include "hamming_fast_logic_simple.h"
 
-// TODO: actually make this through the sysfs, maybe allow dynamic increasing?
-#define SECTOR_COUNT (1024*1024*2)
+static int hamming_sysfs_reg_error(u64 addr);
+
+// default capacity in MB, see the capacity_mb parameter
+#define HAMMING_CAPACITY_MB 1024
 
 #endif
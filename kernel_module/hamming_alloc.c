@@ -0,0 +1,768 @@
+#include "hamming_alloc.h"
+
+#include <linux/moduleparam.h>
+#include <linux/mm.h>
+
+/**
+ * \file hamming_alloc.c
+ * \brief Allocation of tree nodes and pages
+ *
+ * hamming_alloc_node and hamming_alloc_page are called from
+ * hamming_tree_resolve_raw in the IO path, so callers pass GFP_ATOMIC,
+ * everything else can sleep
+ */
+
+static int alloc_mode = HAMMING_ALLOC_ON_DEMAND;
+module_param(alloc_mode, int, 0444);
+MODULE_PARM_DESC(alloc_mode, "0 allocates in the IO path, 1 keeps a reserve refilled in the background, 2 preallocates the whole device");
+
+static uint alloc_reserve = 1024;
+module_param(alloc_reserve, uint, 0444);
+MODULE_PARM_DESC(alloc_reserve, "Pages (and nodes) held in reserve per NUMA node for alloc_mode 1");
+
+static int numa_policy = HAMMING_NUMA_INTERLEAVE;
+module_param(numa_policy, int, 0444);
+MODULE_PARM_DESC(numa_policy, "0 puts data on the node of its tree shard (interleaved), 1 on the node of the CPU that first writes it");
+
+static bool alloc_arena;
+module_param(alloc_arena, bool, 0444);
+MODULE_PARM_DESC(alloc_arena, "Carve data pages out of 2MB chunks");
+
+static struct kmem_cache *hamming_node_cache;
+static struct kmem_cache *hamming_page_cache;
+static struct kmem_cache *hamming_codes_cache;
+static struct kmem_cache *hamming_compressed_caches[HAMMING_COMPRESSED_CLASSES];
+static char hamming_compressed_names[HAMMING_COMPRESSED_CLASSES][32];
+
+static struct workqueue_struct *hamming_alloc_wq; // only with HAMMING_ALLOC_RESERVE
+static struct work_struct hamming_alloc_refill;
+
+/**
+ * \brief Allocate and set up an arena chunk
+ *
+ * Doesn't try hard, a fragmented node just means single pages
+ *
+ * \param[in] gfp		Allocation flags
+ * \param[in] nid		Node to allocate on
+ *
+ * \return Chunk with every page free, NULL on failure
+ */
+static hamming_arena_chunk_t *hamming_arena_chunk_alloc(gfp_t gfp, int nid){
+	hamming_arena_chunk_t *chunk;
+	struct page *pages;
+	int i;
+
+	pages = alloc_pages_node(nid, gfp | __GFP_NOWARN | __GFP_NORETRY, HAMMING_ARENA_ORDER);
+	if(pages == NULL){
+		return NULL;
+	}
+	chunk = page_address(pages);
+	INIT_LIST_HEAD(&chunk->list);
+	chunk->nid = nid;
+	for(i = 0;i < HAMMING_ARENA_PAGES - 1;i++){
+		chunk->free[i] = HAMMING_ARENA_PAGES - 1 - i; // lowest on top, pages go out in order
+	}
+	chunk->free_count = HAMMING_ARENA_PAGES - 1;
+	atomic64_inc(&hamming_alloc_stats.arena_chunks);
+	return chunk;
+}
+
+static void hamming_arena_chunk_free(hamming_arena_chunk_t *chunk){
+	__free_pages(virt_to_page(chunk), HAMMING_ARENA_ORDER);
+	atomic64_dec(&hamming_alloc_stats.arena_chunks);
+}
+
+/**
+ * \brief Take a data page from a node's arena
+ *
+ * Fills the first chunk with free pages, so pages written in order end up
+ * next to each other. The chunk is allocated outside the lock, racing
+ * allocators can both add one, which is harmless.
+ *
+ * \param[in] arena		Arena of the node
+ * \param[in] gfp		Allocation flags for a new chunk
+ * \param[in] nid		Node of the arena
+ *
+ * \return Data page, NULL if there's no free page and no chunk could be had
+ */
+static u8 *hamming_arena_alloc(hamming_arena_t *arena, gfp_t gfp, int nid){
+	hamming_arena_chunk_t *chunk;
+	u8 *data;
+
+	spin_lock(&arena->lock);
+	if(list_empty(&arena->partial) && arena->spare){
+		list_add(&arena->spare->list, &arena->partial);
+		arena->spare = NULL;
+	}
+	if(list_empty(&arena->partial)){
+		spin_unlock(&arena->lock);
+		chunk = hamming_arena_chunk_alloc(gfp, nid);
+		if(chunk == NULL){
+			return NULL;
+		}
+		spin_lock(&arena->lock);
+		list_add(&chunk->list, &arena->partial);
+	}
+	chunk = list_first_entry(&arena->partial, hamming_arena_chunk_t, list);
+	data = (u8*)chunk + chunk->free[--chunk->free_count]*PAGE_SIZE;
+	if(chunk->free_count == 0){
+		list_del(&chunk->list);
+	}
+	spin_unlock(&arena->lock);
+	return data;
+}
+
+/**
+ * \brief Give a data page back to its chunk
+ *
+ * \param[in] data		Page from hamming_arena_alloc
+ */
+static void hamming_arena_free(u8 *data){
+	hamming_arena_chunk_t *chunk = (hamming_arena_chunk_t*)((unsigned long)data & ~(HAMMING_ARENA_SIZE - 1));
+	hamming_arena_t *arena = &hamming_alloc_pools[chunk->nid]->arena;
+
+	spin_lock(&arena->lock);
+	if(chunk->free_count == 0){
+		list_add(&chunk->list, &arena->partial);
+	}
+	chunk->free[chunk->free_count++] = (data - (u8*)chunk)/PAGE_SIZE;
+	if(chunk->free_count == HAMMING_ARENA_PAGES - 1){
+		list_del(&chunk->list); // empty
+		if(arena->spare == NULL){
+			arena->spare = chunk;
+			chunk = NULL;
+		}
+	}else{
+		chunk = NULL;
+	}
+	spin_unlock(&arena->lock);
+	if(chunk){
+		hamming_arena_chunk_free(chunk);
+	}
+}
+
+static void *hamming_alloc_node_raw(gfp_t gfp, int nid){
+	hamming_node_t *node_ptr = kmem_cache_alloc_node(hamming_node_cache, gfp | __GFP_ZERO, nid);
+	if(unlikely(node_ptr == NULL)){
+		atomic64_inc(&hamming_alloc_stats.failed);
+		return NULL;
+	}
+	atomic64_inc(&hamming_alloc_stats.nodes);
+	atomic64_inc(&hamming_alloc_pools[nid]->node_count);
+	return node_ptr;
+}
+
+static void hamming_free_node_raw(void *node_ptr, int nid){
+	kmem_cache_free(hamming_node_cache, node_ptr);
+	atomic64_dec(&hamming_alloc_stats.nodes);
+	atomic64_dec(&hamming_alloc_pools[nid]->node_count);
+}
+
+static void *hamming_alloc_codes_raw(gfp_t gfp, int nid){
+	hamming_code_set_t *codes = kmem_cache_alloc_node(hamming_codes_cache, gfp | __GFP_ZERO, nid);
+	if(unlikely(codes == NULL)){
+		atomic64_inc(&hamming_alloc_stats.failed);
+		return NULL;
+	}
+	atomic64_inc(&hamming_alloc_stats.codes);
+	return codes;
+}
+
+static void hamming_free_codes_raw(void *codes, int nid){
+	kmem_cache_free(hamming_codes_cache, codes);
+	atomic64_dec(&hamming_alloc_stats.codes);
+}
+
+/**
+ * \brief Get a data page, out of an arena chunk if alloc_arena is set
+ *
+ * \param[in] gfp		Allocation flags
+ * \param[in] nid		NUMA node to allocate on
+ * \param[in,out] flags		Page flags, HAMMING_PAGE_ARENA is added for arena pages
+ *
+ * \return Uninitialized data, NULL on failure
+ */
+static u8 *hamming_alloc_data(gfp_t gfp, int nid, u32 *flags){
+	struct page *data_page;
+	u8 *data;
+
+	if(alloc_arena){
+		data = hamming_arena_alloc(&hamming_alloc_pools[nid]->arena, gfp, nid);
+		if(likely(data != NULL)){
+			*flags |= HAMMING_PAGE_ARENA;
+			return data;
+		}
+		atomic64_inc(&hamming_alloc_stats.arena_fallback);
+	}
+	data_page = alloc_pages_node(nid, gfp, 0);
+	if(unlikely(data_page == NULL)){
+		atomic64_inc(&hamming_alloc_stats.failed);
+		return NULL;
+	}
+	return page_address(data_page);
+}
+
+static void *hamming_alloc_page_raw(gfp_t gfp, int nid){
+	hamming_page_t *page_ptr;
+
+	page_ptr = kmem_cache_alloc_node(hamming_page_cache, gfp | __GFP_ZERO, nid);
+	if(unlikely(page_ptr == NULL)){
+		atomic64_inc(&hamming_alloc_stats.failed);
+		return NULL;
+	}
+	page_ptr->flags = HAMMING_PAGE_UNINIT;
+	seqcount_init(&page_ptr->seq);
+	page_ptr->data = hamming_alloc_data(gfp, nid, &page_ptr->flags);
+	if(unlikely(page_ptr->data == NULL)){
+		kmem_cache_free(hamming_page_cache, page_ptr);
+		return NULL;
+	}
+	page_ptr->len = PAGE_SIZE;
+	page_ptr->nid = nid;
+	atomic64_inc(&hamming_alloc_stats.pages);
+	atomic64_inc(&hamming_alloc_pools[nid]->page_count);
+	return page_ptr;
+}
+
+static void hamming_free_data(u8 *data, u32 flags){
+	if(flags & HAMMING_PAGE_ARENA){
+		hamming_arena_free(data);
+	}else{
+		__free_page(virt_to_page(data));
+	}
+}
+
+static void hamming_free_page_raw(void *page_ptr, int nid){
+	hamming_free_data(((hamming_page_t*)page_ptr)->data, ((hamming_page_t*)page_ptr)->flags);
+	kmem_cache_free(hamming_page_cache, page_ptr);
+	atomic64_dec(&hamming_alloc_stats.pages);
+	atomic64_dec(&hamming_alloc_pools[nid]->page_count);
+}
+
+/**
+ * \brief Take an object out of a reserve
+ *
+ * Kicks the refill worker once the reserve is half empty
+ *
+ * \param[in] reserve		Reserve to take from
+ *
+ * \return Ready object, NULL if there is no reserve or it ran dry
+ */
+static void *hamming_alloc_reserve_pop(hamming_alloc_reserve_t *reserve){
+	void *ptr = NULL;
+	bool refill;
+
+	if(reserve->target == 0){
+		return NULL;
+	}
+	spin_lock(&reserve->lock);
+	if(likely(reserve->count)){
+		ptr = reserve->slots[--reserve->count];
+	}
+	refill = reserve->count < reserve->target/2;
+	spin_unlock(&reserve->lock);
+
+	if(refill && hamming_alloc_wq){
+		queue_work(hamming_alloc_wq, &hamming_alloc_refill);
+	}
+	if(unlikely(ptr == NULL)){
+		atomic64_inc(&hamming_alloc_stats.fallback);
+	}
+	return ptr;
+}
+
+/**
+ * \brief Put an object back into a reserve if it has room
+ *
+ * \param[in] reserve		Reserve to fill
+ * \param[in] ptr		Object, in the same state the allocator hands them out
+ *
+ * \return True if the reserve took it
+ */
+static bool hamming_alloc_reserve_push(hamming_alloc_reserve_t *reserve, void *ptr){
+	bool pushed = false;
+
+	if(reserve->target == 0){
+		return false;
+	}
+	spin_lock(&reserve->lock);
+	if(reserve->count < reserve->target){
+		reserve->slots[reserve->count++] = ptr;
+		pushed = true;
+	}
+	spin_unlock(&reserve->lock);
+	return pushed;
+}
+
+/**
+ * \brief Top a reserve up to its target
+ *
+ * \param[in] reserve		Reserve to fill
+ * \param[in] alloc_fn		Raw allocator
+ * \param[in] free_fn		Raw free, for racing with frees that refilled it
+ * \param[in] gfp		Allocation flags
+ * \param[in] nid		Node the reserve is for
+ *
+ * \return -ENOMEM if the allocator failed, 0 otherwise
+ */
+static int hamming_alloc_reserve_fill(hamming_alloc_reserve_t *reserve,
+				      void *(*alloc_fn)(gfp_t, int), void (*free_fn)(void*, int), gfp_t gfp, int nid){
+	void *ptr;
+
+	while(READ_ONCE(reserve->count) < reserve->target){
+		ptr = alloc_fn(gfp, nid);
+		if(ptr == NULL){
+			return -ENOMEM;
+		}
+		if(!hamming_alloc_reserve_push(reserve, ptr)){
+			free_fn(ptr, nid);
+			break;
+		}
+	}
+	return 0;
+}
+
+static void hamming_alloc_reserve_drain(hamming_alloc_reserve_t *reserve, void (*free_fn)(void*, int), int nid){
+	while(reserve->count){
+		free_fn(reserve->slots[--reserve->count], nid);
+	}
+	kvfree(reserve->slots);
+	reserve->slots = NULL;
+	reserve->target = 0;
+}
+
+/**
+ * \brief Refill worker, runs on hamming_alloc_wq
+ *
+ * GFP_NOIO since reclaim may well be swapping to us, every node's reserve
+ * is topped up
+ */
+static void hamming_alloc_refill_work(struct work_struct *work){
+	hamming_alloc_pool_t *pool;
+	int nid;
+
+	for_each_node_state(nid, N_MEMORY){
+		pool = hamming_alloc_pools[nid];
+		if(pool == NULL){
+			continue;
+		}
+		hamming_alloc_reserve_fill(&pool->nodes, hamming_alloc_node_raw, hamming_free_node_raw, GFP_NOIO, nid);
+		hamming_alloc_reserve_fill(&pool->pages, hamming_alloc_page_raw, hamming_free_page_raw, GFP_NOIO, nid);
+		hamming_alloc_reserve_fill(&pool->codes, hamming_alloc_codes_raw, hamming_free_codes_raw, GFP_NOIO, nid);
+	}
+}
+
+/**
+ * \brief Nodes one shard of a tree covering a number of sectors needs, its root excluded
+ *
+ * Leaf parents are split between the shards, anything above them may be
+ * needed by every shard
+ *
+ * \param[in] sectors		Capacity
+ * \param[in] shards		Shards the tree is split into
+ *
+ * \return Node count
+ */
+static u64 hamming_alloc_tree_nodes(sector_t sectors, int shards){
+	u64 last = SECTOR_TO_PAGE(sectors - 1), nodes;
+	int shift = HAMMING_TREE_LEVEL_BITS;
+
+	nodes = DIV_ROUND_UP((last >> shift) + 1, shards);
+	while((last >> shift) != 0){ // not the root yet
+		shift += HAMMING_TREE_LEVEL_BITS;
+		nodes += (last >> shift) + 1; // distinct prefixes one level further up
+	}
+	return nodes - 1;
+}
+
+static int hamming_alloc_reserve_init(hamming_alloc_reserve_t *reserve, u32 target){
+	spin_lock_init(&reserve->lock);
+	reserve->count = 0;
+	reserve->slots = kvmalloc_array(target, sizeof(void*), GFP_KERNEL);
+	if(reserve->slots == NULL){
+		return -ENOMEM;
+	}
+	reserve->target = target;
+	return 0;
+}
+
+/**
+ * \brief Create the node, page descriptor and code table caches, and a pool per node with the reserve for alloc_mode
+ *
+ * \return -ENOMEM on failure (everything is undone by hamming_alloc_close), 0 otherwise
+ */
+static int hamming_alloc_init(void){
+	int shards = num_node_state(N_MEMORY), nid;
+	hamming_alloc_pool_t *pool;
+	u64 nodes, pages, codes;
+	uint i;
+
+	hamming_node_cache = kmem_cache_create("hamming_node", sizeof(hamming_node_t),
+					       L1_CACHE_BYTES, SLAB_HWCACHE_ALIGN, NULL);
+	if(hamming_node_cache == NULL){
+		return -ENOMEM;
+	}
+	hamming_page_cache = kmem_cache_create("hamming_page", sizeof(hamming_page_t),
+					       0, 0, NULL);
+	if(hamming_page_cache == NULL){
+		return -ENOMEM;
+	}
+	hamming_codes_cache = kmem_cache_create("hamming_codes", HAMMING_CODE_TABLE_PAGES*sizeof(hamming_code_set_t),
+						L1_CACHE_BYTES, SLAB_HWCACHE_ALIGN, NULL);
+	if(hamming_codes_cache == NULL){
+		return -ENOMEM;
+	}
+	for(i = 0;i < HAMMING_COMPRESSED_CLASSES;i++){
+		snprintf(hamming_compressed_names[i], sizeof(hamming_compressed_names[i]), "hamming_compressed_%lu",
+			 (unsigned long)(i + 1)*HAMMING_COMPRESSED_CLASS);
+		hamming_compressed_caches[i] = kmem_cache_create(hamming_compressed_names[i], (i + 1)*HAMMING_COMPRESSED_CLASS,
+								 L1_CACHE_BYTES, SLAB_HWCACHE_ALIGN, NULL);
+		if(hamming_compressed_caches[i] == NULL){
+			return -ENOMEM;
+		}
+	}
+
+	if(numa_policy != HAMMING_NUMA_INTERLEAVE && numa_policy != HAMMING_NUMA_LOCAL){
+		printk(KERN_ERR "Unknown numa_policy %d\n", numa_policy);
+		return -EINVAL;
+	}
+	for_each_node_state(nid, N_MEMORY){
+		pool = kzalloc_node(sizeof(hamming_alloc_pool_t), GFP_KERNEL, nid);
+		if(pool == NULL){
+			return -ENOMEM;
+		}
+		spin_lock_init(&pool->arena.lock);
+		INIT_LIST_HEAD(&pool->arena.partial);
+		hamming_alloc_pools[nid] = pool;
+	}
+
+	switch(alloc_mode){
+	case HAMMING_ALLOC_ON_DEMAND:
+		return 0;
+	case HAMMING_ALLOC_RESERVE:
+		if(alloc_reserve == 0){
+			return -EINVAL;
+		}
+		nodes = alloc_reserve;
+		pages = alloc_reserve;
+		codes = DIV_ROUND_UP(alloc_reserve, HAMMING_CODE_TABLE_PAGES);
+		hamming_alloc_wq = alloc_workqueue("hamming_alloc", WQ_MEM_RECLAIM, 0);
+		if(hamming_alloc_wq == NULL){
+			return -ENOMEM;
+		}
+		INIT_WORK(&hamming_alloc_refill, hamming_alloc_refill_work);
+		break;
+	case HAMMING_ALLOC_PREALLOC:
+		nodes = hamming_alloc_tree_nodes(hamming->capacity, shards);
+		pages = DIV_ROUND_UP(SECTOR_TO_PAGE(hamming->capacity), shards);
+		codes = DIV_ROUND_UP(SECTOR_TO_PAGE(hamming->capacity), (u64)HAMMING_TREE_FANOUT*shards)*
+			(HAMMING_TREE_FANOUT/HAMMING_CODE_TABLE_PAGES); // every table of its leaf parents
+		if(pages > U32_MAX){
+			printk(KERN_ERR "Device too large to preallocate\n");
+			return -EINVAL;
+		}
+		printk(KERN_INFO "Preallocating %llu nodes and %llu pages on each of %d nodes\n",
+		       (unsigned long long)nodes, (unsigned long long)pages, shards);
+		break;
+	default:
+		printk(KERN_ERR "Unknown alloc_mode %d\n", alloc_mode);
+		return -EINVAL;
+	}
+
+	for_each_node_state(nid, N_MEMORY){
+		pool = hamming_alloc_pools[nid];
+		if(hamming_alloc_reserve_init(&pool->nodes, nodes) < 0 ||
+		   hamming_alloc_reserve_init(&pool->pages, pages) < 0 ||
+		   hamming_alloc_reserve_init(&pool->codes, codes) < 0){
+			return -ENOMEM;
+		}
+		if(hamming_alloc_reserve_fill(&pool->nodes, hamming_alloc_node_raw, hamming_free_node_raw, GFP_KERNEL, nid) < 0 ||
+		   hamming_alloc_reserve_fill(&pool->pages, hamming_alloc_page_raw, hamming_free_page_raw, GFP_KERNEL, nid) < 0 ||
+		   hamming_alloc_reserve_fill(&pool->codes, hamming_alloc_codes_raw, hamming_free_codes_raw, GFP_KERNEL, nid) < 0){
+			printk(KERN_ERR "Can't fill the allocation reserve of node %d\n", nid);
+			return -ENOMEM;
+		}
+	}
+	return 0;
+}
+
+/**
+ * \brief Stop refilling, free the reserves and destroy the caches
+ *
+ * Everything in the tree must have been freed already, see
+ * hamming_tree_free
+ */
+static void hamming_alloc_close(void){
+	int nid;
+	uint i;
+
+	if(hamming_alloc_wq){
+		destroy_workqueue(hamming_alloc_wq); // drains a pending refill
+		hamming_alloc_wq = NULL;
+	}
+	for(nid = 0;nid < MAX_NUMNODES;nid++){
+		if(hamming_alloc_pools[nid] == NULL){
+			continue;
+		}
+		hamming_alloc_reserve_drain(&hamming_alloc_pools[nid]->nodes, hamming_free_node_raw, nid);
+		hamming_alloc_reserve_drain(&hamming_alloc_pools[nid]->pages, hamming_free_page_raw, nid);
+		hamming_alloc_reserve_drain(&hamming_alloc_pools[nid]->codes, hamming_free_codes_raw, nid);
+		if(hamming_alloc_pools[nid]->arena.spare){
+			hamming_arena_chunk_free(hamming_alloc_pools[nid]->arena.spare);
+		}
+		kfree(hamming_alloc_pools[nid]);
+		hamming_alloc_pools[nid] = NULL;
+	}
+	if(atomic64_read(&hamming_alloc_stats.arena_chunks)){
+		printk(KERN_ERR "Arena chunks still in use, leaking them\n");
+	}
+	for(i = 0;i < HAMMING_COMPRESSED_CLASSES;i++){
+		if(hamming_compressed_caches[i]){
+			kmem_cache_destroy(hamming_compressed_caches[i]);
+			hamming_compressed_caches[i] = NULL;
+		}
+	}
+	if(hamming_codes_cache){
+		kmem_cache_destroy(hamming_codes_cache);
+		hamming_codes_cache = NULL;
+	}
+	if(hamming_page_cache){
+		kmem_cache_destroy(hamming_page_cache);
+		hamming_page_cache = NULL;
+	}
+	if(hamming_node_cache){
+		kmem_cache_destroy(hamming_node_cache);
+		hamming_node_cache = NULL;
+	}
+}
+
+/**
+ * \brief Get an empty node, from the node's reserve if there is one
+ *
+ * \param[in] gfp		Allocation flags if the reserve can't cover it
+ * \param[in] nid		NUMA node to allocate on, must have a pool
+ *
+ * \return Zeroed node, NULL on failure
+ */
+static hamming_node_t *hamming_alloc_node(gfp_t gfp, int nid){
+	hamming_node_t *node_ptr = hamming_alloc_reserve_pop(&hamming_alloc_pools[nid]->nodes);
+	if(likely(node_ptr != NULL)){
+		return node_ptr;
+	}
+	return hamming_alloc_node_raw(gfp, nid);
+}
+
+// nid is what it was allocated with
+static void hamming_free_node(hamming_node_t *node_ptr, int nid){
+	memset(node_ptr, 0, sizeof(hamming_node_t));
+	if(!hamming_alloc_reserve_push(&hamming_alloc_pools[nid]->nodes, node_ptr)){
+		hamming_free_node_raw(node_ptr, nid);
+	}
+}
+
+/**
+ * \brief Get an empty code table for a leaf parent, from the node's reserve if there is one
+ *
+ * \param[in] gfp		Allocation flags if the reserve can't cover it
+ * \param[in] nid		NUMA node of the leaf parent's shard
+ *
+ * \return Zeroed table of HAMMING_CODE_TABLE_PAGES code sets, NULL on failure
+ */
+static hamming_code_set_t *hamming_alloc_codes(gfp_t gfp, int nid){
+	hamming_code_set_t *codes = hamming_alloc_reserve_pop(&hamming_alloc_pools[nid]->codes);
+	if(likely(codes != NULL)){
+		return codes;
+	}
+	return hamming_alloc_codes_raw(gfp, nid);
+}
+
+static void hamming_free_codes(hamming_code_set_t *codes, int nid){
+	memset(codes, 0, HAMMING_CODE_TABLE_PAGES*sizeof(hamming_code_set_t));
+	if(!hamming_alloc_reserve_push(&hamming_alloc_pools[nid]->codes, codes)){
+		hamming_free_codes_raw(codes, nid);
+	}
+}
+
+/**
+ * \brief Get a page and its descriptor, from the reserve if there is one
+ *
+ * Data isn't zeroed, almost every new page is about to be written in full.
+ * Readers treat HAMMING_PAGE_UNINIT pages as zeroes and partial writers
+ * zero them first (hamming_tree_page_zero).
+ *
+ * \param[in] gfp		Allocation flags if the reserve can't cover it, no highmem
+ * \param[in] nid		NUMA node to allocate on, see hamming_alloc_page_nid
+ *
+ * \return Page with len, flags and nid set, NULL on failure
+ */
+static hamming_page_t *hamming_alloc_page(gfp_t gfp, int nid){
+	hamming_page_t *page_ptr = hamming_alloc_reserve_pop(&hamming_alloc_pools[nid]->pages);
+	if(likely(page_ptr != NULL)){
+		return page_ptr;
+	}
+	return hamming_alloc_page_raw(gfp, nid);
+}
+
+/**
+ * \brief Get the descriptor of a same filled page, without data
+ *
+ * Never from the reserve, those all come with data. The page is freed with
+ * hamming_free_page like any other.
+ *
+ * \param[in] gfp		Allocation flags
+ * \param[in] nid		NUMA node of the page's shard
+ *
+ * \return Descriptor flagged HAMMING_PAGE_FILLED with len and nid set, NULL on failure
+ */
+static hamming_page_t *hamming_alloc_page_filled(gfp_t gfp, int nid){
+	hamming_page_t *page_ptr = kmem_cache_alloc_node(hamming_page_cache, gfp | __GFP_ZERO, nid);
+
+	if(unlikely(page_ptr == NULL)){
+		atomic64_inc(&hamming_alloc_stats.failed);
+		return NULL;
+	}
+	page_ptr->flags = HAMMING_PAGE_FILLED;
+	page_ptr->len = PAGE_SIZE;
+	page_ptr->nid = nid;
+	seqcount_init(&page_ptr->seq);
+	atomic64_inc(&hamming_alloc_stats.filled);
+	return page_ptr;
+}
+
+/**
+ * \brief Get data for a same filled, compressed or written back page that is about to lose its fill, be expanded or be fetched
+ *
+ * Data and flags are left for the caller to publish under the page lock,
+ * the page counts as a page with data from here on.
+ *
+ * \param[in] gfp		Allocation flags
+ * \param[in] page_ptr		Page flagged HAMMING_PAGE_FILLED, HAMMING_PAGE_COMPRESSED or HAMMING_PAGE_BACKED, data goes on its node
+ * \param[in,out] flags		Page flags to add HAMMING_PAGE_ARENA to
+ *
+ * \return Uninitialized data, NULL on failure
+ */
+static u8 *hamming_alloc_page_data(gfp_t gfp, hamming_page_t *page_ptr, u32 *flags){
+	u8 *data = hamming_alloc_data(gfp, page_ptr->nid, flags);
+
+	if(unlikely(data == NULL)){
+		return NULL;
+	}
+	if(page_ptr->flags & HAMMING_PAGE_COMPRESSED){
+		atomic64_dec(&hamming_alloc_stats.compressed);
+	}else if(page_ptr->flags & HAMMING_PAGE_BACKED){
+		atomic64_dec(&hamming_alloc_stats.backed);
+	}else{
+		atomic64_dec(&hamming_alloc_stats.filled);
+	}
+	atomic64_inc(&hamming_alloc_stats.pages);
+	atomic64_inc(&hamming_alloc_pools[page_ptr->nid]->page_count);
+	return data;
+}
+
+/**
+ * \brief Free the data page a compressed page no longer points at
+ *
+ * The descriptor was counted as compressed when the data was swapped out,
+ * this only gives back the page, after a grace period, see
+ * hamming_compress_defer.
+ *
+ * \param[in] data		Data page
+ * \param[in] flags		Flags of the page while it had it, for HAMMING_PAGE_ARENA
+ * \param[in] nid		Node it was allocated on
+ */
+static void hamming_free_page_data(u8 *data, u32 flags, int nid){
+	hamming_free_data(data, flags);
+	atomic64_dec(&hamming_alloc_stats.pages);
+	atomic64_dec(&hamming_alloc_pools[nid]->page_count);
+}
+
+/**
+ * \brief Get a buffer for compressed data
+ *
+ * \param[in] gfp		Allocation flags
+ * \param[in] nid		Node of the page
+ * \param[in] len		Compressed length, at most HAMMING_COMPRESSED_MAX
+ *
+ * \return Buffer of len rounded up to its size class, uninitialized, NULL on failure
+ */
+static u8 *hamming_alloc_compressed(gfp_t gfp, int nid, u32 len){
+	int class = DIV_ROUND_UP(len, HAMMING_COMPRESSED_CLASS) - 1;
+	u8 *data = kmem_cache_alloc_node(hamming_compressed_caches[class], gfp, nid);
+
+	if(unlikely(data == NULL)){
+		atomic64_inc(&hamming_alloc_stats.failed);
+		return NULL;
+	}
+	atomic64_add((class + 1)*HAMMING_COMPRESSED_CLASS, &hamming_alloc_stats.compressed_bytes);
+	return data;
+}
+
+static void hamming_free_compressed(u8 *data, u32 len){
+	int class = DIV_ROUND_UP(len, HAMMING_COMPRESSED_CLASS) - 1;
+
+	kmem_cache_free(hamming_compressed_caches[class], data);
+	atomic64_sub((class + 1)*HAMMING_COMPRESSED_CLASS, &hamming_alloc_stats.compressed_bytes);
+}
+
+static void hamming_free_page(hamming_page_t *page_ptr){
+	u8 *data = page_ptr->data;
+	int nid = page_ptr->nid;
+	u32 arena = page_ptr->flags & HAMMING_PAGE_ARENA;
+
+	if(page_ptr->flags & HAMMING_PAGE_BACKED){ // data points at the zero page, the slot is all there is
+		hamming_writeback_free_slots(page_ptr->fill[0], 1);
+		kmem_cache_free(hamming_page_cache, page_ptr);
+		atomic64_dec(&hamming_alloc_stats.backed);
+		return;
+	}
+	if(data == NULL){ // same filled, just the descriptor
+		kmem_cache_free(hamming_page_cache, page_ptr);
+		atomic64_dec(&hamming_alloc_stats.filled);
+		return;
+	}
+	if(page_ptr->flags & HAMMING_PAGE_COMPRESSED){ // its data page went when it was compressed
+		hamming_free_compressed(data, page_ptr->len);
+		kmem_cache_free(hamming_page_cache, page_ptr);
+		atomic64_dec(&hamming_alloc_stats.compressed);
+		return;
+	}
+	memset(page_ptr, 0, sizeof(hamming_page_t));
+	page_ptr->data = data;
+	page_ptr->len = PAGE_SIZE;
+	page_ptr->flags = HAMMING_PAGE_UNINIT | arena;
+	page_ptr->nid = nid;
+	seqcount_init(&page_ptr->seq);
+	if(!hamming_alloc_reserve_push(&hamming_alloc_pools[nid]->pages, page_ptr)){
+		hamming_free_page_raw(page_ptr, nid);
+	}
+}
+
+/**
+ * \brief Pick the node for a new data page
+ *
+ * \param[in] shard_nid		Node of the shard the page goes into
+ *
+ * \return shard_nid when interleaving, the node of this CPU for
+ * HAMMING_NUMA_LOCAL (unless it came online after we loaded and has no pool)
+ */
+static int hamming_alloc_page_nid(int shard_nid){
+	int nid;
+
+	if(numa_policy == HAMMING_NUMA_INTERLEAVE){
+		return shard_nid;
+	}
+	nid = numa_mem_id();
+	return hamming_alloc_pools[nid] ? nid : shard_nid;
+}
+
+static u64 hamming_alloc_reserved(void){
+	u64 count = 0;
+	int nid;
+
+	for(nid = 0;nid < MAX_NUMNODES;nid++){
+		if(hamming_alloc_pools[nid]){
+			count += READ_ONCE(hamming_alloc_pools[nid]->pages.count);
+		}
+	}
+	return count;
+}
@@ -0,0 +1,147 @@
+#ifndef _HAMMING_ALLOC_H_
+#define _HAMMING_ALLOC_H_
+
+#include "hamming.h"
+#include "hamming_tree.h"
+
+#include <linux/slab.h>
+#include <linux/gfp.h>
+#include <linux/list.h>
+
+/**
+ * \file hamming_alloc.h
+ * \brief Allocation of tree nodes and pages
+ *
+ * Nodes, page descriptors and the code tables of leaf parents come from
+ * their own caches instead of the
+ * generic kmalloc ones, data is a whole page straight from the page allocator
+ * and isn't zeroed until something needs it to be (see HAMMING_PAGE_UNINIT)
+ *
+ * Where the IO path gets them from depends on the alloc_mode parameter
+ *  - HAMMING_ALLOC_ON_DEMAND, GFP_ATOMIC allocations as the tree grows
+ *  - HAMMING_ALLOC_RESERVE, a reserve of alloc_reserve pages (and as many
+ *    nodes) topped up by a worker with GFP_NOIO once it's half empty
+ *  - HAMMING_ALLOC_PREALLOC, the reserve holds everything the full capacity
+ *    needs, allocated at load time and never refilled
+ * The last two only fall back to GFP_ATOMIC when the reserve is empty.
+ *
+ * Everything is per NUMA node (hamming_alloc_pool_t), nodes are allocated on
+ * the node of their shard and data pages where numa_policy says
+ *  - HAMMING_NUMA_INTERLEAVE, with the shard, so memory is interleaved over
+ *    nodes 256K at a time like the tree
+ *  - HAMMING_NUMA_LOCAL, on the node of the CPU that creates the page
+ *
+ * With alloc_arena set, data pages are carved out of 2MB chunks (see
+ * hamming_arena_t) instead of coming from the page allocator one at a time.
+ *
+ * Compressed data (see hamming_compress.h) comes from caches of
+ * HAMMING_COMPRESSED_CLASS byte size classes, on the node of the page.
+ */
+
+#define HAMMING_ALLOC_ON_DEMAND 0
+#define HAMMING_ALLOC_RESERVE 1
+#define HAMMING_ALLOC_PREALLOC 2
+
+#define HAMMING_NUMA_INTERLEAVE 0
+#define HAMMING_NUMA_LOCAL 1
+
+#define HAMMING_COMPRESSED_CLASS 128 // bytes, also keeps every class a multiple of a row
+#define HAMMING_COMPRESSED_MAX (PAGE_SIZE*3/4) // compressing any less isn't worth decompressing for
+#define HAMMING_COMPRESSED_CLASSES (HAMMING_COMPRESSED_MAX/HAMMING_COMPRESSED_CLASS)
+
+typedef struct{
+	atomic64_t nodes; // allocated, reserve included
+	atomic64_t pages; // allocated, reserve included
+	atomic64_t filled; // descriptors of same filled pages, no data
+	atomic64_t compressed; // descriptors of compressed pages, their data page is gone or going
+	atomic64_t compressed_bytes; // in size classes
+	atomic64_t backed; // descriptors of written back pages, their data is in the backing store
+	atomic64_t codes; // code tables, reserve included
+	atomic64_t zeroed; // pages that had to be zeroed, the rest were fully written first
+	atomic64_t failed;
+	atomic64_t fallback; // IO path allocations the reserve couldn't cover
+	atomic64_t arena_chunks; // live arena chunks, spares included
+	atomic64_t arena_fallback; // data pages the arena couldn't get a chunk for
+} hamming_alloc_stats_t;
+
+typedef struct{
+	spinlock_t lock;
+	void **slots; // stack of ready objects
+	u32 count;
+	u32 target; // zero without a reserve
+} hamming_alloc_reserve_t;
+
+/*
+  Data arena. The kernel maps RAM with 2MB (or larger) pages, so data pages
+  carved out of one physically contiguous 2MB chunk share a TLB entry, where
+  pages from the page allocator one at a time can each land in a different
+  one. Scrubs and streaming reads over neighbouring pages walk far fewer.
+
+  The first page of a chunk is its header, the rest are handed out from a
+  stack of free indexes. Chunks come from the buddy allocator, which aligns
+  them to their size, so the chunk of a data pointer is the pointer rounded
+  down. A chunk is given back once its last page is freed, except for one
+  spare per node so a page going back and forth doesn't cost 2MB each time.
+ */
+#define HAMMING_ARENA_ORDER 9
+#define HAMMING_ARENA_PAGES (1 << HAMMING_ARENA_ORDER)
+#define HAMMING_ARENA_SIZE (PAGE_SIZE << HAMMING_ARENA_ORDER)
+
+typedef struct{
+	struct list_head list; // on the arena's partial list while it has free pages
+	int nid;
+	u16 free_count;
+	u16 free[HAMMING_ARENA_PAGES - 1]; // page 0 is this header
+} hamming_arena_chunk_t;
+
+typedef struct{
+	spinlock_t lock;
+	struct list_head partial; // chunks with free pages
+	hamming_arena_chunk_t *spare; // empty, kept back
+} hamming_arena_t;
+
+// reserves and counts of one node
+typedef struct{
+	hamming_alloc_reserve_t nodes;
+	hamming_alloc_reserve_t pages;
+	hamming_alloc_reserve_t codes;
+	hamming_arena_t arena; // only with alloc_arena
+	atomic64_t node_count; // allocated on this node, reserve included
+	atomic64_t page_count;
+} hamming_alloc_pool_t;
+
+static hamming_alloc_stats_t hamming_alloc_stats;
+static hamming_alloc_pool_t *hamming_alloc_pools[MAX_NUMNODES]; // nodes with memory only
+
+static int hamming_alloc_init(void);
+static void hamming_alloc_close(void);
+
+static hamming_node_t *hamming_alloc_node(gfp_t gfp, int nid);
+static void hamming_free_node(hamming_node_t *node_ptr, int nid);
+
+// zeroed table of HAMMING_CODE_TABLE_PAGES code sets
+static hamming_code_set_t *hamming_alloc_codes(gfp_t gfp, int nid);
+static void hamming_free_codes(hamming_code_set_t *codes, int nid);
+
+// data is left uninitialized and the page flagged HAMMING_PAGE_UNINIT
+static hamming_page_t *hamming_alloc_page(gfp_t gfp, int nid);
+static void hamming_free_page(hamming_page_t *page_ptr);
+
+// descriptor of a same filled page, see HAMMING_PAGE_FILLED, and data for a same filled, compressed or written back one that needs it again
+static hamming_page_t *hamming_alloc_page_filled(gfp_t gfp, int nid);
+static u8 *hamming_alloc_page_data(gfp_t gfp, hamming_page_t *page_ptr, u32 *flags);
+
+// data page taken from a page that was compressed, flags are the page's before, only HAMMING_PAGE_ARENA matters
+static void hamming_free_page_data(u8 *data, u32 flags, int nid);
+
+// compressed data of len bytes, rounded up to its size class
+static u8 *hamming_alloc_compressed(gfp_t gfp, int nid, u32 len);
+static void hamming_free_compressed(u8 *data, u32 len);
+
+// node a new page of a shard on shard_nid goes to, see numa_policy
+static int hamming_alloc_page_nid(int shard_nid);
+
+// pages held in reserve over every node
+static u64 hamming_alloc_reserved(void);
+
+#endif
@@ -21,9 +21,10 @@
  * \return Negative on failure, 0 otherwise
  */
 static int hamming_write(hamming_t *hamming, u64 offset, u8 *data, size_t len){
-    VM_BUG_ON(hamming != NULL);
-    VM_BUG_ON(data != NULL);
-    int i;
+    size_t i;
+
+    VM_BUG_ON(hamming == NULL);
+    VM_BUG_ON(data == NULL);
     
     switch(hamming->backend.mode){
     case BACK_BIN_TREE:
@@ -32,14 +33,21 @@ static int hamming_write(hamming_t *hamming, u64 offset, u8 *data, size_t len){
             return -EINVAL;
         }
         for(i = 0;i < len / SECTOR_SIZE;i++){
-            void *sector = hamming_tree_sector_simple(SECTOR_TO_PAGE(offset),
-                                                      SECTOR_TO_CHUNK(offset),
-                                                      true);
+            void *sector;
+            if(hamming_writeback_fetch(offset + i, SECTOR_SIZE, false) < 0){
+                return -EIO;
+            }
+            hamming_tree_write_begin();
+            sector = hamming_tree_sector_simple(SECTOR_TO_PAGE(offset + i),
+                                                SECTOR_TO_CHUNK(offset + i),
+                                                true);
             if(sector == NULL){
+                hamming_tree_write_end();
                 pr_err("No valid sector found for write\n");
                 return -EIO;
             }
             memcpy(sector, data + SECTOR_SIZE*i, SECTOR_SIZE);
+            hamming_tree_write_end();
         }
         break;
     case BACK_BLOCK_IO:
@@ -66,9 +74,11 @@ static int hamming_write(hamming_t *hamming, u64 offset, u8 *data, size_t len){
  * \return Negative on failure, 0 otherwise
  */
 static int hamming_read(hamming_t *hamming, u64 offset, u8 *data, size_t len){
-    VM_BUG_ON(hamming != NULL);
-    VM_BUG_ON(data != NULL);
-    int i;
+    size_t i;
+    int ret;
+
+    VM_BUG_ON(hamming == NULL);
+    VM_BUG_ON(data == NULL);
 
     switch(hamming->backend.mode){
     case BACK_BIN_TREE:
@@ -77,14 +87,50 @@ static int hamming_read(hamming_t *hamming, u64 offset, u8 *data, size_t len){
             return -EINVAL;
         }
         for(i = 0;i < len / SECTOR_SIZE;i++){
-            void *sector = hamming_tree_sector_simple(SECTOR_TO_PAGE(offset),
-                                                      SECTOR_TO_CHUNK(offset),
-                                                      false);
-            if(sector == NULL){
+            hamming_page_t *page_ptr;
+            spinlock_t *lock;
+            void *sector;
+            if(hamming_writeback_fetch(offset + i, SECTOR_SIZE, false) < 0){
+                return -EIO;
+            }
+            rcu_read_lock();
+            sector = hamming_tree_sector_simple(SECTOR_TO_PAGE(offset + i),
+                                                SECTOR_TO_CHUNK(offset + i),
+                                                false);
+            page_ptr = sector ? NULL : hamming_tree_page_simple(SECTOR_TO_PAGE(offset + i), false);
+            if(page_ptr != NULL && (READ_ONCE(page_ptr->flags) & HAMMING_PAGE_FILLED)){
+                lock = hamming_tree_page_lock(SECTOR_TO_PAGE(offset + i));
+                spin_lock(lock);
+                hamming_tree_page_fill_read(hamming_tree_page_fill_verify(page_ptr),
+                                            data + SECTOR_SIZE*i, SECTOR_SIZE);
+                spin_unlock(lock);
+            }else if(page_ptr != NULL && (READ_ONCE(page_ptr->flags) & HAMMING_PAGE_COMPRESSED)){
+                lock = hamming_tree_page_lock(SECTOR_TO_PAGE(offset + i));
+                spin_lock(lock);
+                if(page_ptr->flags & HAMMING_PAGE_COMPRESSED){
+                    ret = hamming_compress_read(page_ptr, SECTOR_TO_CHUNK(offset + i),
+                                                data + SECTOR_SIZE*i, SECTOR_SIZE);
+                }else{ // a write expanded it in the meantime
+                    ret = 0;
+                    memcpy(data + SECTOR_SIZE*i, hamming_tree_sector_from_page(page_ptr, SECTOR_TO_CHUNK(offset + i)),
+                           SECTOR_SIZE);
+                }
+                spin_unlock(lock);
+                if(ret < 0){
+                    rcu_read_unlock();
+                    pr_err("Uncorrectable page %llu\n", (unsigned long long)SECTOR_TO_PAGE(offset + i));
+                    return -EIO;
+                }
+            }else if(page_ptr != NULL && (READ_ONCE(page_ptr->flags) & HAMMING_PAGE_BACKED)){
+                rcu_read_unlock(); // a pass wrote it back since we fetched, again
+                i--;
+                continue;
+            }else if(sector == NULL){
                 memset(data + SECTOR_SIZE*i, 0, SECTOR_SIZE);
             }else{
                 memcpy(data + SECTOR_SIZE*i, sector, SECTOR_SIZE);
             }
+            rcu_read_unlock();
         }
         break;
     case BACK_BLOCK_IO:
@@ -2,6 +2,9 @@
 #include "hamming_fast_logic.h"
 #include "hamming_fast_logic_simple.h"
 
+#include <linux/prefetch.h>
+#include <linux/version.h>
+
 /**
  * \file hamming_blkdev.c
  * \brief Block IO initialization and callbacks
@@ -10,36 +13,95 @@
 /**
  * \brief Fill a read BIO request
  *
- * If there is a node in the tree at the address, copy the contents over
- * If there is no node in the tree at the address, blank the memory
+ * If there is a node in the tree at the address, verify it (unless that was
+ * done recently, possibly ahead of us by hamming_readahead_work) and copy
+ * the contents over. Pages that don't need verifying are copied without
+ * taking their lock, see hamming_tree_page_read_trusted
+ * If there is no node in the tree at the address, blank the memory, that's
+ * also what a discarded page reads as (see hamming_blkdev_discard)
+ *
+ * Same filled pages are synthesized from their fill, the locked path votes
+ * on it first (hamming_tree_page_fill_verify). Compressed pages are verified
+ * and decompressed under the lock, see hamming_compress_read. A written back
+ * page stops the read with -EAGAIN, it has to be fetched first, see
+ * hamming_bvec_rw.
  *
- * NOTE: we can specify DISCARD/WRITE_ZEROES, and truncate the tree for size,
- * but that also means we have to blank the memory if we don't have a node,
- * which isn't an expensive operation
+ * Reads of the snapshot disk look the page up in the snapshot instead, the
+ * page itself (and verifying it) is the same one the live tree may share.
+ * Pages shared by content are locked with the dedup index's lock for them,
+ * see hamming_tree_page_lock_of.
  *
  * \param[in] sector		Sector to read
  * \param[in] page_ptr		Pointer to page, passed by Linux, we need to populate
  * \param[in] page_len		Length of page information we need to populate
+ * \param[in] snapshot		True to read the snapshot
  *
- * \return -EIO on errors, 0 otherwise
+ * \return -EIO on errors, -EAGAIN for a written back page, 0 otherwise
  */
-static int hamming_bvec_read(u32 sector, u8 *page_ptr, u32 page_len){
-	u8 *end_ptr;
-	u8 *sector_ptr;
-
-	end_ptr = page_ptr + page_len;
-	while(page_ptr <= end_ptr - SECTOR_SIZE){
-		sector_ptr = hamming_tree_sector_simple(SECTOR_TO_PAGE(sector), SECTOR_TO_CHUNK(sector), false);
-		if(sector_ptr == NULL){
-			memset(page_ptr, 0, SECTOR_SIZE);
+static int hamming_bvec_read(sector_t sector, u8 *page_ptr, u32 page_len, bool snapshot){
+	hamming_page_t *tree_page;
+	spinlock_t *lock;
+	u32 len;
+	bool ahead;
+	int ret;
+
+	while(page_len >= SECTOR_SIZE){
+		if(unlikely(sector >= hamming->capacity)){
+			return -EIO;
+		}
+		len = min_t(u32, page_len, (SECTORS_PER_PAGE_SHIFT - SECTOR_TO_CHUNK(sector)) << SECTOR_SHIFT);
+		if(snapshot){
+			tree_page = hamming_tree_snapshot_page(SECTOR_TO_PAGE(sector));
 		}else{
-			memcpy(page_ptr, sector_ptr, SECTOR_SIZE);
+			tree_page = hamming_tree_page_simple(SECTOR_TO_PAGE(sector), false);
 		}
-		page_ptr += SECTOR_SIZE;
-		sector++;
-		if(unlikely(sector > SECTOR_COUNT)){
-			return -EIO;
+		if(tree_page != NULL){
+			hamming_compress_touch(tree_page);
 		}
+		if(tree_page == NULL){
+			memset(page_ptr, 0, len);
+		}else if(hamming_tree_page_read_trusted(tree_page, SECTOR_TO_CHUNK(sector), page_ptr, len, &ahead)){
+			if(ahead){
+				atomic64_inc(&hamming->frontend.block_io.readahead.hits);
+			}
+		}else{
+			ret = 0;
+			lock = hamming_tree_page_lock_of(tree_page, SECTOR_TO_PAGE(sector));
+			spin_lock(lock);
+			ahead = tree_page->flags & HAMMING_PAGE_READAHEAD;
+			if(unlikely(tree_page->flags & HAMMING_PAGE_UNINIT)){
+				memset(page_ptr, 0, len); // created by a write that hasn't copied in yet
+			}else if(tree_page->flags & HAMMING_PAGE_FILLED){
+				hamming_tree_page_fill_read(hamming_tree_page_fill_verify(tree_page), page_ptr, len);
+			}else if(tree_page->flags & HAMMING_PAGE_COMPRESSED){
+				ret = hamming_compress_read(tree_page, SECTOR_TO_CHUNK(sector), page_ptr, len);
+			}else if(unlikely(tree_page->flags & HAMMING_PAGE_BACKED)){
+				ret = -EAGAIN;
+			}else{
+				if(hamming_tree_page_trusted(tree_page)){
+					if(ahead){
+						atomic64_inc(&hamming->frontend.block_io.readahead.hits);
+					}
+				}else{
+					ret = hamming_tree_page_verify(tree_page);
+				}
+				if(likely(ret >= 0)){
+					memcpy(page_ptr, hamming_tree_sector_from_page(tree_page, SECTOR_TO_CHUNK(sector)), len);
+				}
+			}
+			spin_unlock(lock);
+			if(unlikely(ret == -EAGAIN)){
+				return ret;
+			}
+			if(unlikely(ret < 0)){
+				printk(KERN_ERR "uncorrectable page %llu\n", (unsigned long long)SECTOR_TO_PAGE(sector));
+				hamming_sysfs_reg_error(SECTOR_TO_PAGE(sector));
+				return -EIO;
+			}
+		}
+		page_ptr += len;
+		page_len -= len;
+		sector += len >> SECTOR_SHIFT;
 	}
 	return 0;
 }
@@ -49,111 +111,529 @@ static int hamming_bvec_read(u32 sector, u8 *page_ptr, u32 page_len){
  *
  * If there is a node in the tree at the address, copy the data over directly
  * If there is no node in the tree at the address, allocate and copy over
+ * Either way the page is re-encoded before anyone else can read it, pages only
+ * partially written are verified (or zeroed, if new) first so we don't encode
+ * over an error
+ *
+ * A whole page write of one word is kept as just that where the page has no
+ * data, see hamming_tree_page_fill. Partial writes of a same filled page
+ * give it data first. With dedup set, other whole page writes where the page
+ * has no data of its own share a page with the same contents, see
+ * hamming_tree_page_dedup, and partial writes of one copy it first. A
+ * compressed page is expanded again, see hamming_compress_expand, and may
+ * compress differently once written. A written back page stops the write
+ * with -EAGAIN like it stops a read, rewriting the pages before it again is
+ * harmless.
  *
- * See hamming_tree_sector_simple for allocation of new nodes
+ * See hamming_tree_page_simple for allocation of new nodes
  *
  * \param[in] sector		Sector to write
  * \param[in] page_ptr		Pointer to page, passed by Linux, we need to write
  * \param[in] page_len		Length of page information we need to write
  * 
- * \return -EIO on errors, 0 otherwise
+ * \return -EIO on errors, -EAGAIN for a written back page, 0 otherwise
  */
-static int hamming_bvec_write(u32 sector, u8 *page_ptr, u32 page_len){
-	u8 *end_ptr;
-	u8 *sector_ptr;
-	end_ptr = page_ptr + page_len;
-
-	while(page_ptr <= end_ptr - SECTOR_SIZE){
-		sector_ptr = hamming_tree_sector_simple(SECTOR_TO_PAGE(sector), SECTOR_TO_CHUNK(sector), true);
-		if(unlikely(sector_ptr == NULL)){
+static int hamming_bvec_write(sector_t sector, u8 *page_ptr, u32 page_len){
+	hamming_page_t *tree_page;
+	spinlock_t *lock;
+	u64 fill;
+	u32 len;
+	int ret;
+
+	while(page_len >= SECTOR_SIZE){
+		if(unlikely(sector >= hamming->capacity)){
+			return -EIO;
+		}
+		len = min_t(u32, page_len, (SECTORS_PER_PAGE_SHIFT - SECTOR_TO_CHUNK(sector)) << SECTOR_SHIFT);
+		if(len == PAGE_SIZE && hamming_tree_data_filled(page_ptr, len, &fill)){
+			ret = hamming_tree_page_fill(SECTOR_TO_PAGE(sector), fill);
+			if(unlikely(ret < 0)){
+				printk(KERN_ERR "write operation failed\n");
+				return -EIO;
+			}
+			if(ret == 0){
+				page_ptr += len;
+				page_len -= len;
+				sector += len >> SECTOR_SHIFT;
+				continue;
+			}
+		}else if(len == PAGE_SIZE && hamming_dedup_enabled()){
+			ret = hamming_tree_page_dedup(SECTOR_TO_PAGE(sector), page_ptr);
+			if(unlikely(ret < 0)){
+				printk(KERN_ERR "write operation failed\n");
+				return -EIO;
+			}
+			if(ret == 0){
+				page_ptr += len;
+				page_len -= len;
+				sector += len >> SECTOR_SHIFT;
+				continue;
+			}
+		}
+		tree_page = hamming_tree_page_simple(SECTOR_TO_PAGE(sector), false);
+		if(unlikely(tree_page != NULL && (READ_ONCE(tree_page->flags) & HAMMING_PAGE_BACKED))){
+			return -EAGAIN; // before a snapshot's copy of it is attempted
+		}
+		tree_page = hamming_tree_page_simple(SECTOR_TO_PAGE(sector), true);
+		if(unlikely(tree_page == NULL)){
 			printk(KERN_ERR "write operation failed\n");
 			return -EIO; // realistically it fell out of bounds for the sector
 		}
-		memcpy(sector_ptr, page_ptr, SECTOR_SIZE);
-		page_ptr += SECTOR_SIZE;
-		sector++;
+		hamming_compress_touch(tree_page);
+		ret = 0;
+		lock = hamming_tree_page_lock(SECTOR_TO_PAGE(sector));
+		spin_lock(lock);
+		if(unlikely(tree_page->flags & HAMMING_PAGE_BACKED)){
+			spin_unlock(lock);
+			return -EAGAIN; // a pass got to it since
+		}
+		if(unlikely(tree_page->flags & HAMMING_PAGE_FILLED) && hamming_tree_page_unfill(tree_page) < 0){
+			spin_unlock(lock);
+			printk(KERN_ERR "write operation failed\n");
+			return -EIO;
+		}
+		if(unlikely(tree_page->flags & HAMMING_PAGE_COMPRESSED)){
+			ret = hamming_compress_expand(tree_page, len != PAGE_SIZE);
+			if(unlikely(ret == -ENOMEM)){
+				spin_unlock(lock);
+				printk(KERN_ERR "write operation failed\n");
+				return -EIO;
+			}
+		}
+		if(ret >= 0 && len != tree_page->len){
+			if(tree_page->flags & HAMMING_PAGE_UNINIT){
+				hamming_tree_page_zero(tree_page);
+			}else{
+				ret = hamming_tree_page_correct(tree_page);
+			}
+		}
+		if(likely(ret >= 0)){
+			write_seqcount_begin(&tree_page->seq);
+			memcpy(hamming_tree_sector_from_page(tree_page, SECTOR_TO_CHUNK(sector)), page_ptr, len);
+			HAMMING_PAGE_LOGIC(tree_page);
+			tree_page->last_check = ktime_get();
+			tree_page->flags &= ~(HAMMING_PAGE_READAHEAD | HAMMING_PAGE_UNINIT | HAMMING_PAGE_INCOMPRESSIBLE);
+			write_seqcount_end(&tree_page->seq);
+		}
+		spin_unlock(lock);
+		if(unlikely(ret < 0)){
+			printk(KERN_ERR "uncorrectable page %llu\n", (unsigned long long)SECTOR_TO_PAGE(sector));
+			hamming_sysfs_reg_error(SECTOR_TO_PAGE(sector));
+			return -EIO;
+		}
+		page_ptr += len;
+		page_len -= len;
+		sector += len >> SECTOR_SHIFT;
 	}
 	return 0;
 }
 
+/**
+ * \brief Verify pages ahead of a sequential reader
+ *
+ * Takes pages off the window one at a time, so a reader that moves on (or
+ * catches up) shrinks what's left. Pages that don't exist read as zeroes and
+ * pages that can't be corrected are left for the reader to report.
+ *
+ * \param[in] work		Work item embedded in hamming_readahead_t
+ */
+static void hamming_readahead_work(struct work_struct *work){
+	hamming_readahead_t *readahead = container_of(work, hamming_readahead_t, work);
+	hamming_page_t *tree_page;
+	spinlock_t *lock;
+	sector_t sector;
+
+	while(true){
+		spin_lock(&readahead->lock);
+		if(readahead->next < readahead->last_sector){
+			readahead->next = readahead->last_sector; // reader passed us
+		}
+		if(readahead->next >= readahead->end){
+			spin_unlock(&readahead->lock);
+			break;
+		}
+		sector = readahead->next;
+		readahead->next = PAGE_TO_SECTOR(SECTOR_TO_PAGE(sector) + 1);
+		spin_unlock(&readahead->lock);
+
+		rcu_read_lock();
+		tree_page = hamming_tree_page_simple(SECTOR_TO_PAGE(sector), false);
+		if(tree_page != NULL){
+			lock = hamming_tree_page_lock_of(tree_page, SECTOR_TO_PAGE(sector));
+			spin_lock(lock);
+			if(!(tree_page->flags & (HAMMING_PAGE_READAHEAD | HAMMING_PAGE_UNINIT | HAMMING_PAGE_FILLED |
+						 HAMMING_PAGE_COMPRESSED | HAMMING_PAGE_BACKED)) &&
+			   hamming_tree_page_verify(tree_page) >= 0){
+				tree_page->flags |= HAMMING_PAGE_READAHEAD;
+				atomic64_inc(&readahead->verified);
+			}
+			spin_unlock(lock);
+		}
+		rcu_read_unlock();
+	}
+}
+
+/**
+ * \brief Detect sequential reads and keep verification ahead of them
+ *
+ * After HAMMING_READAHEAD_TRIGGER back to back reads, the window is pushed to
+ * HAMMING_READAHEAD_PAGES past this read and handed to the workqueue, and the
+ * first few pages past it are prefetched for the next read. A read anywhere
+ * else resets the streak and empties the window.
+ *
+ * \param[in] readahead		Readahead state of the device
+ * \param[in] sector		First sector of the read
+ * \param[in] size			Length of the read in bytes
+ */
+static void hamming_blkdev_readahead(hamming_readahead_t *readahead, sector_t sector, u32 size){
+	hamming_page_t *tree_page;
+	sector_t end = sector + (size >> SECTOR_SHIFT);
+	bool queue = false;
+	int i;
+
+	spin_lock(&readahead->lock);
+	if(sector == readahead->last_sector){
+		if(readahead->streak < HAMMING_READAHEAD_TRIGGER){
+			readahead->streak++;
+		}
+	}else{
+		readahead->streak = 0;
+		readahead->end = readahead->next;
+	}
+	readahead->last_sector = end;
+	if(readahead->streak >= HAMMING_READAHEAD_TRIGGER){
+		readahead->end = min_t(sector_t, end + PAGE_TO_SECTOR(HAMMING_READAHEAD_PAGES), hamming->capacity);
+		queue = readahead->next < readahead->end;
+	}
+	spin_unlock(&readahead->lock);
+
+	if(queue){
+		queue_work(readahead->wq, &readahead->work);
+		rcu_read_lock();
+		for(i = 0;i < HAMMING_READAHEAD_PREFETCH && end < hamming->capacity;i++){
+			tree_page = hamming_tree_page_simple(SECTOR_TO_PAGE(end), false);
+			if(tree_page != NULL){
+				prefetch(tree_page);
+				prefetch(READ_ONCE(tree_page->data));
+			}
+			end += SECTORS_PER_PAGE_SHIFT;
+		}
+		rcu_read_unlock();
+	}
+}
+
 /**
  * \brief Handle individual BIO requests
  *
  * Calls either hamming_bvec_write or hamming_bvec_read
  *
  * Since the memory is HIGHMEMORY, we have to kmap/kunmap pages to get a kernelspace
- * pointer
+ * pointer. The segment is one RCU read side section, tree pages it finds stay
+ * valid until it's done with them. A write sleeps before mapping while a
+ * snapshot is being taken (hamming_tree_write_begin). The section may not
+ * sleep, so a segment that runs into a written back page is left, the page
+ * fetched (see hamming_writeback_fetch) and the segment started over.
  *
  * \param[in] bvec		Vector of current BIO request, contains page information
  * \param[in] sector	Sector to operate on
  * \param[in] is_write	True for write operation, false for read
+ * \param[in] snapshot	True to read the snapshot instead of the live tree
  */
-static int hamming_bvec_rw(struct bio_vec *bvec, u32 sector, bool is_write){
-	u32 ret;
-	u8 *bv_page_ptr = kmap_atomic(bvec->bv_page);
-	if(is_write){
-		ret = hamming_bvec_write(sector, bv_page_ptr, bvec->bv_len);
-	}else{
-		ret = hamming_bvec_read(sector, bv_page_ptr, bvec->bv_len);
+static int hamming_bvec_rw(struct bio_vec *bvec, sector_t sector, bool is_write, bool snapshot){
+	u8 *bv_page_ptr;
+	int ret;
+
+	do{
+		if(is_write){
+			hamming_tree_write_begin();
+			bv_page_ptr = kmap_local_page(bvec->bv_page);
+			ret = hamming_bvec_write(sector, bv_page_ptr, bvec->bv_len);
+			kunmap_local(bv_page_ptr);
+			hamming_tree_write_end();
+		}else{
+			bv_page_ptr = kmap_local_page(bvec->bv_page);
+			rcu_read_lock();
+			ret = hamming_bvec_read(sector, bv_page_ptr, bvec->bv_len, snapshot);
+			rcu_read_unlock();
+			kunmap_local(bv_page_ptr);
+		}
+		if(likely(ret != -EAGAIN)){
+			break;
+		}
+		ret = hamming_writeback_fetch(sector, bvec->bv_len, snapshot && !is_write);
+	}while(ret == 0);
+	return ret;
+}
+
+/**
+ * \brief Zero part of a page
+ *
+ * Goes through hamming_bvec_write, so the page is verified and re-encoded
+ * like any partial write, and fetched first if it was written back. A page
+ * that doesn't exist is already zeroes.
+ *
+ * \param[in] sector		First sector to zero
+ * \param[in] end		Sector past the last one, in the same page
+ *
+ * \return Negative on errors, 1 if the whole page reads as zeroes now, 0 otherwise
+ */
+static int hamming_blkdev_zero_part(sector_t sector, sector_t end){
+	hamming_page_t *tree_page;
+	spinlock_t *lock;
+	int ret;
+
+again:
+	ret = 1;
+	hamming_tree_write_begin();
+	if(hamming_tree_page_simple(SECTOR_TO_PAGE(sector), false) != NULL){
+		ret = hamming_bvec_write(sector, page_address(ZERO_PAGE(0)), (end - sector) << SECTOR_SHIFT);
+		tree_page = hamming_tree_page_simple(SECTOR_TO_PAGE(sector), false); // a snapshot makes the write copy it
+		if(ret == 0 && tree_page != NULL){
+			lock = hamming_tree_page_lock_of(tree_page, SECTOR_TO_PAGE(sector)); // a racing dedup write may have shared it again
+			spin_lock(lock);
+			if(tree_page->flags & HAMMING_PAGE_FILLED){
+				ret = hamming_tree_page_fill_verify(tree_page) == 0;
+			}else if(tree_page->flags & (HAMMING_PAGE_COMPRESSED | HAMMING_PAGE_BACKED)){
+				ret = 0; // a pass got to it already, keep it
+			}else{
+				ret = memchr_inv(tree_page->data, 0, tree_page->len) == NULL;
+			}
+			spin_unlock(lock);
+		}
+	}
+	hamming_tree_write_end();
+	if(unlikely(ret == -EAGAIN)){
+		ret = hamming_writeback_fetch(sector, (end - sector) << SECTOR_SHIFT, false);
+		if(ret == 0){
+			goto again; // written back, fetched
+		}
 	}
-	kunmap_atomic(bv_page_ptr);
 	return ret;
 }
 
 /**
- * \brief Callback for BIO requests
+ * \brief Handle DISCARD and WRITE_ZEROES
+ *
+ * Both read back as zeroes afterwards, and a page that isn't in the tree
+ * does, so whole pages are taken out of it (hamming_tree_discard) and the
+ * memory goes back to the allocator. Parts of pages at either end are
+ * zeroed, and taken out as well if that leaves nothing but zeroes in them.
+ * WRITE_ZEROES with REQ_NOUNMAP is treated the same, there's nothing to
+ * provision here.
  *
- * Traditionally, queues are used, since real hardware has unreliable latency.
- * Since we aren't, we use the callback interface for block requests, which is
- * faster and less error prone (also used by other virt interfaces).
+ * \param[in] sector		First sector
+ * \param[in] size		Length in bytes
+ *
+ * \return -EIO on errors, -ENOMEM if shared nodes couldn't be copied, 0 otherwise
+ */
+static int hamming_blkdev_discard(sector_t sector, u32 size){
+	sector_t end = sector + (size >> SECTOR_SHIFT);
+	u64 head = SECTOR_TO_PAGE(sector), first = head, last;
+	int ret;
+
+	if(unlikely(end > hamming->capacity)){
+		return -EIO;
+	}
+	if(end == sector){
+		return 0;
+	}
+	last = SECTOR_TO_PAGE(end - 1);
+	if(SECTOR_TO_CHUNK(sector) || (head == last && SECTOR_TO_CHUNK(end))){
+		ret = hamming_blkdev_zero_part(sector, min_t(sector_t, end, PAGE_TO_SECTOR(head + 1)));
+		if(ret < 0){
+			return ret;
+		}
+		first += !ret;
+	}
+	if(SECTOR_TO_CHUNK(end) && last != head){
+		ret = hamming_blkdev_zero_part(PAGE_TO_SECTOR(last), end);
+		if(ret < 0){
+			return ret;
+		}
+		last -= !ret;
+	}
+	if(first > last){
+		return 0;
+	}
+	return hamming_tree_discard(first, last);
+}
+
+/**
+ * \brief Handle one request
  *
- * NOTE: return values here hint at what can be read next in the least amount
- * of time (IIRC), since there's no locality in access, we pass nothing
+ * DISCARD and WRITE_ZEROES go to hamming_blkdev_discard, everything else
+ * is read or written a segment at a time, over every bio merged into it.
+ * Reads of the snapshot disk don't feed the readahead, a snapshot is read
+ * back once or twice (a backup, a check) so verifying ahead of it isn't
+ * worth the work.
  *
- * \param[in] q			Request queue (currently unused)
- * \param[in] bio		BIO request chunk
+ * \param[in] rq		Request, started
+ * \param[in] snapshot		True if it's for the snapshot disk
  *
- * \return BLK_QC_T_NONE
+ * \return BLK_STS_IOERR on errors, BLK_STS_OK otherwise
  */
-static blk_qc_t hamming_make_request(struct request_queue *q, struct bio *bio){
+static blk_status_t hamming_blkdev_rq(struct request *rq, bool snapshot){
+	struct req_iterator iter;
 	struct bio_vec bvec;
-	struct bvec_iter iter;
-	int bio_ret;
+	sector_t cur_sector = blk_rq_pos(rq);
 	bool is_write;
+	int ret;
 
-	if(bio_op(bio) == REQ_OP_DISCARD ||
-	   bio_op(bio) == REQ_OP_WRITE_ZEROES){
-		// TODO: should we investigate REQ_OP_WRITE_ZEROES?
-		bio_ret = 0;
-	}else{
-		u32 cur_sector;
-		cur_sector = bio->bi_iter.bi_sector;
-
-		is_write = op_is_write(bio_op(bio));
-		bio_for_each_segment(bvec, bio, iter){
-			bio_ret = hamming_bvec_rw(&bvec, cur_sector, is_write);
-			if(unlikely(bio_ret < 0)){
-				printk(KERN_ERR "hamming_rw_page failed with %d\n", bio_ret);
-				goto out;
-			}
-			if(unlikely(bvec.bv_len % 512)){
-				printk(KERN_ERR "we currently have no way of dealing with sub-sector precision, weird\n");
-				goto out;
-			}
-			cur_sector += bvec.bv_len/512;
+	if(req_op(rq) == REQ_OP_DISCARD ||
+	   req_op(rq) == REQ_OP_WRITE_ZEROES){
+		ret = hamming_blkdev_discard(cur_sector, blk_rq_bytes(rq));
+		if(unlikely(ret < 0)){
+			printk(KERN_ERR "discard failed with %d\n", ret);
+			return BLK_STS_IOERR;
+		}
+		return BLK_STS_OK;
+	}
+	is_write = op_is_write(req_op(rq));
+	if(!is_write && !snapshot){
+		hamming_blkdev_readahead(&hamming->frontend.block_io.readahead, cur_sector, blk_rq_bytes(rq));
+	}
+	rq_for_each_segment(bvec, rq, iter){
+		ret = hamming_bvec_rw(&bvec, cur_sector, is_write, snapshot);
+		if(unlikely(ret < 0)){
+			printk(KERN_ERR "hamming_rw_page failed with %d\n", ret);
+			return BLK_STS_IOERR;
+		}
+		if(unlikely(bvec.bv_len % 512)){
+			printk(KERN_ERR "we currently have no way of dealing with sub-sector precision, weird\n");
+			return BLK_STS_IOERR;
 		}
-		//printk(KERN_ERR "bio request %d at sector %ld sector count %ld\n", is_write, bio->bi_iter.bi_sector, cur_sector - bio->bi_iter.bi_sector);
+		cur_sector += bvec.bv_len >> SECTOR_SHIFT;
 	}
-	bio_endio(bio);
-	return BLK_QC_T_NONE;
+	return BLK_STS_OK;
+}
 
-out:
-	bio_io_error(bio);
-	return BLK_QC_T_NONE;
+/**
+ * \brief Handle the requests queued on a hardware context
+ *
+ * Takes the whole batch off pending at once, so requests queued while it
+ * runs make a batch of their own, and does what only has to happen once
+ * per batch (kicking compression, counting) before handling them in order.
+ *
+ * \param[in] ctx		Hardware context, see hamming_blkdev_init_hctx
+ */
+static void hamming_blkdev_dispatch(hamming_hctx_t *ctx){
+	struct request *rq, *next;
+	LIST_HEAD(batch);
+	blk_status_t status;
+	u32 count;
+
+	spin_lock(&ctx->lock);
+	list_splice_init(&ctx->pending, &batch);
+	count = ctx->count;
+	ctx->count = 0;
+	if(count > ctx->max_batch){
+		ctx->max_batch = count;
+	}
+	spin_unlock(&ctx->lock);
+	if(count == 0){
+		return;
+	}
+	atomic64_inc(&ctx->batches);
+	atomic64_add(count, &ctx->requests);
+	hamming_compress_kick();
+	list_for_each_entry_safe(rq, next, &batch, queuelist){
+		list_del_init(&rq->queuelist);
+		status = hamming_blkdev_rq(rq, false);
+		if(unlikely(status != BLK_STS_OK)){
+			atomic64_inc(&ctx->errors);
+		}
+		blk_mq_end_request(rq, status);
+	}
 }
 
+/**
+ * \brief Callback for requests
+ *
+ * Requests come in on the hardware context of the CPU that submitted them,
+ * and the block layer marks the last one of what it dispatches together.
+ * Until then they're only queued on the context, the last one (or
+ * hamming_blkdev_commit_rqs, if dispatching stopped short of it) handles
+ * them all, see hamming_blkdev_dispatch. Handling may sleep to fetch
+ * written back pages, the tag set is BLK_MQ_F_BLOCKING.
+ *
+ * \param[in] hctx		Hardware context
+ * \param[in] bd		Request, and whether it's the last of its batch
+ *
+ * \return BLK_STS_OK, errors complete the request
+ */
+static blk_status_t hamming_blkdev_queue_rq(struct blk_mq_hw_ctx *hctx, const struct blk_mq_queue_data *bd){
+	hamming_hctx_t *ctx = hctx->driver_data;
+
+	blk_mq_start_request(bd->rq);
+	spin_lock(&ctx->lock);
+	list_add_tail(&bd->rq->queuelist, &ctx->pending);
+	ctx->count++;
+	spin_unlock(&ctx->lock);
+	if(bd->last){
+		hamming_blkdev_dispatch(ctx);
+	}
+	return BLK_STS_OK;
+}
+
+// dispatching stopped before the request marked last, handle what was queued
+static void hamming_blkdev_commit_rqs(struct blk_mq_hw_ctx *hctx){
+	hamming_blkdev_dispatch(hctx->driver_data);
+}
+
+// one hamming_hctx_t per hardware context, allocated with the tag set
+static int hamming_blkdev_init_hctx(struct blk_mq_hw_ctx *hctx, void *data, unsigned int index){
+	hamming_hctx_t *ctx = &hamming->frontend.block_io.hctx[index];
+
+	spin_lock_init(&ctx->lock);
+	INIT_LIST_HEAD(&ctx->pending);
+	hctx->driver_data = ctx;
+	return 0;
+}
+
+/**
+ * \brief Callback for requests to the snapshot disk
+ *
+ * Reads only, handled right away, nothing is worth batching for a disk
+ * that's read back once or twice.
+ *
+ * \param[in] hctx		Hardware context (currently unused)
+ * \param[in] bd		Request
+ *
+ * \return BLK_STS_OK, errors complete the request
+ */
+static blk_status_t hamming_snapshot_queue_rq(struct blk_mq_hw_ctx *hctx, const struct blk_mq_queue_data *bd){
+	blk_mq_start_request(bd->rq);
+	if(req_op(bd->rq) != REQ_OP_READ){
+		blk_mq_end_request(bd->rq, BLK_STS_IOERR);
+		return BLK_STS_OK;
+	}
+	blk_mq_end_request(bd->rq, hamming_blkdev_rq(bd->rq, true));
+	return BLK_STS_OK;
+}
+
+static const struct blk_mq_ops hamming_mq_ops = {
+	.queue_rq = hamming_blkdev_queue_rq,
+	.commit_rqs = hamming_blkdev_commit_rqs,
+	.init_hctx = hamming_blkdev_init_hctx,
+};
+
+static const struct blk_mq_ops hamming_snapshot_mq_ops = {
+	.queue_rq = hamming_snapshot_queue_rq,
+};
+
 static int hamming_major; // block device
 
+// minor of the snapshot disk of a device, after the minors of the devices themselves
+#define HAMMING_SNAPSHOT_MINOR 128
+
+static ulong capacity_mb = HAMMING_CAPACITY_MB;
+module_param(capacity_mb, ulong, 0444);
+MODULE_PARM_DESC(capacity_mb, "Size of the device in MB, only what's written takes memory");
+
+static uint queue_depth = HAMMING_QUEUE_DEPTH;
+module_param(queue_depth, uint, 0444);
+MODULE_PARM_DESC(queue_depth, "Requests in flight per hardware queue, there's one per CPU");
+
 /**
  * \brief Handle ioctl requests
  *
@@ -168,7 +648,7 @@ static int hamming_major; // block device
  * \return Negaitve on failure, 0 otherwise
  */
 
-static int hamming_blkdev_ioctl(struct block_device *bdev, fmode_t mode, unsigned int cmd, unsigned long arg){
+static int __maybe_unused hamming_blkdev_ioctl(struct block_device *bdev, fmode_t mode, unsigned int cmd, unsigned long arg){
     return 0;
 }
 
@@ -181,7 +661,7 @@ static int hamming_blkdev_ioctl(struct block_device *bdev, fmode_t mode, unsigne
  * \return Negative on failure, 0 otherwise
  */
 
-static int hamming_blkdev_open(struct block_device *bdev, fmode_t mode){
+static int __maybe_unused hamming_blkdev_open(struct block_device *bdev, fmode_t mode){
     return 0;
 }
 
@@ -194,7 +674,7 @@ static int hamming_blkdev_open(struct block_device *bdev, fmode_t mode){
  * \return Negative on failure, 0 otherwise
  */
 
-static int hamming_blkdev_release(struct gendisk *disk, fmode_t mode){
+static int __maybe_unused hamming_blkdev_release(struct gendisk *disk, fmode_t mode){
     return 0;
 }
 
@@ -209,7 +689,7 @@ static int hamming_blkdev_release(struct gendisk *disk, fmode_t mode){
  * \return Negative on failure, 0 otherwise
  */
 
-static int hamming_blkdev_validate(struct gendisk *disk){
+static int __maybe_unused hamming_blkdev_validate(struct gendisk *disk){
     return 0;
 }
 
@@ -221,11 +701,82 @@ static const struct block_device_operations hamming_devops = {
 	.owner = THIS_MODULE
 };
 
+/**
+ * \brief Fill in a tag set for one of the disks
+ *
+ * Both are BLK_MQ_F_BLOCKING, handling a request may sleep to fetch a
+ * written back page (see hamming_bvec_rw).
+ *
+ * \param[in] set		Tag set, zeroed
+ * \param[in] ops		Callbacks of the disk
+ * \param[in] nr_hw_queues	Hardware contexts
+ *
+ * \return Negative on failure, 0 otherwise
+ */
+static int hamming_blkdev_tag_set(struct blk_mq_tag_set *set, const struct blk_mq_ops *ops, unsigned int nr_hw_queues){
+	set->ops = ops;
+	set->nr_hw_queues = nr_hw_queues;
+	set->queue_depth = clamp_t(uint, queue_depth, 1, BLK_MQ_MAX_DEPTH);
+	set->numa_node = NUMA_NO_NODE;
+#if LINUX_VERSION_CODE < KERNEL_VERSION(6, 14, 0)
+	set->flags = BLK_MQ_F_SHOULD_MERGE | BLK_MQ_F_BLOCKING;
+#else
+	set->flags = BLK_MQ_F_BLOCKING; // merging is the default from 6.14 on
+#endif
+	return blk_mq_alloc_tag_set(set);
+}
+
+/**
+ * \brief Allocate one of the disks with its limits
+ *
+ * blk_mq_alloc_disk takes the limits from 6.9 on, before that they are set
+ * on the new queue. Queues are non-rotational and add no entropy, which
+ * flags had to say before 6.11 and an empty lim->features says since.
+ *
+ * \param[in] set		Tag set of the disk
+ * \param[in] lim		Limits of the disk
+ *
+ * \return The disk, or an ERR_PTR
+ */
+static struct gendisk *hamming_blkdev_alloc_disk(struct blk_mq_tag_set *set, struct queue_limits *lim){
+	struct gendisk *disk;
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 9, 0)
+	disk = blk_mq_alloc_disk(set, lim, hamming);
+#else
+	disk = blk_mq_alloc_disk(set, hamming);
+	if(IS_ERR(disk)){
+		return disk;
+	}
+	blk_queue_physical_block_size(disk->queue, lim->physical_block_size);
+	blk_queue_logical_block_size(disk->queue, lim->logical_block_size);
+	blk_queue_io_min(disk->queue, lim->io_min);
+	blk_queue_io_opt(disk->queue, lim->io_opt);
+	disk->queue->limits.discard_granularity = lim->discard_granularity;
+	blk_queue_max_discard_sectors(disk->queue, lim->max_hw_discard_sectors);
+	blk_queue_max_write_zeroes_sectors(disk->queue, lim->max_write_zeroes_sectors);
+#endif
+#if LINUX_VERSION_CODE < KERNEL_VERSION(6, 11, 0)
+	if(!IS_ERR(disk)){
+		blk_queue_flag_set(QUEUE_FLAG_NONROT, disk->queue);
+		blk_queue_flag_clear(QUEUE_FLAG_ADD_RANDOM, disk->queue);
+	}
+#endif
+	return disk;
+}
+
 /**
  * \brief Initialize the block layer and block device
  *
- * This generates one disk, /dev/hamming0, of a set size (currently 1GB),
- * as well as tunes and configures parameters for reasonable operation.
+ * This generates one disk, /dev/hamming0, of capacity_mb (1GB by default),
+ * as well as tunes and configures parameters for reasonable operation. The
+ * disk only shows up once hamming_blkdev_add is called, after the tree has
+ * what it should hold.
+ *
+ * The disk is blk-mq, with a hardware context per CPU so submitters never
+ * share one, and queue_depth requests in flight on each. Nothing here needs
+ * requests kept in order or spread over time, so there's no scheduler
+ * either, whatever the block layer dispatches together is handled together.
  *
  * We can add a few options to increase performance, but a lot of them are built
  * to optimize the binary tree model directly, and may not properly reflect real
@@ -235,55 +786,174 @@ static const struct block_device_operations hamming_devops = {
  * \return Negative value on error, 0 otherwise
  */
 static int hamming_blkdev_init(void){
+    struct queue_limits lim = {
+        // Used to sanity check size of IO requests
+        .physical_block_size = PAGE_SIZE,
+        .logical_block_size = PAGE_SIZE,
+        .io_min = PAGE_SIZE,
+        .io_opt = PAGE_SIZE,
+        // No way to specify read size, so we just have to roll with it
+        .discard_granularity = PAGE_SIZE,
+        .max_hw_discard_sectors = UINT_MAX,
+        .max_write_zeroes_sectors = UINT_MAX
+        // no features, so neither BLK_FEAT_ROTATIONAL nor BLK_FEAT_ADD_RANDOM
+    };
+    struct gendisk *disk;
+    int ret;
+
     hamming->frontend.mode = FRONT_BLOCK_IO;
+    if(capacity_mb == 0){
+        pr_err("capacity_mb can't be zero\n");
+        return -EINVAL;
+    }
+    hamming->capacity = (sector_t)capacity_mb << (20 - SECTOR_SHIFT);
     
 	hamming_major = register_blkdev(0, "hamming");
 	if (hamming_major <= 0) {
 		pr_err("Unable to get major number\n");
 		return -ENOMEM;
 	}
-	hamming->frontend.block_io.queue = blk_alloc_queue(GFP_KERNEL);
-	if (hamming->frontend.block_io.queue == NULL) {
-		pr_err("Couldn't allocate block device queue\n");
-        return -EINVAL;
+	hamming->frontend.block_io.hctx = kcalloc(nr_cpu_ids, sizeof(hamming_hctx_t), GFP_KERNEL);
+	if(hamming->frontend.block_io.hctx == NULL){
+		pr_err("Couldn't allocate hardware queues\n");
+		return -ENOMEM;
+	}
+	ret = hamming_blkdev_tag_set(&hamming->frontend.block_io.tag_set, &hamming_mq_ops, nr_cpu_ids);
+	if(ret < 0){
+		pr_err("Couldn't allocate tag set\n");
+		return ret;
+	}
+
+	spin_lock_init(&hamming->frontend.block_io.readahead.lock);
+	INIT_WORK(&hamming->frontend.block_io.readahead.work, hamming_readahead_work);
+	hamming->frontend.block_io.readahead.wq = alloc_workqueue("hamming_verify", WQ_UNBOUND | WQ_HIGHPRI | WQ_MEM_RECLAIM, 0);
+	if(hamming->frontend.block_io.readahead.wq == NULL){
+		pr_err("Couldn't allocate verification workqueue\n");
+		return -ENOMEM;
 	}
-	blk_queue_make_request(hamming->frontend.block_io.queue, hamming_make_request);
 
-	hamming->frontend.block_io.disk = alloc_disk(1);
-	if(!hamming->frontend.block_io.disk) {
+	disk = hamming_blkdev_alloc_disk(&hamming->frontend.block_io.tag_set, &lim);
+	if(IS_ERR(disk)) {
 		pr_err("Error allocating disk structure for device %d\n",
 		       device_id);
-        return -ENOMEM;
+        return PTR_ERR(disk);
 	}
+	hamming->frontend.block_io.disk = disk;
+	hamming->frontend.block_io.queue = disk->queue;
 
-	hamming->frontend.block_io.disk->major = hamming_major;
-	hamming->frontend.block_io.disk->first_minor = device_id;
-	hamming->frontend.block_io.disk->fops = &hamming_devops; // ?
-    hamming->frontend.block_io.disk->queue = hamming->frontend.block_io.queue;
-	hamming->frontend.block_io.disk->queue->queuedata = hamming;
-	hamming->frontend.block_io.disk->private_data = hamming;
-	snprintf(hamming->frontend.block_io.disk->disk_name, 16, "hamming%d", device_id);
+	disk->major = hamming_major;
+	disk->first_minor = device_id;
+	disk->minors = 1;
+	disk->fops = &hamming_devops;
+	disk->private_data = hamming;
+	snprintf(disk->disk_name, 16, "hamming%d", device_id);
 
-	set_capacity(hamming->frontend.block_io.disk, SECTOR_COUNT); // This should be set through sysfs, but that's not a thing yet, only inline now for testing
-	queue_flag_set_unlocked(QUEUE_FLAG_NONROT, hamming->frontend.block_io.disk->queue);
-	queue_flag_clear_unlocked(QUEUE_FLAG_ADD_RANDOM, hamming->frontend.block_io.disk->queue);
-	// Used to sanity check size of IO requests
-	blk_queue_physical_block_size(hamming->frontend.block_io.disk->queue, PAGE_SIZE);
-	blk_queue_logical_block_size(hamming->frontend.block_io.disk->queue, PAGE_SIZE);
+	set_capacity(disk, hamming->capacity);
+    return 0;
+}
 
-	blk_queue_io_min(hamming->frontend.block_io.disk->queue, PAGE_SIZE);
-	blk_queue_io_opt(hamming->frontend.block_io.disk->queue, PAGE_SIZE);
+/**
+ * \brief Make the disk visible, I/O can come in from here on
+ *
+ * Separate from hamming_blkdev_init so the self tests and a restore (see
+ * hamming_persist_restore) have the tree to themselves, nothing reads a half
+ * restored device.
+ *
+ * \return Negative on failure, 0 otherwise
+ */
+static int hamming_blkdev_add(void){
+	int ret;
 
-	// No way to specify read size, so we just have to roll with it
+	printk(KERN_INFO "Adding single Hamming disk\n");
+	ret = add_disk(hamming->frontend.block_io.disk);
+	if(ret < 0){
+		return ret;
+	}
+	hamming->frontend.block_io.added = true;
+	return 0;
+}
 
-    hamming->frontend.block_io.disk->queue->limits.discard_granularity = PAGE_SIZE;
-	blk_queue_max_discard_sectors(hamming->frontend.block_io.disk->queue, UINT_MAX);
-	queue_flag_set_unlocked(QUEUE_FLAG_DISCARD, hamming->frontend.block_io.disk->queue);
-	blk_queue_max_write_zeroes_sectors(hamming->frontend.block_io.disk->queue, UINT_MAX);
+/**
+ * \brief Take the snapshot disk away
+ *
+ * Once del_gendisk returns nothing is reading it anymore, so the snapshot
+ * itself can be dropped after. Caller holds hamming->lock for write.
+ */
+static void hamming_blkdev_snapshot_remove(void){
+    if(hamming->frontend.block_io.snap_disk){
+        del_gendisk(hamming->frontend.block_io.snap_disk);
+        put_disk(hamming->frontend.block_io.snap_disk);
+        hamming->frontend.block_io.snap_disk = NULL;
+        hamming->frontend.block_io.snap_queue = NULL;
+    }
+    if(hamming->frontend.block_io.snap_tag_set.tags){
+        blk_mq_free_tag_set(&hamming->frontend.block_io.snap_tag_set);
+        memset(&hamming->frontend.block_io.snap_tag_set, 0, sizeof(struct blk_mq_tag_set));
+    }
+}
 
-	printk(KERN_INFO "Adding single Hamming disk\n");
-	add_disk(hamming->frontend.block_io.disk);
-    return 0;
+/**
+ * \brief Snapshot the device, or drop the snapshot
+ *
+ * A new snapshot replaces the last one and shows up as /dev/hamming0snap,
+ * read only and as large as the device. See hamming_tree_snapshot_take.
+ * Its disk has one hardware context, see hamming_snapshot_queue_rq.
+ *
+ * \param[in] take		True to take a snapshot, false to only drop the last one
+ *
+ * \return Negative on failure (there is no snapshot then), 0 otherwise
+ */
+static int hamming_blkdev_snapshot(bool take){
+    struct queue_limits lim = {
+        .physical_block_size = PAGE_SIZE,
+        .logical_block_size = PAGE_SIZE
+    };
+    struct gendisk *disk = NULL;
+    int ret = 0;
+
+    down_write(&hamming->lock);
+    hamming_blkdev_snapshot_remove();
+    if(!take){
+        hamming_tree_snapshot_drop();
+        goto out;
+    }
+    ret = hamming_tree_snapshot_take();
+    if(ret < 0){
+        goto out;
+    }
+
+    ret = hamming_blkdev_tag_set(&hamming->frontend.block_io.snap_tag_set, &hamming_snapshot_mq_ops, 1);
+    if(ret == 0){
+        disk = hamming_blkdev_alloc_disk(&hamming->frontend.block_io.snap_tag_set, &lim);
+        ret = IS_ERR(disk) ? PTR_ERR(disk) : 0;
+    }
+    if(ret < 0){
+        pr_err("Couldn't allocate the snapshot disk\n");
+        hamming_blkdev_snapshot_remove();
+        hamming_tree_snapshot_drop();
+        goto out;
+    }
+    disk->major = hamming_major;
+    disk->first_minor = HAMMING_SNAPSHOT_MINOR + device_id;
+    disk->minors = 1;
+    disk->fops = &hamming_devops;
+    disk->private_data = hamming;
+    snprintf(disk->disk_name, 16, "hamming%dsnap", device_id);
+    set_capacity(disk, hamming->capacity);
+    set_disk_ro(disk, 1);
+    ret = add_disk(disk);
+    if(ret < 0){
+        pr_err("Couldn't add the snapshot disk\n");
+        put_disk(disk);
+        hamming_blkdev_snapshot_remove();
+        hamming_tree_snapshot_drop();
+        goto out;
+    }
+    hamming->frontend.block_io.snap_disk = disk;
+    hamming->frontend.block_io.snap_queue = disk->queue;
+out:
+    up_write(&hamming->lock);
+    return ret;
 }
 
 /**
@@ -297,15 +967,28 @@ static int hamming_blkdev_close(void){
     if(hamming->frontend.mode == FRONT_BLOCK_IO){
         unregister_blkdev(hamming_major, "hamming");
         if(hamming){
+            down_write(&hamming->lock);
+            hamming_blkdev_snapshot_remove(); // the snapshot goes with the tree
+            up_write(&hamming->lock);
             if(hamming->frontend.block_io.disk){
-                del_gendisk(hamming->frontend.block_io.disk);
-                put_disk(hamming->frontend.block_io.disk);
+                if(hamming->frontend.block_io.added){ // not if loading failed before hamming_blkdev_add
+                    del_gendisk(hamming->frontend.block_io.disk);
+                    hamming->frontend.block_io.added = false;
+                }
+                put_disk(hamming->frontend.block_io.disk); // and the queue with it
                 hamming->frontend.block_io.disk = NULL;
-            }
-            if(hamming->frontend.block_io.queue){
-                blk_cleanup_queue(hamming->frontend.block_io.queue);
                 hamming->frontend.block_io.queue = NULL;
             }
+            if(hamming->frontend.block_io.tag_set.tags){
+                blk_mq_free_tag_set(&hamming->frontend.block_io.tag_set);
+                memset(&hamming->frontend.block_io.tag_set, 0, sizeof(struct blk_mq_tag_set));
+            }
+            kfree(hamming->frontend.block_io.hctx);
+            hamming->frontend.block_io.hctx = NULL;
+            if(hamming->frontend.block_io.readahead.wq){
+                destroy_workqueue(hamming->frontend.block_io.readahead.wq); // drains pending work
+                hamming->frontend.block_io.readahead.wq = NULL;
+            }
         }
     }else pr_err("init/close mismatch with blkdev (?)\n");
     return 0;
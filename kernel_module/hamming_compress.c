@@ -0,0 +1,326 @@
+#include "hamming_compress.h"
+
+#include <linux/moduleparam.h>
+
+/**
+ * \file hamming_compress.c
+ * \brief Compression of cold pages, see hamming_compress.h
+ */
+
+static uint compress_interval;
+module_param(compress_interval, uint, 0644);
+MODULE_PARM_DESC(compress_interval, "Milliseconds between passes compressing cold pages, 0 turns them off");
+
+static uint compress_age = 4;
+module_param(compress_age, uint, 0644);
+MODULE_PARM_DESC(compress_age, "Passes a page has to go untouched before it is compressed");
+
+// never worth trying, or done already
+#define HAMMING_COMPRESS_SKIP (HAMMING_PAGE_UNINIT | HAMMING_PAGE_FILLED | HAMMING_PAGE_DEDUP | \
+			       HAMMING_PAGE_COMPRESSED | HAMMING_PAGE_INCOMPRESSIBLE | HAMMING_PAGE_BACKED)
+
+static hamming_compress_t hamming_compress;
+
+static void hamming_compress_touch(hamming_page_t *page_ptr){
+	u32 tick = READ_ONCE(hamming_compress.tick);
+
+	if(unlikely(READ_ONCE(page_ptr->atime) != tick)){
+		WRITE_ONCE(page_ptr->atime, tick);
+	}
+}
+
+/**
+ * \brief Free data a page no longer points at, after a grace period
+ *
+ * \param[in] data		Data page or compressed data
+ * \param[in] len		PAGE_SIZE for a data page, the compressed length otherwise
+ * \param[in] flags		Flags of the page while it had it
+ * \param[in] nid		Node it was allocated on
+ */
+static void hamming_compress_defer(void *data, u32 len, u32 flags, int nid){
+	hamming_compress_free_t *entry = data;
+
+	entry->len = len;
+	entry->flags = flags;
+	entry->nid = nid;
+	spin_lock(&hamming_compress.reclaim_lock);
+	entry->next = hamming_compress.reclaim;
+	hamming_compress.reclaim = entry;
+	spin_unlock(&hamming_compress.reclaim_lock);
+}
+
+/**
+ * \brief Free what passes and expansions swapped out, once no reader can be copying it
+ *
+ * \param[in] work		hamming_compress.reclaim_work
+ */
+static void hamming_compress_reclaim(struct work_struct *work){
+	hamming_compress_free_t *entry, *next;
+	u32 len, flags;
+	int nid;
+
+	spin_lock(&hamming_compress.reclaim_lock);
+	entry = hamming_compress.reclaim;
+	hamming_compress.reclaim = NULL;
+	spin_unlock(&hamming_compress.reclaim_lock);
+	if(entry == NULL){
+		return;
+	}
+	synchronize_rcu();
+	for(;entry;entry = next){
+		next = entry->next;
+		len = entry->len;
+		flags = entry->flags;
+		nid = entry->nid;
+		if(len == PAGE_SIZE){
+			hamming_free_page_data((u8*)entry, flags, nid);
+		}else{
+			hamming_free_compressed((u8*)entry, len);
+		}
+	}
+}
+
+/**
+ * \brief Compress a page
+ *
+ * Verified first, the codes are recomputed over the compressed bytes, so an
+ * error that got in before would be kept for good. Caller holds the page
+ * lock and is the pass, which owns the compressor's buffers.
+ *
+ * \param[in] page_ptr		Page with data, not flagged with any of HAMMING_COMPRESS_SKIP
+ * \param[in] tree_id		Id it was found at, for error reports
+ */
+static void hamming_compress_page(hamming_page_t *page_ptr, u64 tree_id){
+	u32 flags = page_ptr->flags;
+	u8 *old = page_ptr->data, *data;
+	int len;
+
+	if(unlikely(hamming_tree_page_verify(page_ptr) < 0)){
+		atomic64_inc(&hamming_compress_stats.failed);
+		hamming_sysfs_reg_error(tree_id);
+		return;
+	}
+	len = LZ4_compress_default((const char*)old, (char*)hamming_compress.dst, PAGE_SIZE,
+				   HAMMING_COMPRESSED_MAX, hamming_compress.wrkmem);
+	if(len <= 0){
+		page_ptr->flags |= HAMMING_PAGE_INCOMPRESSIBLE;
+		atomic64_inc(&hamming_compress_stats.incompressible);
+		return;
+	}
+	data = hamming_alloc_compressed(GFP_NOWAIT | __GFP_NOWARN, page_ptr->nid, len);
+	if(unlikely(data == NULL)){
+		return; // the next pass tries again
+	}
+	memcpy(data, hamming_compress.dst, len);
+	memset(data + len, 0, round_up(len, 16) - len);
+
+	write_seqcount_begin(&page_ptr->seq);
+	WRITE_ONCE(page_ptr->data, data);
+	page_ptr->len = len;
+	HAMMING_PAGE_LOGIC(page_ptr);
+	page_ptr->last_check = ktime_get();
+	page_ptr->flags = (flags & ~(HAMMING_PAGE_ARENA | HAMMING_PAGE_READAHEAD)) | HAMMING_PAGE_COMPRESSED;
+	write_seqcount_end(&page_ptr->seq);
+
+	atomic64_inc(&hamming_alloc_stats.compressed);
+	atomic64_inc(&hamming_compress_stats.compressed);
+	hamming_compress_defer(old, PAGE_SIZE, flags, page_ptr->nid);
+}
+
+/**
+ * \brief Compress the cold pages under a leaf parent
+ *
+ * Flags and age are checked without the lock first, most pages are either
+ * hot or done already. Caller is in an RCU read side section.
+ *
+ * \param[in] leaf		Leaf parent
+ * \param[in] id		Id of its first page
+ */
+static void hamming_compress_leaf(hamming_node_t *leaf, u64 id){
+	u32 tick = hamming_compress.tick, age = READ_ONCE(compress_age);
+	hamming_page_t *page_ptr;
+	spinlock_t *lock;
+	int i;
+
+	for(i = 0;i < HAMMING_TREE_FANOUT;i++){
+		page_ptr = rcu_dereference(leaf->child[i]);
+		if(page_ptr == NULL || (READ_ONCE(page_ptr->flags) & HAMMING_COMPRESS_SKIP) ||
+		   tick - READ_ONCE(page_ptr->atime) < age){
+			continue;
+		}
+		lock = hamming_tree_page_lock(id + i);
+		spin_lock(lock);
+		if(!(page_ptr->flags & HAMMING_COMPRESS_SKIP)){
+			hamming_compress_page(page_ptr, id + i);
+		}
+		spin_unlock(lock);
+	}
+}
+
+/**
+ * \brief Run a pass
+ *
+ * Ages every page by a tick and compresses what went untouched for
+ * compress_age of them. Holds hamming->lock for read like the scrub, so the
+ * tree stays put, then writes back what went untouched even longer (see
+ * hamming_writeback_pass) and frees the data it swapped out.
+ *
+ * \param[in] work		hamming_compress.work
+ */
+static void hamming_compress_work(struct work_struct *work){
+	down_read(&hamming->lock);
+	WRITE_ONCE(hamming_compress.tick, hamming_compress.tick + 1);
+	hamming_tree_for_each_leaf(hamming_compress_leaf);
+	up_read(&hamming->lock);
+	atomic64_inc(&hamming_compress_stats.passes);
+	hamming_writeback_pass();
+	hamming_compress_reclaim(&hamming_compress.reclaim_work);
+}
+
+static void hamming_compress_kick(void){
+	uint interval = READ_ONCE(compress_interval);
+	u64 now, next;
+
+	if(interval == 0){
+		return;
+	}
+	now = ktime_get();
+	next = READ_ONCE(hamming_compress.next);
+	if(now < next || cmpxchg(&hamming_compress.next, next, now + interval*NSEC_PER_MSEC) != next){
+		return; // not due, or another CPU is queueing it
+	}
+	queue_work(hamming_compress.wq, &hamming_compress.work);
+}
+
+static void hamming_compress_run(void){
+	queue_work(hamming_compress.wq, &hamming_compress.work);
+	flush_workqueue(hamming_compress.wq);
+}
+
+/**
+ * \brief Copy part of a compressed page out
+ *
+ * Verifies unless the last verification is trusted, like any read, then
+ * decompresses. A whole page goes straight into buf, anything less through
+ * this CPU's page, the page lock keeps us on it.
+ *
+ * \param[in] page_ptr		Page flagged HAMMING_PAGE_COMPRESSED
+ * \param[in] chunk		First sector to copy
+ * \param[out] buf		Where to copy to
+ * \param[in] len		Bytes to copy, no further than the end of the page
+ *
+ * \return Negative if uncorrectable, number of errors corrected otherwise
+ */
+static int hamming_compress_read(hamming_page_t *page_ptr, u8 chunk, u8 *buf, u32 len){
+	u8 *dst = buf;
+	int ret = hamming_tree_page_correct(page_ptr);
+
+	if(unlikely(ret < 0)){
+		return ret;
+	}
+	if(len != PAGE_SIZE){
+		dst = hamming_compress.bufs + (size_t)smp_processor_id()*PAGE_SIZE;
+	}
+	if(unlikely(LZ4_decompress_safe((const char*)page_ptr->data, (char*)dst, page_ptr->len, PAGE_SIZE) != PAGE_SIZE)){
+		atomic64_inc(&hamming_compress_stats.failed);
+		return -EIO;
+	}
+	if(dst != buf){
+		memcpy(buf, dst + chunk*SECTOR_SIZE, len);
+	}
+	atomic64_inc(&hamming_compress_stats.reads);
+	return ret;
+}
+
+/**
+ * \brief Give a compressed page a data page again
+ *
+ * For writes. A write that covers the whole page leaves it flagged
+ * HAMMING_PAGE_UNINIT instead of decompressing what it's about to
+ * overwrite. Runs in the I/O path, allocates with GFP_ATOMIC.
+ *
+ * \param[in] page_ptr		Page flagged HAMMING_PAGE_COMPRESSED
+ * \param[in] keep		True to verify and decompress the contents
+ *
+ * \return -ENOMEM on failure, -EIO if uncorrectable, number of errors corrected otherwise
+ */
+static int hamming_compress_expand(hamming_page_t *page_ptr, bool keep){
+	u8 *old = page_ptr->data, *data;
+	u32 len = page_ptr->len, flags = 0;
+	int ret = 0;
+
+	if(keep){
+		ret = hamming_tree_page_correct(page_ptr);
+		if(unlikely(ret < 0)){
+			return -EIO;
+		}
+	}
+	data = hamming_alloc_page_data(GFP_ATOMIC, page_ptr, &flags);
+	if(unlikely(data == NULL)){
+		printk(KERN_ERR "can't allocate data to expand a compressed page\n");
+		return -ENOMEM;
+	}
+	if(keep && unlikely(LZ4_decompress_safe((const char*)old, (char*)data, len, PAGE_SIZE) != PAGE_SIZE)){
+		hamming_free_page_data(data, flags, page_ptr->nid);
+		atomic64_inc(&hamming_alloc_stats.compressed); // still is
+		atomic64_inc(&hamming_compress_stats.failed);
+		return -EIO;
+	}
+
+	write_seqcount_begin(&page_ptr->seq);
+	WRITE_ONCE(page_ptr->data, data);
+	page_ptr->len = PAGE_SIZE;
+	if(keep){
+		HAMMING_PAGE_LOGIC(page_ptr);
+		page_ptr->last_check = ktime_get();
+	}else{
+		flags |= HAMMING_PAGE_UNINIT;
+	}
+	page_ptr->flags = (page_ptr->flags & ~(HAMMING_PAGE_COMPRESSED | HAMMING_PAGE_READAHEAD)) | flags;
+	write_seqcount_end(&page_ptr->seq);
+
+	atomic64_inc(&hamming_compress_stats.expanded);
+	hamming_compress_defer(old, len, 0, page_ptr->nid);
+	queue_work(hamming_compress.wq, &hamming_compress.reclaim_work);
+	return ret;
+}
+
+/**
+ * \brief Set up the worker and the buffers
+ *
+ * Set up whether compress_interval is set or not, it can be set later, and
+ * a write to the compress attribute runs a pass either way.
+ *
+ * \return -ENOMEM on failure, 0 otherwise
+ */
+static int hamming_compress_init(void){
+	spin_lock_init(&hamming_compress.reclaim_lock);
+	INIT_WORK(&hamming_compress.work, hamming_compress_work);
+	INIT_WORK(&hamming_compress.reclaim_work, hamming_compress_reclaim);
+	hamming_compress.wq = alloc_workqueue("hamming_compress", WQ_UNBOUND | WQ_MEM_RECLAIM, 1);
+	hamming_compress.dst = kmalloc(HAMMING_COMPRESSED_MAX, GFP_KERNEL);
+	hamming_compress.wrkmem = kmalloc(LZ4_MEM_COMPRESS, GFP_KERNEL);
+	hamming_compress.bufs = kvmalloc_array(nr_cpu_ids, PAGE_SIZE, GFP_KERNEL);
+	if(hamming_compress.wq == NULL || hamming_compress.dst == NULL ||
+	   hamming_compress.wrkmem == NULL || hamming_compress.bufs == NULL){
+		hamming_compress_close();
+		return -ENOMEM;
+	}
+	return 0;
+}
+
+// I/O is over, waits out a pass and frees what it left waiting, compressed pages themselves go with the tree
+static void hamming_compress_close(void){
+	if(hamming_compress.wq){
+		flush_workqueue(hamming_compress.wq);
+		destroy_workqueue(hamming_compress.wq);
+		hamming_compress.wq = NULL;
+		hamming_compress_reclaim(&hamming_compress.reclaim_work);
+	}
+	kfree(hamming_compress.dst);
+	hamming_compress.dst = NULL;
+	kfree(hamming_compress.wrkmem);
+	hamming_compress.wrkmem = NULL;
+	kvfree(hamming_compress.bufs);
+	hamming_compress.bufs = NULL;
+}
@@ -0,0 +1,95 @@
+#ifndef _HAMMING_COMPRESS_H_
+#define _HAMMING_COMPRESS_H_
+
+#include "hamming.h"
+#include "hamming_tree.h"
+#include "hamming_alloc.h"
+
+#include <linux/atomic.h>
+#include <linux/lz4.h>
+#include <linux/spinlock.h>
+#include <linux/workqueue.h>
+
+/**
+ * \file hamming_compress.h
+ * \brief Compressed tier for pages nobody touched in a while
+ *
+ * With compress_interval set, a pass over the tree runs at most that often,
+ * started by I/O, and compresses every page that wasn't read or written for
+ * compress_age passes with LZ4. The data page goes back to the allocator and
+ * the page keeps the compressed bytes in a buffer of the next size class.
+ * Pages still being used are never touched and read as they always did.
+ */
+
+/*
+  Age is counted in passes, every pass bumps hamming_compress.tick and I/O
+  stamps the pages it touches with it (hamming_page_t.atime). Stamping only
+  writes when the tick moved, so a hot page costs a read of its descriptor.
+
+  A compressed page is flagged HAMMING_PAGE_COMPRESSED, data points at the
+  compressed bytes zero padded to a whole row and len is their length, so
+  the codes cover the compressed bytes and verifying, correcting and
+  scrubbing work on it like on any page. Reads verify under the page lock
+  and decompress straight into the reader's buffer, a partial read through
+  a per CPU page. Writes expand the page again first (hamming_compress_expand),
+  they have to change it anyway, a whole page write doesn't even decompress.
+
+  Swapping data for compressed bytes or back happens under the page lock
+  and inside the seqcount, but lockless readers may still be copying the
+  old data, so it's freed a grace period later by the reclaim work. Same
+  filled and shared pages are never compressed, and pages that don't fit in
+  HAMMING_COMPRESSED_MAX are flagged HAMMING_PAGE_INCOMPRESSIBLE until they
+  are written again.
+ */
+
+// written over data waiting for a grace period
+typedef struct hamming_compress_free{
+	struct hamming_compress_free *next;
+	u32 len; // PAGE_SIZE for a data page, the compressed length otherwise
+	u32 flags; // of the page while it had the data, for HAMMING_PAGE_ARENA
+	int nid;
+} hamming_compress_free_t;
+
+typedef struct{
+	u32 tick; // passes so far, see hamming_page_t.atime
+	u64 next; // ktime the next pass is due, see hamming_compress_kick
+	struct work_struct work; // runs a pass
+	struct work_struct reclaim_work;
+	struct workqueue_struct *wq; // one pass at a time
+	spinlock_t reclaim_lock;
+	hamming_compress_free_t *reclaim; // freed after a grace period
+	u8 *dst; // compressor output, only the pass uses it
+	void *wrkmem; // and its hash table
+	u8 *bufs; // a page per CPU for partial reads
+} hamming_compress_t;
+
+typedef struct{
+	atomic64_t passes;
+	atomic64_t compressed; // pages compressed by passes, hamming_alloc_stats has how many are now
+	atomic64_t expanded; // compressed pages given their data back by writes
+	atomic64_t incompressible; // pages that didn't fit in HAMMING_COMPRESSED_MAX
+	atomic64_t reads; // reads decompressed
+	atomic64_t failed; // pages that couldn't be verified or decompressed
+} hamming_compress_stats_t;
+
+static hamming_compress_stats_t hamming_compress_stats;
+
+static int hamming_compress_init(void);
+static void hamming_compress_close(void);
+
+// stamps a page with the current tick, caller is reading or writing it
+static void hamming_compress_touch(hamming_page_t *page_ptr);
+
+// queues a pass if compress_interval has passed since the last one, called by I/O
+static void hamming_compress_kick(void);
+
+// runs a pass to completion, from process context
+static void hamming_compress_run(void);
+
+// copies part of a compressed page out, caller holds the page lock, negative if uncorrectable
+static int hamming_compress_read(hamming_page_t *page_ptr, u8 chunk, u8 *buf, u32 len);
+
+// gives a compressed page a data page again, decompressed into unless the caller overwrites it whole, caller holds the page lock
+static int hamming_compress_expand(hamming_page_t *page_ptr, bool keep);
+
+#endif
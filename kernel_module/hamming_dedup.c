@@ -0,0 +1,309 @@
+#include "hamming_dedup.h"
+
+#include <linux/moduleparam.h>
+#include <linux/log2.h>
+
+/**
+ * \file hamming_dedup.c
+ * \brief Index of shared pages, see hamming_dedup.h
+ */
+
+static bool dedup;
+module_param(dedup, bool, 0644);
+MODULE_PARM_DESC(dedup, "Share pages written with the same contents, can be flipped at runtime");
+
+static hamming_dedup_t hamming_dedup;
+static struct kmem_cache *hamming_dedup_cache;
+
+static bool hamming_dedup_enabled(void){
+	return READ_ONCE(dedup);
+}
+
+/**
+ * \brief Hash a page
+ *
+ * Four independent lanes of multiply and rotate over the words, so the
+ * multiplies overlap, folded together at the end. Matches are compared in
+ * full, this only has to spread pages over the buckets and keep the
+ * comparisons down.
+ *
+ * \param[in] data		Page, word aligned
+ *
+ * \return Hash of the page
+ */
+static u64 hamming_dedup_hash(const u8 *data){
+	const u64 *word = (const u64*)data;
+	u64 lane[4] = {0x9E3779B97F4A7C15ULL, 0xC2B2AE3D27D4EB4FULL, 0x165667B19E3779F9ULL, 0x27D4EB2F165667C5ULL};
+	uint i, j;
+
+	for(i = 0;i < PAGE_SIZE/sizeof(u64);i += 4){
+		for(j = 0;j < 4;j++){
+			lane[j] = rol64((lane[j] ^ word[i + j])*0x9E3779B97F4A7C15ULL, 31);
+		}
+	}
+	return hash_64(lane[0] ^ rol64(lane[1], 16) ^ rol64(lane[2], 32) ^ rol64(lane[3], 48), 64);
+}
+
+static spinlock_t *hamming_dedup_bucket_lock(u64 bucket){
+	return &hamming_dedup.bucket_locks[bucket % HAMMING_DEDUP_LOCKS];
+}
+
+static spinlock_t *hamming_dedup_page_lock(hamming_page_t *page_ptr){
+	return &hamming_dedup.page_locks[hash_64((unsigned long)page_ptr, ilog2(HAMMING_DEDUP_LOCKS))];
+}
+
+static hamming_dedup_entry_t *hamming_dedup_entry(hamming_page_t *page_ptr){
+	return container_of(page_ptr->code, hamming_dedup_entry_t, code);
+}
+
+/**
+ * \brief Find a page with the same contents in a bucket, and take a reference to it
+ *
+ * Pages whose last reference is going are skipped. Caller holds the bucket lock.
+ *
+ * \param[in] bucket		Bucket of hash
+ * \param[in] hash		Hash of data
+ * \param[in] data		Contents to look for
+ *
+ * \return Entry of the page, NULL if there is none
+ */
+static hamming_dedup_entry_t *hamming_dedup_find(u64 bucket, u64 hash, const u8 *data){
+	hamming_dedup_entry_t *entry;
+	u64 probes = 0;
+
+	for(entry = hamming_dedup.buckets[bucket];entry;entry = entry->next){
+		probes++;
+		if(entry->hash == hash && memcmp(entry->page->data, data, PAGE_SIZE) == 0 &&
+		   atomic_inc_not_zero(&entry->refs)){
+			break;
+		}
+	}
+	atomic64_add(probes, &hamming_dedup_stats.probes);
+	return entry;
+}
+
+/**
+ * \brief Set up a shared page holding data
+ *
+ * \param[in] data		Contents
+ * \param[in] hash		Hash of data
+ * \param[in] tree_id		Page it's written to
+ * \param[in] nid		Node of the shard of tree_id
+ *
+ * \return Entry with one reference, not in the index yet, NULL on failure
+ */
+static hamming_dedup_entry_t *hamming_dedup_alloc(const u8 *data, u64 hash, u64 tree_id, int nid){
+	hamming_dedup_entry_t *entry = kmem_cache_alloc_node(hamming_dedup_cache, GFP_ATOMIC, nid);
+	hamming_page_t *page_ptr;
+
+	if(unlikely(entry == NULL)){
+		atomic64_inc(&hamming_alloc_stats.failed);
+		return NULL;
+	}
+	page_ptr = hamming_alloc_page(GFP_ATOMIC, hamming_alloc_page_nid(nid));
+	if(unlikely(page_ptr == NULL)){
+		kmem_cache_free(hamming_dedup_cache, entry);
+		return NULL;
+	}
+	memcpy(page_ptr->data, data, PAGE_SIZE);
+	page_ptr->code = &entry->code;
+	page_ptr->flags = (page_ptr->flags & ~HAMMING_PAGE_UNINIT) | HAMMING_PAGE_DEDUP;
+	HAMMING_PAGE_LOGIC(page_ptr);
+	page_ptr->last_check = ktime_get();
+	entry->page = page_ptr;
+	entry->hash = hash;
+	entry->id = tree_id;
+	atomic_set(&entry->refs, 1);
+	entry->next = NULL;
+	return entry;
+}
+
+static void hamming_dedup_free(hamming_dedup_entry_t *entry){
+	hamming_free_page(entry->page);
+	kmem_cache_free(hamming_dedup_cache, entry);
+	atomic64_inc(&hamming_dedup_stats.freed);
+}
+
+/**
+ * \brief Get a shared page holding data
+ *
+ * The page is set up outside the bucket lock, and thrown away if a racing
+ * writer put the same contents in first.
+ *
+ * \param[in] data		Contents of a full page write
+ * \param[in] tree_id		Page it's written to
+ * \param[in] nid		Node of the shard of tree_id
+ *
+ * \return Shared page with a reference for the caller, NULL on failure
+ */
+static hamming_page_t *hamming_dedup_get(const u8 *data, u64 tree_id, int nid){
+	ktime_t start = ktime_get();
+	u64 hash = hamming_dedup_hash(data), bucket = hash >> (64 - hamming_dedup.bits);
+	spinlock_t *lock = hamming_dedup_bucket_lock(bucket);
+	hamming_dedup_entry_t *entry, *new_entry;
+
+	spin_lock(lock);
+	entry = hamming_dedup_find(bucket, hash, data);
+	spin_unlock(lock);
+	atomic64_inc(&hamming_dedup_stats.lookups);
+	atomic64_add(ktime_get() - start, &hamming_dedup_stats.lookup_ns);
+	if(entry == NULL){
+		new_entry = hamming_dedup_alloc(data, hash, tree_id, nid);
+		if(unlikely(new_entry == NULL)){
+			printk(KERN_ERR "can't allocate a shared page\n");
+			return NULL;
+		}
+		spin_lock(lock);
+		entry = hamming_dedup_find(bucket, hash, data);
+		if(entry == NULL){
+			new_entry->next = hamming_dedup.buckets[bucket];
+			hamming_dedup.buckets[bucket] = new_entry;
+		}
+		spin_unlock(lock);
+		if(entry == NULL){
+			atomic64_inc(&hamming_dedup_stats.pages);
+			atomic64_inc(&hamming_dedup_stats.refs);
+			return new_entry->page;
+		}
+		hamming_free_page(new_entry->page); // a racing writer put it in first
+		kmem_cache_free(hamming_dedup_cache, new_entry);
+	}
+	atomic64_inc(&hamming_dedup_stats.hits);
+	atomic64_inc(&hamming_dedup_stats.refs);
+	return entry->page;
+}
+
+static void hamming_dedup_hold(hamming_page_t *page_ptr){
+	atomic_inc(&hamming_dedup_entry(page_ptr)->refs);
+	atomic64_inc(&hamming_dedup_stats.refs);
+}
+
+static void hamming_dedup_put(hamming_page_t *page_ptr){
+	hamming_dedup_entry_t *entry = hamming_dedup_entry(page_ptr), **prev;
+	u64 bucket = entry->hash >> (64 - hamming_dedup.bits);
+	spinlock_t *lock = hamming_dedup_bucket_lock(bucket);
+
+	atomic64_dec(&hamming_dedup_stats.refs);
+	if(!atomic_dec_and_test(&entry->refs)){
+		return;
+	}
+	spin_lock(lock);
+	for(prev = &hamming_dedup.buckets[bucket];*prev != entry;prev = &(*prev)->next);
+	*prev = entry->next;
+	spin_unlock(lock);
+	atomic64_dec(&hamming_dedup_stats.pages);
+
+	spin_lock(&hamming_dedup.reclaim_lock);
+	entry->next = hamming_dedup.reclaim;
+	hamming_dedup.reclaim = entry;
+	spin_unlock(&hamming_dedup.reclaim_lock);
+	queue_work(hamming_dedup.wq, &hamming_dedup.reclaim_work);
+}
+
+/**
+ * \brief Free shared pages the last reference was dropped to, once no reader can be copying them
+ *
+ * \param[in] work		hamming_dedup.reclaim_work
+ */
+static void hamming_dedup_reclaim(struct work_struct *work){
+	hamming_dedup_entry_t *entry, *next;
+
+	spin_lock(&hamming_dedup.reclaim_lock);
+	entry = hamming_dedup.reclaim;
+	hamming_dedup.reclaim = NULL;
+	spin_unlock(&hamming_dedup.reclaim_lock);
+	if(entry == NULL){
+		return;
+	}
+	synchronize_rcu();
+	for(;entry;entry = next){
+		next = entry->next;
+		hamming_dedup_free(entry);
+	}
+}
+
+/**
+ * \brief Verify every shared page once
+ *
+ * Bucket by bucket, the bucket lock keeps the pages in it from being freed
+ * while they are verified. Counted in hamming_scrub_stats like any page.
+ */
+static void hamming_dedup_scrub(void){
+	hamming_dedup_entry_t *entry;
+	spinlock_t *page_lock;
+	u64 bucket;
+	int ret;
+
+	for(bucket = 0;bucket < (1ULL << hamming_dedup.bits);bucket++){
+		if(READ_ONCE(hamming_dedup.buckets[bucket]) == NULL){
+			continue;
+		}
+		spin_lock(hamming_dedup_bucket_lock(bucket));
+		for(entry = hamming_dedup.buckets[bucket];entry;entry = entry->next){
+			page_lock = hamming_dedup_page_lock(entry->page);
+			spin_lock(page_lock);
+			ret = hamming_tree_page_verify(entry->page);
+			spin_unlock(page_lock);
+			atomic64_inc(&hamming_scrub_stats.pages);
+			if(unlikely(ret < 0)){
+				atomic64_inc(&hamming_scrub_stats.failed);
+				hamming_sysfs_reg_error(entry->id);
+			}else if(ret > 0){
+				atomic64_inc(&hamming_scrub_stats.corrected);
+			}
+		}
+		spin_unlock(hamming_dedup_bucket_lock(bucket));
+		if(bucket % HAMMING_TREE_FANOUT == 0){
+			cond_resched();
+		}
+	}
+}
+
+/**
+ * \brief Set up the index
+ *
+ * HAMMING_DEDUP_BUCKET_PAGES pages of capacity per bucket, up to
+ * 2^HAMMING_DEDUP_MAX_BITS buckets. Allocated whether dedup is set or not,
+ * it can be set later.
+ *
+ * \return -ENOMEM on failure, 0 otherwise
+ */
+static int hamming_dedup_init(void){
+	u64 pages = SECTOR_TO_PAGE(hamming->capacity)/HAMMING_DEDUP_BUCKET_PAGES;
+	int i;
+
+	hamming_dedup.bits = clamp_t(int, pages ? ilog2(pages) : 0, ilog2(HAMMING_DEDUP_LOCKS), HAMMING_DEDUP_MAX_BITS);
+	hamming_dedup.buckets = kvmalloc_array(1ULL << hamming_dedup.bits, sizeof(hamming_dedup_entry_t*),
+					       GFP_KERNEL | __GFP_ZERO);
+	if(hamming_dedup.buckets == NULL){
+		return -ENOMEM;
+	}
+	for(i = 0;i < HAMMING_DEDUP_LOCKS;i++){
+		spin_lock_init(&hamming_dedup.bucket_locks[i]);
+		spin_lock_init(&hamming_dedup.page_locks[i]);
+	}
+	spin_lock_init(&hamming_dedup.reclaim_lock);
+	INIT_WORK(&hamming_dedup.reclaim_work, hamming_dedup_reclaim);
+	hamming_dedup.wq = alloc_workqueue("hamming_dedup", WQ_UNBOUND | WQ_MEM_RECLAIM, 1);
+	hamming_dedup_cache = kmem_cache_create("hamming_dedup_entry", sizeof(hamming_dedup_entry_t), 0, 0, NULL);
+	if(hamming_dedup.wq == NULL || hamming_dedup_cache == NULL){
+		hamming_dedup_close();
+		return -ENOMEM;
+	}
+	return 0;
+}
+
+// the tree is freed first, so every reference is gone and the last pages are waiting for the reclaim work
+static void hamming_dedup_close(void){
+	if(hamming_dedup.wq){
+		flush_workqueue(hamming_dedup.wq);
+		destroy_workqueue(hamming_dedup.wq);
+		hamming_dedup.wq = NULL;
+	}
+	if(hamming_dedup_cache){
+		kmem_cache_destroy(hamming_dedup_cache);
+		hamming_dedup_cache = NULL;
+	}
+	kvfree(hamming_dedup.buckets);
+	hamming_dedup.buckets = NULL;
+}
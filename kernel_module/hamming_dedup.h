@@ -0,0 +1,98 @@
+#ifndef _HAMMING_DEDUP_H_
+#define _HAMMING_DEDUP_H_
+
+#include "hamming.h"
+#include "hamming_tree.h"
+
+#include <linux/atomic.h>
+#include <linux/hash.h>
+#include <linux/spinlock.h>
+#include <linux/workqueue.h>
+
+/**
+ * \file hamming_dedup.h
+ * \brief Deduplication of full page writes by content
+ *
+ * With the dedup parameter set, a full page write into a slot with no data
+ * of its own (no page yet, a shared page, or one a snapshot holds) is hashed
+ * and looked up in an index of shared pages. If a page with the same
+ * contents is there the slot points at it, otherwise the write becomes a new
+ * shared page. Pages that have data of their own are written in place.
+ */
+
+/*
+  A shared page is a page flagged HAMMING_PAGE_DEDUP with its code set in
+  its index entry, page->code points into the entry. Data and codes never
+  change but for corrections, under a stripe lock of the index hashed by the
+  page (hamming_dedup_page_lock), since the page is reachable through any
+  number of ids. A write that doesn't cover a whole shared page copies it
+  into a page of its own first, see hamming_tree_cow_page.
+
+  Every leaf parent slot pointing at a shared page holds a reference to it,
+  copies of leaf parents (copy on write, snapshot roots) take one per shared
+  page they point at and freeing a leaf parent drops them. The page leaves
+  the index when the last one goes, and is freed a grace period later by
+  the reclaim work, lockless readers may still be copying it out.
+
+  The scrub verifies every shared page once, from the index, instead of once
+  per slot.
+ */
+#define HAMMING_DEDUP_LOCKS 256
+#define HAMMING_DEDUP_BUCKET_PAGES 2 // pages of capacity per bucket
+#define HAMMING_DEDUP_MAX_BITS 20
+
+typedef struct hamming_dedup_entry{
+	hamming_code_set_t code; // of the page, page->code points here
+	hamming_page_t *page; // flagged HAMMING_PAGE_DEDUP
+	u64 hash; // of the data, see hamming_dedup_hash
+	u64 id; // page it was first written to, for error reports
+	atomic_t refs; // leaf parent slots pointing at the page
+	struct hamming_dedup_entry *next; // in its bucket, then on the reclaim list
+} hamming_dedup_entry_t;
+
+typedef struct{
+	hamming_dedup_entry_t **buckets;
+	int bits; // log2 of the bucket count
+	spinlock_t bucket_locks[HAMMING_DEDUP_LOCKS];
+	spinlock_t page_locks[HAMMING_DEDUP_LOCKS];
+	spinlock_t reclaim_lock;
+	hamming_dedup_entry_t *reclaim; // out of the index, freed after a grace period
+	struct work_struct reclaim_work;
+	struct workqueue_struct *wq;
+} hamming_dedup_t;
+
+typedef struct{
+	atomic64_t lookups; // full page writes hashed and looked up
+	atomic64_t hits; // found a page with the same contents
+	atomic64_t probes; // index entries walked by lookups
+	atomic64_t lookup_ns; // spent hashing and walking the index
+	atomic64_t pages; // shared pages in the index
+	atomic64_t refs; // slots pointing at them
+	atomic64_t broken; // copied out by writes that didn't cover them
+	atomic64_t freed;
+} hamming_dedup_stats_t;
+
+static hamming_dedup_stats_t hamming_dedup_stats;
+
+static int hamming_dedup_init(void);
+static void hamming_dedup_close(void);
+
+// true if full page writes are deduplicated, see the dedup parameter
+static bool hamming_dedup_enabled(void);
+
+// shared page with the contents of data, with a reference for the caller, NULL on failure
+static hamming_page_t *hamming_dedup_get(const u8 *data, u64 tree_id, int nid);
+
+// another reference to a shared page, for a copy of a leaf parent pointing at it
+static void hamming_dedup_hold(hamming_page_t *page_ptr);
+
+// drops a reference, the last one takes the page out of the index and frees it after a grace period
+static void hamming_dedup_put(hamming_page_t *page_ptr);
+
+// lock held around verifying or correcting a shared page
+static spinlock_t *hamming_dedup_page_lock(hamming_page_t *page_ptr);
+
+// verifies every shared page once, caller holds hamming->lock for read
+static void hamming_dedup_scrub(void);
+
+#endif
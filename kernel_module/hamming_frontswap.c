@@ -73,7 +73,9 @@ static struct frontswap_ops hamming_frontswap_ops = {
 static int hamming_frontswap_init(void){
     hamming->frontend.mode = FRONT_FRONTSWAP;
     frontswap_register_ops(&hamming_frontswap_ops);
+#if LINUX_VERSION_CODE < KERNEL_VERSION(5, 17, 0) // gone with the 5.17 cleanup, pages are never written through now
     frontswap_writethrough(false);
+#endif
     return 0;
 }
 
@@ -0,0 +1,487 @@
+#include "hamming_persist.h"
+
+#include <linux/moduleparam.h>
+
+/**
+ * \file hamming_persist.c
+ * \brief Dump and restore of the device, see hamming_persist.h
+ */
+
+static char *persist_path;
+module_param(persist_path, charp, 0444);
+MODULE_PARM_DESC(persist_path, "File the device is dumped to on unload and restored from on load, none by default");
+
+static hamming_persist_t hamming_persist;
+
+// keeps the first error, restores report from any number of workers
+static void hamming_persist_fail(int err){
+	cmpxchg(&hamming_persist.error, 0, err);
+}
+
+// bytes of a record after its hamming_persist_record_t
+static u32 hamming_persist_record_size(u32 flags, u32 len){
+	if(flags & HAMMING_PAGE_FILLED){
+		return 2*sizeof(u64); // the fill, padded to a row
+	}
+	return sizeof(hamming_code_set_t) + round_up(len, sizeof(hamming_row_t));
+}
+
+/**
+ * \brief Write the chunk being filled out
+ *
+ * Padded to HAMMING_PERSIST_CHUNK, so every chunk is at a known offset. The
+ * caller isn't in an RCU read side section.
+ */
+static void hamming_persist_flush(void){
+	hamming_persist_chunk_header_t *header = (hamming_persist_chunk_header_t*)hamming_persist.buf;
+	loff_t pos = PAGE_SIZE + hamming_persist.chunks*HAMMING_PERSIST_CHUNK;
+
+	memset(header, 0, sizeof(*header));
+	header->magic = HAMMING_PERSIST_CHUNK_MAGIC;
+	header->count = hamming_persist.count;
+	header->len = hamming_persist.used - sizeof(*header);
+	header->index = hamming_persist.chunks;
+	header->crc = crc32c(~0, header, sizeof(*header));
+	memset(hamming_persist.buf + hamming_persist.used, 0, HAMMING_PERSIST_CHUNK - hamming_persist.used);
+	if(unlikely(kernel_write(hamming_persist.file, hamming_persist.buf, HAMMING_PERSIST_CHUNK, &pos) !=
+		    HAMMING_PERSIST_CHUNK)){
+		printk(KERN_ERR "can't write chunk %llu of the dump\n", (unsigned long long)hamming_persist.chunks);
+		hamming_persist_fail(-EIO);
+	}
+	hamming_persist.chunks++;
+	hamming_persist.used = sizeof(*header);
+	hamming_persist.count = 0;
+}
+
+/**
+ * \brief Add a page to the chunk being filled
+ *
+ * Copied as it is under the page lock. A written back page is read from the
+ * backing store after, with nothing held, nothing frees it while the dump
+ * holds hamming->lock and no I/O comes in. Caller is in an RCU read side
+ * section, left around writes and reads.
+ *
+ * \param[in] page_ptr		Page with contents, not HAMMING_PAGE_UNINIT
+ * \param[in] tree_id		Id it was found at
+ */
+static void hamming_persist_dump_page(hamming_page_t *page_ptr, u64 tree_id){
+	spinlock_t *lock = hamming_tree_page_lock_of(page_ptr, tree_id);
+	hamming_persist_record_t *record;
+	bool backed = false;
+	u64 slot = 0;
+	loff_t pos;
+	u8 *payload;
+	u32 size;
+
+	if(HAMMING_PERSIST_CHUNK - hamming_persist.used < HAMMING_PERSIST_RECORD_MAX){
+		rcu_read_unlock();
+		hamming_persist_flush();
+		rcu_read_lock();
+	}
+	record = (hamming_persist_record_t*)(hamming_persist.buf + hamming_persist.used);
+	payload = (u8*)(record + 1);
+	memset(record, 0, sizeof(*record));
+	record->id = tree_id;
+
+	spin_lock(lock);
+	record->flags = page_ptr->flags & (HAMMING_PAGE_FILLED | HAMMING_PAGE_COMPRESSED | HAMMING_PAGE_DEDUP);
+	if(page_ptr->flags & HAMMING_PAGE_FILLED){
+		record->len = 0;
+		((u64*)payload)[0] = hamming_tree_page_fill_verify(page_ptr);
+		((u64*)payload)[1] = 0;
+	}else{
+		record->len = page_ptr->len;
+		memcpy(payload, page_ptr->code, sizeof(hamming_code_set_t));
+		if(page_ptr->flags & HAMMING_PAGE_BACKED){
+			backed = true;
+			slot = page_ptr->fill[0];
+		}else{
+			memcpy(payload + sizeof(hamming_code_set_t), page_ptr->data, round_up(page_ptr->len, sizeof(hamming_row_t)));
+		}
+	}
+	spin_unlock(lock);
+
+	if(backed){
+		rcu_read_unlock();
+		pos = slot*PAGE_SIZE;
+		if(unlikely(kernel_read(hamming_writeback.file, payload + sizeof(hamming_code_set_t), PAGE_SIZE, &pos) != PAGE_SIZE)){
+			printk(KERN_ERR "can't read page %llu from the backing store\n", (unsigned long long)tree_id);
+			hamming_persist_fail(-EIO);
+		}
+		rcu_read_lock();
+	}
+	size = sizeof(*record) + hamming_persist_record_size(record->flags, record->len);
+	record->crc = crc32c(~0, record, size);
+	hamming_persist.used += size;
+	hamming_persist.count++;
+	hamming_persist.pages++;
+}
+
+static void hamming_persist_dump_leaf(hamming_node_t *leaf, u64 id){
+	hamming_page_t *page_ptr;
+	int i;
+
+	for(i = 0;i < HAMMING_TREE_FANOUT;i++){
+		page_ptr = rcu_dereference(leaf->child[i]);
+		if(page_ptr != NULL && !(READ_ONCE(page_ptr->flags) & HAMMING_PAGE_UNINIT)){ // reads as zeroes, like no page
+			hamming_persist_dump_page(page_ptr, id + i);
+		}
+	}
+}
+
+/**
+ * \brief Dump the device to persist_path
+ *
+ * The chunks go out first, synced, then the header, so a dump that didn't
+ * finish is never taken for one that did. The snapshot isn't dumped.
+ *
+ * \return 0 without persist_path or on success, -errno otherwise
+ */
+static int hamming_persist_dump(void){
+	hamming_persist_header_t *header;
+	ktime_t start = ktime_get();
+	loff_t pos = 0;
+	int ret;
+
+	if(persist_path == NULL || persist_path[0] == '\0'){
+		return 0;
+	}
+	hamming_persist.file = filp_open(persist_path, O_WRONLY | O_CREAT | O_TRUNC | O_LARGEFILE, 0600);
+	if(IS_ERR(hamming_persist.file)){
+		ret = PTR_ERR(hamming_persist.file);
+		hamming_persist.file = NULL;
+		printk(KERN_ERR "can't open %s to dump to (%d)\n", persist_path, ret);
+		return ret;
+	}
+	hamming_persist.buf = kvmalloc(HAMMING_PERSIST_CHUNK, GFP_KERNEL);
+	if(hamming_persist.buf == NULL){
+		ret = -ENOMEM;
+		goto out;
+	}
+	hamming_persist.used = sizeof(hamming_persist_chunk_header_t);
+	hamming_persist.count = 0;
+	hamming_persist.chunks = 0;
+	hamming_persist.pages = 0;
+	hamming_persist.error = 0;
+
+	down_write(&hamming->lock);
+	hamming_tree_for_each_leaf(hamming_persist_dump_leaf);
+	if(hamming_persist.count){
+		hamming_persist_flush();
+	}
+	up_write(&hamming->lock);
+	if(hamming_persist.error == 0){
+		hamming_persist.error = vfs_fsync(hamming_persist.file, 0);
+	}
+	ret = hamming_persist.error;
+	if(ret < 0){
+		printk(KERN_ERR "dump to %s failed (%d), it won't restore\n", persist_path, ret);
+		goto out;
+	}
+
+	header = (hamming_persist_header_t*)hamming_persist.buf;
+	memset(header, 0, PAGE_SIZE);
+	header->magic = HAMMING_PERSIST_MAGIC;
+	header->version = HAMMING_PERSIST_VERSION;
+	header->page_size = PAGE_SIZE;
+	header->code_size = sizeof(hamming_code_set_t);
+	header->chunk_size = HAMMING_PERSIST_CHUNK;
+	header->capacity = hamming->capacity;
+	header->chunks = hamming_persist.chunks;
+	header->pages = hamming_persist.pages;
+	header->crc = crc32c(~0, header, sizeof(*header));
+	if(kernel_write(hamming_persist.file, header, PAGE_SIZE, &pos) != PAGE_SIZE ||
+	   vfs_fsync(hamming_persist.file, 0) < 0){
+		printk(KERN_ERR "can't write the header of the dump to %s, it won't restore\n", persist_path);
+		ret = -EIO;
+		goto out;
+	}
+	atomic64_add(hamming_persist.pages, &hamming_persist_stats.dumped);
+	printk(KERN_INFO "dumped %llu pages to %s in %llu ms\n", (unsigned long long)hamming_persist.pages,
+	       persist_path, (unsigned long long)((ktime_get() - start)/NSEC_PER_MSEC));
+out:
+	kvfree(hamming_persist.buf);
+	hamming_persist.buf = NULL;
+	filp_close(hamming_persist.file, NULL);
+	hamming_persist.file = NULL;
+	return ret;
+}
+
+/**
+ * \brief Put a record back into the tree
+ *
+ * The data is verified against its codes in the chunk first, so what goes
+ * into the tree is right whatever happened to it since it was dumped, and
+ * a record that failed its checksum has to match it once corrected.
+ * Caller is restoring into an empty tree nothing else uses, so the data
+ * page a compressed page is created with is freed right away.
+ *
+ * \param[in] record		Record, its fields checked against the chunk
+ * \param[in] size		Bytes that follow it
+ *
+ * \return -ENOMEM, -EIO or -EEXIST on failure, 0 otherwise
+ */
+static int hamming_persist_restore_page(hamming_persist_record_t *record, u32 size){
+	u8 *payload = (u8*)(record + 1);
+	hamming_code_set_t *code = (hamming_code_set_t*)payload;
+	u8 *data = payload + sizeof(hamming_code_set_t), *old, *compressed;
+	hamming_page_t check, *page_ptr;
+	spinlock_t *lock;
+	u32 flags, len = record->len, crc = record->crc;
+	bool intact;
+	int ret;
+
+	record->crc = 0;
+	intact = crc32c(~0, record, sizeof(*record) + size) == crc;
+	if(record->flags & HAMMING_PAGE_FILLED){
+		if(unlikely(!intact)){
+			return -EIO; // nothing to correct it with
+		}
+		hamming_tree_write_begin();
+		ret = hamming_tree_page_fill(record->id, *(u64*)payload);
+		hamming_tree_write_end();
+		return ret == 0 ? 0 : ret < 0 ? ret : -EEXIST;
+	}
+
+	memset(&check, 0, sizeof(check));
+	check.data = data;
+	check.code = code;
+	check.len = len;
+	seqcount_init(&check.seq);
+	ret = hamming_tree_page_verify(&check);
+	if(unlikely(ret < 0)){
+		printk(KERN_ERR "uncorrectable page %llu in the dump\n", (unsigned long long)record->id);
+		hamming_sysfs_reg_error(record->id);
+		return -EIO;
+	}
+	if(unlikely(!intact) && (ret == 0 || crc32c(~0, record, sizeof(*record) + size) != crc)){
+		return -EIO; // not in the data, or more than the codes can put right
+	}
+	if(ret > 0){
+		atomic64_inc(&hamming_persist_stats.corrected);
+	}
+
+	hamming_tree_write_begin();
+	if(record->flags & HAMMING_PAGE_DEDUP){
+		ret = hamming_tree_page_dedup(record->id, data);
+		hamming_tree_write_end();
+		return ret == 0 ? 0 : ret < 0 ? ret : -EEXIST;
+	}
+	page_ptr = hamming_tree_page_simple(record->id, true);
+	if(unlikely(page_ptr == NULL)){
+		hamming_tree_write_end();
+		return -ENOMEM;
+	}
+	ret = 0;
+	lock = hamming_tree_page_lock(record->id);
+	spin_lock(lock);
+	flags = page_ptr->flags;
+	if(unlikely(!(flags & HAMMING_PAGE_UNINIT))){
+		ret = -EEXIST; // the same id twice
+	}else if(record->flags & HAMMING_PAGE_COMPRESSED){
+		compressed = hamming_alloc_compressed(GFP_ATOMIC, page_ptr->nid, len);
+		if(unlikely(compressed == NULL)){
+			ret = -ENOMEM;
+		}else{
+			memcpy(compressed, data, round_up(len, sizeof(hamming_row_t)));
+			old = page_ptr->data;
+			write_seqcount_begin(&page_ptr->seq);
+			WRITE_ONCE(page_ptr->data, compressed);
+			page_ptr->len = len;
+			memcpy(page_ptr->code, code, sizeof(hamming_code_set_t));
+			page_ptr->last_check = ktime_get();
+			page_ptr->flags = (flags & ~(HAMMING_PAGE_ARENA | HAMMING_PAGE_UNINIT)) | HAMMING_PAGE_COMPRESSED;
+			write_seqcount_end(&page_ptr->seq);
+			atomic64_inc(&hamming_alloc_stats.compressed);
+			hamming_free_page_data(old, flags, page_ptr->nid);
+		}
+	}else{
+		write_seqcount_begin(&page_ptr->seq);
+		memcpy(page_ptr->data, data, PAGE_SIZE);
+		memcpy(page_ptr->code, code, sizeof(hamming_code_set_t));
+		page_ptr->last_check = ktime_get();
+		page_ptr->flags &= ~HAMMING_PAGE_UNINIT;
+		write_seqcount_end(&page_ptr->seq);
+	}
+	spin_unlock(lock);
+	hamming_tree_write_end();
+	return ret;
+}
+
+/**
+ * \brief Check a chunk and restore its records
+ *
+ * Runs in parallel with other chunks, they never have the same pages.
+ *
+ * \param[in] work		Work item embedded in hamming_persist_chunk_t
+ */
+static void hamming_persist_restore_work(struct work_struct *work){
+	hamming_persist_chunk_t *chunk = container_of(work, hamming_persist_chunk_t, work);
+	hamming_persist_chunk_header_t *header = (hamming_persist_chunk_header_t*)chunk->buf;
+	u64 pages = SECTOR_TO_PAGE(hamming->capacity);
+	hamming_persist_record_t *record;
+	u8 *pos = (u8*)(header + 1), *end;
+	u32 i, size, crc = header->crc;
+	int ret;
+
+	header->crc = 0;
+	if(crc32c(~0, header, sizeof(*header)) != crc || header->magic != HAMMING_PERSIST_CHUNK_MAGIC ||
+	   header->index != chunk->index || header->len > HAMMING_PERSIST_CHUNK - sizeof(*header)){
+		goto corrupt;
+	}
+	end = pos + header->len;
+	for(i = 0;i < header->count;i++){
+		record = (hamming_persist_record_t*)pos;
+		if((size_t)(end - pos) < sizeof(*record) || record->id >= pages ||
+		   (!(record->flags & HAMMING_PAGE_FILLED) &&
+		    (record->len == 0 || record->len > ((record->flags & HAMMING_PAGE_COMPRESSED) ? HAMMING_COMPRESSED_MAX : PAGE_SIZE) ||
+		     (!(record->flags & HAMMING_PAGE_COMPRESSED) && record->len != PAGE_SIZE)))){
+			goto corrupt;
+		}
+		size = hamming_persist_record_size(record->flags, record->len);
+		if((size_t)(end - pos) - sizeof(*record) < size){
+			goto corrupt;
+		}
+		ret = hamming_persist_restore_page(record, size);
+		if(unlikely(ret < 0)){
+			printk(KERN_ERR "can't restore page %llu (%d)\n", (unsigned long long)record->id, ret);
+			atomic64_inc(&hamming_persist_stats.failed);
+			hamming_persist_fail(ret);
+			return;
+		}
+		atomic64_inc(&hamming_persist_stats.restored);
+		pos += sizeof(*record) + size;
+		cond_resched();
+	}
+	atomic64_inc(&hamming_persist_stats.chunks);
+	return;
+
+corrupt:
+	printk(KERN_ERR "chunk %llu of the dump is corrupt\n", (unsigned long long)chunk->index);
+	atomic64_inc(&hamming_persist_stats.failed);
+	hamming_persist_fail(-EIO);
+}
+
+// header read from the start of the dump, -EINVAL if this module can't restore it
+static int hamming_persist_check_header(hamming_persist_header_t *header, loff_t size){
+	u32 crc = header->crc;
+
+	header->crc = 0;
+	if(header->magic != HAMMING_PERSIST_MAGIC || crc32c(~0, header, sizeof(*header)) != crc){
+		printk(KERN_ERR "%s isn't a complete dump\n", persist_path);
+		return -EINVAL;
+	}
+	if(header->version != HAMMING_PERSIST_VERSION || header->page_size != PAGE_SIZE ||
+	   header->code_size != sizeof(hamming_code_set_t) || header->chunk_size != HAMMING_PERSIST_CHUNK){
+		printk(KERN_ERR "%s was dumped by an incompatible module\n", persist_path);
+		return -EINVAL;
+	}
+	if(header->capacity > hamming->capacity){
+		printk(KERN_ERR "%s needs capacity_mb of at least %llu\n", persist_path,
+		       (unsigned long long)(header->capacity >> (20 - SECTOR_SHIFT)));
+		return -EINVAL;
+	}
+	if(size < (loff_t)PAGE_SIZE + (loff_t)header->chunks*HAMMING_PERSIST_CHUNK){
+		printk(KERN_ERR "%s is truncated\n", persist_path);
+		return -EINVAL;
+	}
+	return 0;
+}
+
+/**
+ * \brief Restore the device from persist_path
+ *
+ * Chunks are read in order, HAMMING_PERSIST_INFLIGHT ahead of the ones the
+ * workqueue is checking and restoring. A missing file is a device that
+ * starts empty. On failure the tree holds part of the dump, the dump itself
+ * is left alone.
+ *
+ * \return 0 without persist_path, without a dump or on success, -errno otherwise
+ */
+static int hamming_persist_restore(void){
+	hamming_persist_header_t header;
+	hamming_persist_chunk_t *chunk;
+	ktime_t start = ktime_get();
+	s64 restored = atomic64_read(&hamming_persist_stats.restored);
+	loff_t pos = 0, size;
+	u64 i;
+	int ret;
+
+	if(persist_path == NULL || persist_path[0] == '\0'){
+		return 0;
+	}
+	hamming_persist.file = filp_open(persist_path, O_RDONLY | O_LARGEFILE, 0);
+	if(IS_ERR(hamming_persist.file)){
+		ret = PTR_ERR(hamming_persist.file);
+		hamming_persist.file = NULL;
+		if(ret == -ENOENT){
+			printk(KERN_INFO "no dump at %s, starting empty\n", persist_path);
+			return 0;
+		}
+		printk(KERN_ERR "can't open %s to restore from (%d)\n", persist_path, ret);
+		return ret;
+	}
+	hamming_persist.error = 0;
+	size = vfs_llseek(hamming_persist.file, 0, SEEK_END);
+	if(kernel_read(hamming_persist.file, &header, sizeof(header), &pos) != sizeof(header)){
+		printk(KERN_ERR "%s isn't a complete dump\n", persist_path);
+		ret = -EINVAL;
+		goto out;
+	}
+	ret = hamming_persist_check_header(&header, size);
+	if(ret < 0){
+		goto out;
+	}
+
+	hamming_persist.wq = alloc_workqueue("hamming_persist", WQ_UNBOUND, 0);
+	if(hamming_persist.wq == NULL){
+		ret = -ENOMEM;
+		goto out;
+	}
+	for(i = 0;i < HAMMING_PERSIST_INFLIGHT;i++){
+		INIT_WORK(&hamming_persist.chunk[i].work, hamming_persist_restore_work);
+		hamming_persist.chunk[i].buf = kvmalloc(HAMMING_PERSIST_CHUNK, GFP_KERNEL);
+		if(hamming_persist.chunk[i].buf == NULL){
+			ret = -ENOMEM;
+			goto out;
+		}
+	}
+	for(i = 0;i < header.chunks && READ_ONCE(hamming_persist.error) == 0;i++){
+		chunk = &hamming_persist.chunk[i % HAMMING_PERSIST_INFLIGHT];
+		flush_work(&chunk->work);
+		pos = PAGE_SIZE + i*HAMMING_PERSIST_CHUNK;
+		if(kernel_read(hamming_persist.file, chunk->buf, HAMMING_PERSIST_CHUNK, &pos) != HAMMING_PERSIST_CHUNK){
+			printk(KERN_ERR "can't read chunk %llu of the dump\n", (unsigned long long)i);
+			hamming_persist_fail(-EIO);
+			break;
+		}
+		chunk->index = i;
+		queue_work(hamming_persist.wq, &chunk->work);
+	}
+	flush_workqueue(hamming_persist.wq);
+	ret = hamming_persist.error;
+	if(ret == 0 && atomic64_read(&hamming_persist_stats.restored) - restored != (s64)header.pages){
+		printk(KERN_ERR "%s has %llu pages, the chunks had %lld\n", persist_path, (unsigned long long)header.pages,
+		       (long long)(atomic64_read(&hamming_persist_stats.restored) - restored));
+		ret = -EIO;
+	}
+	atomic64_set(&hamming_persist_stats.restore_ns, ktime_get() - start);
+	if(ret < 0){
+		printk(KERN_ERR "restoring from %s failed (%d)\n", persist_path, ret);
+	}else{
+		printk(KERN_INFO "restored %llu pages from %s in %llu ms\n", (unsigned long long)header.pages,
+		       persist_path, (unsigned long long)((ktime_get() - start)/NSEC_PER_MSEC));
+	}
+out:
+	if(hamming_persist.wq){
+		destroy_workqueue(hamming_persist.wq);
+		hamming_persist.wq = NULL;
+	}
+	for(i = 0;i < HAMMING_PERSIST_INFLIGHT;i++){
+		kvfree(hamming_persist.chunk[i].buf);
+		hamming_persist.chunk[i].buf = NULL;
+	}
+	filp_close(hamming_persist.file, NULL);
+	hamming_persist.file = NULL;
+	return ret;
+}
@@ -0,0 +1,128 @@
+#ifndef _HAMMING_PERSIST_H_
+#define _HAMMING_PERSIST_H_
+
+#include "hamming.h"
+#include "hamming_tree.h"
+#include "hamming_alloc.h"
+#include "hamming_dedup.h"
+#include "hamming_compress.h"
+#include "hamming_writeback.h"
+
+#include <linux/atomic.h>
+#include <linux/crc32c.h>
+#include <linux/fs.h>
+#include <linux/workqueue.h>
+
+/**
+ * \file hamming_persist.h
+ * \brief Contents of the device kept across module reloads
+ *
+ * With persist_path set, unloading dumps every page and its code set to
+ * that file, and loading restores them before the disk shows up. The dump
+ * is a header and HAMMING_PERSIST_CHUNK byte chunks, each written and read
+ * in one go, every page in them checksummed with CRC32C. Restoring reads
+ * chunks in order while the ones read already are checked and put into the
+ * tree in parallel on an unbound workqueue.
+ */
+
+/*
+  Pages go out the way they are in memory, codes and all: same filled ones
+  as their fill, compressed ones as their compressed bytes, shared ones
+  marked so they're shared again. Written back pages are read from the
+  backing store and come back as pages in RAM, its slots only mean
+  anything to the module that wrote them. Nothing is verified on the way
+  out, the codes travel with the data and restoring verifies every page
+  against its own before it goes into the tree, so a bit flipped in memory
+  before the dump or on disk after it is corrected like any other.
+
+  Every record has a checksum over itself and what follows, which catches
+  what the codes don't cover (ids, flags, lengths, the codes themselves).
+  A record that fails it is only taken if the codes correct its data and
+  the checksum matches after. Anything else, a chunk header that fails its
+  own checksum or a page the codes can't correct, fails the load without
+  touching the dump. A dump interrupted before its header went out last
+  has no valid header and fails the load the same way, delete it to start
+  empty.
+
+  Chunks are a fixed size on disk, the records in one are padded out to it,
+  so chunk i is at a known offset and every read is a whole chunk. A record
+  is a hamming_persist_record_t and then, 16 byte aligned, the fill for a
+  same filled page or the code set and the data rounded up to a row.
+ */
+#define HAMMING_PERSIST_MAGIC 0x504d55444d4d4148ULL // "HAMMDUMP"
+#define HAMMING_PERSIST_VERSION 1
+#define HAMMING_PERSIST_CHUNK (1 << 20)
+#define HAMMING_PERSIST_CHUNK_MAGIC 0x4b4e4843 // "CHNK"
+#define HAMMING_PERSIST_INFLIGHT 8 // chunks read ahead of the ones being restored
+
+// first PAGE_SIZE bytes of the dump, written last
+typedef struct{
+	u64 magic;
+	u32 version;
+	u32 page_size;
+	u32 code_size; // sizeof(hamming_code_set_t), the codes have to be the same shape
+	u32 chunk_size;
+	u64 capacity; // sectors, a smaller device can't take the dump
+	u64 chunks;
+	u64 pages;
+	u32 crc; // of the header with this zeroed
+	u32 reserved;
+} hamming_persist_header_t;
+
+typedef struct{
+	u32 magic;
+	u32 count; // records
+	u32 len; // bytes of records after the header
+	u32 crc; // of the header with this zeroed
+	u64 index; // chunk number, a chunk in the wrong place fails like a bad one
+	u64 reserved;
+} hamming_persist_chunk_header_t;
+
+typedef struct{
+	u64 id;
+	u32 flags; // HAMMING_PAGE_FILLED, HAMMING_PAGE_COMPRESSED and HAMMING_PAGE_DEDUP of the page
+	u32 len; // of its data, PAGE_SIZE or the compressed length, 0 for a same filled page
+	u32 crc; // of the record with this zeroed and what follows it
+	u32 reserved[3]; // keeps what follows a row aligned
+} hamming_persist_record_t;
+
+// largest record, a whole page with its code set
+#define HAMMING_PERSIST_RECORD_MAX (sizeof(hamming_persist_record_t) + sizeof(hamming_code_set_t) + PAGE_SIZE)
+
+// a chunk being read and restored
+typedef struct{
+	struct work_struct work;
+	u8 *buf; // HAMMING_PERSIST_CHUNK bytes
+	u64 index;
+} hamming_persist_chunk_t;
+
+typedef struct{
+	struct file *file;
+	u8 *buf; // chunk being filled by a dump
+	u32 used; // bytes of it
+	u32 count; // records in it
+	u64 chunks; // written
+	u64 pages;
+	int error; // first error of a dump or a restore
+	struct workqueue_struct *wq; // restores only
+	hamming_persist_chunk_t chunk[HAMMING_PERSIST_INFLIGHT];
+} hamming_persist_t;
+
+typedef struct{
+	atomic64_t dumped; // pages
+	atomic64_t restored; // pages
+	atomic64_t chunks; // restored
+	atomic64_t corrected; // restored pages the codes put right
+	atomic64_t failed; // chunks and pages that failed their checksum, couldn't be corrected or restored
+	atomic64_t restore_ns; // time the last restore took
+} hamming_persist_stats_t;
+
+static hamming_persist_stats_t hamming_persist_stats;
+
+// writes the tree out to persist_path if set, nothing may be doing I/O, takes hamming->lock for write
+static int hamming_persist_dump(void);
+
+// reads persist_path back into an empty tree if it exists, before the disk is added, -errno if it can't be trusted
+static int hamming_persist_restore(void);
+
+#endif
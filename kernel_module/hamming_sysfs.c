@@ -65,8 +65,7 @@ static ssize_t hamming_sysfs_error_show(struct kobject *kobj, struct kobj_attrib
  * \param[in] buf		Buffer to parse
  * \param[in] count		Length of buffer to parse
  */
-static ssize_t hamming_sysfs_disk_mgmt(struct kobject *kobj, struct kobj_attribute *attr, char *buf, size_t count){
-    int i;
+static ssize_t hamming_sysfs_disk_mgmt(struct kobject *kobj, struct kobj_attribute *attr, const char *buf, size_t count){
     int backend, frontend;
     char back_attr[512], front_attr[512];
 
@@ -83,16 +82,764 @@ static ssize_t hamming_sysfs_disk_mgmt(struct kobject *kobj, struct kobj_attribu
     }
 
     // TODO: actually spin up a new Hamming device
+    return -EOPNOTSUPP;
+}
+
+/**
+ * \brief Report traversal cursor hits
+ *
+ * Lookups that started from the per-CPU cursor instead of the tree head
+ *
+ * \param[in] kobj		Kobject
+ * \param[in] attr		Kobject attribute
+ * \param[out] buf		Buffer to print to
+ *
+ * \return Length written
+ */
+static ssize_t hamming_sysfs_cursor_hits_show(struct kobject *kobj, struct kobj_attribute *attr, char *buf){
+    u64 hits, misses;
+    hamming_tree_cursor_stats(&hits, &misses);
+    return sprintf(buf, "%llu\n", (unsigned long long)hits);
+}
+
+/**
+ * \brief Report traversal cursor misses
+ *
+ * \param[in] kobj		Kobject
+ * \param[in] attr		Kobject attribute
+ * \param[out] buf		Buffer to print to
+ *
+ * \return Length written
+ */
+static ssize_t hamming_sysfs_cursor_misses_show(struct kobject *kobj, struct kobj_attribute *attr, char *buf){
+    u64 hits, misses;
+    hamming_tree_cursor_stats(&hits, &misses);
+    return sprintf(buf, "%llu\n", (unsigned long long)misses);
+}
+
+/**
+ * \brief Report pages verified ahead of sequential readers
+ *
+ * \param[in] kobj		Kobject
+ * \param[in] attr		Kobject attribute
+ * \param[out] buf		Buffer to print to
+ *
+ * \return Length written
+ */
+static ssize_t hamming_sysfs_readahead_verified_show(struct kobject *kobj, struct kobj_attribute *attr, char *buf){
+    return sprintf(buf, "%lld\n", (long long)atomic64_read(&hamming->frontend.block_io.readahead.verified));
+}
+
+/**
+ * \brief Report reads served without verifying because readahead already did
+ *
+ * \param[in] kobj		Kobject
+ * \param[in] attr		Kobject attribute
+ * \param[out] buf		Buffer to print to
+ *
+ * \return Length written
+ */
+static ssize_t hamming_sysfs_readahead_hits_show(struct kobject *kobj, struct kobj_attribute *attr, char *buf){
+    return sprintf(buf, "%lld\n", (long long)atomic64_read(&hamming->frontend.block_io.readahead.hits));
+}
+
+/**
+ * \brief Report tree allocations, see hamming_alloc_stats_t
+ *
+ * Allocated nodes, pages and code tables, pages zeroed because they weren't fully written
+ * first, failed allocations, allocations the reserve couldn't cover, arena
+ * chunks and data pages that had to do without one, pages left in the
+ * reserve, and same filled pages kept without data, one per attribute
+ *
+ * \param[in] kobj		Kobject
+ * \param[in] attr		Kobject attribute
+ * \param[out] buf		Buffer to print to
+ *
+ * \return Length written
+ */
+static ssize_t hamming_sysfs_alloc_nodes_show(struct kobject *kobj, struct kobj_attribute *attr, char *buf){
+    return sprintf(buf, "%lld\n", (long long)atomic64_read(&hamming_alloc_stats.nodes));
+}
+
+static ssize_t hamming_sysfs_alloc_pages_show(struct kobject *kobj, struct kobj_attribute *attr, char *buf){
+    return sprintf(buf, "%lld\n", (long long)atomic64_read(&hamming_alloc_stats.pages));
+}
+
+static ssize_t hamming_sysfs_alloc_codes_show(struct kobject *kobj, struct kobj_attribute *attr, char *buf){
+    return sprintf(buf, "%lld\n", (long long)atomic64_read(&hamming_alloc_stats.codes));
+}
+
+static ssize_t hamming_sysfs_alloc_zeroed_show(struct kobject *kobj, struct kobj_attribute *attr, char *buf){
+    return sprintf(buf, "%lld\n", (long long)atomic64_read(&hamming_alloc_stats.zeroed));
+}
+
+static ssize_t hamming_sysfs_alloc_failed_show(struct kobject *kobj, struct kobj_attribute *attr, char *buf){
+    return sprintf(buf, "%lld\n", (long long)atomic64_read(&hamming_alloc_stats.failed));
+}
+
+static ssize_t hamming_sysfs_alloc_fallback_show(struct kobject *kobj, struct kobj_attribute *attr, char *buf){
+    return sprintf(buf, "%lld\n", (long long)atomic64_read(&hamming_alloc_stats.fallback));
+}
+
+static ssize_t hamming_sysfs_alloc_arena_chunks_show(struct kobject *kobj, struct kobj_attribute *attr, char *buf){
+    return sprintf(buf, "%lld\n", (long long)atomic64_read(&hamming_alloc_stats.arena_chunks));
+}
+
+static ssize_t hamming_sysfs_alloc_arena_fallback_show(struct kobject *kobj, struct kobj_attribute *attr, char *buf){
+    return sprintf(buf, "%lld\n", (long long)atomic64_read(&hamming_alloc_stats.arena_fallback));
+}
+
+static ssize_t hamming_sysfs_alloc_reserve_show(struct kobject *kobj, struct kobj_attribute *attr, char *buf){
+    return sprintf(buf, "%llu\n", (unsigned long long)hamming_alloc_reserved());
+}
+
+static ssize_t hamming_sysfs_alloc_filled_show(struct kobject *kobj, struct kobj_attribute *attr, char *buf){
+    return sprintf(buf, "%lld\n", (long long)atomic64_read(&hamming_alloc_stats.filled));
+}
+
+/**
+ * \brief Scrub every page now
+ *
+ * Any write runs hamming_tree_scrub to completion before returning
+ *
+ * \param[in] kobj		Kobject
+ * \param[in] attr		Kobject attribute
+ * \param[in] buf		Buffer to parse, ignored
+ * \param[in] count		Length of buffer to parse
+ *
+ * \return count
+ */
+static ssize_t hamming_sysfs_scrub(struct kobject *kobj, struct kobj_attribute *attr, const char *buf, size_t count){
+    hamming_tree_scrub();
+    return count;
+}
+
+/**
+ * \brief Report scrubs, see hamming_scrub_stats_t
+ *
+ * Completed scrubs, pages they verified, pages they corrected and pages they
+ * couldn't correct (also logged in error_cycle), one per attribute
+ *
+ * \param[in] kobj		Kobject
+ * \param[in] attr		Kobject attribute
+ * \param[out] buf		Buffer to print to
+ *
+ * \return Length written
+ */
+static ssize_t hamming_sysfs_scrub_runs_show(struct kobject *kobj, struct kobj_attribute *attr, char *buf){
+    return sprintf(buf, "%lld\n", (long long)atomic64_read(&hamming_scrub_stats.runs));
+}
+
+static ssize_t hamming_sysfs_scrub_pages_show(struct kobject *kobj, struct kobj_attribute *attr, char *buf){
+    return sprintf(buf, "%lld\n", (long long)atomic64_read(&hamming_scrub_stats.pages));
+}
+
+static ssize_t hamming_sysfs_scrub_corrected_show(struct kobject *kobj, struct kobj_attribute *attr, char *buf){
+    return sprintf(buf, "%lld\n", (long long)atomic64_read(&hamming_scrub_stats.corrected));
+}
+
+static ssize_t hamming_sysfs_scrub_failed_show(struct kobject *kobj, struct kobj_attribute *attr, char *buf){
+    return sprintf(buf, "%lld\n", (long long)atomic64_read(&hamming_scrub_stats.failed));
+}
+
+/**
+ * \brief Take or drop the snapshot
+ *
+ * 1 snapshots the device (replacing the last snapshot), 0 drops the
+ * snapshot, see hamming_blkdev_snapshot
+ *
+ * \param[in] kobj		Kobject
+ * \param[in] attr		Kobject attribute
+ * \param[in] buf		Buffer to parse
+ * \param[in] count		Length of buffer to parse
+ *
+ * \return count, negative on failure
+ */
+static ssize_t hamming_sysfs_snapshot(struct kobject *kobj, struct kobj_attribute *attr, const char *buf, size_t count){
+    int take, ret;
+
+    if(sscanf(buf, "%d", &take) != 1 || take < 0 || take > 1){
+        return -EINVAL;
+    }
+    ret = hamming_blkdev_snapshot(take);
+    return ret < 0 ? ret : (ssize_t)count;
+}
+
+static ssize_t hamming_sysfs_snapshot_show(struct kobject *kobj, struct kobj_attribute *attr, char *buf){
+    return sprintf(buf, "%d\n", READ_ONCE(hamming_cow.cow));
+}
+
+/**
+ * \brief Report snapshots, see hamming_snapshot_stats_t
+ *
+ * Snapshots taken, nodes and pages copied on write since the module loaded,
+ * and pages freed along with dropped snapshots, one per attribute
+ *
+ * \param[in] kobj		Kobject
+ * \param[in] attr		Kobject attribute
+ * \param[out] buf		Buffer to print to
+ *
+ * \return Length written
+ */
+static ssize_t hamming_sysfs_snapshot_taken_show(struct kobject *kobj, struct kobj_attribute *attr, char *buf){
+    return sprintf(buf, "%lld\n", (long long)atomic64_read(&hamming_snapshot_stats.taken));
+}
+
+static ssize_t hamming_sysfs_snapshot_cow_nodes_show(struct kobject *kobj, struct kobj_attribute *attr, char *buf){
+    return sprintf(buf, "%lld\n", (long long)atomic64_read(&hamming_snapshot_stats.nodes));
+}
+
+static ssize_t hamming_sysfs_snapshot_cow_pages_show(struct kobject *kobj, struct kobj_attribute *attr, char *buf){
+    return sprintf(buf, "%lld\n", (long long)atomic64_read(&hamming_snapshot_stats.pages));
+}
+
+static ssize_t hamming_sysfs_snapshot_freed_show(struct kobject *kobj, struct kobj_attribute *attr, char *buf){
+    return sprintf(buf, "%lld\n", (long long)atomic64_read(&hamming_snapshot_stats.freed));
+}
+
+static ssize_t hamming_sysfs_discards_show(struct kobject *kobj, struct kobj_attribute *attr, char *buf){
+    return sprintf(buf, "%lld\n", (long long)atomic64_read(&hamming_discard_stats.discards));
+}
+
+static ssize_t hamming_sysfs_discard_pages_show(struct kobject *kobj, struct kobj_attribute *attr, char *buf){
+    return sprintf(buf, "%lld\n", (long long)atomic64_read(&hamming_discard_stats.pages));
+}
+
+static ssize_t hamming_sysfs_discard_nodes_show(struct kobject *kobj, struct kobj_attribute *attr, char *buf){
+    return sprintf(buf, "%lld\n", (long long)atomic64_read(&hamming_discard_stats.nodes));
+}
+
+/**
+ * \brief Report same filled page counts, see hamming_fill_stats_t
+ *
+ * Full page writes kept as their fill, zero filled writes dropped where
+ * there was no page, same filled pages given data by a partial write, and
+ * fill copies put right by a vote, one per attribute
+ *
+ * \param[in] kobj		Kobject
+ * \param[in] attr		Kobject attribute
+ * \param[out] buf		Buffer to print to
+ *
+ * \return Length written
+ */
+static ssize_t hamming_sysfs_fill_stored_show(struct kobject *kobj, struct kobj_attribute *attr, char *buf){
+    return sprintf(buf, "%lld\n", (long long)atomic64_read(&hamming_fill_stats.stored));
+}
+
+static ssize_t hamming_sysfs_fill_elided_show(struct kobject *kobj, struct kobj_attribute *attr, char *buf){
+    return sprintf(buf, "%lld\n", (long long)atomic64_read(&hamming_fill_stats.elided));
+}
+
+static ssize_t hamming_sysfs_fill_unfilled_show(struct kobject *kobj, struct kobj_attribute *attr, char *buf){
+    return sprintf(buf, "%lld\n", (long long)atomic64_read(&hamming_fill_stats.unfilled));
+}
+
+static ssize_t hamming_sysfs_fill_corrected_show(struct kobject *kobj, struct kobj_attribute *attr, char *buf){
+    return sprintf(buf, "%lld\n", (long long)atomic64_read(&hamming_fill_stats.corrected));
+}
+
+/**
+ * \brief Report deduplication, see hamming_dedup_stats_t
+ *
+ * Lookups and the ones that found a page with the same contents, shared
+ * pages and the slots pointing at them, copies made by partial writes, then
+ * the dedup ratio (slots per shared page) and average nanoseconds and index
+ * entries walked per lookup, one per attribute
+ *
+ * \param[in] kobj		Kobject
+ * \param[in] attr		Kobject attribute
+ * \param[out] buf		Buffer to print to
+ *
+ * \return Length written
+ */
+static ssize_t hamming_sysfs_dedup_lookups_show(struct kobject *kobj, struct kobj_attribute *attr, char *buf){
+    return sprintf(buf, "%lld\n", (long long)atomic64_read(&hamming_dedup_stats.lookups));
+}
+
+static ssize_t hamming_sysfs_dedup_hits_show(struct kobject *kobj, struct kobj_attribute *attr, char *buf){
+    return sprintf(buf, "%lld\n", (long long)atomic64_read(&hamming_dedup_stats.hits));
+}
+
+static ssize_t hamming_sysfs_dedup_pages_show(struct kobject *kobj, struct kobj_attribute *attr, char *buf){
+    return sprintf(buf, "%lld\n", (long long)atomic64_read(&hamming_dedup_stats.pages));
+}
+
+static ssize_t hamming_sysfs_dedup_refs_show(struct kobject *kobj, struct kobj_attribute *attr, char *buf){
+    return sprintf(buf, "%lld\n", (long long)atomic64_read(&hamming_dedup_stats.refs));
+}
+
+static ssize_t hamming_sysfs_dedup_broken_show(struct kobject *kobj, struct kobj_attribute *attr, char *buf){
+    return sprintf(buf, "%lld\n", (long long)atomic64_read(&hamming_dedup_stats.broken));
+}
+
+static ssize_t hamming_sysfs_dedup_ratio_show(struct kobject *kobj, struct kobj_attribute *attr, char *buf){
+    u64 pages = atomic64_read(&hamming_dedup_stats.pages);
+    u64 ratio = pages ? atomic64_read(&hamming_dedup_stats.refs)*100/pages : 0;
+
+    return sprintf(buf, "%llu.%02llu\n", (unsigned long long)ratio/100, (unsigned long long)ratio % 100);
+}
+
+static ssize_t hamming_sysfs_dedup_lookup_ns_show(struct kobject *kobj, struct kobj_attribute *attr, char *buf){
+    u64 lookups = atomic64_read(&hamming_dedup_stats.lookups);
+
+    return sprintf(buf, "%llu\n", lookups ? (unsigned long long)atomic64_read(&hamming_dedup_stats.lookup_ns)/lookups : 0);
+}
+
+static ssize_t hamming_sysfs_dedup_probes_show(struct kobject *kobj, struct kobj_attribute *attr, char *buf){
+    u64 lookups = atomic64_read(&hamming_dedup_stats.lookups);
+    u64 probes = lookups ? atomic64_read(&hamming_dedup_stats.probes)*100/lookups : 0;
+
+    return sprintf(buf, "%llu.%02llu\n", (unsigned long long)probes/100, (unsigned long long)probes % 100);
+}
+
+/**
+ * \brief Compress cold pages now
+ *
+ * Any write runs a pass of hamming_compress_work to completion before
+ * returning, whether compress_interval is set or not
+ *
+ * \param[in] kobj		Kobject
+ * \param[in] attr		Kobject attribute
+ * \param[in] buf		Buffer to parse, ignored
+ * \param[in] count		Length of buffer to parse
+ *
+ * \return count
+ */
+static ssize_t hamming_sysfs_compress(struct kobject *kobj, struct kobj_attribute *attr, const char *buf, size_t count){
+    hamming_compress_run();
+    return count;
+}
+
+/**
+ * \brief Report compression, see hamming_compress_stats_t
+ *
+ * Passes, pages compressed now and the memory their size classes take, the
+ * ratio of what they would take uncompressed to that, then pages compressed, expanded again by writes and found incompressible
+ * over all passes, reads decompressed and pages that couldn't be verified
+ * or decompressed, one per attribute
+ *
+ * \param[in] kobj		Kobject
+ * \param[in] attr		Kobject attribute
+ * \param[out] buf		Buffer to print to
+ *
+ * \return Length written
+ */
+static ssize_t hamming_sysfs_compress_passes_show(struct kobject *kobj, struct kobj_attribute *attr, char *buf){
+    return sprintf(buf, "%lld\n", (long long)atomic64_read(&hamming_compress_stats.passes));
+}
+
+static ssize_t hamming_sysfs_compress_pages_show(struct kobject *kobj, struct kobj_attribute *attr, char *buf){
+    return sprintf(buf, "%lld\n", (long long)atomic64_read(&hamming_alloc_stats.compressed));
+}
+
+static ssize_t hamming_sysfs_compress_memory_show(struct kobject *kobj, struct kobj_attribute *attr, char *buf){
+    return sprintf(buf, "%lld\n", (long long)atomic64_read(&hamming_alloc_stats.compressed_bytes));
+}
+
+static ssize_t hamming_sysfs_compress_ratio_show(struct kobject *kobj, struct kobj_attribute *attr, char *buf){
+    u64 memory = atomic64_read(&hamming_alloc_stats.compressed_bytes);
+    u64 ratio = memory ? atomic64_read(&hamming_alloc_stats.compressed)*PAGE_SIZE*100/memory : 0;
+
+    return sprintf(buf, "%llu.%02llu\n", (unsigned long long)ratio/100, (unsigned long long)ratio % 100);
+}
+
+static ssize_t hamming_sysfs_compress_compressed_show(struct kobject *kobj, struct kobj_attribute *attr, char *buf){
+    return sprintf(buf, "%lld\n", (long long)atomic64_read(&hamming_compress_stats.compressed));
+}
+
+static ssize_t hamming_sysfs_compress_expanded_show(struct kobject *kobj, struct kobj_attribute *attr, char *buf){
+    return sprintf(buf, "%lld\n", (long long)atomic64_read(&hamming_compress_stats.expanded));
+}
+
+static ssize_t hamming_sysfs_compress_incompressible_show(struct kobject *kobj, struct kobj_attribute *attr, char *buf){
+    return sprintf(buf, "%lld\n", (long long)atomic64_read(&hamming_compress_stats.incompressible));
+}
+
+static ssize_t hamming_sysfs_compress_reads_show(struct kobject *kobj, struct kobj_attribute *attr, char *buf){
+    return sprintf(buf, "%lld\n", (long long)atomic64_read(&hamming_compress_stats.reads));
+}
+
+static ssize_t hamming_sysfs_compress_failed_show(struct kobject *kobj, struct kobj_attribute *attr, char *buf){
+    return sprintf(buf, "%lld\n", (long long)atomic64_read(&hamming_compress_stats.failed));
+}
+
+/**
+ * \brief Write cold pages back now
+ *
+ * Any write runs a writeback pass to completion before returning, without
+ * a compress pass or aging anything, nothing happens without backing_path
+ *
+ * \param[in] kobj		Kobject
+ * \param[in] attr		Kobject attribute
+ * \param[in] buf		Buffer to parse, ignored
+ * \param[in] count		Length of buffer to parse
+ *
+ * \return count
+ */
+static ssize_t hamming_sysfs_writeback(struct kobject *kobj, struct kobj_attribute *attr, const char *buf, size_t count){
+    hamming_writeback_run();
+    return count;
+}
+
+/**
+ * \brief Report writeback, see hamming_writeback_stats_t
+ *
+ * Passes, pages written back now and the slots they take, then pages
+ * written, the writes they took, pages left in RAM because they changed
+ * while being written or there was no room, pages fetched back in and how
+ * many of those were corrected, and pages that couldn't be verified, read
+ * or written, one per attribute
+ *
+ * \param[in] kobj		Kobject
+ * \param[in] attr		Kobject attribute
+ * \param[out] buf		Buffer to print to
+ *
+ * \return Length written
+ */
+static ssize_t hamming_sysfs_writeback_passes_show(struct kobject *kobj, struct kobj_attribute *attr, char *buf){
+    return sprintf(buf, "%lld\n", (long long)atomic64_read(&hamming_writeback_stats.passes));
+}
+
+static ssize_t hamming_sysfs_writeback_pages_show(struct kobject *kobj, struct kobj_attribute *attr, char *buf){
+    return sprintf(buf, "%lld\n", (long long)atomic64_read(&hamming_alloc_stats.backed));
+}
+
+static ssize_t hamming_sysfs_writeback_slots_show(struct kobject *kobj, struct kobj_attribute *attr, char *buf){
+    return sprintf(buf, "%lld %llu\n", (long long)atomic64_read(&hamming_writeback_stats.slots_used),
+                   (unsigned long long)hamming_writeback.slots);
+}
+
+static ssize_t hamming_sysfs_writeback_written_show(struct kobject *kobj, struct kobj_attribute *attr, char *buf){
+    return sprintf(buf, "%lld\n", (long long)atomic64_read(&hamming_writeback_stats.written));
+}
+
+static ssize_t hamming_sysfs_writeback_writes_show(struct kobject *kobj, struct kobj_attribute *attr, char *buf){
+    return sprintf(buf, "%lld\n", (long long)atomic64_read(&hamming_writeback_stats.writes));
+}
+
+static ssize_t hamming_sysfs_writeback_raced_show(struct kobject *kobj, struct kobj_attribute *attr, char *buf){
+    return sprintf(buf, "%lld\n", (long long)atomic64_read(&hamming_writeback_stats.raced));
+}
+
+static ssize_t hamming_sysfs_writeback_full_show(struct kobject *kobj, struct kobj_attribute *attr, char *buf){
+    return sprintf(buf, "%lld\n", (long long)atomic64_read(&hamming_writeback_stats.full));
+}
+
+static ssize_t hamming_sysfs_writeback_fetched_show(struct kobject *kobj, struct kobj_attribute *attr, char *buf){
+    return sprintf(buf, "%lld\n", (long long)atomic64_read(&hamming_writeback_stats.fetched));
+}
+
+static ssize_t hamming_sysfs_writeback_corrected_show(struct kobject *kobj, struct kobj_attribute *attr, char *buf){
+    return sprintf(buf, "%lld\n", (long long)atomic64_read(&hamming_writeback_stats.corrected));
+}
+
+static ssize_t hamming_sysfs_writeback_failed_show(struct kobject *kobj, struct kobj_attribute *attr, char *buf){
+    return sprintf(buf, "%lld\n", (long long)atomic64_read(&hamming_writeback_stats.failed));
+}
+
+/**
+ * \brief Report the restore at load, see hamming_persist_stats_t
+ *
+ * Pages and chunks restored, pages the codes corrected on the way in,
+ * chunks and pages that failed, and how long it took in milliseconds, one
+ * per attribute
+ *
+ * \param[in] kobj		Kobject
+ * \param[in] attr		Kobject attribute
+ * \param[out] buf		Buffer to print to
+ *
+ * \return Length written
+ */
+static ssize_t hamming_sysfs_persist_restored_show(struct kobject *kobj, struct kobj_attribute *attr, char *buf){
+    return sprintf(buf, "%lld\n", (long long)atomic64_read(&hamming_persist_stats.restored));
+}
+
+static ssize_t hamming_sysfs_persist_chunks_show(struct kobject *kobj, struct kobj_attribute *attr, char *buf){
+    return sprintf(buf, "%lld\n", (long long)atomic64_read(&hamming_persist_stats.chunks));
+}
+
+static ssize_t hamming_sysfs_persist_corrected_show(struct kobject *kobj, struct kobj_attribute *attr, char *buf){
+    return sprintf(buf, "%lld\n", (long long)atomic64_read(&hamming_persist_stats.corrected));
+}
+
+static ssize_t hamming_sysfs_persist_failed_show(struct kobject *kobj, struct kobj_attribute *attr, char *buf){
+    return sprintf(buf, "%lld\n", (long long)atomic64_read(&hamming_persist_stats.failed));
+}
+
+static ssize_t hamming_sysfs_persist_restore_ms_show(struct kobject *kobj, struct kobj_attribute *attr, char *buf){
+    return sprintf(buf, "%lld\n", (long long)atomic64_read(&hamming_persist_stats.restore_ns)/NSEC_PER_MSEC);
+}
+
+/**
+ * \brief Report per NUMA node counts, one line per node with memory
+ *
+ * Nodes and pages allocated on it, then lookups from its CPUs that went to a
+ * tree shard on the same node or another one
+ *
+ * \param[in] kobj		Kobject
+ * \param[in] attr		Kobject attribute
+ * \param[out] buf		Buffer to print to
+ *
+ * \return Length written
+ */
+static ssize_t hamming_sysfs_numa_stat_show(struct kobject *kobj, struct kobj_attribute *attr, char *buf){
+    hamming_alloc_pool_t *pool;
+    u64 local, remote;
+    ssize_t len = 0;
+    int nid;
+
+    for_each_node_state(nid, N_MEMORY){
+        pool = hamming_alloc_pools[nid];
+        if(pool == NULL){
+            continue;
+        }
+        hamming_tree_numa_stats(nid, &local, &remote);
+        len += scnprintf(buf + len, PAGE_SIZE - len, "node%d nodes %lld pages %lld local %llu remote %llu\n", nid,
+                         (long long)atomic64_read(&pool->node_count), (long long)atomic64_read(&pool->page_count),
+                         (unsigned long long)local, (unsigned long long)remote);
+    }
+    return len;
+}
+
+/**
+ * \brief Report per hardware queue counts, one line per queue that saw requests
+ *
+ * Requests handled, the batches they came in and the largest of those, and
+ * requests that failed. Idle queues are left out, a queue per CPU doesn't
+ * fit a page on large machines otherwise.
+ *
+ * \param[in] kobj		Kobject
+ * \param[in] attr		Kobject attribute
+ * \param[out] buf		Buffer to print to
+ *
+ * \return Length written
+ */
+static ssize_t hamming_sysfs_queue_stat_show(struct kobject *kobj, struct kobj_attribute *attr, char *buf){
+    hamming_hctx_t *ctx;
+    ssize_t len = 0;
+    unsigned int i;
+
+    for(i = 0;i < hamming->frontend.block_io.tag_set.nr_hw_queues;i++){
+        ctx = &hamming->frontend.block_io.hctx[i];
+        if(atomic64_read(&ctx->requests) == 0){
+            continue;
+        }
+        len += scnprintf(buf + len, PAGE_SIZE - len, "hctx%u requests %lld batches %lld max_batch %u errors %lld\n", i,
+                         (long long)atomic64_read(&ctx->requests), (long long)atomic64_read(&ctx->batches),
+                         READ_ONCE(ctx->max_batch), (long long)atomic64_read(&ctx->errors));
+    }
+    return len;
 }
 
 static struct kobj_attribute hamming_sysfs_error_attribute =
     __ATTR(error_cycle, S_IRUGO, hamming_sysfs_error_show, NULL);
-static struct kobj_attribute hamming_sysfs_disk_mgmt =
+static struct kobj_attribute hamming_sysfs_disk_mgmt_attribute =
     __ATTR(disk_mgmt, S_IWUSR | S_IWGRP, NULL, hamming_sysfs_disk_mgmt);
+static struct kobj_attribute hamming_sysfs_cursor_hits_attribute =
+    __ATTR(cursor_hits, S_IRUGO, hamming_sysfs_cursor_hits_show, NULL);
+static struct kobj_attribute hamming_sysfs_cursor_misses_attribute =
+    __ATTR(cursor_misses, S_IRUGO, hamming_sysfs_cursor_misses_show, NULL);
+static struct kobj_attribute hamming_sysfs_readahead_verified_attribute =
+    __ATTR(readahead_verified, S_IRUGO, hamming_sysfs_readahead_verified_show, NULL);
+static struct kobj_attribute hamming_sysfs_readahead_hits_attribute =
+    __ATTR(readahead_hits, S_IRUGO, hamming_sysfs_readahead_hits_show, NULL);
+static struct kobj_attribute hamming_sysfs_alloc_nodes_attribute =
+    __ATTR(alloc_nodes, S_IRUGO, hamming_sysfs_alloc_nodes_show, NULL);
+static struct kobj_attribute hamming_sysfs_alloc_pages_attribute =
+    __ATTR(alloc_pages, S_IRUGO, hamming_sysfs_alloc_pages_show, NULL);
+static struct kobj_attribute hamming_sysfs_alloc_codes_attribute =
+    __ATTR(alloc_codes, S_IRUGO, hamming_sysfs_alloc_codes_show, NULL);
+static struct kobj_attribute hamming_sysfs_alloc_zeroed_attribute =
+    __ATTR(alloc_zeroed, S_IRUGO, hamming_sysfs_alloc_zeroed_show, NULL);
+static struct kobj_attribute hamming_sysfs_alloc_failed_attribute =
+    __ATTR(alloc_failed, S_IRUGO, hamming_sysfs_alloc_failed_show, NULL);
+static struct kobj_attribute hamming_sysfs_alloc_fallback_attribute =
+    __ATTR(alloc_fallback, S_IRUGO, hamming_sysfs_alloc_fallback_show, NULL);
+static struct kobj_attribute hamming_sysfs_alloc_reserve_attribute =
+    __ATTR(alloc_reserve, S_IRUGO, hamming_sysfs_alloc_reserve_show, NULL);
+static struct kobj_attribute hamming_sysfs_alloc_arena_chunks_attribute =
+    __ATTR(alloc_arena_chunks, S_IRUGO, hamming_sysfs_alloc_arena_chunks_show, NULL);
+static struct kobj_attribute hamming_sysfs_alloc_arena_fallback_attribute =
+    __ATTR(alloc_arena_fallback, S_IRUGO, hamming_sysfs_alloc_arena_fallback_show, NULL);
+static struct kobj_attribute hamming_sysfs_alloc_filled_attribute =
+    __ATTR(alloc_filled, S_IRUGO, hamming_sysfs_alloc_filled_show, NULL);
+static struct kobj_attribute hamming_sysfs_numa_stat_attribute =
+    __ATTR(numa_stat, S_IRUGO, hamming_sysfs_numa_stat_show, NULL);
+static struct kobj_attribute hamming_sysfs_queue_stat_attribute =
+    __ATTR(queue_stat, S_IRUGO, hamming_sysfs_queue_stat_show, NULL);
+static struct kobj_attribute hamming_sysfs_scrub_attribute =
+    __ATTR(scrub, S_IWUSR | S_IWGRP, NULL, hamming_sysfs_scrub);
+static struct kobj_attribute hamming_sysfs_scrub_runs_attribute =
+    __ATTR(scrub_runs, S_IRUGO, hamming_sysfs_scrub_runs_show, NULL);
+static struct kobj_attribute hamming_sysfs_scrub_pages_attribute =
+    __ATTR(scrub_pages, S_IRUGO, hamming_sysfs_scrub_pages_show, NULL);
+static struct kobj_attribute hamming_sysfs_scrub_corrected_attribute =
+    __ATTR(scrub_corrected, S_IRUGO, hamming_sysfs_scrub_corrected_show, NULL);
+static struct kobj_attribute hamming_sysfs_scrub_failed_attribute =
+    __ATTR(scrub_failed, S_IRUGO, hamming_sysfs_scrub_failed_show, NULL);
+static struct kobj_attribute hamming_sysfs_snapshot_attribute =
+    __ATTR(snapshot, S_IRUGO | S_IWUSR | S_IWGRP, hamming_sysfs_snapshot_show, hamming_sysfs_snapshot);
+static struct kobj_attribute hamming_sysfs_snapshot_taken_attribute =
+    __ATTR(snapshot_taken, S_IRUGO, hamming_sysfs_snapshot_taken_show, NULL);
+static struct kobj_attribute hamming_sysfs_snapshot_cow_nodes_attribute =
+    __ATTR(snapshot_cow_nodes, S_IRUGO, hamming_sysfs_snapshot_cow_nodes_show, NULL);
+static struct kobj_attribute hamming_sysfs_snapshot_cow_pages_attribute =
+    __ATTR(snapshot_cow_pages, S_IRUGO, hamming_sysfs_snapshot_cow_pages_show, NULL);
+static struct kobj_attribute hamming_sysfs_snapshot_freed_attribute =
+    __ATTR(snapshot_freed, S_IRUGO, hamming_sysfs_snapshot_freed_show, NULL);
+static struct kobj_attribute hamming_sysfs_discards_attribute =
+    __ATTR(discards, S_IRUGO, hamming_sysfs_discards_show, NULL);
+static struct kobj_attribute hamming_sysfs_discard_pages_attribute =
+    __ATTR(discard_pages, S_IRUGO, hamming_sysfs_discard_pages_show, NULL);
+static struct kobj_attribute hamming_sysfs_discard_nodes_attribute =
+    __ATTR(discard_nodes, S_IRUGO, hamming_sysfs_discard_nodes_show, NULL);
+static struct kobj_attribute hamming_sysfs_fill_stored_attribute =
+    __ATTR(fill_stored, S_IRUGO, hamming_sysfs_fill_stored_show, NULL);
+static struct kobj_attribute hamming_sysfs_fill_elided_attribute =
+    __ATTR(fill_elided, S_IRUGO, hamming_sysfs_fill_elided_show, NULL);
+static struct kobj_attribute hamming_sysfs_fill_unfilled_attribute =
+    __ATTR(fill_unfilled, S_IRUGO, hamming_sysfs_fill_unfilled_show, NULL);
+static struct kobj_attribute hamming_sysfs_fill_corrected_attribute =
+    __ATTR(fill_corrected, S_IRUGO, hamming_sysfs_fill_corrected_show, NULL);
+static struct kobj_attribute hamming_sysfs_dedup_lookups_attribute =
+    __ATTR(dedup_lookups, S_IRUGO, hamming_sysfs_dedup_lookups_show, NULL);
+static struct kobj_attribute hamming_sysfs_dedup_hits_attribute =
+    __ATTR(dedup_hits, S_IRUGO, hamming_sysfs_dedup_hits_show, NULL);
+static struct kobj_attribute hamming_sysfs_dedup_pages_attribute =
+    __ATTR(dedup_pages, S_IRUGO, hamming_sysfs_dedup_pages_show, NULL);
+static struct kobj_attribute hamming_sysfs_dedup_refs_attribute =
+    __ATTR(dedup_refs, S_IRUGO, hamming_sysfs_dedup_refs_show, NULL);
+static struct kobj_attribute hamming_sysfs_dedup_broken_attribute =
+    __ATTR(dedup_broken, S_IRUGO, hamming_sysfs_dedup_broken_show, NULL);
+static struct kobj_attribute hamming_sysfs_dedup_ratio_attribute =
+    __ATTR(dedup_ratio, S_IRUGO, hamming_sysfs_dedup_ratio_show, NULL);
+static struct kobj_attribute hamming_sysfs_dedup_lookup_ns_attribute =
+    __ATTR(dedup_lookup_ns, S_IRUGO, hamming_sysfs_dedup_lookup_ns_show, NULL);
+static struct kobj_attribute hamming_sysfs_dedup_probes_attribute =
+    __ATTR(dedup_probes, S_IRUGO, hamming_sysfs_dedup_probes_show, NULL);
+static struct kobj_attribute hamming_sysfs_compress_attribute =
+    __ATTR(compress, S_IWUSR | S_IWGRP, NULL, hamming_sysfs_compress);
+static struct kobj_attribute hamming_sysfs_compress_passes_attribute =
+    __ATTR(compress_passes, S_IRUGO, hamming_sysfs_compress_passes_show, NULL);
+static struct kobj_attribute hamming_sysfs_compress_pages_attribute =
+    __ATTR(compress_pages, S_IRUGO, hamming_sysfs_compress_pages_show, NULL);
+static struct kobj_attribute hamming_sysfs_compress_memory_attribute =
+    __ATTR(compress_memory, S_IRUGO, hamming_sysfs_compress_memory_show, NULL);
+static struct kobj_attribute hamming_sysfs_compress_ratio_attribute =
+    __ATTR(compress_ratio, S_IRUGO, hamming_sysfs_compress_ratio_show, NULL);
+static struct kobj_attribute hamming_sysfs_compress_compressed_attribute =
+    __ATTR(compress_compressed, S_IRUGO, hamming_sysfs_compress_compressed_show, NULL);
+static struct kobj_attribute hamming_sysfs_compress_expanded_attribute =
+    __ATTR(compress_expanded, S_IRUGO, hamming_sysfs_compress_expanded_show, NULL);
+static struct kobj_attribute hamming_sysfs_compress_incompressible_attribute =
+    __ATTR(compress_incompressible, S_IRUGO, hamming_sysfs_compress_incompressible_show, NULL);
+static struct kobj_attribute hamming_sysfs_compress_reads_attribute =
+    __ATTR(compress_reads, S_IRUGO, hamming_sysfs_compress_reads_show, NULL);
+static struct kobj_attribute hamming_sysfs_compress_failed_attribute =
+    __ATTR(compress_failed, S_IRUGO, hamming_sysfs_compress_failed_show, NULL);
+static struct kobj_attribute hamming_sysfs_writeback_attribute =
+    __ATTR(writeback, S_IWUSR | S_IWGRP, NULL, hamming_sysfs_writeback);
+static struct kobj_attribute hamming_sysfs_writeback_passes_attribute =
+    __ATTR(writeback_passes, S_IRUGO, hamming_sysfs_writeback_passes_show, NULL);
+static struct kobj_attribute hamming_sysfs_writeback_pages_attribute =
+    __ATTR(writeback_pages, S_IRUGO, hamming_sysfs_writeback_pages_show, NULL);
+static struct kobj_attribute hamming_sysfs_writeback_slots_attribute =
+    __ATTR(writeback_slots, S_IRUGO, hamming_sysfs_writeback_slots_show, NULL);
+static struct kobj_attribute hamming_sysfs_writeback_written_attribute =
+    __ATTR(writeback_written, S_IRUGO, hamming_sysfs_writeback_written_show, NULL);
+static struct kobj_attribute hamming_sysfs_writeback_writes_attribute =
+    __ATTR(writeback_writes, S_IRUGO, hamming_sysfs_writeback_writes_show, NULL);
+static struct kobj_attribute hamming_sysfs_writeback_raced_attribute =
+    __ATTR(writeback_raced, S_IRUGO, hamming_sysfs_writeback_raced_show, NULL);
+static struct kobj_attribute hamming_sysfs_writeback_full_attribute =
+    __ATTR(writeback_full, S_IRUGO, hamming_sysfs_writeback_full_show, NULL);
+static struct kobj_attribute hamming_sysfs_writeback_fetched_attribute =
+    __ATTR(writeback_fetched, S_IRUGO, hamming_sysfs_writeback_fetched_show, NULL);
+static struct kobj_attribute hamming_sysfs_writeback_corrected_attribute =
+    __ATTR(writeback_corrected, S_IRUGO, hamming_sysfs_writeback_corrected_show, NULL);
+static struct kobj_attribute hamming_sysfs_writeback_failed_attribute =
+    __ATTR(writeback_failed, S_IRUGO, hamming_sysfs_writeback_failed_show, NULL);
+static struct kobj_attribute hamming_sysfs_persist_restored_attribute =
+    __ATTR(persist_restored, S_IRUGO, hamming_sysfs_persist_restored_show, NULL);
+static struct kobj_attribute hamming_sysfs_persist_chunks_attribute =
+    __ATTR(persist_chunks, S_IRUGO, hamming_sysfs_persist_chunks_show, NULL);
+static struct kobj_attribute hamming_sysfs_persist_corrected_attribute =
+    __ATTR(persist_corrected, S_IRUGO, hamming_sysfs_persist_corrected_show, NULL);
+static struct kobj_attribute hamming_sysfs_persist_failed_attribute =
+    __ATTR(persist_failed, S_IRUGO, hamming_sysfs_persist_failed_show, NULL);
+static struct kobj_attribute hamming_sysfs_persist_restore_ms_attribute =
+    __ATTR(persist_restore_ms, S_IRUGO, hamming_sysfs_persist_restore_ms_show, NULL);
 
 static struct attribute *attrs[] = {
     &hamming_sysfs_error_attribute.attr,
-    &hamming_sysfs_disk_mgmt.attr,
+    &hamming_sysfs_disk_mgmt_attribute.attr,
+    &hamming_sysfs_cursor_hits_attribute.attr,
+    &hamming_sysfs_cursor_misses_attribute.attr,
+    &hamming_sysfs_readahead_verified_attribute.attr,
+    &hamming_sysfs_readahead_hits_attribute.attr,
+    &hamming_sysfs_alloc_nodes_attribute.attr,
+    &hamming_sysfs_alloc_pages_attribute.attr,
+    &hamming_sysfs_alloc_codes_attribute.attr,
+    &hamming_sysfs_alloc_zeroed_attribute.attr,
+    &hamming_sysfs_alloc_failed_attribute.attr,
+    &hamming_sysfs_alloc_fallback_attribute.attr,
+    &hamming_sysfs_alloc_reserve_attribute.attr,
+    &hamming_sysfs_alloc_arena_chunks_attribute.attr,
+    &hamming_sysfs_alloc_arena_fallback_attribute.attr,
+    &hamming_sysfs_alloc_filled_attribute.attr,
+    &hamming_sysfs_numa_stat_attribute.attr,
+    &hamming_sysfs_queue_stat_attribute.attr,
+    &hamming_sysfs_scrub_attribute.attr,
+    &hamming_sysfs_scrub_runs_attribute.attr,
+    &hamming_sysfs_scrub_pages_attribute.attr,
+    &hamming_sysfs_scrub_corrected_attribute.attr,
+    &hamming_sysfs_scrub_failed_attribute.attr,
+    &hamming_sysfs_snapshot_attribute.attr,
+    &hamming_sysfs_snapshot_taken_attribute.attr,
+    &hamming_sysfs_snapshot_cow_nodes_attribute.attr,
+    &hamming_sysfs_snapshot_cow_pages_attribute.attr,
+    &hamming_sysfs_snapshot_freed_attribute.attr,
+    &hamming_sysfs_discards_attribute.attr,
+    &hamming_sysfs_discard_pages_attribute.attr,
+    &hamming_sysfs_discard_nodes_attribute.attr,
+    &hamming_sysfs_fill_stored_attribute.attr,
+    &hamming_sysfs_fill_elided_attribute.attr,
+    &hamming_sysfs_fill_unfilled_attribute.attr,
+    &hamming_sysfs_fill_corrected_attribute.attr,
+    &hamming_sysfs_dedup_lookups_attribute.attr,
+    &hamming_sysfs_dedup_hits_attribute.attr,
+    &hamming_sysfs_dedup_pages_attribute.attr,
+    &hamming_sysfs_dedup_refs_attribute.attr,
+    &hamming_sysfs_dedup_broken_attribute.attr,
+    &hamming_sysfs_dedup_ratio_attribute.attr,
+    &hamming_sysfs_dedup_lookup_ns_attribute.attr,
+    &hamming_sysfs_dedup_probes_attribute.attr,
+    &hamming_sysfs_compress_attribute.attr,
+    &hamming_sysfs_compress_passes_attribute.attr,
+    &hamming_sysfs_compress_pages_attribute.attr,
+    &hamming_sysfs_compress_memory_attribute.attr,
+    &hamming_sysfs_compress_ratio_attribute.attr,
+    &hamming_sysfs_compress_compressed_attribute.attr,
+    &hamming_sysfs_compress_expanded_attribute.attr,
+    &hamming_sysfs_compress_incompressible_attribute.attr,
+    &hamming_sysfs_compress_reads_attribute.attr,
+    &hamming_sysfs_compress_failed_attribute.attr,
+    &hamming_sysfs_writeback_attribute.attr,
+    &hamming_sysfs_writeback_passes_attribute.attr,
+    &hamming_sysfs_writeback_pages_attribute.attr,
+    &hamming_sysfs_writeback_slots_attribute.attr,
+    &hamming_sysfs_writeback_written_attribute.attr,
+    &hamming_sysfs_writeback_writes_attribute.attr,
+    &hamming_sysfs_writeback_raced_attribute.attr,
+    &hamming_sysfs_writeback_full_attribute.attr,
+    &hamming_sysfs_writeback_fetched_attribute.attr,
+    &hamming_sysfs_writeback_corrected_attribute.attr,
+    &hamming_sysfs_writeback_failed_attribute.attr,
+    &hamming_sysfs_persist_restored_attribute.attr,
+    &hamming_sysfs_persist_chunks_attribute.attr,
+    &hamming_sysfs_persist_corrected_attribute.attr,
+    &hamming_sysfs_persist_failed_attribute.attr,
+    &hamming_sysfs_persist_restore_ms_attribute.attr,
     NULL
 };
 
@@ -103,8 +850,13 @@ static struct attribute_group attr_group = {
 /**
  * \brief Initialize sysfs
  *
- * The only output is currently a error circular buffer, which is written to the sysfs in
- * whatever the current order is upon request
+ * Outputs are the error circular buffer, which is written to the sysfs in
+ * whatever the current order is upon request, the tree cursor hit counts,
+ * readahead verification counts, tree allocation counts, per node and per
+ * hardware queue counts and scrub, snapshot, discard, fill, dedup, compression, writeback and
+ * restore counts, a write to scrub verifies the whole tree, one to compress
+ * runs a compression pass, one to writeback a writeback pass and one to
+ * snapshot takes or drops the snapshot
  *
  * \return Negative on error, zero otherwise
  */
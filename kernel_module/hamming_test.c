@@ -8,7 +8,7 @@ static int hamming_test_sector_simple(void){
 	for(i = 0;i < 256;i++){
 		u8 *sector = hamming_tree_sector_simple(SECTOR_TO_PAGE(i), SECTOR_TO_CHUNK(i), true);
 		if(sector == NULL){
-			printk(KERN_ERR "sector is NULL in self test (%d, %d)\n", SECTOR_TO_PAGE(i), SECTOR_TO_CHUNK(i));
+			printk(KERN_ERR "sector is NULL in self test (%llu, %d)\n", (unsigned long long)SECTOR_TO_PAGE(i), SECTOR_TO_CHUNK(i));
 			return -EIO;
 		}
 		memset(sector, i&0xFF, SECTOR_SIZE);
@@ -36,34 +36,70 @@ static int hamming_test_subtree_system(void){
 
 	test_sector = 64 << 3;
 	create = true;
-	master.ptr = NULL;
+	if(hamming_tree_grow(SECTOR_TO_PAGE(test_sector)) < 0){
+		printk(KERN_ERR "couldn't grow the tree\n");
+		return -EIO;
+	}
+	master = hamming_tree_head(SECTOR_TO_PAGE(test_sector));
 	slave.ptr = NULL;
-	slave.processed_bits = 29;
+	slave.processed_bits = PAGE_PROCESSED_BITS - HAMMING_TREE_LEVEL_BITS;
 	slave.id = SECTOR_TO_PAGE(test_sector);
 
 	hamming_tree_resolve(master, &slave, &create, 1);
 
 	if(slave.ptr == NULL){
 		printk(KERN_ERR "couldn't resolve actual subtree\n");
+		return -EIO;
 	}
 
 	memcpy(&master, &slave, sizeof(hamming_subtree_t));
 
 	slave.ptr = NULL;
-	slave.processed_bits = 32;
+	slave.processed_bits = PAGE_PROCESSED_BITS;
 	slave.id = SECTOR_TO_PAGE(test_sector); // should be redundant
 
 	hamming_tree_resolve(master, &slave, &create, 1);
 
 	if(slave.ptr == NULL){
 		printk(KERN_ERR "couldn't resolve final node from subtree\n");
+		return -EIO;
+	}
+	if(hamming_tree_page_from_subtree(slave) == NULL){
+		printk(KERN_ERR "final node from subtree isn't a page\n");
+		return -EIO;
+	}
+	return 0;
+}
+
+static int hamming_test_large_id(void){
+	u64 tree_id = 1ULL << 40; // past what 32-bit sectors could reach
+	u8 *sector;
+
+	sector = hamming_tree_sector_simple(tree_id, 7, true);
+	if(sector == NULL){
+		printk(KERN_ERR "can't create a page past 32 bits\n");
+		return -EIO;
+	}
+	memset(sector, 0xA5, SECTOR_SIZE);
+	if(hamming_tree_sector_simple(tree_id, 7, false) != sector ||
+	   hamming_tree_sector_simple(tree_id & 0xFFFFFFFF, 7, false) == sector){
+		printk(KERN_ERR "page past 32 bits aliases another\n");
+		return -EIO;
+	}
+	if(hamming_tree_sector_simple(0, 0, false) == NULL){
+		printk(KERN_ERR "growing the tree lost page 0\n");
+		return -EIO;
 	}
 	return 0;
 }
 
 static int hamming_tests(void){
-	hamming_test_sector_simple();
-	//hamming_test_subtree_system();
+	if(hamming_test_sector_simple() < 0 ||
+	   hamming_test_subtree_system() < 0 ||
+	   hamming_test_large_id() < 0){
+		return -EIO;
+	}
+	hamming_tree_free(); // don't leave test data (or a tall tree) on the device
 	printk(KERN_INFO "All tests passed succesfully\n");
 	return 0;
 }
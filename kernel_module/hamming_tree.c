@@ -3,75 +3,361 @@
 
 /**
  * \file hamming_tree.c
- * \brief Binary tree implementation
+ * \brief Radix tree implementation
  *
- * I hand rolled my own binary tree implementation because why not
+ * I hand rolled my own tree implementation because why not. It started out as
+ * a binary tree (one bit per level, 32 levels), every level now resolves
+ * HAMMING_TREE_LEVEL_BITS of the id, see hamming_tree.h
  */
 
-static hamming_subtree_t tree_head;
+/**
+ * \brief Publish a new node, page or code table into an empty slot
+ *
+ * cmpxchg is a full barrier, so whoever finds ptr through the slot sees
+ * everything written to it before
+ *
+ * \param[in] slot		Slot that was seen empty
+ * \param[in] ptr		Fully initialized object
+ *
+ * \return ptr, or what another creator published first (ptr is then still the caller's to free)
+ */
+static void *hamming_tree_publish(void **slot, void *ptr){
+	void *old = cmpxchg(slot, NULL, ptr);
+	return old ? old : ptr;
+}
+
+/**
+ * \brief Code set of a page under a leaf parent
+ *
+ * Allocates the code table the page falls in, if it's the first page of
+ * that range
+ *
+ * \param[in] leaf		Leaf parent
+ * \param[in] index		Child index of the page
+ * \param[in] nid		Node of the shard
+ *
+ * \return Code set, NULL on failure
+ */
+static hamming_code_set_t *hamming_tree_page_code(hamming_node_t *leaf, int index, int nid){
+	hamming_code_set_t **slot = &leaf->codes[index/HAMMING_CODE_TABLE_PAGES];
+	hamming_code_set_t *table = rcu_dereference(*slot), *new_table;
+
+	if(unlikely(table == NULL)){
+		new_table = hamming_alloc_codes(GFP_ATOMIC, nid);
+		if(unlikely(new_table == NULL)){
+			printk(KERN_ERR "can't allocate a code table\n");
+			return NULL;
+		}
+		table = hamming_tree_publish((void**)slot, new_table);
+		if(table != new_table){
+			hamming_free_codes(new_table, nid);
+		}
+	}
+	return &table[index % HAMMING_CODE_TABLE_PAGES];
+}
+
+/**
+ * \brief Create a page under a leaf parent
+ *
+ * The page itself isn't published, see hamming_tree_resolve_raw
+ *
+ * \param[in] leaf		Leaf parent
+ * \param[in] index		Child index of the page
+ * \param[in] nid		Node of the shard
+ *
+ * \return Page with its code pointer set, NULL on failure
+ */
+static hamming_page_t *hamming_tree_page_create(hamming_node_t *leaf, int index, int nid){
+	hamming_code_set_t *code = hamming_tree_page_code(leaf, index, nid);
+	hamming_page_t *page_ptr;
+
+	if(unlikely(code == NULL)){
+		return NULL;
+	}
+	page_ptr = hamming_alloc_page(GFP_ATOMIC, hamming_alloc_page_nid(nid));
+	if(unlikely(page_ptr == NULL)){
+		printk(KERN_ERR "can't allocate hamming_page_t\n");
+		return NULL;
+	}
+	page_ptr->code = code;
+	return page_ptr;
+}
+
+// takes a reference to every shared page under a leaf parent, for a copy of it
+static void hamming_tree_dedup_hold_leaf(hamming_node_t *leaf){
+	hamming_page_t *page_ptr;
+	int i;
+
+	if(atomic64_read(&hamming_dedup_stats.pages) == 0){
+		return; // nothing is shared, don't touch every page
+	}
+	for(i = 0;i < HAMMING_TREE_FANOUT;i++){
+		page_ptr = leaf->child[i];
+		if(page_ptr && (page_ptr->flags & HAMMING_PAGE_DEDUP)){
+			hamming_dedup_hold(page_ptr);
+		}
+	}
+}
+
+// drops the references a leaf parent holds, ahead of freeing it
+static void hamming_tree_dedup_put_leaf(hamming_node_t *leaf){
+	hamming_page_t *page_ptr;
+	int i;
+
+	if(atomic64_read(&hamming_dedup_stats.pages) == 0){
+		return;
+	}
+	for(i = 0;i < HAMMING_TREE_FANOUT;i++){
+		page_ptr = leaf->child[i];
+		if(page_ptr && (page_ptr->flags & HAMMING_PAGE_DEDUP)){
+			hamming_dedup_put(page_ptr);
+			leaf->child[i] = NULL;
+		}
+	}
+}
+
+/**
+ * \brief Copy a node a snapshot shares, before changing it
+ *
+ * Nothing changes a shared node, so its children are copied as they are,
+ * code tables aren't (see hamming_cow_t). A copied leaf parent takes its own
+ * references to the shared pages it points at. The copy replaces the node
+ * in slot, which is in a node the caller already owns.
+ *
+ * \param[in] slot		Slot the shared node was found in
+ * \param[in] node_ptr		Shared node
+ * \param[in] processed_bits	Depth of the node
+ * \param[in] nid		Node of the shard
+ * \param[in] epoch		Current hamming_cow.epoch
+ *
+ * \return The copy, or the one another writer swapped in first, NULL on failure
+ */
+static hamming_node_t *hamming_tree_cow_node(void **slot, hamming_node_t *node_ptr, u8 processed_bits, int nid, u32 epoch){
+	hamming_node_t *copy = hamming_alloc_node(GFP_ATOMIC, nid), *old;
+
+	if(unlikely(copy == NULL)){
+		printk(KERN_ERR "can't allocate a copy of hamming_node_t\n");
+		return NULL;
+	}
+	memcpy(copy->child, node_ptr->child, sizeof(copy->child));
+	copy->gen = epoch;
+	if(processed_bits == HAMMING_TREE_CURSOR_BITS){
+		hamming_tree_dedup_hold_leaf(copy);
+	}
+	old = cmpxchg(slot, node_ptr, copy);
+	if(old != node_ptr){
+		if(processed_bits == HAMMING_TREE_CURSOR_BITS){
+			hamming_tree_dedup_put_leaf(copy);
+		}
+		hamming_free_node(copy, nid);
+		return old;
+	}
+	atomic64_inc(&hamming_cow.seq);
+	atomic64_inc(&hamming_snapshot_stats.nodes);
+	return copy;
+}
+
+/**
+ * \brief Copy a page a snapshot shares, before writing it
+ *
+ * Data, code set and the time of the last verification come along, so the
+ * copy doesn't need verifying any sooner than the page did. The copy is
+ * swapped in under the page lock, a losing writer never touches the code
+ * set, which lives in the slot of the winner's table. A same filled page is
+ * copied into a page with data, the write about to happen breaks the fill
+ * (whole page fills replace the shared page instead, see
+ * hamming_tree_page_fill). A compressed page is decompressed into the copy
+ * and the copy encoded, the snapshot keeps it compressed. A written back
+ * page can't be read from here, the copy fails and the writer fetches it
+ * first, see hamming_writeback_fetch. Pages shared by content are copied the same way, snapshot or not, under the index's lock
+ * for them as well, and the slot's reference to them dropped.
+ *
+ * \param[in] slot		Slot the shared page was found in
+ * \param[in] page_ptr		Shared page
+ * \param[in] leaf		Leaf parent slot is in, owned by the caller
+ * \param[in] index		Child index of the page
+ * \param[in] tree_id		Page
+ * \param[in] nid		Node of the shard
+ * \param[in] epoch		Current hamming_cow.epoch
+ *
+ * \return The copy, or the one another writer swapped in first, NULL on failure
+ */
+static hamming_page_t *hamming_tree_cow_page(void **slot, hamming_page_t *page_ptr, hamming_node_t *leaf,
+					     int index, u64 tree_id, int nid, u32 epoch){
+	hamming_page_t *copy = hamming_tree_page_create(leaf, index, nid), *old;
+	spinlock_t *lock = hamming_tree_page_lock(tree_id), *dedup_lock = NULL;
+	bool filled, compressed;
+
+	if(unlikely(copy == NULL)){
+		return NULL;
+	}
+	copy->gen = epoch;
+	spin_lock(lock);
+	if(page_ptr->flags & HAMMING_PAGE_DEDUP){
+		dedup_lock = hamming_dedup_page_lock(page_ptr);
+		spin_lock(dedup_lock);
+	}
+	if(unlikely(page_ptr->flags & HAMMING_PAGE_BACKED)){
+		if(dedup_lock){
+			spin_unlock(dedup_lock);
+		}
+		spin_unlock(lock);
+		hamming_free_page(copy);
+		return NULL;
+	}
+	filled = page_ptr->flags & HAMMING_PAGE_FILLED;
+	compressed = page_ptr->flags & HAMMING_PAGE_COMPRESSED;
+	if(filled){
+		hamming_tree_page_fill_read(hamming_tree_page_fill_verify(page_ptr), copy->data, copy->len);
+		copy->last_check = ktime_get();
+		copy->flags &= ~HAMMING_PAGE_UNINIT;
+	}else if(compressed){
+		if(unlikely(hamming_compress_read(page_ptr, 0, copy->data, copy->len) < 0)){
+			spin_unlock(lock);
+			printk(KERN_ERR "uncorrectable page %llu\n", (unsigned long long)tree_id);
+			hamming_sysfs_reg_error(tree_id);
+			hamming_free_page(copy);
+			return NULL;
+		}
+		copy->last_check = ktime_get();
+		copy->flags &= ~HAMMING_PAGE_UNINIT;
+	}else if(!(page_ptr->flags & HAMMING_PAGE_UNINIT)){
+		memcpy(copy->data, page_ptr->data, page_ptr->len);
+		copy->last_check = page_ptr->last_check;
+		copy->flags &= ~HAMMING_PAGE_UNINIT;
+	}
+	old = cmpxchg(slot, page_ptr, copy);
+	if(old == page_ptr){
+		if(filled || compressed){
+			HAMMING_PAGE_LOGIC(copy);
+		}else{
+			memcpy(copy->code, page_ptr->code, sizeof(hamming_code_set_t));
+		}
+	}
+	if(dedup_lock){
+		spin_unlock(dedup_lock);
+	}
+	spin_unlock(lock);
+	if(old != page_ptr){
+		hamming_free_page(copy);
+		return old;
+	}
+	if(dedup_lock){
+		hamming_dedup_put(page_ptr);
+		atomic64_inc(&hamming_dedup_stats.broken);
+	}else{
+		atomic64_inc(&hamming_snapshot_stats.pages);
+	}
+	return copy;
+}
 
 /**
  * \brief Lookup a node in a tree
  *
- * This is a fairly complicated binary tree traversal that was supposed to allow for
+ * This is a fairly complicated tree traversal that was supposed to allow for
  * partial traversals to generate subtrees that we can use for optimal prefetching,
  * since it would make sense for swap disks to optimize for locality.
  *
- * However, with current testing, I was getting over 90% the performance of loopback devices,
- * so I'm not concerned with increasing performance on that front until later
- *
  * \param[in] subtree		Head of tree to traverse, all fields valid
  * \param[in,out] target	Target location, id and processed_bytes valid on input, ptr valid on output
- * \param[in] create		Flag to allow for creation of new nodes
+ *							(NULL if target isn't under subtree), processed_bits is rounded down
+ *							to a level boundary
+ * \param[in] create		Flag to allow for creation of new nodes, on the node of target's shard
  *
- * \return -ENOMEM or 0 for success
+ * Caller is in an RCU read side section. Two CPUs creating the same node race
+ * on publishing it, the loser frees its copy and both carry on with one.
+ * Creating walks also copy whatever a snapshot shares on the way down, the
+ * target page included, so subtree has to start at a node the caller owns
+ * (a root, or a cursor that was cached by a creating walk). A same filled
+ * target page is given a code set by creating walks, see HAMMING_FILL_COPIES,
+ * and a page shared by content is copied, see hamming_dedup.h. A slot that
+ * empties under a creating walk was unlinked by a discard, the walk has to
+ * start over from a root.
+ *
+ * \return -ENOMEM, -EAGAIN if a discard got in the way, or 0 for success
  */
 static int hamming_tree_resolve_raw(hamming_subtree_t subtree, hamming_subtree_t *target, bool create){
-	u32 cur_mask, end_mask;
-	
+	hamming_node_t *node_ptr;
+	hamming_page_t *page_ptr;
+	hamming_code_set_t *code;
+	void *new_ptr;
+	u32 epoch = 0;
+	bool cow = false;
+	u8 next_bits;
+	int nid = 0, index;
+
 	target->ptr = NULL;
-	cur_mask = (subtree.processed_bits == 32) ? 0 : (1 << (31-subtree.processed_bits));
-	end_mask = (target->processed_bits == 32) ? 0 : (1 << (31-target->processed_bits));
+	if(unlikely(!IS_SUBTREE(subtree.id, subtree.processed_bits, target->id))){
+		return 0; // past what the tree has grown to, or a different branch
+	}
 	if(create){
-        while(cur_mask != end_mask){
-			subtree.ptr = &(((hamming_node_t*)(*subtree.ptr))->child[!!(target->id & cur_mask)]);
-			if(unlikely(*(subtree.ptr) == NULL)){
-				if(unlikely(cur_mask == 1)){ // last generation, hamming_node_t
-					hamming_page_t *page_ptr;
-					
-					*(subtree.ptr) = kzalloc(sizeof(hamming_page_t), GFP_ATOMIC);
-					if(unlikely(*(subtree.ptr) == NULL)){
-						printk(KERN_ERR "can't allocate hamming_page_t\n");
-						return -ENOMEM;
-					}
-					page_ptr = (hamming_page_t*)*(subtree.ptr);
-					page_ptr->data = kzalloc(PAGE_SIZE, GFP_ATOMIC);
-					if(unlikely(page_ptr->data == NULL)){
-						printk(KERN_ERR "can't allocate page data\n");
-						return -ENOMEM;
-					}
-					page_ptr->len = PAGE_SIZE;
-				}else{
-					*(subtree.ptr) = kzalloc(sizeof(hamming_node_t), GFP_ATOMIC);
-					if(unlikely(*(subtree.ptr) == NULL)){
-						printk(KERN_ERR "can't allocate hamming_node_t\n");
-						return -ENOMEM;
-					}
-				}
+		nid = hamming_tree_shard(target->id)->nid;
+		epoch = READ_ONCE(hamming_cow.epoch); // can't move while we are in a writer's section
+		cow = READ_ONCE(hamming_cow.cow);
+	}
+	while((next_bits = subtree.processed_bits + HAMMING_TREE_STEP(subtree.processed_bits)) <= target->processed_bits){
+		node_ptr = rcu_dereference(*(subtree.ptr));
+		if(unlikely(node_ptr == NULL)){
+			return create ? -EAGAIN : 0; // discarded since we came through
+		}
+		if(unlikely(cow) && node_ptr->gen != epoch){
+			node_ptr = hamming_tree_cow_node(subtree.ptr, node_ptr, subtree.processed_bits, nid, epoch);
+			if(unlikely(node_ptr == NULL)){
+				return READ_ONCE(*(subtree.ptr)) ? -ENOMEM : -EAGAIN;
 			}
-			cur_mask >>= 1;
-			subtree.processed_bits++; // only for generate_lca
 		}
-	}else{
-		while(cur_mask != end_mask){
-			subtree.ptr = &(((hamming_node_t*)(*subtree.ptr))->child[!!(target->id & cur_mask)]);
-			if(unlikely(*(subtree.ptr) == NULL)){
+		index = HAMMING_TREE_INDEX(target->id, subtree.processed_bits);
+		subtree.ptr = &(node_ptr->child[index]);
+		subtree.processed_bits = next_bits;
+		new_ptr = rcu_dereference(*(subtree.ptr));
+		if(unlikely(new_ptr == NULL)){
+			if(create == false){
 				return 0; // nothing we can do here
 			}
-			cur_mask >>= 1;
+			if(unlikely(next_bits == PAGE_PROCESSED_BITS)){ // last generation, hamming_page_t
+				new_ptr = hamming_tree_page_create(node_ptr, index, nid);
+				if(unlikely(new_ptr == NULL)){
+					return -ENOMEM;
+				}
+				((hamming_page_t*)new_ptr)->gen = epoch;
+				if(hamming_tree_publish(subtree.ptr, new_ptr) != new_ptr){
+					hamming_free_page(new_ptr);
+				}
+			}else{
+				new_ptr = hamming_alloc_node(GFP_ATOMIC, nid);
+				if(unlikely(new_ptr == NULL)){
+					printk(KERN_ERR "can't allocate hamming_node_t\n");
+					return -ENOMEM;
+				}
+				((hamming_node_t*)new_ptr)->gen = epoch;
+				if(hamming_tree_publish(subtree.ptr, new_ptr) != new_ptr){
+					hamming_free_node(new_ptr, nid);
+				}
+			}
 		}
-	}	
-	
+		if(create && next_bits == PAGE_PROCESSED_BITS){ // whoever won the slot, it's ours now
+			page_ptr = rcu_dereference(*(subtree.ptr));
+			if(unlikely(page_ptr == NULL)){
+				return -EAGAIN;
+			}
+			// a losing copy (or publish) comes back with whatever won, which a dedup write may have shared again
+			while((page_ptr->flags & HAMMING_PAGE_DEDUP) || (unlikely(cow) && page_ptr->gen != epoch)){
+				page_ptr = hamming_tree_cow_page(subtree.ptr, page_ptr, node_ptr, index, target->id, nid, epoch);
+				if(unlikely(page_ptr == NULL)){
+					return READ_ONCE(*(subtree.ptr)) ? -ENOMEM : -EAGAIN;
+				}
+			}
+			if(unlikely(READ_ONCE(page_ptr->code) == NULL)){ // same filled, the write may break the fill
+				code = hamming_tree_page_code(node_ptr, index, nid);
+				if(unlikely(code == NULL)){
+					return -ENOMEM;
+				}
+				hamming_tree_publish((void**)&page_ptr->code, code); // same slot whoever wins
+			}
+		}
+	}
+
+	target->processed_bits = subtree.processed_bits;
 	target->ptr = subtree.ptr;
 	return 0;
 }
@@ -81,48 +367,184 @@ static int hamming_tree_resolve_raw(hamming_subtree_t subtree, hamming_subtree_t
  *
  * Think of it like CoW for traversals, you share the path until you don't anymore, fork off from there.
  *
+ * The shared walk follows the deepest target and stops early at the first
+ * missing node, whatever is left is resolved (and created if asked) from there.
+ * Targets in another shard than subtree come back NULL. While a snapshot
+ * exists, creating targets are resolved one by one from subtree, since the
+ * shared walk doesn't copy anything.
+ *
  * \param[in] subtree		Head of the tree to traverse, all fields valid
  * \param[in,out] target	Array of target locations, id and processed_bytes valid on input, ptr valid on output
  * \param[in] create		Array of create flags for targets
- * \param[in] size			Length of target and create arrays
+ * \param[in] size			Length of target and create arrays, at most 8
  *
  * \return Zero
  */
 static int hamming_tree_resolve(hamming_subtree_t subtree, hamming_subtree_t *target, bool *create, int size){
 	int i;
-	u32 cur_mask;
+	u8 next_bits;
 	hamming_subtree_t next_subtree;
 	hamming_subtree_t *longest_subtree;
+	hamming_node_t *node_ptr;
 	u8 computing = 0;
+	bool cow = false;
 	
 	longest_subtree = target;
-	for(i = 0;i < 8;i++){
+	for(i = 0;i < size;i++){
 		if(target[i].processed_bits > longest_subtree->processed_bits){
 			longest_subtree = &(target[i]);
 		}
+		cow |= create[i] && READ_ONCE(hamming_cow.cow);
+	}
+	if(unlikely(cow || !IS_SUBTREE(subtree.id, subtree.processed_bits, longest_subtree->id))){
+		for(i = 0;i < size;i++){ // can't share the walk, resolve_raw sorts them out
+			hamming_tree_resolve_raw(subtree, &(target[i]), create[i]);
+		}
+		return 0;
 	}
-	cur_mask = (subtree.processed_bits == 32) ? 0 : (1 << (31-subtree.processed_bits));
 	// traverse down the first tree on the main loop, resolve at the end
-	while(cur_mask != 0 && computing != (1 << size)-1){ // non zero
-		next_subtree.ptr = &(((hamming_node_t*)(*subtree.ptr))->child[!!(longest_subtree->id & cur_mask)]);
-		next_subtree.processed_bits = subtree.processed_bits + 1;
-		next_subtree.id = longest_subtree->id & (0xFFFFFFFF << (32-next_subtree.processed_bits)); // can compute directly from tree_id
+	while((next_bits = subtree.processed_bits + HAMMING_TREE_STEP(subtree.processed_bits)) <= longest_subtree->processed_bits &&
+	      computing != (1 << size)-1){
+		node_ptr = rcu_dereference(*subtree.ptr);
+		if(unlikely(node_ptr == NULL)){
+			break; // discarded, resolve_raw sorts them out
+		}
+		next_subtree.ptr = &(node_ptr->child[HAMMING_TREE_INDEX(longest_subtree->id, subtree.processed_bits)]);
+		next_subtree.processed_bits = next_bits;
+		next_subtree.id = HAMMING_TREE_PREFIX(longest_subtree->id, next_subtree.processed_bits); // can compute directly from tree_id
 		for(i = 0;i < size;i++){
 			if(computing & (1 << i)){
 				continue; // already resolved
 			}
-			if(IS_SUBTREE(next_subtree.id, next_subtree.processed_bits, target[i].id) == false){
+			if(target[i].processed_bits < next_bits ||
+			   IS_SUBTREE(next_subtree.id, next_subtree.processed_bits, target[i].id) == false){
 				hamming_tree_resolve_raw(subtree, &(target[i]), create[i]); // has no retval, all errors set target[i] to NULL
 				computing |= (1 << i);
 			}
 		}
-		// next pointer is not used until the next iteration
+		if(rcu_dereference(*(next_subtree.ptr)) == NULL){
+			break; // the rest branch off (or get created) below here
+		}
 		subtree = next_subtree;
-		cur_mask >>= 1;
+	}
+	for(i = 0;i < size;i++){
+		if((computing & (1 << i)) == 0){
+			hamming_tree_resolve_raw(subtree, &(target[i]), create[i]);
+		}
 	}
 	return 0;
 }
 
+static DEFINE_PER_CPU(hamming_tree_cursor_t, hamming_tree_cursor);
+
+/**
+ * \brief Lookup a node starting from this CPU's cursor
+ *
+ * If the cursor (last leaf parent resolved on this CPU) is a prefix of the
+ * target, the walk starts there. Otherwise the leaf parent is resolved from
+ * the root of its shard (grown first if we are creating) and becomes the new
+ * cursor, then the walk finishes from it. A cursor is skipped once a copy on
+ * write may have taken it out of the live tree, and by creating lookups if
+ * it was cached by a read while a snapshot shared the nodes above it. A
+ * creating lookup a discard got in the way of starts over from the root.
+ *
+ * \param[in,out] target	Target location, at least HAMMING_TREE_CURSOR_BITS deep
+ * \param[in] create		Flag to allow for creation of new nodes
+ *
+ * \return -ENOMEM or 0 for success, target->ptr is NULL if it doesn't exist
+ */
+static int hamming_tree_resolve_cursor(hamming_subtree_t *target, bool create){
+	hamming_tree_cursor_t *cursor;
+	hamming_subtree_t parent;
+	s64 seq;
+	int ret;
+
+again:
+	seq = atomic64_read(&hamming_cow.seq);
+	ret = 0;
+	target->ptr = NULL;
+	cursor = get_cpu_ptr(&hamming_tree_cursor);
+	if(likely(cursor->subtree.ptr != NULL) &&
+	   IS_SUBTREE(cursor->subtree.id, HAMMING_TREE_CURSOR_BITS, target->id) &&
+	   likely(cursor->seq == seq) && (cursor->writable || !create)){
+		cursor->hits++;
+		parent = cursor->subtree;
+	}else{
+		cursor->misses++;
+		if(create){
+			ret = hamming_tree_grow(target->id);
+			if(unlikely(ret < 0)){
+				goto out;
+			}
+		}
+		parent.processed_bits = HAMMING_TREE_CURSOR_BITS;
+		parent.id = HAMMING_TREE_PREFIX(target->id, HAMMING_TREE_CURSOR_BITS);
+		ret = hamming_tree_resolve_raw(hamming_tree_head(target->id), &parent, create);
+		if(ret < 0 || parent.ptr == NULL){
+			goto out; // reads of a missing leaf parent, nothing below it
+		}
+		cursor->subtree = parent;
+		cursor->nid = hamming_tree_shard(target->id)->nid;
+		cursor->seq = seq;
+		cursor->writable = create || !READ_ONCE(hamming_cow.cow);
+	}
+	if(cursor->nid == numa_mem_id()){
+		cursor->local++;
+	}else{
+		cursor->remote++;
+	}
+	ret = hamming_tree_resolve_raw(parent, target, create);
+out:
+	if(unlikely(ret == -EAGAIN)){
+		cursor->subtree.ptr = NULL; // may be what was discarded
+		put_cpu_ptr(&hamming_tree_cursor);
+		goto again;
+	}
+	put_cpu_ptr(&hamming_tree_cursor);
+	return ret;
+}
+
+/**
+ * \brief Sum cursor hits and misses over every CPU
+ *
+ * \param[out] hits		Lookups that started from a cursor
+ * \param[out] misses		Lookups that started from the root
+ */
+static void hamming_tree_cursor_stats(u64 *hits, u64 *misses){
+	int cpu;
+
+	*hits = 0;
+	*misses = 0;
+	for_each_possible_cpu(cpu){
+		*hits += per_cpu_ptr(&hamming_tree_cursor, cpu)->hits;
+		*misses += per_cpu_ptr(&hamming_tree_cursor, cpu)->misses;
+	}
+}
+
+/**
+ * \brief Sum local and remote lookups over the CPUs of a node
+ *
+ * A lookup is local when the shard it went to is on the CPU's node, misses
+ * of reads that found nothing aren't counted
+ *
+ * \param[in] nid		Node of the CPUs
+ * \param[out] local		Lookups into a shard on nid
+ * \param[out] remote		Lookups into a shard on another node
+ */
+static void hamming_tree_numa_stats(int nid, u64 *local, u64 *remote){
+	int cpu;
+
+	*local = 0;
+	*remote = 0;
+	for_each_possible_cpu(cpu){
+		if(cpu_to_mem(cpu) != nid){
+			continue;
+		}
+		*local += per_cpu_ptr(&hamming_tree_cursor, cpu)->local;
+		*remote += per_cpu_ptr(&hamming_tree_cursor, cpu)->remote;
+	}
+}
+
 /**
  * \brief Generate page from subtree
  *
@@ -141,27 +563,7 @@ static hamming_page_t *hamming_tree_page_from_subtree(hamming_subtree_t subtree)
 		// often the case for reads where the page doesn't exist (no parent to reference from)
 		return NULL;
 	}
-	return *(subtree.ptr);
-}
-
-/**
- * \brief Generate node from subtree
- * If the node is not a leaf node, then we interpret the pointer as a hamming_node_t
- *
- * \param[in] subtree 		Subtree to pull node pointer from
- *
- * \return Node pointer on success, NULL on failure
- */
-static hamming_node_t *hamming_tree_node_from_subtree(hamming_subtree_t subtree){
-	if(unlikely(subtree.processed_bits >= PAGE_PROCESSED_BITS)){
-		printk(KERN_ERR "requested a node, but our processed_bits say we are a page or out of bounds (%d)\n", subtree.processed_bits);
-		return NULL;
-	}
-	if(unlikely(subtree.ptr == NULL)){
-		printk(KERN_ERR "subtree.ptr is a NULL\n");
-		return NULL;
-	}
-	return *(subtree.ptr);
+	return rcu_dereference(*(subtree.ptr));
 }
 
 /**
@@ -196,15 +598,52 @@ static void *hamming_tree_sector_from_page(
 	return page_ptr->data + (chunk * SECTOR_SIZE);
 }
 
+/**
+ * \brief Find page in tree
+ *
+ * \param[in] tree_id		Traversal to take down tree, pulled from SECTOR_TO_PAGE
+ * \param[in] create		True to create page if it doesn't exist
+ *
+ * \return Pointer to page on success, NULL on failure
+ */
+static hamming_page_t *hamming_tree_page_simple(
+	u64 tree_id, bool create){
+	hamming_subtree_t subtree;
+	hamming_page_t *page_ptr;
+
+	do{
+		subtree.processed_bits = PAGE_PROCESSED_BITS; // leaf depth, one page
+		subtree.id = tree_id;
+
+		if(unlikely(hamming_tree_resolve_cursor(&subtree, create) < 0)){
+			printk(KERN_ERR "cannot create subtree\n");
+			return NULL;
+		}
+
+		if(subtree.ptr == NULL){ // often the case for reads
+			return NULL;
+		}
+
+		page_ptr = hamming_tree_page_from_subtree(subtree);
+	}while(unlikely(page_ptr == NULL) && create); // a discard took it out again
+	if(unlikely(page_ptr == NULL)){
+		if(create){
+			printk(KERN_ERR "hamming_page_from_subtree returned NULL, check the tree functions\n");
+		}
+		return NULL;
+	}
+	return page_ptr;
+}
+
 /**
  * \brief Find sector in tree
  *
  * Given a tree_id and a chunk, traverse the tree and return the proper sector
- * information. This is often used to handle BIO requests. 
- *
- * For simplicity (for now), error correction is done when create is false (i.e.
- * when read operations are going on) on the entire page, if the last check time
- * is less than a second ago
+ * information. Doesn't verify anything, see hamming_bvec_read for that.
+ * Same filled and compressed pages have no sector to point into, creating
+ * lookups give them data first and the others come back NULL. Written back
+ * pages always come back NULL, fetching them sleeps, see
+ * hamming_writeback_fetch. Counts as an access for hamming_compress_touch.
  *
  * \param[in] tree_id		Traversal to take down tree, pulled from SECTOR_TO_PAGE
  * \param[in] chunk			Offset in page for sector, pulled from SECTOR_TO_CHUNK
@@ -213,76 +652,1286 @@ static void *hamming_tree_sector_from_page(
  * \return Pointer to sector on success, NULL on failure
  */
 static void *hamming_tree_sector_simple(
-	u32 tree_id, u8 chunk, bool create){
-	hamming_subtree_t subtree;
+	u64 tree_id, u8 chunk, bool create){
 	hamming_page_t *page_ptr;
+	spinlock_t *lock;
 
-	subtree.processed_bits = 32; // at the 32nd depth, one node
-	subtree.id = tree_id;
-
-	if(unlikely(hamming_tree_resolve_raw(tree_head, &subtree, create) < 0)){
-		printk(KERN_ERR "cannot create subtree\n");
+	page_ptr = hamming_tree_page_simple(tree_id, create);
+	if(page_ptr == NULL){
 		return NULL;
 	}
-
-	if(subtree.ptr == NULL){ // often the case for reads
+	hamming_compress_touch(page_ptr);
+	if(unlikely(READ_ONCE(page_ptr->flags) & HAMMING_PAGE_BACKED)){
 		return NULL;
 	}
-
-	page_ptr = hamming_tree_page_from_subtree(subtree);
-	if(unlikely(page_ptr == NULL)){
-		if(create){
-			printk(KERN_ERR "hamming_page_from_subtree returned NULL, check the binary tree functions\n");
+	if(unlikely(page_ptr->flags & (HAMMING_PAGE_UNINIT | HAMMING_PAGE_FILLED | HAMMING_PAGE_COMPRESSED))){ // caller could touch any part of it
+		if((page_ptr->flags & (HAMMING_PAGE_FILLED | HAMMING_PAGE_COMPRESSED)) && !create){
+			return NULL; // no data to point into
+		}
+		lock = hamming_tree_page_lock(tree_id);
+		spin_lock(lock);
+		if(page_ptr->flags & HAMMING_PAGE_UNINIT){
+			hamming_tree_page_zero(page_ptr);
+		}else if((page_ptr->flags & HAMMING_PAGE_FILLED) && hamming_tree_page_unfill(page_ptr) < 0){
+			page_ptr = NULL;
+		}else if((page_ptr->flags & HAMMING_PAGE_COMPRESSED) && hamming_compress_expand(page_ptr, true) < 0){
+			page_ptr = NULL;
+		}
+		spin_unlock(lock);
+		if(page_ptr == NULL){
+			return NULL;
 		}
-		return NULL;
 	}
-    
 	return hamming_tree_sector_from_page(page_ptr, chunk);
 }
 
 /**
- * \brief Run error correction on a page
+ * \brief Stripe lock for a page
  *
- * This runs the vectorized ECC over an entire page. To keep sizes efficient, and because this was
- * originally modelled after 4K pages of RAM, not 512 sectors on disk, you can only run ECC operations
- * on 8 sectors at a time.
- * 
- * \param[in] page_ptr		Pointer to page to correct
+ * Held around anything that reads data against its codes or changes either,
+ * so verification never sees a half written page. Locks live in the page's
+ * shard, hashed since the low bits of the ids in a shard aren't uniform.
+ *
+ * \param[in] tree_id		Page to lock
  *
- * \return Number of errors detected
+ * \return Lock to hold
  */
-static int hamming_tree_page_correct(hamming_page_t *page_ptr){
-	int retval;
-	ktime_t cur_time;
-	cur_time = ktime_get();
+static spinlock_t *hamming_tree_page_lock(u64 tree_id){
+	return &hamming_tree_shard(tree_id)->page_locks[hash_64(tree_id, ilog2(HAMMING_PAGE_LOCKS))];
+}
 
-	if(cur_time - page_ptr->last_check){
-		int i;
-		hamming_code_set_t new_code_set;
-		logic_set(&new_code_set, (__int128*)page_ptr->data, page_ptr->len/16);
-		retval = correct_set(&new_code_set, &(page_ptr->code), (__int128*)page_ptr->data, page_ptr->len/16);
-		page_ptr->last_check = cur_time;
+/**
+ * \brief Stripe lock for a page found at tree_id
+ *
+ * A page shared by content is reachable through any number of ids, so its
+ * lock comes from the dedup index instead. The flag never changes over the
+ * life of a page.
+ *
+ * \param[in] page_ptr		Page
+ * \param[in] tree_id		Id it was found at
+ *
+ * \return Lock to hold
+ */
+static spinlock_t *hamming_tree_page_lock_of(hamming_page_t *page_ptr, u64 tree_id){
+	if(unlikely(page_ptr->flags & HAMMING_PAGE_DEDUP)){
+		return hamming_dedup_page_lock(page_ptr);
 	}
-	return retval;
+	return hamming_tree_page_lock(tree_id);
 }
 
-static hamming_node_t tree_node;
-static hamming_node_t *tree_ptr;
+/**
+ * \brief Give a never written page its contents
+ *
+ * The codes of an all zero page are all zero, so nothing is encoded
+ *
+ * \param[in] page_ptr		Page flagged HAMMING_PAGE_UNINIT
+ */
+static void hamming_tree_page_zero(hamming_page_t *page_ptr){
+	write_seqcount_begin(&page_ptr->seq);
+	memset(page_ptr->data, 0, page_ptr->len);
+	memset(page_ptr->code, 0, sizeof(hamming_code_set_t));
+	page_ptr->flags &= ~HAMMING_PAGE_UNINIT;
+	write_seqcount_end(&page_ptr->seq);
+	atomic64_inc(&hamming_alloc_stats.zeroed);
+}
 
 /**
- * \brief Initialize binary tree
- * 
- * I had some crazy idea of doing a double pointer traversal to optimize deletions with a simpler
- * code path (pointer to parent's pointer to child), and that's why we have tree_node and tree_ptr.
- * It works, but hot deletions from the tree isn't something implemented yet, so no way to show
- * whether that was a good choice or not currently.
- */
-static void hamming_tree_init(void){
-	if(tree_head.ptr != NULL){
-		printk(KERN_ERR "tree started with a non-NULL, something fishy is happening\n");		
-	}
-	tree_ptr = &tree_node;
-	tree_head.ptr = (void**)&tree_ptr;
-	tree_head.processed_bits = 0;
-	tree_head.id = 0;
+ * \brief Check if a buffer is one word over and over
+ *
+ * Bails out at the first word that differs, most data does early on.
+ *
+ * \param[in] data		Buffer, word aligned
+ * \param[in] len		Length in bytes, a multiple of 8
+ * \param[out] fill		The word, if it is
+ *
+ * \return True if every word of data is the same
+ */
+static bool hamming_tree_data_filled(const void *data, u32 len, u64 *fill){
+	const u64 *word = data;
+	u32 i;
+
+	for(i = 1;i < len/sizeof(u64);i++){
+		if(word[i] != word[0]){
+			return false;
+		}
+	}
+	*fill = word[0];
+	return true;
+}
+
+static void hamming_tree_page_fill_set(hamming_page_t *page_ptr, u64 fill){
+	int i;
+
+	for(i = 0;i < HAMMING_FILL_COPIES;i++){
+		page_ptr->fill[i] = fill;
+	}
+}
+
+// bitwise majority of the copies, see HAMMING_FILL_COPIES
+static u64 hamming_tree_fill_vote(const u64 *fill){
+	return (fill[0] & fill[1]) | (fill[0] & fill[2]) | (fill[1] & fill[2]);
+}
+
+/**
+ * \brief Slot of a page in a leaf parent the live tree owns
+ *
+ * Creates the leaf parent, or copies it if a snapshot shares it. Caller is
+ * in a writer's section.
+ *
+ * \param[in] tree_id		Page
+ *
+ * \return Slot, NULL on failure
+ */
+static hamming_page_t **hamming_tree_leaf_slot(u64 tree_id){
+	hamming_subtree_t leaf;
+	hamming_node_t *leaf_ptr;
+	u32 epoch = READ_ONCE(hamming_cow.epoch);
+
+again:
+	leaf.processed_bits = HAMMING_TREE_CURSOR_BITS;
+	leaf.id = tree_id;
+	if(unlikely(hamming_tree_resolve_cursor(&leaf, true) < 0 || leaf.ptr == NULL)){
+		return NULL;
+	}
+	leaf_ptr = rcu_dereference(*(leaf.ptr));
+	if(unlikely(leaf_ptr == NULL)){
+		goto again; // discarded since it was resolved
+	}
+	if(unlikely(READ_ONCE(hamming_cow.cow)) && leaf_ptr->gen != epoch){
+		leaf_ptr = hamming_tree_cow_node(leaf.ptr, leaf_ptr, HAMMING_TREE_CURSOR_BITS, hamming_tree_shard(tree_id)->nid, epoch);
+		if(unlikely(leaf_ptr == NULL)){
+			if(READ_ONCE(*(leaf.ptr)) == NULL){
+				goto again;
+			}
+			return NULL;
+		}
+	}
+	return (hamming_page_t**)&leaf_ptr->child[HAMMING_TREE_INDEX(tree_id, HAMMING_TREE_CURSOR_BITS)];
+}
+
+// true if a page can be replaced whole instead of written, a snapshot or the dedup index shares it
+static bool hamming_tree_page_replaceable(hamming_page_t *page_ptr, bool cow, u32 epoch){
+	return (page_ptr->flags & HAMMING_PAGE_DEDUP) || (unlikely(cow) && page_ptr->gen != epoch);
+}
+
+/**
+ * \brief Store a full page write of one word
+ *
+ * Where there is no page, a zero fill is dropped (that's what a missing page
+ * reads as) and anything else gets a descriptor without data. A page a
+ * snapshot or the dedup index shares is replaced by one the same way,
+ * there's nothing of it to copy. A same filled page just takes the new fill.
+ * Caller is in a writer's section, see hamming_tree_write_begin.
+ *
+ * \param[in] tree_id		Page
+ * \param[in] fill		Every word of the write
+ *
+ * \return -ENOMEM on failure, 1 if the page has data and needs a regular write, 0 if stored
+ */
+static int hamming_tree_page_fill(u64 tree_id, u64 fill){
+	hamming_page_t *page_ptr, *new_ptr;
+	hamming_page_t **slot = hamming_tree_leaf_slot(tree_id);
+	spinlock_t *lock;
+	u32 epoch = READ_ONCE(hamming_cow.epoch);
+	bool cow = READ_ONCE(hamming_cow.cow);
+	int nid = hamming_tree_shard(tree_id)->nid;
+
+	if(unlikely(slot == NULL)){
+		return -ENOMEM;
+	}
+	while(true){
+		page_ptr = rcu_dereference(*slot);
+		if(page_ptr != NULL && !hamming_tree_page_replaceable(page_ptr, cow, epoch)){
+			break;
+		}
+		if(page_ptr == NULL && fill == 0){
+			atomic64_inc(&hamming_fill_stats.elided);
+			return 0;
+		}
+		new_ptr = hamming_alloc_page_filled(GFP_ATOMIC, hamming_alloc_page_nid(nid));
+		if(unlikely(new_ptr == NULL)){
+			printk(KERN_ERR "can't allocate a same filled hamming_page_t\n");
+			return -ENOMEM;
+		}
+		new_ptr->gen = epoch;
+		new_ptr->last_check = ktime_get();
+		hamming_tree_page_fill_set(new_ptr, fill);
+		if(cmpxchg(slot, page_ptr, new_ptr) == page_ptr){
+			if(page_ptr && (page_ptr->flags & HAMMING_PAGE_DEDUP)){
+				hamming_dedup_put(page_ptr);
+			}
+			atomic64_inc(&hamming_fill_stats.stored);
+			return 0;
+		}
+		hamming_free_page(new_ptr); // another writer got there first, look again
+	}
+	lock = hamming_tree_page_lock(tree_id);
+	spin_lock(lock);
+	if(!(page_ptr->flags & HAMMING_PAGE_FILLED)){
+		spin_unlock(lock);
+		return 1;
+	}
+	write_seqcount_begin(&page_ptr->seq);
+	hamming_tree_page_fill_set(page_ptr, fill);
+	page_ptr->last_check = ktime_get();
+	page_ptr->flags &= ~HAMMING_PAGE_READAHEAD;
+	write_seqcount_end(&page_ptr->seq);
+	spin_unlock(lock);
+	atomic64_inc(&hamming_fill_stats.stored);
+	return 0;
+}
+
+/**
+ * \brief Store a full page write as a page shared by content
+ *
+ * Only where the page has no data of its own: no page yet, or one a snapshot
+ * or the dedup index shares, which is replaced whole like
+ * hamming_tree_page_fill does. A page the live tree owns is written in place,
+ * the write would cost a lookup and a page of its own anyway once anything
+ * else changes it. Caller is in a writer's section.
+ *
+ * \param[in] tree_id		Page
+ * \param[in] data		Contents of the write, a full page
+ *
+ * \return -ENOMEM on failure, 1 if the page has data and needs a regular write, 0 if stored
+ */
+static int hamming_tree_page_dedup(u64 tree_id, const u8 *data){
+	hamming_page_t *page_ptr, *shared_ptr, *old;
+	hamming_page_t **slot = hamming_tree_leaf_slot(tree_id);
+	u32 epoch = READ_ONCE(hamming_cow.epoch);
+	bool cow = READ_ONCE(hamming_cow.cow);
+
+	if(unlikely(slot == NULL)){
+		return -ENOMEM;
+	}
+	page_ptr = rcu_dereference(*slot);
+	if(page_ptr != NULL && !hamming_tree_page_replaceable(page_ptr, cow, epoch)){
+		return 1;
+	}
+	shared_ptr = hamming_dedup_get(data, tree_id, hamming_tree_shard(tree_id)->nid);
+	if(unlikely(shared_ptr == NULL)){
+		return -ENOMEM;
+	}
+	while(page_ptr != shared_ptr){
+		old = cmpxchg(slot, page_ptr, shared_ptr);
+		if(old == page_ptr){
+			if(page_ptr && (page_ptr->flags & HAMMING_PAGE_DEDUP)){
+				hamming_dedup_put(page_ptr);
+			}
+			return 0;
+		}
+		page_ptr = old; // another writer got there first, look again
+		if(page_ptr != NULL && !hamming_tree_page_replaceable(page_ptr, cow, epoch)){
+			hamming_dedup_put(shared_ptr);
+			return 1;
+		}
+	}
+	hamming_dedup_put(shared_ptr); // rewritten with what it shares already, the slot has its reference
+	return 0;
+}
+
+/**
+ * \brief Vote on the fill of a same filled page
+ *
+ * Copies the majority disagrees with are put right. Caller holds the page lock.
+ *
+ * \param[in] page_ptr		Page flagged HAMMING_PAGE_FILLED
+ *
+ * \return The fill
+ */
+static u64 hamming_tree_page_fill_verify(hamming_page_t *page_ptr){
+	u64 fill = hamming_tree_fill_vote(page_ptr->fill);
+	int i;
+
+	for(i = 0;i < HAMMING_FILL_COPIES;i++){
+		if(unlikely(page_ptr->fill[i] != fill)){
+			write_seqcount_begin(&page_ptr->seq);
+			page_ptr->fill[i] = fill;
+			write_seqcount_end(&page_ptr->seq);
+			atomic64_inc(&hamming_fill_stats.corrected);
+		}
+	}
+	page_ptr->last_check = ktime_get();
+	return fill;
+}
+
+static void hamming_tree_page_fill_read(u64 fill, u8 *buf, u32 len){
+	memset64((u64*)buf, fill, len/sizeof(u64));
+}
+
+/**
+ * \brief Give a same filled page data, ahead of a write that breaks the fill
+ *
+ * The data is the fill and gets encoded into the page's code set, which a
+ * creating walk attached. Caller holds the page lock.
+ *
+ * \param[in] page_ptr		Page flagged HAMMING_PAGE_FILLED
+ *
+ * \return -ENOMEM on failure, 0 otherwise
+ */
+static int hamming_tree_page_unfill(hamming_page_t *page_ptr){
+	u64 fill = hamming_tree_page_fill_verify(page_ptr);
+	u32 flags = 0;
+	u8 *data;
+
+	if(unlikely(page_ptr->code == NULL)){
+		printk(KERN_ERR "same filled page has no code set, check the tree functions\n");
+		return -ENOMEM;
+	}
+	data = hamming_alloc_page_data(GFP_ATOMIC, page_ptr, &flags);
+	if(unlikely(data == NULL)){
+		printk(KERN_ERR "can't allocate data for a same filled page\n");
+		return -ENOMEM;
+	}
+	hamming_tree_page_fill_read(fill, data, page_ptr->len);
+	write_seqcount_begin(&page_ptr->seq);
+	WRITE_ONCE(page_ptr->data, data);
+	HAMMING_PAGE_LOGIC(page_ptr);
+	page_ptr->last_check = ktime_get();
+	page_ptr->flags = (page_ptr->flags & ~HAMMING_PAGE_FILLED) | flags;
+	write_seqcount_end(&page_ptr->seq);
+	atomic64_inc(&hamming_fill_stats.unfilled);
+	return 0;
+}
+
+/**
+ * \brief Check if a page's last verification can be trusted
+ *
+ * Pages verified ahead of a sequential reader are trusted for
+ * HAMMING_MAX_READAHEAD_NS_DIFF, once, everything else for
+ * HAMMING_MAX_NS_DIFF. Caller holds the page lock.
+ *
+ * \param[in] page_ptr		Page to check
+ *
+ * \return True if the page doesn't need verifying
+ */
+static bool hamming_tree_page_trusted(hamming_page_t *page_ptr){
+	ktime_t diff = ktime_get() - page_ptr->last_check;
+
+	if(page_ptr->flags & HAMMING_PAGE_READAHEAD){
+		page_ptr->flags &= ~HAMMING_PAGE_READAHEAD;
+		return diff <= HAMMING_MAX_READAHEAD_NS_DIFF;
+	}
+	return diff <= HAMMING_MAX_NS_DIFF;
+}
+
+/**
+ * \brief Copy part of a page out without its lock, if its last verification is still trusted
+ *
+ * Same trust rules as hamming_tree_page_trusted. A readahead verification is
+ * consumed with cmpxchg, since this races the locked paths changing flags,
+ * and the copy is retried if the seqcount moved under it. Caller is in an RCU
+ * read side section. Same filled pages are synthesized from their fill while
+ * all the copies agree, compressed and written back pages are left to the
+ * locked path.
+ *
+ * \param[in] page_ptr		Page to read
+ * \param[in] chunk		First sector to copy
+ * \param[out] buf		Where to copy to
+ * \param[in] len		Bytes to copy, no further than the end of the page
+ * \param[out] ahead		True if a readahead verification was used up
+ *
+ * \return False if the page is uninitialized, compressed, written back or has to be verified, nothing was copied then
+ */
+static bool hamming_tree_page_read_trusted(hamming_page_t *page_ptr, u8 chunk, u8 *buf, u32 len, bool *ahead){
+	unsigned int seq;
+	ktime_t diff;
+	u32 flags;
+
+	*ahead = false;
+	do{
+		seq = read_seqcount_begin(&page_ptr->seq);
+		flags = READ_ONCE(page_ptr->flags);
+		diff = ktime_get() - READ_ONCE(page_ptr->last_check);
+		if(flags & (HAMMING_PAGE_UNINIT | HAMMING_PAGE_COMPRESSED | HAMMING_PAGE_BACKED)){
+			return false;
+		}
+		if(flags & HAMMING_PAGE_FILLED){
+			if(unlikely(READ_ONCE(page_ptr->fill[0]) != READ_ONCE(page_ptr->fill[1]) ||
+				    READ_ONCE(page_ptr->fill[1]) != READ_ONCE(page_ptr->fill[2]))){
+				return false; // let the locked path vote
+			}
+			hamming_tree_page_fill_read(READ_ONCE(page_ptr->fill[0]), buf, len);
+			continue;
+		}
+		if(flags & HAMMING_PAGE_READAHEAD){
+			if(diff > HAMMING_MAX_READAHEAD_NS_DIFF ||
+			   cmpxchg(&page_ptr->flags, flags, flags & ~HAMMING_PAGE_READAHEAD) != flags){
+				return false;
+			}
+			*ahead = true;
+		}else if(diff > HAMMING_MAX_NS_DIFF && !*ahead){ // a retry keeps what it consumed
+			return false;
+		}
+		memcpy(buf, page_ptr->data + chunk*SECTOR_SIZE, len);
+	}while(read_seqcount_retry(&page_ptr->seq, seq));
+	return true;
+}
+
+/**
+ * \brief Verify and correct a page
+ *
+ * This runs the vectorized ECC over an entire page. To keep sizes efficient, and because this was
+ * originally modelled after 4K pages of RAM, not 512 sectors on disk, you can only run ECC operations
+ * on 8 sectors at a time. Caller holds the page lock, lockless readers retry
+ * if a correction changed the data under them.
+ *
+ * \param[in] page_ptr		Pointer to page to correct
+ *
+ * \return Negative if uncorrectable, number of errors corrected otherwise
+ */
+static int hamming_tree_page_verify(hamming_page_t *page_ptr){
+	int retval = 0;
+	hamming_code_set_t new_code_set;
+
+	logic_set(&new_code_set, (hamming_row_t*)page_ptr->data, HAMMING_PAGE_ROWS(page_ptr));
+	if(memcmp(&new_code_set, page_ptr->code, sizeof(hamming_code_set_t)) != 0){
+		write_seqcount_begin(&page_ptr->seq);
+		retval = correct_set(&new_code_set, page_ptr->code, (hamming_row_t*)page_ptr->data, HAMMING_PAGE_ROWS(page_ptr));
+		write_seqcount_end(&page_ptr->seq);
+	}
+	page_ptr->last_check = ktime_get();
+	return retval;
+}
+
+/**
+ * \brief Run error correction on a page
+ *
+ * Verifies unless the last verification is still trusted, see
+ * hamming_tree_page_trusted
+ *
+ * \param[in] page_ptr		Pointer to page to correct
+ *
+ * \return Negative if uncorrectable, number of errors corrected otherwise
+ */
+static int hamming_tree_page_correct(hamming_page_t *page_ptr){
+	if(hamming_tree_page_trusted(page_ptr)){
+		return 0;
+	}
+	return hamming_tree_page_verify(page_ptr);
+}
+
+/**
+ * \brief Shard a page lives in
+ *
+ * Round robin by leaf parent, see hamming_shard_t
+ *
+ * \param[in] tree_id		Page
+ *
+ * \return Shard, never NULL once the tree is initialized
+ */
+static hamming_shard_t *hamming_tree_shard(u64 tree_id){
+	return hamming_shards[(tree_id >> HAMMING_TREE_LEVEL_BITS) % hamming_shard_count];
+}
+
+/**
+ * \brief Current root of a shard
+ *
+ * A root never changes once published, growing puts a new one above it and
+ * bumps the height, so a stale head is still a valid (smaller) tree
+ *
+ * \param[in] tree_id		Any page of the shard
+ *
+ * \return Subtree of the root, covers every id the shard has grown to
+ */
+static hamming_subtree_t hamming_tree_head(u64 tree_id){
+	hamming_shard_t *shard = hamming_tree_shard(tree_id);
+	hamming_subtree_t head;
+	int height = smp_load_acquire(&shard->height);
+
+	head.ptr = &shard->roots[height];
+	head.processed_bits = HAMMING_TREE_ROOT_BITS(height);
+	head.id = 0;
+	return head;
+}
+
+/**
+ * \brief Grow a shard until its root covers an id
+ *
+ * The old root becomes child 0 of the new one (every id it covers has zeroes
+ * above it), so lookup depth follows the largest page written, not the
+ * width of the id.
+ *
+ * \param[in] tree_id		Page that is about to be created
+ *
+ * \return -ENOMEM if a root couldn't be allocated, 0 otherwise
+ */
+static int hamming_tree_grow(u64 tree_id){
+	hamming_shard_t *shard = hamming_tree_shard(tree_id);
+	hamming_node_t *node_ptr;
+	int ret = 0;
+
+	if(likely(IS_SUBTREE(0, HAMMING_TREE_ROOT_BITS(smp_load_acquire(&shard->height)), tree_id))){
+		return 0;
+	}
+	spin_lock(&shard->grow_lock);
+	while(!IS_SUBTREE(0, HAMMING_TREE_ROOT_BITS(shard->height), tree_id)){
+		node_ptr = hamming_alloc_node(GFP_ATOMIC, shard->nid);
+		if(unlikely(node_ptr == NULL)){
+			printk(KERN_ERR "can't allocate a new root\n");
+			ret = -ENOMEM;
+			break;
+		}
+		node_ptr->child[0] = shard->roots[shard->height];
+		node_ptr->gen = READ_ONCE(hamming_cow.epoch); // roots are never shared, see hamming_tree_snapshot_take
+		shard->roots[shard->height + 1] = node_ptr;
+		smp_store_release(&shard->height, shard->height + 1);
+	}
+	spin_unlock(&shard->grow_lock);
+	return ret;
+}
+
+/**
+ * \brief Initialize the tree, one shard per node with memory
+ * 
+ * I had some crazy idea of doing a double pointer traversal to optimize deletions with a simpler
+ * code path (pointer to parent's pointer to child), and that's why roots live in shard->roots.
+ * Deletions ended up walking down from the roots instead, see hamming_tree_discard.
+ *
+ * \return -ENOMEM if a shard or the reclaim workqueue couldn't be allocated (hamming_tree_close cleans up), 0 otherwise
+ */
+static int hamming_tree_init(void){
+	hamming_shard_t *shard;
+	int nid, i;
+
+	if(hamming_shard_count != 0){
+		printk(KERN_ERR "tree started with shards, something fishy is happening\n");
+	}
+	spin_lock_init(&hamming_tree_reclaimer.lock);
+	init_rwsem(&hamming_tree_reclaimer.walkers);
+	INIT_WORK(&hamming_tree_reclaimer.work, hamming_tree_reclaim_work);
+	hamming_tree_reclaimer.wq = alloc_workqueue("hamming_reclaim", WQ_UNBOUND | WQ_MEM_RECLAIM, 1);
+	if(hamming_tree_reclaimer.wq == NULL){
+		return -ENOMEM;
+	}
+	for_each_node_state(nid, N_MEMORY){
+		shard = kzalloc_node(sizeof(hamming_shard_t), GFP_KERNEL, nid);
+		if(shard == NULL){
+			return -ENOMEM;
+		}
+		for(i = 0;i < HAMMING_PAGE_LOCKS;i++){
+			spin_lock_init(&shard->page_locks[i]);
+		}
+		spin_lock_init(&shard->grow_lock);
+		shard->nid = nid;
+		shard->roots[1] = &shard->root;
+		shard->height = 1;
+		hamming_shards[hamming_shard_count++] = shard;
+	}
+	printk(KERN_INFO "Tree split into %d shards\n", hamming_shard_count);
+	return 0;
+}
+
+/**
+ * \brief Free everything below a node
+ *
+ * \param[in] node_ptr		Node to empty, not freed itself
+ * \param[in] processed_bits	Depth of the node
+ * \param[in] nid		Node of the shard
+ */
+static void hamming_tree_free_node(hamming_node_t *node_ptr, u8 processed_bits, int nid){
+	u8 next_bits = processed_bits + HAMMING_TREE_STEP(processed_bits);
+	int i;
+
+	if(processed_bits == HAMMING_TREE_CURSOR_BITS){
+		hamming_tree_dedup_put_leaf(node_ptr);
+	}
+	for(i = 0;i < (1 << HAMMING_TREE_STEP(processed_bits));i++){
+		if(node_ptr->child[i] == NULL){
+			continue;
+		}
+		if(next_bits == PAGE_PROCESSED_BITS){
+			hamming_free_page(node_ptr->child[i]);
+		}else{
+			hamming_tree_free_node(node_ptr->child[i], next_bits, nid);
+			hamming_free_node(node_ptr->child[i], nid);
+		}
+		node_ptr->child[i] = NULL;
+	}
+	if(processed_bits == HAMMING_TREE_CURSOR_BITS){ // leaf parent
+		for(i = 0;i < HAMMING_TREE_FANOUT/HAMMING_CODE_TABLE_PAGES;i++){
+			if(node_ptr->codes[i]){
+				hamming_free_codes(node_ptr->codes[i], nid);
+				node_ptr->codes[i] = NULL;
+			}
+		}
+	}
+}
+
+/**
+ * \brief Verify every page under a leaf parent
+ *
+ * Code sets are read in order out of the leaf's tables, and the data of the
+ * next page is prefetched while the current one is verified. Pages are only
+ * locked one at a time, I/O carries on around the scrub. Written back pages
+ * are verified when they're fetched. Caller is in an RCU read side section.
+ *
+ * \param[in] leaf		Leaf parent
+ * \param[in] id		Id of its first page
+ */
+static void hamming_tree_scrub_leaf(hamming_node_t *leaf, u64 id){
+	hamming_page_t *page_ptr, *next_ptr = rcu_dereference(leaf->child[0]);
+	spinlock_t *lock;
+	int i, ret;
+
+	for(i = 0;i < HAMMING_TREE_FANOUT;i++){
+		page_ptr = next_ptr;
+		next_ptr = i + 1 < HAMMING_TREE_FANOUT ? rcu_dereference(leaf->child[i + 1]) : NULL;
+		if(next_ptr){
+			prefetch(READ_ONCE(next_ptr->data)); // NULL for same filled pages, prefetch doesn't fault
+		}
+		if(page_ptr == NULL || (READ_ONCE(page_ptr->flags) & (HAMMING_PAGE_UNINIT | HAMMING_PAGE_DEDUP | HAMMING_PAGE_BACKED))){
+			continue; // nothing to check against yet, verified once from the dedup index, or not in RAM
+		}
+		lock = hamming_tree_page_lock(id + i);
+		spin_lock(lock);
+		if(page_ptr->flags & HAMMING_PAGE_FILLED){
+			hamming_tree_page_fill_verify(page_ptr); // counted as fill corrections
+			ret = 0;
+		}else{
+			ret = page_ptr->flags & (HAMMING_PAGE_UNINIT | HAMMING_PAGE_BACKED) ? 0 : hamming_tree_page_verify(page_ptr);
+		}
+		spin_unlock(lock);
+		atomic64_inc(&hamming_scrub_stats.pages);
+		if(unlikely(ret < 0)){
+			atomic64_inc(&hamming_scrub_stats.failed);
+			hamming_sysfs_reg_error(id + i);
+		}else if(ret > 0){
+			atomic64_inc(&hamming_scrub_stats.corrected);
+		}
+	}
+}
+
+static void hamming_tree_walk_node(hamming_node_t *node_ptr, u8 processed_bits, u64 id,
+				   void (*fn)(hamming_node_t *leaf, u64 id)){
+	u8 next_bits = processed_bits + HAMMING_TREE_STEP(processed_bits);
+	hamming_node_t *child;
+	int i;
+
+	if(processed_bits == HAMMING_TREE_CURSOR_BITS){
+		rcu_read_lock();
+		fn(node_ptr, id);
+		rcu_read_unlock();
+		cond_resched();
+		return;
+	}
+	for(i = 0;i < (1 << HAMMING_TREE_STEP(processed_bits));i++){
+		child = READ_ONCE(node_ptr->child[i]); // nodes stay put while we hold hamming_tree_reclaimer.walkers
+		if(child){
+			hamming_tree_walk_node(child, next_bits, id | ((u64)i << (64 - next_bits)), fn);
+		}
+	}
+}
+
+/**
+ * \brief Call fn on every leaf parent of every shard, from its current root
+ *
+ * One RCU read side section per leaf, rescheduling between them. Caller
+ * holds hamming->lock for read, nodes a discard unlinks under us aren't
+ * freed before we're done (see hamming_tree_reclaimer_t). Leaves created
+ * while it runs may or may not be visited.
+ *
+ * \param[in] fn		Called with the leaf parent and the id of its first page
+ */
+static void hamming_tree_for_each_leaf(void (*fn)(hamming_node_t *leaf, u64 id)){
+	hamming_shard_t *shard;
+	int i, height;
+
+	down_read(&hamming_tree_reclaimer.walkers);
+	for(i = 0;i < hamming_shard_count;i++){
+		shard = hamming_shards[i];
+		height = smp_load_acquire(&shard->height);
+		hamming_tree_walk_node(shard->roots[height], HAMMING_TREE_ROOT_BITS(height), 0, fn);
+	}
+	up_read(&hamming_tree_reclaimer.walkers);
+}
+
+/**
+ * \brief Scrub the whole tree
+ *
+ * Every shard from its current root, see hamming_tree_scrub_leaf, then every
+ * page shared by content, once. Pages created while it runs may or may not
+ * be visited.
+ */
+static void hamming_tree_scrub(void){
+	down_read(&hamming->lock);
+	hamming_tree_for_each_leaf(hamming_tree_scrub_leaf);
+	hamming_dedup_scrub();
+	up_read(&hamming->lock);
+	atomic64_inc(&hamming_scrub_stats.runs);
+}
+
+/**
+ * \brief Enter a writer's RCU read side section
+ *
+ * Sleeps on hamming_cow_writers first while hamming_tree_snapshot_take
+ * holds writers off, so callers must be able to sleep here. Writers already
+ * inside one are what it waits for.
+ */
+static void hamming_tree_write_begin(void){
+	percpu_down_read(&hamming_cow_writers);
+	rcu_read_lock();
+}
+
+static void hamming_tree_write_end(void){
+	rcu_read_unlock();
+	percpu_up_read(&hamming_cow_writers);
+}
+
+// frees a chain of root copies from hamming_tree_snapshot_chain that nothing has seen
+static void hamming_tree_snapshot_unchain(hamming_node_t *node_ptr, int height, int nid){
+	hamming_node_t *next;
+
+	for(;height >= 1;height--){
+		next = height > 1 ? node_ptr->child[0] : NULL;
+		if(height == 1){
+			hamming_tree_dedup_put_leaf(node_ptr);
+		}
+		hamming_free_node(node_ptr, nid);
+		node_ptr = next;
+	}
+}
+
+/**
+ * \brief Copy the chain of roots of a shard
+ *
+ * roots[h] has roots[h - 1] as child 0, the copy of roots[h] gets the copy
+ * of roots[h - 1] there instead, every other child is shared. roots[1] is a
+ * leaf parent, its copy takes references to the pages shared by content.
+ *
+ * \param[in] shard		Shard, writers are held off
+ *
+ * \return Copy of the current root, NULL on failure
+ */
+static hamming_node_t *hamming_tree_snapshot_chain(hamming_shard_t *shard){
+	hamming_node_t *copy, *prev = NULL;
+	int height;
+
+	for(height = 1;height <= shard->height;height++){
+		copy = hamming_alloc_node(GFP_KERNEL, shard->nid);
+		if(copy == NULL){
+			printk(KERN_ERR "can't allocate a snapshot root\n");
+			hamming_tree_snapshot_unchain(prev, height - 1, shard->nid);
+			return NULL;
+		}
+		memcpy(copy->child, ((hamming_node_t*)shard->roots[height])->child, sizeof(copy->child));
+		if(height > 1){
+			copy->child[0] = prev;
+		}else{
+			hamming_tree_dedup_hold_leaf(copy);
+		}
+		prev = copy;
+	}
+	return prev;
+}
+
+/**
+ * \brief Take a snapshot of the whole tree
+ *
+ * Writers are held off and the ones already writing waited for, then the
+ * chain of roots of every shard is copied for the snapshot. The live roots
+ * move to the new epoch, so they are never shared (and the root embedded in
+ * hamming_shard_t never ends up in the snapshot alone), the code tables of
+ * the lowest one go to its copy along with the pages pointing into them.
+ * Readers carry on throughout.
+ *
+ * \return -ENOMEM if the roots couldn't be copied (there is no snapshot then), 0 otherwise
+ */
+static int hamming_tree_snapshot_take(void){
+	hamming_shard_t *shard;
+	hamming_node_t *node_ptr;
+	u32 epoch = hamming_cow.epoch + 1;
+	int i, height, ret = 0;
+
+	hamming_tree_snapshot_drop();
+	percpu_down_write(&hamming_cow_writers);
+	for(i = 0;i < hamming_shard_count;i++){
+		shard = hamming_shards[i];
+		shard->snap_root = hamming_tree_snapshot_chain(shard);
+		if(shard->snap_root == NULL){
+			ret = -ENOMEM;
+			while(i--){
+				hamming_tree_snapshot_unchain(hamming_shards[i]->snap_root, hamming_shards[i]->snap_height, hamming_shards[i]->nid);
+				hamming_shards[i]->snap_root = NULL;
+			}
+			goto out;
+		}
+		shard->snap_height = shard->height;
+	}
+	for(i = 0;i < hamming_shard_count;i++){
+		shard = hamming_shards[i];
+		for(height = 1;height <= shard->height;height++){
+			((hamming_node_t*)shard->roots[height])->gen = epoch;
+		}
+		node_ptr = shard->snap_root;
+		for(height = shard->height;height > 1;height--){
+			node_ptr = node_ptr->child[0];
+		}
+		memcpy(node_ptr->codes, shard->root.codes, sizeof(node_ptr->codes));
+		memset(shard->root.codes, 0, sizeof(shard->root.codes));
+	}
+	WRITE_ONCE(hamming_cow.epoch, epoch);
+	WRITE_ONCE(hamming_cow.cow, true);
+	atomic64_inc(&hamming_cow.seq); // cursors may point into shared nodes now
+	atomic64_inc(&hamming_snapshot_stats.taken);
+out:
+	percpu_up_write(&hamming_cow_writers);
+	return ret;
+}
+
+/**
+ * \brief Free what only the snapshot has under a leaf parent
+ *
+ * Pages the live tree still shares stay, and their code sets go to the live
+ * leaf parent's tables. If it has no table for their range yet, the
+ * snapshot's is handed over whole (no page of the range was copied then,
+ * that would have allocated one), otherwise they are copied into it under
+ * the page lock, live writers may be using the pages. References to pages
+ * shared by content are dropped either way, the live leaf parent has its own.
+ *
+ * \param[in] snap_ptr		Leaf parent only the snapshot has
+ * \param[in] live_ptr		Live leaf parent at the same place, NULL if there is none
+ * \param[in] id		Id of its first page
+ * \param[in] nid		Node of the shard
+ */
+static void hamming_tree_snapshot_free_leaf(hamming_node_t *snap_ptr, hamming_node_t *live_ptr, u64 id, int nid){
+	hamming_code_set_t *table;
+	hamming_page_t *page_ptr;
+	spinlock_t *lock;
+	int i, t;
+
+	for(t = 0;t < HAMMING_TREE_FANOUT/HAMMING_CODE_TABLE_PAGES;t++){
+		table = NULL;
+		for(i = t*HAMMING_CODE_TABLE_PAGES;i < (t + 1)*HAMMING_CODE_TABLE_PAGES;i++){
+			page_ptr = snap_ptr->child[i];
+			if(page_ptr == NULL){
+				continue;
+			}
+			if(page_ptr->flags & HAMMING_PAGE_DEDUP){
+				hamming_dedup_put(page_ptr);
+				continue;
+			}
+			if(live_ptr == NULL || page_ptr != READ_ONCE(live_ptr->child[i])){
+				hamming_free_page(page_ptr);
+				atomic64_inc(&hamming_snapshot_stats.freed);
+				continue;
+			}
+			if(page_ptr->code == NULL){
+				continue; // same filled, nothing to hand over
+			}
+			if(table == NULL){
+				table = cmpxchg(&live_ptr->codes[t], NULL, snap_ptr->codes[t]);
+				if(table == NULL){
+					table = snap_ptr->codes[t];
+					snap_ptr->codes[t] = NULL;
+				}
+			}
+			if(page_ptr->code != &table[i % HAMMING_CODE_TABLE_PAGES]){
+				lock = hamming_tree_page_lock(id + i);
+				spin_lock(lock);
+				memcpy(&table[i % HAMMING_CODE_TABLE_PAGES], page_ptr->code, sizeof(hamming_code_set_t));
+				page_ptr->code = &table[i % HAMMING_CODE_TABLE_PAGES];
+				spin_unlock(lock);
+			}
+		}
+		if(snap_ptr->codes[t]){
+			hamming_free_codes(snap_ptr->codes[t], nid);
+			snap_ptr->codes[t] = NULL;
+		}
+	}
+}
+
+/**
+ * \brief Free what only the snapshot has below a node
+ *
+ * A child the live node at the same place also has is shared with
+ * everything below it, the walk only goes down where they differ.
+ *
+ * \param[in] snap_ptr		Node only the snapshot has, not freed itself
+ * \param[in] live_ptr		Live node at the same place, NULL if there is none
+ * \param[in] processed_bits	Depth of the nodes
+ * \param[in] id		Id of the first page under them
+ * \param[in] nid		Node of the shard
+ */
+static void hamming_tree_snapshot_free_node(hamming_node_t *snap_ptr, hamming_node_t *live_ptr,
+					    u8 processed_bits, u64 id, int nid){
+	u8 next_bits = processed_bits + HAMMING_TREE_STEP(processed_bits);
+	hamming_node_t *child, *live_child;
+	int i;
+
+	if(processed_bits == HAMMING_TREE_CURSOR_BITS){
+		hamming_tree_snapshot_free_leaf(snap_ptr, live_ptr, id, nid);
+		cond_resched();
+		return;
+	}
+	for(i = 0;i < (1 << HAMMING_TREE_STEP(processed_bits));i++){
+		child = snap_ptr->child[i];
+		live_child = live_ptr ? READ_ONCE(live_ptr->child[i]) : NULL;
+		if(child == NULL || child == live_child){
+			continue;
+		}
+		hamming_tree_snapshot_free_node(child, live_child, next_bits, id | ((u64)i << (64 - next_bits)), nid);
+		hamming_free_node(child, nid);
+	}
+}
+
+/**
+ * \brief Drop the snapshot
+ *
+ * Writers stop copying, and once the ones that might still be are done,
+ * nothing changes a node the snapshot alone has, so it can be walked against
+ * the live tree while I/O carries on. Only the live side gains children
+ * meanwhile, none it shares with the snapshot are replaced anymore. What
+ * discards unlinked is freed first, it may still point at what the snapshot
+ * frees here.
+ */
+static void hamming_tree_snapshot_drop(void){
+	hamming_shard_t *shard;
+	int i;
+
+	hamming_tree_reclaim_drain();
+	if(!hamming_cow.cow){
+		return;
+	}
+	WRITE_ONCE(hamming_cow.cow, false);
+	synchronize_rcu();
+	for(i = 0;i < hamming_shard_count;i++){
+		shard = hamming_shards[i];
+		hamming_tree_snapshot_free_node(shard->snap_root, shard->roots[shard->snap_height],
+						HAMMING_TREE_ROOT_BITS(shard->snap_height), 0, shard->nid);
+		hamming_free_node(shard->snap_root, shard->nid);
+		shard->snap_root = NULL;
+	}
+}
+
+/**
+ * \brief Find page in the snapshot
+ *
+ * Caller is in an RCU read side section, and the snapshot can't be dropped
+ * under it (the snapshot disk is gone before that)
+ *
+ * \param[in] tree_id		Page
+ *
+ * \return Page as it was when the snapshot was taken, NULL if there was none
+ */
+static hamming_page_t *hamming_tree_snapshot_page(u64 tree_id){
+	hamming_shard_t *shard = hamming_tree_shard(tree_id);
+	hamming_subtree_t head, target;
+
+	if(rcu_dereference(shard->snap_root) == NULL){
+		return NULL;
+	}
+	head.ptr = &shard->snap_root;
+	head.processed_bits = HAMMING_TREE_ROOT_BITS(shard->snap_height);
+	head.id = 0;
+	target.id = tree_id;
+	target.processed_bits = PAGE_PROCESSED_BITS;
+	hamming_tree_resolve_raw(head, &target, false);
+	return hamming_tree_page_from_subtree(target);
+}
+
+// epoch a node or page was created in
+static u32 hamming_tree_gen(void *ptr, u8 processed_bits){
+	if(processed_bits == PAGE_PROCESSED_BITS){
+		return ((hamming_page_t*)ptr)->gen;
+	}
+	return ((hamming_node_t*)ptr)->gen;
+}
+
+// true if unlinking ptr from a node the live tree owns is for the discard to free, a page shared by content is the reference dropped
+static bool hamming_tree_reclaim_owned(void *ptr, u8 processed_bits, u32 epoch, bool cow){
+	if(processed_bits == PAGE_PROCESSED_BITS && (((hamming_page_t*)ptr)->flags & HAMMING_PAGE_DEDUP)){
+		return true;
+	}
+	return !cow || hamming_tree_gen(ptr, processed_bits) == epoch;
+}
+
+/**
+ * \brief Free a node or page a discard unlinked, and everything below it
+ *
+ * Children a snapshot shares are left to it, see hamming_tree_snapshot_drop,
+ * pages shared by content only lose the reference the slot held
+ *
+ * \param[in] ptr		Node or page nothing can reach anymore
+ * \param[in] processed_bits	Depth of it
+ * \param[in] nid		Node of the shard
+ * \param[in] reclaim		Batch it was in, epoch and snapshot state of the discard
+ */
+static void hamming_tree_reclaim_free(void *ptr, u8 processed_bits, int nid, hamming_tree_reclaim_t *reclaim){
+	hamming_node_t *node_ptr = ptr;
+	u8 next_bits = processed_bits + HAMMING_TREE_STEP(processed_bits);
+	void *child;
+	int i;
+
+	if(processed_bits == PAGE_PROCESSED_BITS){
+		if(((hamming_page_t*)ptr)->flags & HAMMING_PAGE_DEDUP){
+			hamming_dedup_put(ptr);
+		}else{
+			hamming_free_page(ptr);
+		}
+		atomic64_inc(&hamming_discard_stats.pages);
+		return;
+	}
+	for(i = 0;i < (1 << HAMMING_TREE_STEP(processed_bits));i++){
+		child = node_ptr->child[i];
+		if(child == NULL || !hamming_tree_reclaim_owned(child, next_bits, reclaim->epoch, reclaim->cow)){
+			continue;
+		}
+		hamming_tree_reclaim_free(child, next_bits, nid, reclaim);
+	}
+	if(processed_bits == HAMMING_TREE_CURSOR_BITS){
+		for(i = 0;i < HAMMING_TREE_FANOUT/HAMMING_CODE_TABLE_PAGES;i++){
+			if(node_ptr->codes[i]){
+				hamming_free_codes(node_ptr->codes[i], nid);
+			}
+		}
+		cond_resched();
+	}
+	hamming_free_node(node_ptr, nid);
+	atomic64_inc(&hamming_discard_stats.nodes);
+}
+
+/**
+ * \brief Free the batches discards queued, once nothing can be using them
+ *
+ * Lockless readers and writers are waited for with a grace period, whole
+ * tree walks by taking hamming_tree_reclaimer.walkers for write, the ones
+ * that start after that can't reach anything unlinked. Cursors were
+ * invalidated by the discards before they queued anything. Caller holds
+ * hamming->lock, so no snapshot is taken or dropped under us.
+ */
+static void hamming_tree_reclaim_drain(void){
+	hamming_tree_reclaim_t *reclaim, *next;
+	int i;
+
+	spin_lock(&hamming_tree_reclaimer.lock);
+	reclaim = hamming_tree_reclaimer.batches;
+	hamming_tree_reclaimer.batches = NULL;
+	spin_unlock(&hamming_tree_reclaimer.lock);
+	if(reclaim == NULL){
+		return;
+	}
+	synchronize_rcu();
+	down_write(&hamming_tree_reclaimer.walkers);
+	up_write(&hamming_tree_reclaimer.walkers);
+	for(;reclaim;reclaim = next){
+		next = reclaim->next;
+		for(i = 0;i < reclaim->count;i++){
+			hamming_tree_reclaim_free(reclaim->ptr[i], reclaim->processed_bits[i], reclaim->nid[i], reclaim);
+		}
+		kfree(reclaim);
+	}
+}
+
+/**
+ * \brief Free what discards unlinked
+ *
+ * \param[in] work		hamming_tree_reclaimer.work
+ */
+static void hamming_tree_reclaim_work(struct work_struct *work){
+	down_read(&hamming->lock);
+	hamming_tree_reclaim_drain();
+	up_read(&hamming->lock);
+}
+
+/**
+ * \brief Make room in a discard's batch for one more subtree
+ *
+ * A full batch stays on the discard's list, which goes to
+ * hamming_tree_reclaimer once it's done. The discard is in an RCU read side
+ * section, so a new batch is GFP_ATOMIC.
+ *
+ * \param[in,out] reclaim	Batch being filled, NULL before the first one
+ *
+ * \return false if a batch couldn't be allocated
+ */
+static bool hamming_tree_reclaim_room(hamming_tree_reclaim_t **reclaim){
+	hamming_tree_reclaim_t *batch = *reclaim;
+
+	if(batch != NULL && batch->count < HAMMING_RECLAIM_BATCH){
+		return true;
+	}
+	batch = kmalloc(sizeof(hamming_tree_reclaim_t), GFP_ATOMIC);
+	if(unlikely(batch == NULL)){
+		printk(KERN_ERR "can't allocate a discard batch\n");
+		return false;
+	}
+	batch->count = 0;
+	batch->epoch = hamming_cow.epoch;
+	batch->cow = hamming_cow.cow;
+	batch->next = *reclaim;
+	*reclaim = batch;
+	return true;
+}
+
+static void hamming_tree_reclaim_add(hamming_tree_reclaim_t *reclaim, void *ptr, u8 processed_bits, int nid){
+	reclaim->ptr[reclaim->count] = ptr;
+	reclaim->processed_bits[reclaim->count] = processed_bits;
+	reclaim->nid[reclaim->count] = nid;
+	reclaim->count++;
+}
+
+// hands a discard's batches to hamming_tree_reclaimer
+static void hamming_tree_reclaim_queue(hamming_tree_reclaim_t *reclaim){
+	hamming_tree_reclaim_t *last;
+
+	if(reclaim == NULL){
+		return;
+	}
+	for(last = reclaim;last->next;last = last->next);
+	spin_lock(&hamming_tree_reclaimer.lock);
+	last->next = hamming_tree_reclaimer.batches;
+	hamming_tree_reclaimer.batches = reclaim;
+	spin_unlock(&hamming_tree_reclaimer.lock);
+	queue_work(hamming_tree_reclaimer.wq, &hamming_tree_reclaimer.work);
+}
+
+/**
+ * \brief Unlink a range of pages below a node
+ *
+ * Children entirely in the range are unlinked whole, with cmpxchg since a
+ * writer may swap a copy (or a replacement page) in at the same time. The
+ * others that overlap it are walked down, copied first if a snapshot shares
+ * them, and stay. Caller is in an RCU read side section.
+ *
+ * \param[in] node_ptr		Node the live tree owns
+ * \param[in] processed_bits	Depth of the node
+ * \param[in] id		Id of its first page
+ * \param[in] height		Height of the root node_ptr is, 0 if it isn't one
+ * \param[in] first		First page to discard
+ * \param[in] last		Last page to discard
+ * \param[in] nid		Node of the shard
+ * \param[in,out] reclaim	Batches what's unlinked goes to
+ *
+ * \return -ENOMEM if a shared child couldn't be copied or a batch allocated, 0 otherwise
+ */
+static int hamming_tree_discard_node(hamming_node_t *node_ptr, u8 processed_bits, u64 id, int height,
+				     u64 first, u64 last, int nid, hamming_tree_reclaim_t **reclaim){
+	u8 next_bits = processed_bits + HAMMING_TREE_STEP(processed_bits);
+	u32 epoch = hamming_cow.epoch;
+	bool cow = hamming_cow.cow, owned;
+	u64 child_id, child_last;
+	void *child;
+	int i, ret, err = 0;
+
+	for(i = 0;i < (1 << HAMMING_TREE_STEP(processed_bits));i++){
+		child_id = id | ((u64)i << (64 - next_bits));
+		child_last = child_id | ~HAMMING_TREE_PREFIX(~0ULL, next_bits);
+		child = rcu_dereference(node_ptr->child[i]);
+		if(child == NULL || child_last < first || child_id > last){
+			continue;
+		}
+		if(height > 1 && i == 0){ // next root down, stays even if it's empty
+			ret = hamming_tree_discard_node(child, next_bits, child_id, height - 1, first, last, nid, reclaim);
+			err = ret < 0 ? ret : err;
+			continue;
+		}
+		if(child_id < first || child_last > last){ // only nodes are partly in the range
+			if(cow && hamming_tree_gen(child, next_bits) != epoch){
+				child = hamming_tree_cow_node(&node_ptr->child[i], child, next_bits, nid, epoch);
+				if(unlikely(child == NULL)){
+					err = READ_ONCE(node_ptr->child[i]) ? -ENOMEM : err; // or another discard took it
+					continue;
+				}
+			}
+			ret = hamming_tree_discard_node(child, next_bits, child_id, 0, first, last, nid, reclaim);
+			err = ret < 0 ? ret : err;
+			continue;
+		}
+		do{
+			owned = hamming_tree_reclaim_owned(child, next_bits, epoch, cow);
+			if(owned && unlikely(!hamming_tree_reclaim_room(reclaim))){
+				err = -ENOMEM;
+				break;
+			}
+			if(cmpxchg(&node_ptr->child[i], child, NULL) == child){
+				if(owned){
+					hamming_tree_reclaim_add(*reclaim, child, next_bits, nid);
+				}
+				break;
+			}
+			child = rcu_dereference(node_ptr->child[i]); // a writer swapped something else in
+		}while(child != NULL);
+	}
+	return err;
+}
+
+/**
+ * \brief Take a range of pages out of the tree
+ *
+ * See hamming_tree_reclaim_t. Holds hamming->lock for read, so the snapshot
+ * state stays put, and I/O carries on around it. What was unlinked is freed
+ * later by hamming_tree_reclaimer. A discard covering a whole shard unlinks
+ * the children of its roots.
+ *
+ * \param[in] first		First page
+ * \param[in] last		Last page
+ *
+ * \return -ENOMEM if a shared node couldn't be copied or a batch allocated (the pages under it stay), 0 otherwise
+ */
+static int hamming_tree_discard(u64 first, u64 last){
+	hamming_tree_reclaim_t *reclaim = NULL;
+	hamming_shard_t *shard;
+	int i, height, ret, err = 0;
+
+	down_read(&hamming->lock);
+	for(i = 0;i < hamming_shard_count;i++){
+		shard = hamming_shards[i];
+		height = smp_load_acquire(&shard->height);
+		rcu_read_lock();
+		ret = hamming_tree_discard_node(shard->roots[height], HAMMING_TREE_ROOT_BITS(height), 0,
+						height, first, last, shard->nid, &reclaim);
+		rcu_read_unlock();
+		err = ret < 0 ? ret : err;
+	}
+	atomic64_inc(&hamming_cow.seq); // cursors may point into unlinked nodes, shared ones aren't in the batches
+	hamming_tree_reclaim_queue(reclaim);
+	up_read(&hamming->lock);
+	atomic64_inc(&hamming_discard_stats.discards);
+	return err;
+}
+
+/**
+ * \brief Free the whole tree
+ *
+ * Leaves an empty one level tree behind in every shard (that root is part of
+ * the shard), cursors are dropped since they point into freed nodes. The
+ * snapshot goes first, if there is one, and what discards unlinked with it.
+ */
+static void hamming_tree_free(void){
+	hamming_shard_t *shard;
+	int cpu, height, i;
+
+	down_write(&hamming->lock);
+	hamming_tree_snapshot_drop();
+	for(i = 0;i < hamming_shard_count;i++){
+		shard = hamming_shards[i];
+		for(height = shard->height;height >= 1;height--){
+			if(height > 1){
+				((hamming_node_t*)shard->roots[height])->child[0] = NULL; // next root down, emptied next
+			}
+			hamming_tree_free_node(shard->roots[height], HAMMING_TREE_ROOT_BITS(height), shard->nid);
+			if(height > 1){
+				hamming_free_node(shard->roots[height], shard->nid);
+				shard->roots[height] = NULL;
+			}
+		}
+		shard->height = 1;
+	}
+	for_each_possible_cpu(cpu){
+		per_cpu_ptr(&hamming_tree_cursor, cpu)->subtree.ptr = NULL;
+	}
+	up_write(&hamming->lock);
+}
+
+static void hamming_tree_close(void){
+	hamming_tree_free();
+	if(hamming_tree_reclaimer.wq){
+		destroy_workqueue(hamming_tree_reclaimer.wq); // a work still queued finds nothing left
+		hamming_tree_reclaimer.wq = NULL;
+	}
+	while(hamming_shard_count){
+		kfree(hamming_shards[--hamming_shard_count]);
+		hamming_shards[hamming_shard_count] = NULL;
+	}
 }
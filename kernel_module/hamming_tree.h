@@ -5,40 +5,215 @@
 #include "hamming_fast_logic.h"
 #include "hamming_fast_logic_simple.h"
 
+#include <linux/cache.h>
+#include <linux/hash.h>
+#include <linux/nodemask.h>
+#include <linux/percpu.h>
+#include <linux/percpu-rwsem.h>
+#include <linux/rcupdate.h>
+#include <linux/seqlock.h>
+#include <linux/spinlock.h>
 #include <linux/timekeeping.h>
 #include <linux/ktime.h>
+#include <linux/topology.h>
 
-#define SECTOR_TO_PAGE(sector___) ((sector___ >> 3) << 3)
-#define SECTOR_TO_CHUNK(sector___) (sector___ & 0b111)
+// tree_id is the page number, chunk the sector inside it
+#define SECTOR_TO_PAGE(sector___) ((u64)(sector___) >> 3)
+#define SECTOR_TO_CHUNK(sector___) ((sector___) & 0b111)
+#define PAGE_TO_SECTOR(page___) ((sector_t)(page___) << 3)
 
 // kernel throws undefined behavior when we shift the exact length
+#define HAMMING_TREE_PREFIX(id___, bits___) ((bits___) == 0 ? 0 : (id___) & (~0ULL << (64 - (bits___))))
+#define IS_SUBTREE(m, mpb, s) (HAMMING_TREE_PREFIX((m) ^ (s), mpb) == 0)
 
-#define IS_SUBTREE(m, mpb, s) !((m ^ s) >> (32-mpb)) 
+/*
+  Radix tree over the 64-bit tree_id (SECTOR_TO_PAGE), most significant bits
+  first. Every level consumes HAMMING_TREE_LEVEL_BITS of the id, the top level
+  takes whatever is left over. With 6 bits a full tree would be 11 levels,
+  but it only ever is as tall as the largest page written needs, see
+  hamming_tree_grow.
+
+  processed_bits keeps its meaning (bits of the id already resolved), but only
+  level boundaries are real nodes, a target in between resolves to the
+  shallower boundary.
+ */
+#ifndef HAMMING_TREE_LEVEL_BITS
+#define HAMMING_TREE_LEVEL_BITS 6
+#endif
+#define HAMMING_TREE_FANOUT (1 << HAMMING_TREE_LEVEL_BITS)
+
+#define PAGE_PROCESSED_BITS 64
+#define HAMMING_TREE_TOP_BITS (PAGE_PROCESSED_BITS - HAMMING_TREE_LEVEL_BITS*((PAGE_PROCESSED_BITS - 1)/HAMMING_TREE_LEVEL_BITS))
+#define HAMMING_TREE_DEPTH (1 + (PAGE_PROCESSED_BITS - 1)/HAMMING_TREE_LEVEL_BITS)
 
-#define PAGE_PROCESSED_BITS 32
+// bits consumed by the node at processed_bits
+#define HAMMING_TREE_STEP(processed_bits___) ((processed_bits___) == 0 ? HAMMING_TREE_TOP_BITS : HAMMING_TREE_LEVEL_BITS)
+// child index of id in the node at processed_bits
+#define HAMMING_TREE_INDEX(id___, processed_bits___)				\
+	(((id___) >> (64 - (processed_bits___) - HAMMING_TREE_STEP(processed_bits___))) & \
+	 ((1 << HAMMING_TREE_STEP(processed_bits___)) - 1))
+// processed_bits of the root of a tree height levels tall
+#define HAMMING_TREE_ROOT_BITS(height___)					\
+	((height___) >= HAMMING_TREE_DEPTH ? 0 : PAGE_PROCESSED_BITS - (height___)*HAMMING_TREE_LEVEL_BITS)
 
 // max time we trust a verification before we reverify it
 #define HAMMING_MAX_NS_DIFF 10*1000
+// same, for pages verified ahead of a sequential reader, until that read
+#define HAMMING_MAX_READAHEAD_NS_DIFF 10*1000*1000
+
+#define HAMMING_PAGE_READAHEAD (1 << 0) // verified by readahead, not read since
+#define HAMMING_PAGE_UNINIT (1 << 1) // data never written, reads as zeroes, see hamming_alloc_page
+#define HAMMING_PAGE_ARENA (1 << 2) // data is carved from an arena chunk, see hamming_arena_chunk_t
+#define HAMMING_PAGE_FILLED (1 << 3) // every word is fill, no data, see hamming_tree_page_fill
+#define HAMMING_PAGE_DEDUP (1 << 4) // shared by content between any number of ids, see hamming_dedup.h
+#define HAMMING_PAGE_COMPRESSED (1 << 5) // data is len bytes of LZ4, see hamming_compress.h
+#define HAMMING_PAGE_INCOMPRESSIBLE (1 << 6) // didn't compress enough, not tried again until written
+#define HAMMING_PAGE_BACKED (1 << 7) // data is in the backing store, at slot fill[0], see hamming_writeback.h
+
+/*
+  Concurrency. Lookups take no lock. A node, page or code table is only ever
+  published into an empty slot (or over the shared one it copies, see
+  hamming_cow_t), fully initialized, with cmpxchg, and a creator that loses
+  the race frees its copy and carries on with the winner's. Walkers read child pointers with rcu_dereference from inside an
+  RCU read side section that also covers whatever they do with the page
+  they find (a bio segment, one readahead page, one leaf of a scrub), so
+  anything that takes nodes or pages out of a live tree only has to wait
+  for a grace period before freeing them. Whole tree operations take
+  hamming->lock instead, the scrub and discards for read, freeing the tree
+  for write. A slot a walker saw filled may be empty by the time it looks
+  again (a discard unlinked what was in it), creating walks start over from
+  the root then.
+
+  Data and codes of a page only change under its stripe lock, and inside
+  its seqcount. Verifying reads the codes, so it takes the lock, but a read
+  of a page whose last verification is still trusted just copies the data
+  out under the seqcount (hamming_tree_page_read_trusted) and retries if a
+  writer or a correction got in.
+ */
+#define HAMMING_PAGE_LOCKS 256
+
+/*
+  Code sets don't live in the page descriptors, every leaf parent has tables
+  of HAMMING_CODE_TABLE_PAGES code sets indexed like its children, allocated
+  when the first page of the range is. A scrub over a leaf streams through
+  them instead of chasing a 368 byte descriptor per page, and the descriptor
+  is down to what the I/O path checks on every access.
+
+  A table covers 4 pages by default, so a leaf parent with a single page
+  written pays for 3 unused code sets, build with a larger power of two for
+  longer streams when the device is written densely.
+ */
+#ifndef HAMMING_CODE_TABLE_PAGES
+#define HAMMING_CODE_TABLE_PAGES (HAMMING_TREE_FANOUT < 4 ? HAMMING_TREE_FANOUT : 4)
+#endif
+
+/*
+  Same filled pages. Swap writes plenty of pages that are one word over and
+  over, zeroes most of all. A full page write like that keeps only the word,
+  in the page descriptor, without a data page or a code set. Three copies of
+  it stand in for the codes: reads take the bitwise majority, so a bit has to
+  flip in the same place in two copies to go wrong, and the scrub and locked
+  reads put an outvoted copy right. Zeroes don't even need the descriptor
+  where there is no page yet, a missing page reads as zeroes.
+
+  A write that breaks the fill gives the page data (and a code set, creating
+  walks attach one to a same filled page) under the page lock. A page that
+  has data keeps it when written same filled, until a discard takes it out.
+ */
+#define HAMMING_FILL_COPIES 3
 
 typedef struct{
 	u8 *data;
-	u32 len; // must be 4096
-	hamming_code_set_t code;
+	u32 len; // 4096, or the length of a HAMMING_PAGE_COMPRESSED page's data
+	u32 flags; // HAMMING_PAGE_*
 	u64 last_check;
+	hamming_code_set_t *code; // in its leaf parent's code table, or its dedup index entry
+	int nid; // node data was allocated on
+	u32 gen; // hamming_cow.epoch it was created in, meaningless for HAMMING_PAGE_DEDUP pages
+	seqcount_t seq; // bumped around every change to data and codes
+	u32 atime; // hamming_compress.tick it was last read or written in
+	u64 fill[HAMMING_FILL_COPIES]; // every word of a HAMMING_PAGE_FILLED page, the slot of a HAMMING_PAGE_BACKED one
 } hamming_page_t; // page of allocated memory
 
 typedef struct{
-	void *child[2];
-} hamming_node_t;
+	void *child[HAMMING_TREE_FANOUT];
+	hamming_code_set_t *codes[HAMMING_TREE_FANOUT/HAMMING_CODE_TABLE_PAGES]; // leaf parents only
+	u32 gen; // hamming_cow.epoch it was created in
+} ____cacheline_aligned hamming_node_t;
 
 // atomic operations only
 typedef struct{
 	void **ptr;
-	u32 id;
+	u64 id;
 	u8 processed_bits; // children left until pages start
 } hamming_subtree_t;
 
-static hamming_subtree_t tree_head; // referenced for any global tree functions
+/*
+  The tree is sharded by NUMA node, every leaf parent (the
+  HAMMING_TREE_CURSOR_BITS prefix, 64 pages) belongs to one shard round robin.
+  A shard is a whole tree of its own, with its nodes, page descriptors and
+  stripe locks on its node, ids stay absolute and a shard just never has
+  children for the leaf parents of the others. Interleaving 256K at a time
+  keeps sequential I/O on one shard for a while and spreads everything else
+  over every socket's memory bandwidth.
+
+  Data pages go where numa_policy says (hamming_alloc_page_nid), next to the
+  shard's nodes or on the node of the CPU that first writes them.
+ */
+typedef struct{
+	hamming_node_t root; // root of a one level tree, everything taller grows on top of it
+	void *roots[HAMMING_TREE_DEPTH + 1]; // roots[h] is the root once the shard is h levels tall
+	int height;
+	int nid;
+	spinlock_t grow_lock;
+	spinlock_t page_locks[HAMMING_PAGE_LOCKS];
+	void *snap_root; // copy of the root when the snapshot was taken, NULL without one
+	int snap_height; // height of the shard then
+} hamming_shard_t;
+
+static hamming_shard_t *hamming_shards[MAX_NUMNODES];
+static int hamming_shard_count;
+
+// shard tree_id lives in
+static hamming_shard_t *hamming_tree_shard(u64 tree_id);
+
+// current root of the shard tree_id lives in, only covers ids that shard has grown to
+static hamming_subtree_t hamming_tree_head(u64 tree_id);
+
+// grows the shard of tree_id until its root covers it
+static int hamming_tree_grow(u64 tree_id);
+
+/*
+  Practical head from TREE.txt, kept per CPU: the last leaf parent (one
+  level above the pages) this CPU resolved. Sequential and swap clustered
+  I/O mostly stays under the same leaf parent, so the walk is one level
+  instead of the tree height. A copy on write or a discard can take the
+  node the cursor points into out of the live tree (growing only adds a
+  root above), so a cursor is only used while hamming_cow.seq hasn't moved
+  since it was cached. A leaf parent is
+  in exactly one shard, so the cursor doesn't care about them.
+ */
+#define HAMMING_TREE_CURSOR_BITS (PAGE_PROCESSED_BITS - HAMMING_TREE_LEVEL_BITS)
+
+typedef struct{
+	hamming_subtree_t subtree; // ptr is NULL until the first lookup
+	int nid; // of the cursor's shard
+	s64 seq; // hamming_cow.seq when it was cached, stale once that moves
+	bool writable; // cached by a walk that copied shared nodes on the way (or had none to copy)
+	u64 hits;
+	u64 misses;
+	u64 local; // lookups into a shard on this CPU's node
+	u64 remote;
+} hamming_tree_cursor_t;
+
+// resolves target from this CPU's cursor when it covers target->id, the root otherwise
+static int hamming_tree_resolve_cursor(hamming_subtree_t *target, bool create);
+
+// sums hit/miss counts over all CPUs
+static void hamming_tree_cursor_stats(u64 *hits, u64 *misses);
+
+// sums local/remote lookups over the CPUs of a node
+static void hamming_tree_numa_stats(int nid, u64 *local, u64 *remote);
 
 /*
   All operations are generating subtrees from the master tree
@@ -55,7 +230,7 @@ static hamming_subtree_t tree_head; // referenced for any global tree functions
  */
 
 // hamming_tree_subtree resolves as much as it can, only allowed to allocate if create is true
-// typically cast to hamming_page_t
+// typically cast to hamming_page_t, targets outside the shard of subtree come back NULL
 static int hamming_tree_resolve(hamming_subtree_t subtree, hamming_subtree_t *target, bool *create, int size);
 
 // finds a pointer at a certain depth along a certain path
@@ -67,25 +242,209 @@ static int hamming_tree_resolve(hamming_subtree_t subtree, hamming_subtree_t *ta
 static hamming_page_t *hamming_tree_page_from_subtree(
 	hamming_subtree_t subtree);
 
-static hamming_node_t *hamming_tree_node_from_subtree(
-	hamming_subtree_t subtree);
-
+// rows of data the codes cover, compressed data is zero padded to a whole row
+#define HAMMING_PAGE_ROWS(page_ptr) DIV_ROUND_UP(page_ptr->len, 16)
 // TODO: should probably make this an __always_inline function
-#define HAMMING_PAGE_LOGIC(page_ptr) logic_set(&(page_ptr->code), (__int128*)page_ptr->data, page_ptr->len/16)
+#define HAMMING_PAGE_LOGIC(page_ptr) logic_set(page_ptr->code, (__int128*)page_ptr->data, HAMMING_PAGE_ROWS(page_ptr))
 
 static int hamming_tree_page_correct(
 	hamming_page_t *page_ptr); // ran before any reading is done to a page
 
+// unconditional verify and correct, page_correct without the trust window
+static int hamming_tree_page_verify(
+	hamming_page_t *page_ptr);
+
+// true if the last verification can still be trusted, consumes readahead
+static bool hamming_tree_page_trusted(
+	hamming_page_t *page_ptr);
+
+static spinlock_t *hamming_tree_page_lock(u64 tree_id);
+
+// lock of a page found at tree_id, the index's for shared pages, see hamming_dedup_page_lock
+static spinlock_t *hamming_tree_page_lock_of(hamming_page_t *page_ptr, u64 tree_id);
+
+// copies a trusted page out without the page lock, false if it needs the locked path
+static bool hamming_tree_page_read_trusted(
+	hamming_page_t *page_ptr, u8 chunk, u8 *buf, u32 len, bool *ahead);
+
+// zero data and codes of a HAMMING_PAGE_UNINIT page, caller holds the page lock
+static void hamming_tree_page_zero(
+	hamming_page_t *page_ptr);
+
+typedef struct{
+	atomic64_t stored; // full page writes kept as their fill
+	atomic64_t elided; // zero filled writes where there was no page
+	atomic64_t unfilled; // same filled pages that were given data
+	atomic64_t corrected; // fill copies that were outvoted and rewritten
+} hamming_fill_stats_t;
+
+static hamming_fill_stats_t hamming_fill_stats;
+
+// true if every word of data is the same, the word in fill
+static bool hamming_tree_data_filled(const void *data, u32 len, u64 *fill);
+
+// stores a full page write of one word, 1 if the page has data and needs a regular write, caller is a writer
+static int hamming_tree_page_fill(u64 tree_id, u64 fill);
+
+// points a full page write at a shared page with the same contents, 1 if the page has data of its own and needs a regular write
+static int hamming_tree_page_dedup(u64 tree_id, const u8 *data);
+
+// majority of the fill copies, rewrites outvoted ones, caller holds the page lock
+static u64 hamming_tree_page_fill_verify(hamming_page_t *page_ptr);
+
+// copies part of a same filled page out, caller holds the page lock or is in the page's seqcount
+static void hamming_tree_page_fill_read(u64 fill, u8 *buf, u32 len);
+
+// gives a same filled page data and codes, caller holds the page lock and found it with a creating walk
+static int hamming_tree_page_unfill(hamming_page_t *page_ptr);
+
+// page lookup through the cursor, NULL if it doesn't exist (or can't be created)
+static hamming_page_t *hamming_tree_page_simple(
+	u64 tree_id, bool create);
+
 static void *hamming_tree_sector_from_page(
 	hamming_page_t *page_ptr, u8 chunk);
 
-// sets tree_head to valid runtime pointers
-static void hamming_tree_init(void);
+// sets up an empty one level tree per shard
+static int hamming_tree_init(void);
+
+typedef struct{
+	atomic64_t runs;
+	atomic64_t pages; // verified
+	atomic64_t corrected; // pages that had errors fixed
+	atomic64_t failed; // pages that couldn't be corrected
+} hamming_scrub_stats_t;
+
+static hamming_scrub_stats_t hamming_scrub_stats;
+
+// verifies and corrects every written page, leaf by leaf, from process context, takes hamming->lock for read
+static void hamming_tree_scrub(void);
+
+// calls fn on every leaf parent, each in an RCU read side section, caller holds hamming->lock for read
+static void hamming_tree_for_each_leaf(void (*fn)(hamming_node_t *leaf, u64 id));
+
+/*
+  Snapshots. Taking one shares the whole tree with a read only copy in
+  O(shards*height): the chain of roots of every shard is copied, everything
+  below them is shared. Every node and page carries the epoch it was created
+  in and a snapshot starts a new one, so while a snapshot exists anything
+  older than the current epoch is reachable from it and never changed in
+  place. A writer copies the first shared node on its way down and
+  everything below it it passes through (path copying), pages along with
+  their data and code set, and swaps each copy in with cmpxchg, a writer
+  losing that race carries on with the winner's copy.
+
+  Code tables stay with the leaf parent they were allocated for, a copied
+  leaf parent starts without any and shared pages keep pointing into the
+  snapshot's tables until it's dropped.
+
+  Taking a snapshot holds writers off (see hamming_tree_write_begin), so it
+  holds exactly what completed writes left.
+  Dropping it stops the copying, waits for copies in flight, then walks the
+  snapshot against the live tree and frees what isn't shared. There is one
+  snapshot at most, taking another drops it first.
+ */
+typedef struct{
+	u32 epoch; // of nodes and pages created now
+	bool cow; // a snapshot holds everything older than epoch
+	atomic64_t seq; // bumped by every copy, snapshot and discard, see hamming_tree_cursor_t
+} hamming_cow_t;
+
+static hamming_cow_t hamming_cow;
+// writers hold it for read, taking a snapshot for write
+static DEFINE_STATIC_PERCPU_RWSEM(hamming_cow_writers);
+
+typedef struct{
+	atomic64_t taken;
+	atomic64_t nodes; // copied on write
+	atomic64_t pages; // copied on write
+	atomic64_t freed; // pages only the snapshot had when it was dropped
+} hamming_snapshot_stats_t;
+
+static hamming_snapshot_stats_t hamming_snapshot_stats;
+
+// RCU read side section for a writer, waits while a snapshot is being taken
+static void hamming_tree_write_begin(void);
+static void hamming_tree_write_end(void);
+
+// snapshots the tree, dropping the last snapshot first, caller holds hamming->lock for write
+static int hamming_tree_snapshot_take(void);
+
+// frees what only the snapshot has, caller holds hamming->lock for write and nothing reads the snapshot
+static void hamming_tree_snapshot_drop(void);
+
+// page lookup in the snapshot, NULL if it had no such page (or there is no snapshot)
+static hamming_page_t *hamming_tree_snapshot_page(u64 tree_id);
+
+/*
+  Discards. Pages that were never written and pages that were discarded read
+  the same, as zeroes, so a discard takes pages out of the tree instead of
+  writing them. Leaf parents and nodes entirely inside the range are unlinked
+  from their parent whole, subtree and all, with cmpxchg like writers swap in
+  their copies. Nodes only partly inside it are walked down and stay, along
+  with their code tables, even if nothing is left under them: a writer may be
+  about to create a page there. Roots stay too, the tree doesn't shrink back
+  down.
+
+  Readers and writers carry on throughout. A write racing a discard of its
+  own page may land in a subtree that was just unlinked, which is as if it
+  came first. What was unlinked goes to hamming_tree_reclaimer in batches of
+  HAMMING_RECLAIM_BATCH subtrees and is freed by its work after a grace
+  period, anything a snapshot shares stays for the snapshot to free.
+ */
+#define HAMMING_RECLAIM_BATCH 64
+
+typedef struct hamming_tree_reclaim{
+	void *ptr[HAMMING_RECLAIM_BATCH]; // unlinked nodes and pages
+	u8 processed_bits[HAMMING_RECLAIM_BATCH]; // PAGE_PROCESSED_BITS for pages
+	int nid[HAMMING_RECLAIM_BATCH]; // of their shard
+	int count;
+	u32 epoch; // hamming_cow.epoch, what's older is shared if cow is set
+	bool cow;
+	struct hamming_tree_reclaim *next; // on hamming_tree_reclaimer.batches
+} hamming_tree_reclaim_t;
+
+/*
+  Batches waiting to be freed. Whole tree walks hold walkers for read, so
+  the work can wait for the ones that might be inside an unlinked subtree
+  without holding discards off. Snapshots drain the batches before changing
+  what they share.
+ */
+typedef struct{
+	spinlock_t lock;
+	hamming_tree_reclaim_t *batches;
+	struct work_struct work;
+	struct workqueue_struct *wq;
+	struct rw_semaphore walkers; // hamming_tree_for_each_leaf for read
+} hamming_tree_reclaimer_t;
+
+static hamming_tree_reclaimer_t hamming_tree_reclaimer;
+
+// frees the queued batches now, caller holds hamming->lock
+static void hamming_tree_reclaim_drain(void);
+static void hamming_tree_reclaim_work(struct work_struct *work);
+
+typedef struct{
+	atomic64_t discards;
+	atomic64_t pages; // freed by discards
+	atomic64_t nodes; // freed by discards
+} hamming_discard_stats_t;
+
+static hamming_discard_stats_t hamming_discard_stats;
+
+// takes pages first through last out of the tree, takes hamming->lock for read, the pages are freed later
+static int hamming_tree_discard(u64 first, u64 last);
+
+// frees every node and page (and the snapshot), takes hamming->lock for write, no I/O may be using the tree
+static void hamming_tree_free(void);
+
+// hamming_tree_free, then the shards themselves
+static void hamming_tree_close(void);
 
 // DEPRECATED
 
 // for testing and one off writes, we can use this instead
 static void *hamming_tree_sector_simple(
-	u32 tree_id, u8 chunk, bool create);
+	u64 tree_id, u8 chunk, bool create);
 
 #endif
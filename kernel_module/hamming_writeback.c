@@ -0,0 +1,439 @@
+#include "hamming_writeback.h"
+
+#include <linux/moduleparam.h>
+
+/**
+ * \file hamming_writeback.c
+ * \brief Writeback of cold pages, see hamming_writeback.h
+ */
+
+static char *backing_path;
+module_param(backing_path, charp, 0444);
+MODULE_PARM_DESC(backing_path, "File or partition cold pages are written back to, none by default");
+
+static uint writeback_age = 16;
+module_param(writeback_age, uint, 0644);
+MODULE_PARM_DESC(writeback_age, "Compress passes a page has to go untouched before it is written back");
+
+static uint writeback_watermark_mb;
+module_param(writeback_watermark_mb, uint, 0644);
+MODULE_PARM_DESC(writeback_watermark_mb, "Only write back while more data than this is in RAM, 0 writes back every cold page");
+
+// nothing to write, or done already
+#define HAMMING_WRITEBACK_SKIP (HAMMING_PAGE_UNINIT | HAMMING_PAGE_FILLED | HAMMING_PAGE_DEDUP | HAMMING_PAGE_BACKED)
+
+#if HAMMING_WRITEBACK_BATCH < HAMMING_TREE_FANOUT
+#error "a batch has to hold a whole leaf parent"
+#endif
+
+static hamming_writeback_t hamming_writeback;
+
+/**
+ * \brief Find slots for a batch
+ *
+ * Next fit from where the last batch went, halving what's asked for until
+ * a run of free slots turns up.
+ *
+ * \param[in,out] count		Slots wanted, slots found
+ *
+ * \return First slot, -1 if the backing store is full
+ */
+static s64 hamming_writeback_alloc_slots(u32 *count){
+	unsigned long slot = 0;
+	u32 n;
+
+	spin_lock(&hamming_writeback.lock);
+	for(n = *count;n > 0;n /= 2){
+		slot = bitmap_find_next_zero_area(hamming_writeback.map, hamming_writeback.slots,
+						  hamming_writeback.next, n, 0);
+		if(slot >= hamming_writeback.slots){
+			slot = bitmap_find_next_zero_area(hamming_writeback.map, hamming_writeback.slots, 0, n, 0);
+		}
+		if(slot < hamming_writeback.slots){
+			bitmap_set(hamming_writeback.map, slot, n);
+			hamming_writeback.next = slot + n;
+			break;
+		}
+	}
+	spin_unlock(&hamming_writeback.lock);
+	if(n == 0){
+		return -1;
+	}
+	*count = n;
+	atomic64_add(n, &hamming_writeback_stats.slots_used);
+	return slot;
+}
+
+static void hamming_writeback_free_slots(u64 slot, u32 count){
+	if(hamming_writeback.map == NULL){
+		return; // closed, the tree is being freed
+	}
+	spin_lock(&hamming_writeback.lock);
+	bitmap_clear(hamming_writeback.map, slot, count);
+	spin_unlock(&hamming_writeback.lock);
+	atomic64_sub(count, &hamming_writeback_stats.slots_used);
+}
+
+// true while the data in RAM is above writeback_watermark_mb, counting what this pass already swapped out as gone
+static bool hamming_writeback_wanted(void){
+	u64 watermark = (u64)READ_ONCE(writeback_watermark_mb) << 20;
+	u64 used = atomic64_read(&hamming_alloc_stats.pages)*PAGE_SIZE +
+		atomic64_read(&hamming_alloc_stats.compressed_bytes);
+
+	return used > watermark + hamming_writeback.pending;
+}
+
+/**
+ * \brief Swap a written back page's data out for its slot
+ *
+ * The page is looked up again, it may have been freed or copied while its
+ * batch was being written, and is only swapped if it's still the one that
+ * was copied (same descriptor, seqcount hasn't moved) and nobody touched it
+ * since. The slot is given back otherwise.
+ *
+ * \param[in] entry		Page as it was copied into the batch
+ * \param[in] data		Its contents in the batch
+ * \param[in] slot		Slot they were written to
+ */
+static void hamming_writeback_commit(hamming_writeback_entry_t *entry, const u8 *data, u64 slot){
+	u32 tick = READ_ONCE(hamming_compress.tick), age = READ_ONCE(writeback_age);
+	spinlock_t *lock = hamming_tree_page_lock(entry->id);
+	hamming_page_t *page_ptr;
+	u32 len = 0, flags = 0;
+	u8 *old = NULL;
+	int nid = 0;
+
+	rcu_read_lock();
+	page_ptr = hamming_tree_page_simple(entry->id, false);
+	if(page_ptr == entry->page){
+		spin_lock(lock);
+		if(raw_read_seqcount(&page_ptr->seq) == entry->seq && !(page_ptr->flags & HAMMING_WRITEBACK_SKIP) &&
+		   tick - page_ptr->atime >= age){
+			old = page_ptr->data;
+			len = page_ptr->len;
+			flags = page_ptr->flags;
+			nid = page_ptr->nid;
+			write_seqcount_begin(&page_ptr->seq);
+			WRITE_ONCE(page_ptr->data, page_address(ZERO_PAGE(0)));
+			if(flags & HAMMING_PAGE_COMPRESSED){
+				page_ptr->len = PAGE_SIZE;
+				logic_set(page_ptr->code, (const hamming_row_t*)data, PAGE_SIZE/sizeof(hamming_row_t));
+			}
+			page_ptr->fill[0] = slot;
+			page_ptr->flags = (flags & ~(HAMMING_PAGE_ARENA | HAMMING_PAGE_READAHEAD |
+						     HAMMING_PAGE_COMPRESSED | HAMMING_PAGE_INCOMPRESSIBLE)) | HAMMING_PAGE_BACKED;
+			write_seqcount_end(&page_ptr->seq);
+		}
+		spin_unlock(lock);
+	}
+	rcu_read_unlock();
+	if(old == NULL){
+		atomic64_inc(&hamming_writeback_stats.raced);
+		hamming_writeback_free_slots(slot, 1);
+		return;
+	}
+	if(flags & HAMMING_PAGE_COMPRESSED){
+		atomic64_dec(&hamming_alloc_stats.compressed);
+		hamming_writeback.pending += round_up(len, HAMMING_COMPRESSED_CLASS);
+	}else{
+		hamming_writeback.pending += PAGE_SIZE;
+	}
+	atomic64_inc(&hamming_alloc_stats.backed);
+	atomic64_inc(&hamming_writeback_stats.written);
+	hamming_compress_defer(old, len, flags, nid);
+}
+
+/**
+ * \brief Write the batch out
+ *
+ * One write per run of free slots, a whole batch unless the backing store
+ * is fragmented or full. Pages there's no room for stay in RAM.
+ */
+static void hamming_writeback_flush(void){
+	u32 done = 0, n, i;
+	loff_t pos;
+	s64 slot;
+
+	while(done < hamming_writeback.count){
+		n = hamming_writeback.count - done;
+		slot = hamming_writeback_alloc_slots(&n);
+		if(slot < 0){
+			atomic64_add(hamming_writeback.count - done, &hamming_writeback_stats.full);
+			break;
+		}
+		pos = slot*PAGE_SIZE;
+		if(unlikely(kernel_write(hamming_writeback.file, hamming_writeback.buf + (size_t)done*PAGE_SIZE,
+					 (size_t)n*PAGE_SIZE, &pos) != (ssize_t)(n*PAGE_SIZE))){
+			printk(KERN_ERR "can't write %u pages to the backing store\n", n);
+			atomic64_add(n, &hamming_writeback_stats.failed);
+			hamming_writeback_free_slots(slot, n);
+		}else{
+			atomic64_inc(&hamming_writeback_stats.writes);
+			for(i = 0;i < n;i++){
+				hamming_writeback_commit(&hamming_writeback.batch[done + i],
+							 hamming_writeback.buf + (size_t)(done + i)*PAGE_SIZE, slot + i);
+			}
+		}
+		done += n;
+	}
+	hamming_writeback.count = 0;
+}
+
+/**
+ * \brief Copy the cold pages under a leaf parent into the batch
+ *
+ * Pages are verified on the way, compressed ones decompressed, so the
+ * backing store only ever gets whole, correct pages. Once the batch can't
+ * take another leaf parent it's written out. Caller is in an RCU read side
+ * section, the walk only holds it for the leaf, so it's left around the
+ * write.
+ *
+ * \param[in] leaf		Leaf parent
+ * \param[in] id		Id of its first page
+ */
+static void hamming_writeback_leaf(hamming_node_t *leaf, u64 id){
+	u32 tick = READ_ONCE(hamming_compress.tick), age = READ_ONCE(writeback_age);
+	hamming_writeback_entry_t *entry;
+	hamming_page_t *page_ptr;
+	spinlock_t *lock;
+	unsigned seq;
+	u8 *dst;
+	int i, ret;
+
+	if(!hamming_writeback_wanted()){
+		return;
+	}
+	for(i = 0;i < HAMMING_TREE_FANOUT;i++){
+		page_ptr = rcu_dereference(leaf->child[i]);
+		if(page_ptr == NULL || (READ_ONCE(page_ptr->flags) & HAMMING_WRITEBACK_SKIP) ||
+		   tick - READ_ONCE(page_ptr->atime) < age){
+			continue;
+		}
+		dst = hamming_writeback.buf + (size_t)hamming_writeback.count*PAGE_SIZE;
+		lock = hamming_tree_page_lock(id + i);
+		spin_lock(lock);
+		if(page_ptr->flags & HAMMING_WRITEBACK_SKIP){
+			spin_unlock(lock);
+			continue;
+		}
+		if(page_ptr->flags & HAMMING_PAGE_COMPRESSED){
+			ret = hamming_compress_read(page_ptr, 0, dst, PAGE_SIZE);
+		}else{
+			ret = hamming_tree_page_correct(page_ptr);
+			if(likely(ret >= 0)){
+				memcpy(dst, page_ptr->data, PAGE_SIZE);
+			}
+		}
+		seq = raw_read_seqcount(&page_ptr->seq);
+		spin_unlock(lock);
+		if(unlikely(ret < 0)){
+			atomic64_inc(&hamming_writeback_stats.failed);
+			hamming_sysfs_reg_error(id + i);
+			continue;
+		}
+		entry = &hamming_writeback.batch[hamming_writeback.count++];
+		entry->id = id + i;
+		entry->page = page_ptr;
+		entry->seq = seq;
+	}
+	if(hamming_writeback.count > HAMMING_WRITEBACK_BATCH - HAMMING_TREE_FANOUT){
+		rcu_read_unlock();
+		hamming_writeback_flush();
+		rcu_read_lock();
+	}
+}
+
+/**
+ * \brief Write back what went untouched for writeback_age passes
+ *
+ * Holds hamming->lock for read like the compress pass it runs after, the
+ * data it swapped out is freed by hamming_compress_reclaim. The backing
+ * store is synced at the end, so what the page cache kept of the batches is
+ * clean and can be dropped.
+ */
+static void hamming_writeback_pass(void){
+	if(hamming_writeback.file == NULL){
+		return;
+	}
+	hamming_writeback.pending = 0;
+	down_read(&hamming->lock);
+	hamming_tree_for_each_leaf(hamming_writeback_leaf);
+	hamming_writeback_flush();
+	up_read(&hamming->lock);
+	if(hamming_writeback.pending){
+		vfs_fsync(hamming_writeback.file, 0);
+	}
+	atomic64_inc(&hamming_writeback_stats.passes);
+}
+
+/**
+ * \brief A pass on its own, then give back what it emptied
+ *
+ * \param[in] work		hamming_writeback.work
+ */
+static void hamming_writeback_work(struct work_struct *work){
+	hamming_writeback_pass();
+	hamming_compress_reclaim(&hamming_compress.reclaim_work);
+}
+
+static void hamming_writeback_run(void){
+	if(hamming_writeback.file == NULL){
+		return;
+	}
+	queue_work(hamming_compress.wq, &hamming_writeback.work);
+	flush_workqueue(hamming_compress.wq);
+}
+
+/**
+ * \brief Bring a written back page back in
+ *
+ * The slot is read into a bounce page with nothing held, then the page is
+ * looked up again and, if it's still written back to that slot, given a
+ * data page under the page lock and verified against the codes that stayed
+ * in memory.
+ *
+ * \param[in] tree_id		Page
+ * \param[in] snapshot		True to look it up in the snapshot
+ *
+ * \return -ENOMEM or -EIO on failure, 0 otherwise, also when it wasn't written back
+ */
+static int hamming_writeback_fetch_page(u64 tree_id, bool snapshot){
+	spinlock_t *lock = hamming_tree_page_lock(tree_id);
+	hamming_page_t *page_ptr;
+	struct page *bounce;
+	u32 flags = 0;
+	u64 slot = 0;
+	loff_t pos;
+	bool backed;
+	u8 *data;
+	int ret = 0;
+
+	rcu_read_lock();
+	page_ptr = snapshot ? hamming_tree_snapshot_page(tree_id) : hamming_tree_page_simple(tree_id, false);
+	backed = page_ptr != NULL && (READ_ONCE(page_ptr->flags) & HAMMING_PAGE_BACKED);
+	if(backed){
+		slot = READ_ONCE(page_ptr->fill[0]);
+	}
+	rcu_read_unlock();
+	if(!backed){
+		return 0;
+	}
+
+	bounce = alloc_page(GFP_NOIO);
+	if(unlikely(bounce == NULL)){
+		printk(KERN_ERR "can't allocate a page to fetch %llu into\n", (unsigned long long)tree_id);
+		return -ENOMEM;
+	}
+	pos = slot*PAGE_SIZE;
+	if(unlikely(kernel_read(hamming_writeback.file, page_address(bounce), PAGE_SIZE, &pos) != PAGE_SIZE)){
+		__free_page(bounce);
+		printk(KERN_ERR "can't read page %llu from the backing store\n", (unsigned long long)tree_id);
+		atomic64_inc(&hamming_writeback_stats.failed);
+		hamming_sysfs_reg_error(tree_id);
+		return -EIO;
+	}
+
+	rcu_read_lock();
+	page_ptr = snapshot ? hamming_tree_snapshot_page(tree_id) : hamming_tree_page_simple(tree_id, false);
+	if(page_ptr != NULL){
+		spin_lock(lock);
+		if((page_ptr->flags & HAMMING_PAGE_BACKED) && page_ptr->fill[0] == slot){
+			data = hamming_alloc_page_data(GFP_ATOMIC, page_ptr, &flags);
+			if(unlikely(data == NULL)){
+				ret = -ENOMEM;
+			}else{
+				memcpy(data, page_address(bounce), PAGE_SIZE);
+				write_seqcount_begin(&page_ptr->seq);
+				WRITE_ONCE(page_ptr->data, data);
+				page_ptr->flags = (page_ptr->flags & ~HAMMING_PAGE_BACKED) | flags;
+				write_seqcount_end(&page_ptr->seq);
+				ret = hamming_tree_page_verify(page_ptr);
+				hamming_writeback_free_slots(slot, 1);
+				atomic64_inc(&hamming_writeback_stats.fetched);
+			}
+		}
+		spin_unlock(lock);
+	}
+	rcu_read_unlock();
+	__free_page(bounce);
+
+	if(unlikely(ret == -ENOMEM)){
+		printk(KERN_ERR "can't allocate data to fetch %llu into\n", (unsigned long long)tree_id);
+	}else if(unlikely(ret < 0)){
+		printk(KERN_ERR "uncorrectable page %llu\n", (unsigned long long)tree_id);
+		atomic64_inc(&hamming_writeback_stats.failed);
+		hamming_sysfs_reg_error(tree_id);
+	}else if(ret > 0){
+		atomic64_inc(&hamming_writeback_stats.corrected);
+	}
+	return ret < 0 ? ret : 0;
+}
+
+static int hamming_writeback_fetch(sector_t sector, u32 len, bool snapshot){
+	u64 tree_id, last;
+	int ret = 0;
+
+	if(hamming_writeback.file == NULL || len < SECTOR_SIZE){
+		return 0;
+	}
+	last = SECTOR_TO_PAGE(sector + (len >> SECTOR_SHIFT) - 1);
+	for(tree_id = SECTOR_TO_PAGE(sector);tree_id <= last && ret == 0;tree_id++){
+		ret = hamming_writeback_fetch_page(tree_id, snapshot);
+	}
+	return ret;
+}
+
+/**
+ * \brief Open the backing store
+ *
+ * Its size is whatever the file or partition is when we load, a file has
+ * to be made as large as it should be first (fallocate or truncate).
+ *
+ * \return 0 without backing_path or on success, -errno otherwise
+ */
+static int hamming_writeback_init(void){
+	loff_t size;
+	int ret;
+
+	spin_lock_init(&hamming_writeback.lock);
+	INIT_WORK(&hamming_writeback.work, hamming_writeback_work);
+	if(backing_path == NULL || backing_path[0] == '\0'){
+		return 0;
+	}
+	hamming_writeback.file = filp_open(backing_path, O_RDWR | O_LARGEFILE, 0);
+	if(IS_ERR(hamming_writeback.file)){
+		ret = PTR_ERR(hamming_writeback.file);
+		hamming_writeback.file = NULL;
+		printk(KERN_ERR "can't open backing store %s (%d)\n", backing_path, ret);
+		return ret;
+	}
+	size = vfs_llseek(hamming_writeback.file, 0, SEEK_END);
+	hamming_writeback.slots = size > 0 ? size/PAGE_SIZE : 0;
+	if(hamming_writeback.slots == 0){
+		printk(KERN_ERR "backing store %s is empty\n", backing_path);
+		hamming_writeback_close();
+		return -EINVAL;
+	}
+	hamming_writeback.map = kvmalloc_array(BITS_TO_LONGS(hamming_writeback.slots), sizeof(unsigned long),
+					       GFP_KERNEL | __GFP_ZERO);
+	hamming_writeback.buf = kvmalloc_array(HAMMING_WRITEBACK_BATCH, PAGE_SIZE, GFP_KERNEL);
+	if(hamming_writeback.map == NULL || hamming_writeback.buf == NULL){
+		hamming_writeback_close();
+		return -ENOMEM;
+	}
+	printk(KERN_INFO "writing cold pages back to %s, %llu pages\n", backing_path,
+	       (unsigned long long)hamming_writeback.slots);
+	return 0;
+}
+
+static void hamming_writeback_close(void){
+	if(hamming_writeback.file){
+		filp_close(hamming_writeback.file, NULL);
+		hamming_writeback.file = NULL;
+	}
+	kvfree(hamming_writeback.map);
+	hamming_writeback.map = NULL;
+	kvfree(hamming_writeback.buf);
+	hamming_writeback.buf = NULL;
+	atomic64_set(&hamming_writeback_stats.slots_used, 0);
+}
@@ -0,0 +1,99 @@
+#ifndef _HAMMING_WRITEBACK_H_
+#define _HAMMING_WRITEBACK_H_
+
+#include "hamming.h"
+#include "hamming_tree.h"
+#include "hamming_alloc.h"
+#include "hamming_compress.h"
+
+#include <linux/atomic.h>
+#include <linux/bitmap.h>
+#include <linux/fs.h>
+#include <linux/spinlock.h>
+#include <linux/workqueue.h>
+
+/**
+ * \file hamming_writeback.h
+ * \brief Writeback of cold pages to a backing file or partition
+ *
+ * With backing_path set, pages nobody read or wrote for writeback_age
+ * passes of hamming_compress_work leave RAM for good while the data in it
+ * is above writeback_watermark_mb. They're written to the backing store in
+ * batches of up to HAMMING_WRITEBACK_BATCH pages, one sequential write
+ * each, and only the page descriptor and its code set stay behind.
+ */
+
+/*
+  A written back page is flagged HAMMING_PAGE_BACKED and keeps the slot
+  (PAGE_SIZE bytes at slot*PAGE_SIZE in the backing store) in fill[0], the
+  fill is only meaningful for HAMMING_PAGE_FILLED pages. data points at the
+  zero page, so a lockless reader that raced the swap copies zeroes and
+  retries instead of faulting. The codes are those of the whole page,
+  compressed pages are decompressed into the batch and recomputed.
+
+  Reading the backing store sleeps, and bio segments are handled in an RCU
+  read side section. A segment that runs into a
+  written back page gives up with -EAGAIN, and hamming_writeback_fetch
+  brings the page back in outside of both, verifies it against the codes
+  that stayed in memory, and the segment starts over. A page that's
+  fetched goes back to being a page like any other and its slot is free.
+
+  Passes run on hamming_compress.wq after a compress pass, or alone through
+  the writeback attribute, and swap data out under the page lock like
+  compressing does, with hamming_compress_defer freeing it. A page that
+  changed while its batch was being written (its seqcount moved) is left
+  alone and its slot given back.
+ */
+#define HAMMING_WRITEBACK_BATCH 128 // pages, 512K writes
+
+typedef struct{
+	u64 id;
+	hamming_page_t *page; // only compared against, looked up again before it's touched
+	unsigned seq; // of the page when it was copied into the batch
+} hamming_writeback_entry_t;
+
+typedef struct{
+	struct file *file; // NULL without backing_path
+	u64 slots; // PAGE_SIZE slots the backing store holds
+	unsigned long *map; // bit per slot in use
+	spinlock_t lock; // of map
+	u64 next; // slot the next batch is looked for from, so batches follow each other
+	struct work_struct work; // a pass without compressing, see hamming_writeback_run
+	u8 *buf; // the batch, HAMMING_WRITEBACK_BATCH pages, only passes use it
+	hamming_writeback_entry_t batch[HAMMING_WRITEBACK_BATCH];
+	u32 count; // pages in the batch
+	u64 pending; // bytes of data this pass swapped out, still waiting for hamming_compress_reclaim
+} hamming_writeback_t;
+
+typedef struct{
+	atomic64_t passes;
+	atomic64_t written; // pages written back
+	atomic64_t writes; // batches, one write each
+	atomic64_t raced; // pages changed while their batch was written, kept
+	atomic64_t full; // pages there was no slot left for
+	atomic64_t fetched; // pages read back in
+	atomic64_t corrected; // fetched pages the codes put right
+	atomic64_t failed; // pages that couldn't be verified, read or written
+	atomic64_t slots_used;
+} hamming_writeback_stats_t;
+
+static hamming_writeback_stats_t hamming_writeback_stats;
+
+// opens backing_path if set, -errno if it can't be used
+static int hamming_writeback_init(void);
+// passes are over, after hamming_compress_close, written back pages freed later just drop their slot
+static void hamming_writeback_close(void);
+
+// writes back cold pages, called at the end of a compress pass
+static void hamming_writeback_pass(void);
+
+// runs a pass on its own to completion, from process context
+static void hamming_writeback_run(void);
+
+// brings written back pages in [sector, sector + len) back in, may sleep, -EIO if one can't be
+static int hamming_writeback_fetch(sector_t sector, u32 len, bool snapshot);
+
+// gives slots back, for pages freed while written back
+static void hamming_writeback_free_slots(u64 slot, u32 count);
+
+#endif
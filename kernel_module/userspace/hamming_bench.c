@@ -0,0 +1,2112 @@
+/**
+ * \file hamming_bench.c
+ * \brief Userspace bench for the module's tree and block paths
+ *
+ * Built the same way as hamming.c (one translation unit including the module
+ * sources), with hamming_shim.h in place of the kernel. Runs the module's self
+ * tests, then times the tree lookups, the bio path (with readahead verification)
+ * and page correction under sequential, random and swap-like access, reporting
+ * ns/op and how many allocations each phase made. Phases that read back the
+ * wrong data or fail a bio fail the run.
+ *
+ * usage: hamming_bench [pages] [ops] [pages per bio] [alloc mode] [capacity MB] [nodes] [numa policy] [arena] [threads]
+ */
+
+#include "hamming_shim.h"
+
+#include "../hamming.h"
+#include "../hamming_tree.h"
+#include "../hamming_alloc.h"
+#include "../hamming_dedup.h"
+#include "../hamming_compress.h"
+#include "../hamming_writeback.h"
+#include "../hamming_persist.h"
+#include "../hamming_test.h"
+
+#include "../hamming_fast_logic.c"
+#include "../hamming_fast_logic_simple.c"
+
+static hamming_t *hamming;
+static int device_id;
+static int failures; // phases that got something wrong
+
+#include "../hamming_blkdev.c"
+#include "../hamming_alloc.c"
+#include "../hamming_tree.c"
+#include "../hamming_dedup.c"
+#include "../hamming_compress.c"
+#include "../hamming_writeback.c"
+#include "../hamming_persist.c"
+#include "../hamming_test.c"
+#include "../hamming_backend.c"
+#include "../hamming_sysfs.c"
+
+enum{
+	PATTERN_SEQ,
+	PATTERN_RAND,
+	PATTERN_SWAP
+};
+
+static const char *pattern_name[] = {"seq", "rand", "swap"};
+
+typedef struct{
+	int pattern;
+	u64 pages; // span of the device touched
+	u64 next;
+	u64 run; // pages left in the current swap cluster
+	u64 seed;
+} bench_gen_t;
+
+typedef struct{
+	ktime_t start;
+	u64 allocs;
+	u64 bytes;
+	u64 hits;
+	u64 misses;
+} bench_mark_t;
+
+static u64 xorshift(u64 *state){
+	*state ^= *state << 13;
+	*state ^= *state >> 7;
+	*state ^= *state << 17;
+	return *state;
+}
+
+static void gen_init(bench_gen_t *gen, int pattern, u64 pages){
+	gen->pattern = pattern;
+	gen->pages = pages;
+	gen->next = 0;
+	gen->run = 0;
+	gen->seed = 0x9E3779B97F4A7C15ULL;
+}
+
+/**
+ * \brief Next page number of an access pattern
+ *
+ * Swap-like is runs of 8 to 64 sequential pages (readahead and writeback
+ * clusters) starting at random offsets, count is at most 64
+ */
+static u64 gen_next(bench_gen_t *gen, u64 count){
+	u64 page;
+
+	switch(gen->pattern){
+	case PATTERN_RAND:
+		return xorshift(&gen->seed) % (gen->pages - count + 1);
+	case PATTERN_SWAP:
+		if(gen->run < count){
+			gen->next = xorshift(&gen->seed) % (gen->pages - 64 - count);
+			gen->run = 8 + xorshift(&gen->seed) % 57;
+			gen->run = gen->run < count ? count : gen->run;
+		}
+		page = gen->next;
+		gen->next += count;
+		gen->run -= count;
+		return page;
+	default:
+		page = gen->next;
+		gen->next = (gen->next + count) % (gen->pages - count + 1);
+		return page;
+	}
+}
+
+static void mark_start(bench_mark_t *mark){
+	hamming_shim_quiet = true;
+	mark->allocs = hamming_shim_stats.allocs;
+	mark->bytes = hamming_shim_stats.bytes;
+	hamming_tree_cursor_stats(&mark->hits, &mark->misses);
+	mark->start = ktime_get();
+}
+
+// the end of every phase that checks what it reads, anything wrong fails the bench
+static void bench_wrong(const char *what, u64 bad){
+	if(bad){
+		printf("%-16s %llu %s wrong\n", "", (unsigned long long)bad, what);
+		failures++;
+	}
+}
+
+static void mark_end(bench_mark_t *mark, const char *name, const char *pattern, u64 ops, u64 pages){
+	ktime_t ns = ktime_get() - mark->start;
+	u64 hits, misses;
+
+	hamming_shim_quiet = false;
+	hamming_tree_cursor_stats(&hits, &misses);
+	printf("%-16s %-5s %9.1f ns/op", name, pattern, (double)ns/ops);
+	if(pages){
+		printf(" %8.1f MB/s", pages*PAGE_SIZE*1000.0/ns);
+	}
+	printf(" %9lu allocs %7.1f MB", hamming_shim_stats.allocs - mark->allocs,
+	       (hamming_shim_stats.bytes - mark->bytes)/1048576.0);
+	if(hits + misses != mark->hits + mark->misses){
+		printf(" %5.1f%% cursor hits", 100.0*(hits - mark->hits)/(hits + misses - mark->hits - mark->misses));
+	}
+	printf("\n");
+}
+
+static void bench_sector_simple(u64 pages, u64 ops){
+	bench_mark_t mark;
+	bench_gen_t gen;
+	int pattern;
+	u64 i;
+
+	mark_start(&mark);
+	for(i = 0;i < pages;i++){
+		if(hamming_tree_sector_simple(i, 0, true) == NULL){
+			printf("allocation failed\n");
+			failures++;
+			return;
+		}
+	}
+	mark_end(&mark, "populate", pattern_name[PATTERN_SEQ], pages, 0);
+	if(alloc_mode == HAMMING_ALLOC_ON_DEMAND && !alloc_arena){ // otherwise it came from the reserve or a chunk
+		printf("%-16s %.1f bytes of nodes per data page\n", "",
+		       (double)(hamming_shim_stats.bytes - mark.bytes)/pages - PAGE_SIZE - sizeof(hamming_page_t) - sizeof(hamming_code_set_t));
+	}
+	printf("%-16s tree is %d levels tall\n", "", hamming_tree_shard(0)->height);
+
+	for(pattern = PATTERN_SEQ;pattern <= PATTERN_SWAP;pattern++){
+		gen_init(&gen, pattern, pages);
+		mark_start(&mark);
+		for(i = 0;i < ops;i++){
+			if(hamming_tree_sector_simple(gen_next(&gen, 1), 0, false) == NULL){
+				printf("lost a page\n");
+			failures++;
+			}
+		}
+		mark_end(&mark, "sector_simple", pattern_name[pattern], ops, 0);
+	}
+}
+
+/**
+ * \brief Node overhead when only every 64th page is written
+ *
+ * Uses the part of the first 1GB above the dense range
+ */
+static void bench_sparse(u64 pages){
+	bench_mark_t mark;
+	u64 i, count = 0, end = min_t(u64, SECTOR_TO_PAGE(hamming->capacity), 1 << 18);
+
+	mark_start(&mark);
+	for(i = pages + 64;i < end;i += 64, count++){
+		if(hamming_tree_sector_simple(i, 0, true) == NULL){
+			printf("allocation failed\n");
+			failures++;
+			return;
+		}
+	}
+	if(count == 0){
+		return;
+	}
+	mark_end(&mark, "populate 1/64", pattern_name[PATTERN_SEQ], count, 0);
+	if(alloc_mode == HAMMING_ALLOC_ON_DEMAND && !alloc_arena){
+		printf("%-16s %.1f bytes of nodes per data page\n", "",
+		       (double)(hamming_shim_stats.bytes - mark.bytes)/count - PAGE_SIZE - sizeof(hamming_page_t) - sizeof(hamming_code_set_t));
+	}
+}
+
+#define BENCH_WIDE_PAGES 4096
+
+/**
+ * \brief Pages spread over the whole capacity, for devices far larger than what's written
+ *
+ * BENCH_WIDE_PAGES pages at random offsets (the tree grows to cover the
+ * largest), then lookups of those and of random pages that were never written
+ */
+static void bench_wide(u64 ops){
+	u64 capacity_pages = SECTOR_TO_PAGE(hamming->capacity), seed = 0x2545F4914F6CDD1DULL;
+	u64 *ids = malloc(BENCH_WIDE_PAGES*sizeof(u64));
+	bench_mark_t mark;
+	u64 i, found = 0;
+
+	if(ids == NULL){
+		return;
+	}
+	mark_start(&mark);
+	for(i = 0;i < BENCH_WIDE_PAGES;i++){
+		ids[i] = xorshift(&seed) % capacity_pages;
+		if(hamming_tree_sector_simple(ids[i], 0, true) == NULL){
+			printf("allocation failed\n");
+			failures++;
+			free(ids);
+			return;
+		}
+	}
+	mark_end(&mark, "populate wide", "rand", BENCH_WIDE_PAGES, 0);
+	if(alloc_mode == HAMMING_ALLOC_ON_DEMAND && !alloc_arena){
+		printf("%-16s %.1f bytes of nodes per data page\n", "",
+		       (double)(hamming_shim_stats.bytes - mark.bytes)/BENCH_WIDE_PAGES - PAGE_SIZE - sizeof(hamming_page_t) - sizeof(hamming_code_set_t));
+	}
+	printf("%-16s tree is %d levels tall for %llu pages\n", "", hamming_tree_shard(ids[0])->height, (unsigned long long)capacity_pages);
+
+	mark_start(&mark);
+	for(i = 0;i < ops;i++){
+		if(hamming_tree_sector_simple(ids[xorshift(&seed) % BENCH_WIDE_PAGES], 0, false) == NULL){
+			printf("lost a page\n");
+			failures++;
+		}
+	}
+	mark_end(&mark, "lookup wide", "rand", ops, 0);
+
+	mark_start(&mark);
+	for(i = 0;i < ops;i++){
+		found += hamming_tree_sector_simple(xorshift(&seed) % capacity_pages, 0, false) != NULL;
+	}
+	mark_end(&mark, "lookup wide miss", "rand", ops, 0);
+	printf("%-16s %llu of %llu were written\n", "", (unsigned long long)found, (unsigned long long)ops);
+	free(ids);
+}
+
+static void bench_resolve(u64 pages, u64 ops){
+	hamming_subtree_t target[8];
+	bool create[8];
+	bench_mark_t mark;
+	bench_gen_t gen;
+	int pattern, i;
+	u64 op, page;
+
+	memset(create, 0, sizeof(create));
+	for(pattern = PATTERN_SEQ;pattern <= PATTERN_SWAP;pattern++){
+		gen_init(&gen, pattern, pages);
+		mark_start(&mark);
+		for(op = 0;op < ops/8;op++){
+			page = gen_next(&gen, 8);
+			for(i = 0;i < 8;i++){
+				target[i].ptr = NULL;
+				target[i].processed_bits = PAGE_PROCESSED_BITS;
+				target[i].id = page + i;
+			}
+			hamming_tree_resolve(hamming_tree_head(page), target, create, 8);
+			for(i = 0;i < 8;i++){
+				if(hamming_tree_shard(target[i].id) != hamming_tree_shard(page)){
+					continue; // crossed into another shard, resolve leaves it NULL
+				}
+				if(target[i].ptr == NULL || *target[i].ptr == NULL){
+					printf("resolve lost a page\n");
+				failures++;
+				}
+			}
+		}
+		mark_end(&mark, "resolve x8", pattern_name[pattern], op*8, 0);
+	}
+}
+
+/**
+ * \brief Push bios through the queue's hardware context, like the block layer
+ */
+static void bench_bio(u64 pages, u64 ops, int bio_pages){
+	struct bio_vec *vec = calloc(bio_pages, sizeof(struct bio_vec));
+	struct page *data;
+	struct request_queue *queue = hamming->frontend.block_io.queue;
+	bench_mark_t mark;
+	bench_gen_t gen;
+	struct bio bio;
+	hamming_readahead_t *readahead = &hamming->frontend.block_io.readahead;
+	int pattern, write, i;
+	u64 op, page, hits;
+
+	if(vec == NULL || posix_memalign((void**)&data, PAGE_SIZE, bio_pages*sizeof(struct page))){
+		printf("can't allocate bio pages\n");
+		free(vec);
+		return;
+	}
+	memset(data, 0x5A, bio_pages*sizeof(struct page));
+	for(i = 0;i < bio_pages;i++){
+		data[i].data[PAGE_SIZE/2] = 0; // not same filled, those are bench_fill
+		vec[i].bv_page = &data[i];
+		vec[i].bv_len = PAGE_SIZE;
+		vec[i].bv_offset = 0;
+	}
+
+	for(pattern = PATTERN_SEQ;pattern <= PATTERN_SWAP;pattern++){
+		for(write = 1;write >= 0;write--){
+			gen_init(&gen, pattern, pages);
+			hits = atomic64_read(&readahead->hits);
+			mark_start(&mark);
+			for(op = 0;op < ops/bio_pages;op++){
+				page = gen_next(&gen, bio_pages);
+				memset(&bio, 0, sizeof(bio));
+				bio.bi_opf = write ? REQ_OP_WRITE : REQ_OP_READ;
+				bio.bi_io_vec = vec;
+				bio.bi_vcnt = bio_pages;
+				bio.bi_iter.bi_sector = page << 3;
+				bio.bi_iter.bi_size = bio_pages*PAGE_SIZE;
+				hamming_shim_submit_bio(queue, &bio);
+				if(bio.bi_done == false || bio.bi_status != BLK_STS_OK){
+					printf("bio at sector %lu failed\n", bio.bi_iter.bi_sector);
+				failures++;
+					break;
+				}
+			}
+			mark_end(&mark, write ? "bio write" : "bio read", pattern_name[pattern],
+				 op*bio_pages, op*bio_pages);
+			flush_workqueue(readahead->wq); // nothing may walk the tree behind the next phase
+			if(!write){
+				printf("%-16s %.1f%% of pages verified ahead\n", "",
+				       100.0*(atomic64_read(&readahead->hits) - hits)/(op*bio_pages));
+			}
+		}
+	}
+	for(i = 0;i < bio_pages;i++){
+		if(data[i].data[0] != 0x5A || data[i].data[PAGE_SIZE - 1] != 0x5A){
+			printf("bio read back the wrong data\n");
+			failures++;
+			break;
+		}
+	}
+	free(vec);
+	free(data);
+}
+
+/**
+ * \brief Page sized bios, dispatched one at a time and plugged together
+ *
+ * Every bio is a request, so this is what blk-mq costs per request and
+ * what handling a dispatch as one batch saves. Reads check every word
+ * written, and the hardware context of the CPU has to have seen one batch
+ * per dispatch.
+ */
+static void bench_mq(u64 pages, int bio_pages){
+	struct request_queue *queue = hamming->frontend.block_io.queue;
+	hamming_hctx_t *ctx = &hamming->frontend.block_io.hctx[hamming_shim_cpu];
+	struct bio_vec *vec = calloc(bio_pages, sizeof(struct bio_vec));
+	struct bio *bio = calloc(bio_pages, sizeof(struct bio)), **plug = calloc(bio_pages, sizeof(struct bio*));
+	struct page *data;
+	bench_mark_t mark;
+	u64 op, page, bad, batches, dispatches;
+	int batch, write, i;
+	uint j;
+	char name[32];
+
+	if(vec == NULL || bio == NULL || plug == NULL || posix_memalign((void**)&data, PAGE_SIZE, bio_pages*sizeof(struct page))){
+		printf("can't allocate bio pages\n");
+		goto out;
+	}
+	for(i = 0;i < bio_pages;i++){
+		vec[i].bv_page = &data[i];
+		vec[i].bv_len = PAGE_SIZE;
+		vec[i].bv_offset = 0;
+		plug[i] = &bio[i];
+	}
+	pages = pages/bio_pages*bio_pages;
+	for(batch = 1;batch <= bio_pages;batch = batch < bio_pages ? bio_pages : bio_pages + 1){
+		for(write = 1;write >= 0;write--){
+			bad = 0;
+			dispatches = 0;
+			batches = atomic64_read(&ctx->batches);
+			mark_start(&mark);
+			for(op = 0;op < pages;op += batch){
+				for(i = 0;i < batch;i++){
+					page = op + i;
+					for(j = 0;j < PAGE_SIZE/sizeof(u64) && write;j++){
+						((u64*)data[i].data)[j] = ((page ^ batch)*0x9E3779B97F4A7C15ULL) + j;
+					}
+					memset(&bio[i], 0, sizeof(bio[i]));
+					bio[i].bi_opf = write ? REQ_OP_WRITE : REQ_OP_READ;
+					bio[i].bi_io_vec = &vec[i];
+					bio[i].bi_vcnt = 1;
+					bio[i].bi_iter.bi_sector = page << 3;
+					bio[i].bi_iter.bi_size = PAGE_SIZE;
+				}
+				hamming_shim_submit_bios(queue, plug, batch);
+				dispatches++;
+				for(i = 0;i < batch;i++){
+					if(bio[i].bi_done == false || bio[i].bi_status != BLK_STS_OK){
+						bad++;
+						continue;
+					}
+					for(j = 0;j < PAGE_SIZE/sizeof(u64) && !write;j++){
+						if(((u64*)data[i].data)[j] != (((op + i) ^ batch)*0x9E3779B97F4A7C15ULL) + j){
+							bad++;
+							break;
+						}
+					}
+				}
+			}
+			snprintf(name, sizeof(name), "mq %s x%d", write ? "write" : "read", batch);
+			mark_end(&mark, name, pattern_name[PATTERN_SEQ], pages, pages);
+			flush_workqueue(hamming->frontend.block_io.readahead.wq);
+			bad += atomic64_read(&ctx->batches) - batches != dispatches;
+			bench_wrong("pages or batches", bad);
+		}
+	}
+	free(data);
+out:
+	free(vec);
+	free(bio);
+	free(plug);
+}
+
+static int compare_ktime(const void *a, const void *b){
+	return *(const ktime_t*)a < *(const ktime_t*)b ? -1 : *(const ktime_t*)a > *(const ktime_t*)b;
+}
+
+/**
+ * \brief Sequential bios into an empty tree, every page is allocated by its write
+ *
+ * Also reports the tail of per bio latency, which is what the allocation mode changes.
+ * With pretend NUMA nodes, bios are submitted from each node in turn.
+ */
+static void bench_bio_new(u64 pages, int bio_pages){
+	struct bio_vec *vec = calloc(bio_pages, sizeof(struct bio_vec));
+	ktime_t *lat = calloc(pages/bio_pages + 1, sizeof(ktime_t));
+	struct page *data;
+	struct request_queue *queue = hamming->frontend.block_io.queue;
+	bench_mark_t mark;
+	struct bio bio;
+	u64 op, zeroed = atomic64_read(&hamming_alloc_stats.zeroed);
+	u64 fallback = atomic64_read(&hamming_alloc_stats.fallback);
+	int i;
+
+	if(vec == NULL || lat == NULL || posix_memalign((void**)&data, PAGE_SIZE, bio_pages*sizeof(struct page))){
+		printf("can't allocate bio pages\n");
+		free(vec);
+		free(lat);
+		return;
+	}
+	memset(data, 0xA5, bio_pages*sizeof(struct page));
+	for(i = 0;i < bio_pages;i++){
+		data[i].data[PAGE_SIZE/2] = 0;
+		vec[i].bv_page = &data[i];
+		vec[i].bv_len = PAGE_SIZE;
+		vec[i].bv_offset = 0;
+	}
+
+	mark_start(&mark);
+	for(op = 0;op < pages/bio_pages;op++){
+		memset(&bio, 0, sizeof(bio));
+		bio.bi_opf = REQ_OP_WRITE;
+		bio.bi_io_vec = vec;
+		bio.bi_vcnt = bio_pages;
+		bio.bi_iter.bi_sector = (op*bio_pages) << 3;
+		bio.bi_iter.bi_size = bio_pages*PAGE_SIZE;
+		hamming_shim_node = op % hamming_shim_nodes;
+		lat[op] = ktime_get();
+		hamming_shim_submit_bio(queue, &bio);
+		lat[op] = ktime_get() - lat[op];
+		if(bio.bi_done == false || bio.bi_status != BLK_STS_OK){
+			printf("bio at sector %lu failed\n", bio.bi_iter.bi_sector);
+			failures++;
+			break;
+		}
+	}
+	hamming_shim_node = 0;
+	mark_end(&mark, "bio write new", pattern_name[PATTERN_SEQ], op*bio_pages, op*bio_pages);
+	if(op){
+		qsort(lat, op, sizeof(ktime_t), compare_ktime);
+		printf("%-16s per bio p50 %lld ns, p99 %lld ns, max %lld ns\n", "",
+		       (long long)lat[op/2], (long long)lat[op*99/100], (long long)lat[op - 1]);
+	}
+	printf("%-16s %lld pages zeroed, %lld allocations past the reserve\n", "",
+	       (long long)(atomic64_read(&hamming_alloc_stats.zeroed) - zeroed),
+	       (long long)(atomic64_read(&hamming_alloc_stats.fallback) - fallback));
+	free(vec);
+	free(lat);
+	free(data);
+}
+
+static void bench_backend(u64 ops){
+	u8 buf[PAGE_SIZE], check[PAGE_SIZE];
+	bench_mark_t mark;
+	u64 i;
+
+	memset(buf, 0xC3, sizeof(buf));
+	mark_start(&mark);
+	for(i = 0;i < ops;i++){
+		if(hamming_write(hamming, (i % 1024) << 3, buf, PAGE_SIZE) < 0 ||
+		   hamming_read(hamming, (i % 1024) << 3, check, PAGE_SIZE) < 0){
+			printf("backend failed\n");
+			failures++;
+			break;
+		}
+	}
+	mark_end(&mark, "backend rw", pattern_name[PATTERN_SEQ], i*2, i*2);
+	if(memcmp(buf, check, PAGE_SIZE) != 0){
+		printf("backend read back the wrong data\n");
+		failures++;
+	}
+}
+
+/**
+ * \brief One load per data page in random order, already resolved
+ *
+ * Leaves the tree and the ECC out of it, what's left is mostly the TLB miss
+ * of every page, which is what the data arena is for
+ */
+static void bench_page_touch(u64 pages, u64 ops){
+	u8 **data = malloc(pages*sizeof(u8*));
+	u64 i, seed = 0x2545F4914F6CDD1DULL, sum = 0;
+	bench_mark_t mark;
+
+	if(data == NULL){
+		return;
+	}
+	for(i = 0;i < pages;i++){
+		data[i] = hamming_tree_page_simple(i, false)->data;
+	}
+	mark_start(&mark);
+	for(i = 0;i < ops;i++){
+		sum += data[xorshift(&seed) % pages][(i*64) % PAGE_SIZE];
+	}
+	mark_end(&mark, "page touch", pattern_name[PATTERN_RAND], ops, 0);
+	free(data);
+	if(sum == 1){
+		printf("\n"); // keeps the loads
+	}
+}
+
+static void bench_page_correct(u64 pages, u64 ops){
+	hamming_subtree_t subtree;
+	hamming_page_t *page_ptr;
+	bench_mark_t mark;
+	u64 i, corrected = 0, failed = 0;
+	int ret;
+
+	for(i = 0;i < pages;i++){
+		subtree.processed_bits = PAGE_PROCESSED_BITS;
+		subtree.id = i;
+		hamming_tree_resolve_raw(hamming_tree_head(subtree.id), &subtree, false);
+		page_ptr = hamming_tree_page_from_subtree(subtree);
+		HAMMING_PAGE_LOGIC(page_ptr);
+	}
+
+	for(ret = 0;ret < 2;ret++){
+		mark_start(&mark);
+		for(i = 0;i < ops;i++){
+			subtree.processed_bits = PAGE_PROCESSED_BITS;
+			subtree.id = i % pages;
+			hamming_tree_resolve_raw(hamming_tree_head(subtree.id), &subtree, false);
+			page_ptr = hamming_tree_page_from_subtree(subtree);
+			if(ret == 1){
+				// one flipped bit per visit
+				flip_bit_raw(1 + i % 255, i % 128, (hamming_row_t*)page_ptr->data, 256);
+			}
+			page_ptr->last_check = 0; // no trust window, always verify
+			if(hamming_tree_page_correct(page_ptr) < 0){
+				failed++;
+			}
+		}
+		mark_end(&mark, ret ? "page_correct 1" : "page_correct 0", pattern_name[PATTERN_SEQ], ops, ops);
+	}
+
+	for(i = 0;i < pages;i++){
+		subtree.processed_bits = PAGE_PROCESSED_BITS;
+		subtree.id = i;
+		hamming_tree_resolve_raw(hamming_tree_head(subtree.id), &subtree, false);
+		page_ptr = hamming_tree_page_from_subtree(subtree);
+		page_ptr->last_check = 0;
+		corrected += hamming_tree_page_correct(page_ptr) != 0;
+	}
+	printf("%-16s %llu uncorrectable, %llu pages still wrong\n", "", (unsigned long long)failed, (unsigned long long)corrected);
+	failures += failed || corrected;
+}
+
+/**
+ * \brief Full scrub through the sysfs trigger
+ *
+ * One bit flipped in every 16th page first, then again with nothing to
+ * correct. A scrub walks the code tables in order, so the second pass is
+ * page_correct 0 without the lookups
+ */
+static void bench_scrub(u64 pages){
+	hamming_page_t *page_ptr;
+	bench_mark_t mark;
+	char sysfs_buf[64];
+	u64 i;
+
+	for(i = 0;i < pages;i += 16){
+		page_ptr = hamming_tree_page_simple(i, false);
+		flip_bit_raw(1 + i % 255, i % 128, (hamming_row_t*)page_ptr->data, 256);
+	}
+	mark_start(&mark);
+	hamming_sysfs_scrub(errors_obj, &hamming_sysfs_scrub_attribute, "1\n", 2);
+	mark_end(&mark, "scrub", pattern_name[PATTERN_SEQ], pages, pages);
+	hamming_sysfs_scrub_corrected_show(errors_obj, &hamming_sysfs_scrub_corrected_attribute, sysfs_buf);
+	printf("%-16s %llu pages, corrected %s", "", (unsigned long long)atomic64_read(&hamming_scrub_stats.pages), sysfs_buf);
+
+	mark_start(&mark);
+	hamming_tree_scrub(); // nothing left to correct, compare with page_correct 0
+	mark_end(&mark, "scrub clean", pattern_name[PATTERN_SEQ], pages, pages);
+}
+
+/**
+ * \brief One pass of bios over the first pages of a queue
+ *
+ * Writes give every page its number and a stamp in every word (plus the
+ * word's index, so no page is same filled), reads sum
+ * each page into sums, or check it against sums if check is set
+ *
+ * \return Pages that didn't match, bios that failed
+ */
+static u64 bench_snapshot_pass(struct request_queue *queue, bool write, u64 pages, int bio_pages,
+			       u64 *sums, bool check, u64 stamp){
+	struct bio_vec *vec = calloc(bio_pages, sizeof(struct bio_vec));
+	struct page *data;
+	struct bio bio;
+	u64 op, page, sum, bad = 0;
+	int i;
+	uint j;
+
+	if(vec == NULL || posix_memalign((void**)&data, PAGE_SIZE, bio_pages*sizeof(struct page))){
+		free(vec);
+		return pages;
+	}
+	for(i = 0;i < bio_pages;i++){
+		vec[i].bv_page = &data[i];
+		vec[i].bv_len = PAGE_SIZE;
+		vec[i].bv_offset = 0;
+	}
+	for(op = 0;op < pages/bio_pages;op++){
+		for(i = 0;i < bio_pages && write;i++){
+			for(j = 0;j < PAGE_SIZE/sizeof(u64);j++){
+				((u64*)data[i].data)[j] = ((op*bio_pages + i) ^ stamp) + j;
+			}
+		}
+		memset(&bio, 0, sizeof(bio));
+		bio.bi_opf = write ? REQ_OP_WRITE : REQ_OP_READ;
+		bio.bi_io_vec = vec;
+		bio.bi_vcnt = bio_pages;
+		bio.bi_iter.bi_sector = (op*bio_pages) << 3;
+		bio.bi_iter.bi_size = bio_pages*PAGE_SIZE;
+		hamming_shim_submit_bio(queue, &bio);
+		if(bio.bi_done == false || bio.bi_status != BLK_STS_OK){
+			bad++;
+			continue;
+		}
+		for(i = 0;i < bio_pages && !write;i++){
+			page = op*bio_pages + i;
+			sum = 0;
+			for(j = 0;j < PAGE_SIZE/sizeof(u64);j++){
+				sum = (sum ^ ((u64*)data[i].data)[j])*0x100000001B3ULL;
+			}
+			if(check){
+				bad += sums[page] != sum;
+			}else{
+				sums[page] = sum;
+			}
+		}
+	}
+	free(vec);
+	free(data);
+	return bad;
+}
+
+/**
+ * \brief One pass of bios over the first pages of a queue, every word of them given by word
+ *
+ * Reads check every word against word(page, j, arg, stamp)
+ *
+ * \return Pages that didn't match, bios that failed
+ */
+static u64 bench_word_pass(struct request_queue *queue, bool write, u64 pages, int bio_pages,
+			   u64 (*word)(u64 page, int j, u64 arg, u64 stamp), u64 arg, u64 stamp){
+	struct bio_vec *vec = calloc(bio_pages, sizeof(struct bio_vec));
+	struct page *data;
+	struct bio bio;
+	u64 op, page, bad = 0;
+	int i;
+	uint j;
+
+	if(vec == NULL || posix_memalign((void**)&data, PAGE_SIZE, bio_pages*sizeof(struct page))){
+		free(vec);
+		return pages;
+	}
+	for(i = 0;i < bio_pages;i++){
+		vec[i].bv_page = &data[i];
+		vec[i].bv_len = PAGE_SIZE;
+		vec[i].bv_offset = 0;
+	}
+	for(op = 0;op < pages/bio_pages;op++){
+		for(i = 0;i < bio_pages && write;i++){
+			for(j = 0;j < PAGE_SIZE/sizeof(u64);j++){
+				((u64*)data[i].data)[j] = word(op*bio_pages + i, j, arg, stamp);
+			}
+		}
+		memset(&bio, 0, sizeof(bio));
+		bio.bi_opf = write ? REQ_OP_WRITE : REQ_OP_READ;
+		bio.bi_io_vec = vec;
+		bio.bi_vcnt = bio_pages;
+		bio.bi_iter.bi_sector = (op*bio_pages) << 3;
+		bio.bi_iter.bi_size = bio_pages*PAGE_SIZE;
+		hamming_shim_submit_bio(queue, &bio);
+		if(bio.bi_done == false || bio.bi_status != BLK_STS_OK){
+			bad++;
+			continue;
+		}
+		for(i = 0;i < bio_pages && !write;i++){
+			page = op*bio_pages + i;
+			for(j = 0;j < PAGE_SIZE/sizeof(u64);j++){
+				if(((u64*)data[i].data)[j] != word(page, j, arg, stamp)){
+					bad++;
+					break;
+				}
+			}
+		}
+	}
+	free(vec);
+	free(data);
+	return bad;
+}
+
+// snapshot through the sysfs trigger, false (and a failure) if it can't be taken
+static bool bench_snapshot_take(void){
+	if(hamming_sysfs_snapshot(errors_obj, &hamming_sysfs_snapshot_attribute, "1\n", 2) < 0){
+		hamming_shim_quiet = false;
+		printf("snapshot failed\n");
+		failures++;
+		return false;
+	}
+	return true;
+}
+
+static void bench_snapshot_drop(void){
+	hamming_sysfs_snapshot(errors_obj, &hamming_sysfs_snapshot_attribute, "0\n", 2);
+}
+
+/**
+ * \brief Overwrite the first count pages under a snapshot
+ *
+ * The device holds pages as word has them with old_stamp. Under a snapshot
+ * the first count are written with new_stamp, then setup (if any) changes
+ * whatever else the phase changes under it. The device has to read back the
+ * new pages and the snapshot disk every page as it was, and the device the
+ * new pages again once the snapshot is dropped.
+ *
+ * \return Pages that didn't match, bios that failed, 1 if there was no snapshot
+ */
+static u64 bench_snapshot_overwrite(const char *name, u64 pages, u64 count, int bio_pages,
+				    u64 (*word)(u64 page, int j, u64 arg, u64 stamp), u64 arg, u64 old_stamp, u64 new_stamp,
+				    u64 (*setup)(struct request_queue *queue, u64 pages)){
+	struct request_queue *queue = hamming->frontend.block_io.queue;
+	bench_mark_t mark;
+	u64 bad;
+
+	if(!bench_snapshot_take()){
+		return 1;
+	}
+	mark_start(&mark);
+	bad = bench_word_pass(queue, true, count, bio_pages, word, arg, new_stamp);
+	mark_end(&mark, name, "snap", count, count);
+	if(setup != NULL){
+		bad += setup(queue, pages);
+	}
+	bad += bench_word_pass(queue, false, count, bio_pages, word, arg, new_stamp);
+	bad += bench_word_pass(hamming->frontend.block_io.snap_queue, false, pages, bio_pages, word, arg, old_stamp);
+	bench_snapshot_drop();
+	bad += bench_word_pass(queue, false, count, bio_pages, word, arg, new_stamp);
+	return bad;
+}
+
+/**
+ * \brief Snapshot through the sysfs trigger, then overwrite the device under it
+ *
+ * The first pass of writes after the snapshot copies every page (and the
+ * nodes above them), the second is the same writes without copies. The
+ * snapshot disk has to read back what the device held before either,
+ * dropping it frees the pages it kept.
+ */
+static void bench_snapshot(u64 pages, int bio_pages){
+	struct request_queue *queue = hamming->frontend.block_io.queue;
+	u64 *sums = calloc(pages, sizeof(u64));
+	u64 bad, nodes = atomic64_read(&hamming_snapshot_stats.nodes);
+	u64 copied = atomic64_read(&hamming_snapshot_stats.pages);
+	u64 freed = atomic64_read(&hamming_snapshot_stats.freed);
+	s64 live = atomic64_read(&hamming_alloc_stats.pages) - hamming_alloc_reserved();
+	bench_mark_t mark;
+
+	if(sums == NULL){
+		printf("can't allocate snapshot sums\n");
+		return;
+	}
+	pages = pages/bio_pages*bio_pages;
+	bad = bench_snapshot_pass(queue, false, pages, bio_pages, sums, false, 0);
+
+	mark_start(&mark);
+	if(!bench_snapshot_take()){
+		free(sums);
+		return;
+	}
+	mark_end(&mark, "snapshot take", "", 1, 0);
+
+	mark_start(&mark);
+	bad += bench_snapshot_pass(queue, true, pages, bio_pages, NULL, false, 0xC3C3C3C3C3C3C3C3ULL);
+	mark_end(&mark, "bio write cow", pattern_name[PATTERN_SEQ], pages, pages);
+	printf("%-16s %llu nodes and %llu pages copied\n", "",
+	       (unsigned long long)(atomic64_read(&hamming_snapshot_stats.nodes) - nodes),
+	       (unsigned long long)(atomic64_read(&hamming_snapshot_stats.pages) - copied));
+	mark_start(&mark);
+	bad += bench_snapshot_pass(queue, true, pages, bio_pages, NULL, false, 0x3C3C3C3C3C3C3C3CULL);
+	mark_end(&mark, "bio write owned", pattern_name[PATTERN_SEQ], pages, pages);
+
+	mark_start(&mark);
+	bad += bench_snapshot_pass(hamming->frontend.block_io.snap_queue, false, pages, bio_pages, sums, true, 0);
+	mark_end(&mark, "snapshot read", pattern_name[PATTERN_SEQ], pages, pages);
+
+	mark_start(&mark);
+	bench_snapshot_drop();
+	mark_end(&mark, "snapshot drop", "", 1, 0);
+	printf("%-16s %llu pages freed with it", "",
+	       (unsigned long long)(atomic64_read(&hamming_snapshot_stats.freed) - freed));
+	live -= atomic64_read(&hamming_alloc_stats.pages) - hamming_alloc_reserved();
+	if(live){
+		printf(", %lld pages more than before it", -(long long)live);
+	}
+	printf("\n");
+	bench_wrong("pages or bios", bad);
+	free(sums);
+}
+
+// DISCARD or WRITE_ZEROES bios of at most 2GB over a range, false if one failed, what they unlinked is freed on return
+static bool bench_discard_bio(struct request_queue *queue, int op, sector_t sector, sector_t sectors){
+	struct bio bio;
+
+	while(sectors){
+		memset(&bio, 0, sizeof(bio));
+		bio.bi_opf = op;
+		bio.bi_iter.bi_sector = sector;
+		bio.bi_iter.bi_size = min_t(sector_t, sectors, 1 << 22) << SECTOR_SHIFT;
+		hamming_shim_submit_bio(queue, &bio);
+		if(!bio.bi_done || bio.bi_status != BLK_STS_OK){
+			return false;
+		}
+		sector += bio.bi_iter.bi_size >> SECTOR_SHIFT;
+		sectors -= bio.bi_iter.bi_size >> SECTOR_SHIFT;
+	}
+	flush_workqueue(hamming_tree_reclaimer.wq);
+	return true;
+}
+
+// pages, nodes and code tables the tree holds right now
+static void bench_discard_usage(s64 *usage){
+	usage[0] = atomic64_read(&hamming_alloc_stats.pages) - hamming_alloc_reserved();
+	usage[1] = atomic64_read(&hamming_alloc_stats.nodes);
+	usage[2] = atomic64_read(&hamming_alloc_stats.codes);
+}
+
+static void bench_discard_print(const char *what, s64 *before){
+	s64 after[3];
+
+	bench_discard_usage(after);
+	printf("%-16s %s: %lld pages, %lld nodes, %lld code tables left (%+lld, %+lld, %+lld)\n", "", what,
+	       (long long)after[0], (long long)after[1], (long long)after[2],
+	       (long long)(after[0] - before[0]), (long long)(after[1] - before[1]), (long long)(after[2] - before[2]));
+}
+
+/**
+ * \brief DISCARD and WRITE_ZEROES bios
+ *
+ * Half the device is discarded in one bio, a range with partial pages at
+ * both ends is zeroed, then everything is discarded under a snapshot (which
+ * has to read back what was there) and once more without one. Reads have to
+ * see zeroes where the discards went and the old data everywhere else, and
+ * the memory has to go back to the allocator.
+ */
+static void bench_discard(u64 pages, int bio_pages){
+	struct request_queue *queue = hamming->frontend.block_io.queue;
+	u64 *sums = calloc(pages, sizeof(u64)), *check = calloc(pages, sizeof(u64));
+	u64 bad = 0, i;
+	s64 usage[3];
+	bench_mark_t mark;
+
+	if(sums == NULL || check == NULL){
+		printf("can't allocate discard sums\n");
+		free(sums);
+		free(check);
+		return;
+	}
+	pages = pages/bio_pages*bio_pages;
+	bad += bench_snapshot_pass(queue, true, pages, bio_pages, NULL, false, 0x5A5A5A5A5A5A5A5AULL);
+	bad += bench_snapshot_pass(queue, false, pages, bio_pages, sums, false, 0);
+	bench_discard_usage(usage);
+
+	mark_start(&mark);
+	bad += !bench_discard_bio(queue, REQ_OP_DISCARD, PAGE_TO_SECTOR(pages/2), PAGE_TO_SECTOR(pages - pages/2));
+	mark_end(&mark, "discard half", pattern_name[PATTERN_SEQ], 1, pages - pages/2);
+	bench_discard_print("after", usage);
+
+	// sectors 3..7 of page 1, pages 2..4, sectors 0..4 of page 5
+	bad += !bench_discard_bio(queue, REQ_OP_WRITE_ZEROES, PAGE_TO_SECTOR(1) + 3, PAGE_TO_SECTOR(4) + 2);
+	bad += bench_snapshot_pass(queue, false, pages, bio_pages, check, false, 0);
+	for(i = 0;i < pages;i++){
+		if(i == 1 || i == 5){
+			bad += check[i] == sums[i] || check[i] == 0;
+		}else if((i >= 2 && i <= 4) || i >= pages/2){
+			bad += check[i] != 0; // all zero page sums to zero
+		}else{
+			bad += check[i] != sums[i];
+		}
+	}
+
+	bench_discard_usage(usage);
+	memcpy(sums, check, pages*sizeof(u64));
+	if(bench_snapshot_take()){
+		mark_start(&mark);
+		bad += !bench_discard_bio(queue, REQ_OP_DISCARD, 0, hamming->capacity);
+		mark_end(&mark, "discard snapshot", pattern_name[PATTERN_SEQ], 1, pages/2);
+		bad += bench_snapshot_pass(hamming->frontend.block_io.snap_queue, false, pages, bio_pages, sums, true, 0);
+		memset(sums, 0, pages*sizeof(u64));
+		bad += bench_snapshot_pass(queue, false, pages, bio_pages, sums, true, 0);
+		bench_snapshot_drop();
+		bench_discard_print("snapshot dropped", usage);
+	}
+
+	bad += bench_snapshot_pass(queue, true, pages, bio_pages, NULL, false, 0xA5A5A5A5A5A5A5A5ULL);
+	bench_discard_usage(usage);
+	mark_start(&mark);
+	bad += !bench_discard_bio(queue, REQ_OP_DISCARD, 0, hamming->capacity);
+	mark_end(&mark, "discard device", pattern_name[PATTERN_SEQ], 1, pages);
+	bench_discard_print("after", usage);
+	bad += bench_snapshot_pass(queue, false, pages, bio_pages, sums, true, 0);
+	bench_wrong("pages or bios", bad);
+	free(sums);
+	free(check);
+}
+
+// every word of a page bench_fill writes, every fourth page is zeroes
+static u64 bench_fill_word(u64 page, int j, u64 arg, u64 stamp){
+	return page % 4 ? (page*0x0101010101010101ULL) ^ stamp : 0;
+}
+
+// bench_word_pass with same filled pages
+static u64 bench_fill_pass(struct request_queue *queue, bool write, u64 pages, int bio_pages, u64 stamp){
+	return bench_word_pass(queue, write, pages, bio_pages, bench_fill_word, 0, stamp);
+}
+
+// one bio of len bytes at sector, data is read into or written from buf
+static bool bench_fill_bio(struct request_queue *queue, int op, sector_t sector, u8 *buf, u32 len){
+	struct bio_vec vec;
+	struct bio bio;
+
+	vec.bv_page = (struct page*)buf;
+	vec.bv_len = len;
+	vec.bv_offset = 0;
+	memset(&bio, 0, sizeof(bio));
+	bio.bi_opf = op;
+	bio.bi_io_vec = &vec;
+	bio.bi_vcnt = 1;
+	bio.bi_iter.bi_sector = sector;
+	bio.bi_iter.bi_size = len;
+	hamming_shim_submit_bio(queue, &bio);
+	return bio.bi_done && bio.bi_status == BLK_STS_OK;
+}
+
+// sectors 2..4 of the page past the first half, data around the fill it still has
+static u64 bench_fill_partial(struct request_queue *queue, u64 pages){
+	u8 *buf;
+	u64 bad = 0, i;
+
+	if(posix_memalign((void**)&buf, PAGE_SIZE, PAGE_SIZE)){
+		return 1;
+	}
+	memset(buf, 0xFF, PAGE_SIZE);
+	bad += !bench_fill_bio(queue, REQ_OP_WRITE, PAGE_TO_SECTOR(pages/2 + 1) + 2, buf, 3*SECTOR_SIZE);
+	bad += !bench_fill_bio(queue, REQ_OP_READ, PAGE_TO_SECTOR(pages/2 + 1), buf, PAGE_SIZE);
+	for(i = 0;i < PAGE_SIZE/sizeof(u64);i++){
+		if(((u64*)buf)[i] != (i >= 2*SECTOR_SIZE/8 && i < 5*SECTOR_SIZE/8 ? ~0ULL :
+				       bench_fill_word(pages/2 + 1, i, 0, 0x5A5A5A5A5A5A5A5AULL))){
+			bad++;
+			break;
+		}
+	}
+	free(buf);
+	return bad;
+}
+
+/**
+ * \brief Same filled pages, as swap writes plenty of
+ *
+ * The device is emptied, then every page written same filled (every fourth
+ * one zeroes), which should take descriptors and nothing else. Reads have
+ * to see the fill, with a copy of it flipped on a few pages for the reads
+ * and the scrub to outvote. Under a snapshot, fills replace the shared pages
+ * and a partial write copies one into a page with data around the fill, the
+ * snapshot has to read back the old fills. Overwriting everything with
+ * regular data gives the rest data.
+ */
+static void bench_fill(u64 pages, int bio_pages){
+	struct request_queue *queue = hamming->frontend.block_io.queue;
+	hamming_fill_stats_t before = hamming_fill_stats;
+	s64 filled, usage[3];
+	u64 bad = 0, i, stored, elided, corrected;
+	hamming_page_t *page_ptr;
+	bench_mark_t mark;
+
+	pages = pages/bio_pages*bio_pages;
+	bad += !bench_discard_bio(queue, REQ_OP_DISCARD, 0, hamming->capacity);
+	bench_discard_usage(usage);
+	filled = atomic64_read(&hamming_alloc_stats.filled);
+
+	mark_start(&mark);
+	bad += bench_fill_pass(queue, true, pages, bio_pages, 0x5A5A5A5A5A5A5A5AULL);
+	mark_end(&mark, "bio write filled", pattern_name[PATTERN_SEQ], pages, pages);
+	stored = atomic64_read(&hamming_fill_stats.stored) - atomic64_read(&before.stored);
+	elided = atomic64_read(&hamming_fill_stats.elided) - atomic64_read(&before.elided);
+	printf("%-16s %llu stored, %llu elided, %lld descriptors (%llu bytes each)\n", "",
+	       (unsigned long long)stored, (unsigned long long)elided,
+	       (long long)(atomic64_read(&hamming_alloc_stats.filled) - filled), (unsigned long long)sizeof(hamming_page_t));
+	bench_discard_print("after", usage);
+	bad += stored + elided != pages;
+
+	mark_start(&mark);
+	bad += bench_fill_pass(queue, false, pages, bio_pages, 0x5A5A5A5A5A5A5A5AULL);
+	mark_end(&mark, "bio read filled", pattern_name[PATTERN_SEQ], pages, pages);
+
+	// one copy flipped on every 64th stored page, in a different place each time
+	corrected = atomic64_read(&hamming_fill_stats.corrected);
+	rcu_read_lock();
+	for(i = 1;i < pages;i += 64){
+		page_ptr = hamming_tree_page_simple(i, false);
+		if(page_ptr != NULL){
+			page_ptr->fill[i % HAMMING_FILL_COPIES] ^= 1ULL << (i % 64);
+		}
+	}
+	rcu_read_unlock();
+	bad += bench_fill_pass(queue, false, pages/2, bio_pages, 0x5A5A5A5A5A5A5A5AULL);
+	hamming_tree_scrub();
+	bad += bench_fill_pass(queue, false, pages, bio_pages, 0x5A5A5A5A5A5A5A5AULL);
+	printf("%-16s %llu fill copies outvoted\n", "",
+	       (unsigned long long)(atomic64_read(&hamming_fill_stats.corrected) - corrected));
+	bad += atomic64_read(&hamming_fill_stats.corrected) - corrected != (pages + 62)/64;
+
+	// under a snapshot, new fills replace the first half, sectors 2..4 of one page past it copy it
+	bad += bench_snapshot_overwrite("bio write filled", pages, pages/2, bio_pages, bench_fill_word, 0,
+					0x5A5A5A5A5A5A5A5AULL, 0xC3C3C3C3C3C3C3C3ULL, bench_fill_partial);
+
+	mark_start(&mark);
+	bad += bench_snapshot_pass(queue, true, pages, bio_pages, NULL, false, 0xC3C3C3C3C3C3C3C3ULL);
+	mark_end(&mark, "bio write unfill", pattern_name[PATTERN_SEQ], pages, pages);
+	printf("%-16s %llu pages given data, %lld descriptors left\n", "",
+	       (unsigned long long)(atomic64_read(&hamming_fill_stats.unfilled) - atomic64_read(&before.unfilled)),
+	       (long long)(atomic64_read(&hamming_alloc_stats.filled) - filled));
+	bench_discard_print("after", usage);
+
+	bad += !bench_discard_bio(queue, REQ_OP_DISCARD, 0, hamming->capacity);
+	if(atomic64_read(&hamming_alloc_stats.filled) != filled){
+		printf("%-16s %lld descriptors left after discard\n", "", (long long)(atomic64_read(&hamming_alloc_stats.filled) - filled));
+	}
+	bench_wrong("pages or bios", bad);
+}
+
+// word j of a page bench_dedup writes, pages with the same page % distinct have the same contents
+static u64 bench_dedup_word(u64 page, int j, u64 distinct, u64 stamp){
+	return (((page % distinct) ^ stamp)*0x9E3779B97F4A7C15ULL) + j;
+}
+
+// bench_word_pass with distinct different page contents
+static u64 bench_dedup_pass(struct request_queue *queue, bool write, u64 pages, int bio_pages, u64 distinct, u64 stamp){
+	return bench_word_pass(queue, write, pages, bio_pages, bench_dedup_word, distinct, stamp);
+}
+
+// dedup counts and the averages sysfs derives from them
+static void bench_dedup_print(const char *what){
+	char buf[64];
+
+	printf("%-16s %s: %lld shared pages, %lld refs", "", what,
+	       (long long)atomic64_read(&hamming_dedup_stats.pages), (long long)atomic64_read(&hamming_dedup_stats.refs));
+	hamming_sysfs_dedup_ratio_show(errors_obj, &hamming_sysfs_dedup_ratio_attribute, buf);
+	printf(", ratio %.*s", (int)strcspn(buf, "\n"), buf);
+	hamming_sysfs_dedup_lookup_ns_show(errors_obj, &hamming_sysfs_dedup_lookup_ns_attribute, buf);
+	printf(", %.*s ns", (int)strcspn(buf, "\n"), buf);
+	hamming_sysfs_dedup_probes_show(errors_obj, &hamming_sysfs_dedup_probes_attribute, buf);
+	printf(" and %.*s entries per lookup\n", (int)strcspn(buf, "\n"), buf);
+}
+
+/**
+ * \brief Page deduplication by content
+ *
+ * With the device emptied and dedup set, every page is written with
+ * contents of its own (all misses), then over again with an eighth as many
+ * different contents, which should leave that many shared pages. Reads have
+ * to see every page's contents. A partial write copies one page out of its
+ * sharing, the others keep the old contents, and a bit flipped in a shared
+ * page is corrected once by the scrub, not once per page pointing at it.
+ * Under a snapshot, rewriting half the device has to leave the snapshot
+ * reading the old contents. Discarding everything has to empty the index.
+ */
+static void bench_dedup(u64 pages, int bio_pages){
+	struct request_queue *queue = hamming->frontend.block_io.queue;
+	u64 distinct = max_t(u64, pages/8, 1), bad = 0, corrected, broken, i;
+	hamming_page_t *page_ptr;
+	s64 usage[3];
+	u8 *buf;
+	bench_mark_t mark;
+
+	if(posix_memalign((void**)&buf, PAGE_SIZE, PAGE_SIZE)){
+		printf("can't allocate dedup buffer\n");
+		return;
+	}
+	pages = pages/bio_pages*bio_pages;
+	bad += !bench_discard_bio(queue, REQ_OP_DISCARD, 0, hamming->capacity);
+	bench_discard_usage(usage);
+	dedup = true;
+
+	mark_start(&mark);
+	bad += bench_dedup_pass(queue, true, pages, bio_pages, pages, 0x5A5A5A5A5A5A5A5AULL);
+	mark_end(&mark, "bio write dedup", "unique", pages, pages);
+	bench_dedup_print("after");
+	bad += atomic64_read(&hamming_dedup_stats.pages) != (s64)pages;
+
+	mark_start(&mark);
+	bad += bench_dedup_pass(queue, true, pages, bio_pages, distinct, 0x5A5A5A5A5A5A5A5AULL);
+	mark_end(&mark, "bio write dedup", "1/8", pages, pages);
+	flush_workqueue(hamming_dedup.wq);
+	bench_dedup_print("after");
+	bench_discard_print("after", usage);
+	bad += atomic64_read(&hamming_dedup_stats.pages) != (s64)distinct || atomic64_read(&hamming_dedup_stats.refs) != (s64)pages;
+
+	mark_start(&mark);
+	bad += bench_dedup_pass(queue, false, pages, bio_pages, distinct, 0x5A5A5A5A5A5A5A5AULL);
+	mark_end(&mark, "bio read dedup", pattern_name[PATTERN_SEQ], pages, pages);
+
+	// sectors 2..4 of page 1 copy it, page 1 + distinct still shares the old contents
+	broken = atomic64_read(&hamming_dedup_stats.broken);
+	memset(buf, 0xFF, PAGE_SIZE);
+	bad += !bench_fill_bio(queue, REQ_OP_WRITE, PAGE_TO_SECTOR(1) + 2, buf, 3*SECTOR_SIZE);
+	bad += !bench_fill_bio(queue, REQ_OP_READ, PAGE_TO_SECTOR(1), buf, PAGE_SIZE);
+	for(i = 0;i < PAGE_SIZE/sizeof(u64);i++){
+		if(((u64*)buf)[i] != (i >= 2*SECTOR_SIZE/8 && i < 5*SECTOR_SIZE/8 ? ~0ULL :
+				       bench_dedup_word(1, i, distinct, 0x5A5A5A5A5A5A5A5AULL))){
+			bad++;
+			break;
+		}
+	}
+	bad += atomic64_read(&hamming_dedup_stats.broken) - broken != 1;
+	for(i = 0;i < PAGE_SIZE/sizeof(u64);i++){
+		((u64*)buf)[i] = bench_dedup_word(1, i, distinct, 0x5A5A5A5A5A5A5A5AULL);
+	}
+	bad += !bench_fill_bio(queue, REQ_OP_WRITE, PAGE_TO_SECTOR(1), buf, PAGE_SIZE); // in place, the page is its own now
+
+	// a bit flipped in the page every page 2 + k*distinct shares is corrected once
+	if(distinct > 2){
+		rcu_read_lock();
+		page_ptr = hamming_tree_page_simple(2, false);
+		if(page_ptr != NULL && (page_ptr->flags & HAMMING_PAGE_DEDUP)){
+			page_ptr->data[100] ^= 1 << 3;
+		}else{
+			bad++;
+		}
+		rcu_read_unlock();
+		corrected = atomic64_read(&hamming_scrub_stats.corrected);
+		mark_start(&mark);
+		hamming_tree_scrub();
+		mark_end(&mark, "scrub dedup", "", 1, pages);
+		printf("%-16s %llu pages corrected\n", "", (unsigned long long)(atomic64_read(&hamming_scrub_stats.corrected) - corrected));
+		bad += atomic64_read(&hamming_scrub_stats.corrected) - corrected != 1;
+	}
+	bad += bench_dedup_pass(queue, false, pages, bio_pages, distinct, 0x5A5A5A5A5A5A5A5AULL);
+
+	// under a snapshot, the first half is rewritten with new contents, still shared among themselves
+	bad += bench_snapshot_overwrite("bio write dedup", pages, pages/2, bio_pages, bench_dedup_word, distinct,
+					0x5A5A5A5A5A5A5A5AULL, 0xC3C3C3C3C3C3C3C3ULL, NULL);
+	bench_dedup_print("snapshot dropped");
+
+	bad += !bench_discard_bio(queue, REQ_OP_DISCARD, 0, hamming->capacity);
+	flush_workqueue(hamming_dedup.wq);
+	bench_discard_print("discarded", usage);
+	if(atomic64_read(&hamming_dedup_stats.pages) || atomic64_read(&hamming_dedup_stats.refs)){
+		printf("%-16s %lld shared pages, %lld refs left after discard\n", "",
+		       (long long)atomic64_read(&hamming_dedup_stats.pages), (long long)atomic64_read(&hamming_dedup_stats.refs));
+		bad++;
+	}
+	dedup = false;
+	bench_wrong("pages or bios", bad);
+	free(buf);
+}
+
+#define BENCH_COMPRESS_STAMP 0x3C3C3C3C3C3C3C3CULL
+
+// word j of a page bench_compress writes, its first page % 9 sectors are noise and the rest a 64 byte pattern
+static u64 bench_compress_word(u64 page, int j, u64 arg, u64 stamp){
+	u64 x = ((page << 10) | j) ^ stamp;
+
+	(void)arg;
+	if(j/(SECTOR_SIZE/sizeof(u64)) < page % 9){
+		x *= 0x9E3779B97F4A7C15ULL;
+		x ^= x >> 29;
+		x *= 0xBF58476D1CE4E5B9ULL;
+		return x ^ (x >> 32);
+	}
+	return (page ^ stamp) + j % 8;
+}
+
+// true if buf holds len bytes of page from chunk on, as bench_compress_word has it
+static bool bench_compress_check(const u8 *buf, u64 page, u8 chunk, u32 len, u64 stamp){
+	u32 i;
+
+	for(i = 0;i < len/sizeof(u64);i++){
+		if(((const u64*)buf)[i] != bench_compress_word(page, chunk*SECTOR_SIZE/sizeof(u64) + i, 0, stamp)){
+			return false;
+		}
+	}
+	return true;
+}
+
+// compression counts and the ratio sysfs derives from them
+static void bench_compress_print(const char *what){
+	char buf[64];
+
+	hamming_sysfs_compress_ratio_show(errors_obj, &hamming_sysfs_compress_ratio_attribute, buf);
+	printf("%-16s %s: %lld pages compressed in %lld bytes, ratio %.*s, %lld incompressible\n", "", what,
+	       (long long)atomic64_read(&hamming_alloc_stats.compressed),
+	       (long long)atomic64_read(&hamming_alloc_stats.compressed_bytes), (int)strcspn(buf, "\n"), buf,
+	       (long long)atomic64_read(&hamming_compress_stats.incompressible));
+}
+
+/**
+ * \brief Compression of cold pages
+ *
+ * With the device emptied, every page is written with between none and all
+ * of its sectors noise. A pass later the first half is read, so the next
+ * pass only compresses the second half and the one after that the first.
+ * Every page has to be compressed or found incompressible, and the data
+ * pages of the compressed ones given back. Reads have to see every page's
+ * contents, whole or in part, a bit flipped in compressed bytes is
+ * corrected by the scrub, and writes, partial or whole, expand the page
+ * again. Under a snapshot, rewriting half the device has to leave the
+ * snapshot reading the old contents. Discarding everything has to free
+ * every compressed page.
+ */
+static void bench_compress(u64 pages, int bio_pages){
+	struct request_queue *queue = hamming->frontend.block_io.queue;
+	u64 bad = 0, half, corrected, expanded, reads, incompressible, i;
+	uint age = compress_age;
+	hamming_page_t *page_ptr;
+	s64 usage[3], after[3], compressed;
+	u8 *buf;
+	bench_mark_t mark;
+
+	if(posix_memalign((void**)&buf, PAGE_SIZE, PAGE_SIZE)){
+		printf("can't allocate compress buffer\n");
+		return;
+	}
+	pages = pages/bio_pages*bio_pages;
+	half = pages/bio_pages/2*bio_pages;
+	bad += !bench_discard_bio(queue, REQ_OP_DISCARD, 0, hamming->capacity);
+	bench_discard_usage(usage);
+	compress_age = 2;
+	incompressible = atomic64_read(&hamming_compress_stats.incompressible);
+
+	bad += bench_word_pass(queue, true, pages, bio_pages, bench_compress_word, 0, BENCH_COMPRESS_STAMP);
+	hamming_compress_run();
+	bad += bench_word_pass(queue, false, half, bio_pages, bench_compress_word, 0, BENCH_COMPRESS_STAMP);
+	mark_start(&mark);
+	hamming_compress_run();
+	mark_end(&mark, "compress pass", "cold half", 1, pages - half);
+	bench_compress_print("second half");
+	compressed = atomic64_read(&hamming_alloc_stats.compressed);
+	bad += compressed == 0 ||
+		compressed + atomic64_read(&hamming_compress_stats.incompressible) - incompressible != pages - half;
+	mark_start(&mark);
+	hamming_compress_run();
+	mark_end(&mark, "compress pass", "first half", 1, half);
+	bench_compress_print("all");
+	compressed = atomic64_read(&hamming_alloc_stats.compressed);
+	bad += compressed + atomic64_read(&hamming_compress_stats.incompressible) - incompressible != pages;
+	bench_discard_print("compressed", usage);
+	bench_discard_usage(after);
+	bad += after[0] - usage[0] != (s64)pages - compressed;
+
+	reads = atomic64_read(&hamming_compress_stats.reads);
+	mark_start(&mark);
+	bad += bench_word_pass(queue, false, pages, bio_pages, bench_compress_word, 0, BENCH_COMPRESS_STAMP);
+	mark_end(&mark, "bio read compress", pattern_name[PATTERN_SEQ], pages, pages);
+	bad += atomic64_read(&hamming_compress_stats.reads) - reads != (u64)compressed;
+
+	// pages % 9 == 0 are all pattern, page 9 stays compressed through a partial read
+	bad += !bench_fill_bio(queue, REQ_OP_READ, PAGE_TO_SECTOR(9) + 1, buf, 3*SECTOR_SIZE);
+	bad += !bench_compress_check(buf, 9, 1, 3*SECTOR_SIZE, BENCH_COMPRESS_STAMP);
+
+	// a bit flipped in the compressed bytes of page 18 is corrected by the scrub
+	rcu_read_lock();
+	page_ptr = hamming_tree_page_simple(18, false);
+	if(page_ptr != NULL && (page_ptr->flags & HAMMING_PAGE_COMPRESSED)){
+		page_ptr->data[40] ^= 1 << 2;
+	}else{
+		bad++;
+	}
+	rcu_read_unlock();
+	corrected = atomic64_read(&hamming_scrub_stats.corrected);
+	mark_start(&mark);
+	hamming_tree_scrub();
+	mark_end(&mark, "scrub compress", "", 1, pages);
+	printf("%-16s %llu pages corrected\n", "", (unsigned long long)(atomic64_read(&hamming_scrub_stats.corrected) - corrected));
+	bad += atomic64_read(&hamming_scrub_stats.corrected) - corrected != 1;
+	bad += !bench_fill_bio(queue, REQ_OP_READ, PAGE_TO_SECTOR(18), buf, PAGE_SIZE);
+	bad += !bench_compress_check(buf, 18, 0, PAGE_SIZE, BENCH_COMPRESS_STAMP);
+
+	// sectors 2..4 of page 27 expand it, a whole page write of page 36 as well
+	expanded = atomic64_read(&hamming_compress_stats.expanded);
+	memset(buf, 0xFF, PAGE_SIZE);
+	bad += !bench_fill_bio(queue, REQ_OP_WRITE, PAGE_TO_SECTOR(27) + 2, buf, 3*SECTOR_SIZE);
+	bad += !bench_fill_bio(queue, REQ_OP_READ, PAGE_TO_SECTOR(27), buf, PAGE_SIZE);
+	for(i = 0;i < PAGE_SIZE/sizeof(u64);i++){
+		if(((u64*)buf)[i] != (i >= 2*SECTOR_SIZE/8 && i < 5*SECTOR_SIZE/8 ? ~0ULL :
+				       bench_compress_word(27, i, 0, BENCH_COMPRESS_STAMP))){
+			bad++;
+			break;
+		}
+	}
+	for(i = 0;i < PAGE_SIZE/sizeof(u64);i++){
+		((u64*)buf)[i] = bench_compress_word(27, i, 0, BENCH_COMPRESS_STAMP);
+	}
+	bad += !bench_fill_bio(queue, REQ_OP_WRITE, PAGE_TO_SECTOR(27), buf, PAGE_SIZE);
+	for(i = 0;i < PAGE_SIZE/sizeof(u64);i++){
+		((u64*)buf)[i] = bench_compress_word(36, i, 0, BENCH_COMPRESS_STAMP);
+	}
+	bad += !bench_fill_bio(queue, REQ_OP_WRITE, PAGE_TO_SECTOR(36), buf, PAGE_SIZE);
+	bad += atomic64_read(&hamming_compress_stats.expanded) - expanded != 2;
+	bad += bench_word_pass(queue, false, pages, bio_pages, bench_compress_word, 0, BENCH_COMPRESS_STAMP);
+
+	// under a snapshot, the first half is rewritten, copying its compressed pages
+	bad += bench_snapshot_overwrite("bio write compress", pages, half, bio_pages, bench_compress_word, 0,
+					BENCH_COMPRESS_STAMP, ~BENCH_COMPRESS_STAMP, NULL);
+	bench_compress_print("snapshot dropped");
+
+	bad += !bench_discard_bio(queue, REQ_OP_DISCARD, 0, hamming->capacity);
+	flush_workqueue(hamming_compress.wq);
+	bench_discard_print("discarded", usage);
+	if(atomic64_read(&hamming_alloc_stats.compressed) || atomic64_read(&hamming_alloc_stats.compressed_bytes)){
+		printf("%-16s %lld compressed pages, %lld bytes left after discard\n", "",
+		       (long long)atomic64_read(&hamming_alloc_stats.compressed),
+		       (long long)atomic64_read(&hamming_alloc_stats.compressed_bytes));
+		bad++;
+	}
+	compress_age = age;
+	bench_wrong("pages or bios", bad);
+	free(buf);
+}
+
+#define BENCH_WRITEBACK_STAMP 0x5A5A5A5A5A5A5A5AULL
+
+// writeback counts
+static void bench_writeback_print(const char *what){
+	printf("%-16s %s: %lld pages written back in %lld slots, %lld written in %lld writes, %lld fetched, "
+	       "%lld raced\n", "", what,
+	       (long long)atomic64_read(&hamming_alloc_stats.backed),
+	       (long long)atomic64_read(&hamming_writeback_stats.slots_used),
+	       (long long)atomic64_read(&hamming_writeback_stats.written),
+	       (long long)atomic64_read(&hamming_writeback_stats.writes),
+	       (long long)atomic64_read(&hamming_writeback_stats.fetched),
+	       (long long)atomic64_read(&hamming_writeback_stats.raced));
+}
+
+/**
+ * \brief Writeback of cold pages to the backing file
+ *
+ * With the device emptied, every page is written as bench_compress has
+ * them and compressed a pass later. The first half is read, so the next
+ * pass writes back only the second half and the one after that the first.
+ * Every page has to end up written back and its data given back. Reads
+ * have to fetch every page they touch, whole or in part, and a bit flipped
+ * in the backing file is corrected on the way in. Under a snapshot,
+ * rewriting half the device has to leave the snapshot reading the old
+ * contents, and discarding everything has to free every slot.
+ */
+static void bench_writeback(u64 pages, int bio_pages){
+	struct request_queue *queue = hamming->frontend.block_io.queue;
+	uint age = compress_age, wb_age = writeback_age;
+	u64 bad = 0, half, fetched, corrected;
+	s64 usage[3], after[3], backed;
+	u8 *buf;
+	bench_mark_t mark;
+
+	if(hamming_writeback.file == NULL){
+		return;
+	}
+	if(posix_memalign((void**)&buf, PAGE_SIZE, PAGE_SIZE)){
+		printf("can't allocate writeback buffer\n");
+		return;
+	}
+	pages = pages/bio_pages*bio_pages;
+	half = pages/bio_pages/2*bio_pages;
+	bad += !bench_discard_bio(queue, REQ_OP_DISCARD, 0, hamming->capacity);
+	bench_discard_usage(usage);
+	compress_age = 1;
+	writeback_age = 2;
+
+	bad += bench_word_pass(queue, true, pages, bio_pages, bench_compress_word, 0, BENCH_WRITEBACK_STAMP);
+	hamming_compress_run();
+	bad += bench_word_pass(queue, false, half, bio_pages, bench_compress_word, 0, BENCH_WRITEBACK_STAMP);
+	mark_start(&mark);
+	hamming_compress_run();
+	mark_end(&mark, "writeback pass", "cold half", 1, pages - half);
+	bench_writeback_print("second half");
+	bad += atomic64_read(&hamming_alloc_stats.backed) != (s64)(pages - half);
+	mark_start(&mark);
+	hamming_compress_run();
+	mark_end(&mark, "writeback pass", "first half", 1, half);
+	bench_writeback_print("all");
+	bad += atomic64_read(&hamming_alloc_stats.backed) != (s64)pages;
+	bad += atomic64_read(&hamming_writeback_stats.slots_used) != (s64)pages;
+	bad += atomic64_read(&hamming_alloc_stats.compressed) != 0;
+	bench_discard_print("written back", usage);
+	bench_discard_usage(after);
+	bad += after[0] != usage[0];
+
+	// page 9 comes back in for 3 sectors of it, page 18 with a bit flipped in the backing file
+	fetched = atomic64_read(&hamming_writeback_stats.fetched);
+	bad += !bench_fill_bio(queue, REQ_OP_READ, PAGE_TO_SECTOR(9) + 1, buf, 3*SECTOR_SIZE);
+	bad += !bench_compress_check(buf, 9, 1, 3*SECTOR_SIZE, BENCH_WRITEBACK_STAMP);
+	rcu_read_lock();
+	backed = READ_ONCE(hamming_tree_page_simple(18, false)->fill[0]);
+	rcu_read_unlock();
+	if(pread(hamming_writeback.file->fd, buf, 1, backed*PAGE_SIZE + 40) != 1){
+		bad++;
+	}
+	buf[0] ^= 1 << 2;
+	if(pwrite(hamming_writeback.file->fd, buf, 1, backed*PAGE_SIZE + 40) != 1){
+		bad++;
+	}
+	corrected = atomic64_read(&hamming_writeback_stats.corrected);
+	bad += !bench_fill_bio(queue, REQ_OP_READ, PAGE_TO_SECTOR(18), buf, PAGE_SIZE);
+	bad += !bench_compress_check(buf, 18, 0, PAGE_SIZE, BENCH_WRITEBACK_STAMP);
+	bad += atomic64_read(&hamming_writeback_stats.corrected) - corrected != 1;
+	bad += atomic64_read(&hamming_writeback_stats.fetched) - fetched != 2;
+
+	fetched = atomic64_read(&hamming_writeback_stats.fetched);
+	mark_start(&mark);
+	bad += bench_word_pass(queue, false, pages, bio_pages, bench_compress_word, 0, BENCH_WRITEBACK_STAMP);
+	mark_end(&mark, "bio read backed", pattern_name[PATTERN_SEQ], pages, pages);
+	bench_writeback_print("read back");
+	bad += atomic64_read(&hamming_writeback_stats.fetched) - fetched != pages - 2;
+	bad += atomic64_read(&hamming_alloc_stats.backed) != 0;
+	bad += atomic64_read(&hamming_writeback_stats.slots_used) != 0;
+
+	// written back again, under a snapshot the first half is rewritten
+	hamming_compress_run();
+	hamming_compress_run();
+	bad += atomic64_read(&hamming_alloc_stats.backed) != (s64)pages;
+	bad += bench_snapshot_overwrite("bio write backed", pages, half, bio_pages, bench_compress_word, 0,
+					BENCH_WRITEBACK_STAMP, ~BENCH_WRITEBACK_STAMP, NULL);
+	bench_writeback_print("snapshot dropped");
+
+	hamming_compress_run();
+	hamming_compress_run();
+	bad += !bench_discard_bio(queue, REQ_OP_DISCARD, 0, hamming->capacity);
+	flush_workqueue(hamming_compress.wq);
+	bench_discard_print("discarded", usage);
+	if(atomic64_read(&hamming_alloc_stats.backed) || atomic64_read(&hamming_writeback_stats.slots_used)){
+		printf("%-16s %lld written back pages, %lld slots left after discard\n", "",
+		       (long long)atomic64_read(&hamming_alloc_stats.backed),
+		       (long long)atomic64_read(&hamming_writeback_stats.slots_used));
+		bad++;
+	}
+	compress_age = age;
+	writeback_age = wb_age;
+	bench_wrong("pages or bios", bad);
+	free(buf);
+}
+
+#define BENCH_PERSIST_STAMP 0x6B6B6B6B6B6B6B6BULL
+
+// word j of a page bench_persist writes, every fourth page is same filled, the next one of two shared contents
+static u64 bench_persist_word(u64 page, int j, u64 arg, u64 stamp){
+	switch(page % 4){
+	case 0:
+		return bench_fill_word(page + 1, j, arg, stamp);
+	case 1:
+		return bench_dedup_word(page, j, 2, stamp);
+	default:
+		return bench_compress_word(page, j, arg, stamp);
+	}
+}
+
+// the kinds of page a dump has to bring back the way they were
+static void bench_persist_usage(s64 *usage){
+	usage[0] = atomic64_read(&hamming_alloc_stats.filled);
+	usage[1] = atomic64_read(&hamming_alloc_stats.compressed);
+	usage[2] = atomic64_read(&hamming_dedup_stats.pages);
+	usage[3] = atomic64_read(&hamming_dedup_stats.refs);
+}
+
+// offset in the dump of the data of its first whole page, -1 if there's none
+static loff_t bench_persist_find_plain(const char *path){
+	hamming_persist_chunk_header_t header;
+	hamming_persist_record_t record;
+	loff_t pos = PAGE_SIZE + sizeof(header), ret = -1;
+	int fd = open(path, O_RDONLY);
+	u32 i;
+
+	if(fd < 0 || pread(fd, &header, sizeof(header), PAGE_SIZE) != sizeof(header)){
+		goto out;
+	}
+	for(i = 0;i < header.count;i++){
+		if(pread(fd, &record, sizeof(record), pos) != sizeof(record)){
+			goto out;
+		}
+		pos += sizeof(record);
+		if(!(record.flags & (HAMMING_PAGE_FILLED | HAMMING_PAGE_COMPRESSED))){
+			ret = pos + sizeof(hamming_code_set_t);
+			goto out;
+		}
+		pos += hamming_persist_record_size(record.flags, record.len);
+	}
+out:
+	if(fd >= 0){
+		close(fd);
+	}
+	return ret;
+}
+
+// flips bit of the byte at pos of path, false if it can't
+static bool bench_persist_flip(const char *path, loff_t pos, int bit){
+	int fd = open(path, O_RDWR);
+	u8 byte;
+	bool ok;
+
+	if(fd < 0){
+		return false;
+	}
+	ok = pread(fd, &byte, 1, pos) == 1;
+	byte ^= 1 << bit;
+	ok = ok && pwrite(fd, &byte, 1, pos) == 1;
+	close(fd);
+	return ok;
+}
+
+/**
+ * \brief Dump and restore of the device
+ *
+ * With the device emptied, every page is written with dedup set, a fourth
+ * of them same filled and a fourth with one of two contents, then the
+ * first half again without it. A compress pass later the first quarter is
+ * read, so the next pass writes back only the second. The dump has to bring every
+ * page back into an emptied tree: same filled, shared and compressed pages
+ * as they were, written back ones in RAM. A bit flipped in the data of a
+ * page in the dump is corrected on the way in, a chunk header that fails
+ * its checksum fails the restore.
+ */
+static void bench_persist(u64 pages, int bio_pages){
+	struct request_queue *queue = hamming->frontend.block_io.queue;
+	uint age = compress_age, wb_age = writeback_age;
+	char name[] = "/tmp/hamming_persist.XXXXXX";
+	u64 bad = 0, half, quarter, dumped, restored, corrected, failed;
+	s64 before[4], after[4];
+	loff_t plain;
+	bench_mark_t mark;
+	int fd;
+
+	if(hamming_writeback.file == NULL){
+		return;
+	}
+	fd = mkstemp(name);
+	if(fd < 0){
+		printf("can't create a dump file\n");
+		return;
+	}
+	close(fd);
+	pages = pages/bio_pages*bio_pages;
+	half = pages/bio_pages/2*bio_pages;
+	quarter = pages/bio_pages/4*bio_pages;
+	bad += !bench_discard_bio(queue, REQ_OP_DISCARD, 0, hamming->capacity);
+	persist_path = name;
+	compress_age = 1;
+	writeback_age = 2;
+
+	dedup = true;
+	bad += bench_word_pass(queue, true, pages, bio_pages, bench_persist_word, 0, BENCH_PERSIST_STAMP);
+	dedup = false;
+	bad += bench_word_pass(queue, true, half, bio_pages, bench_persist_word, 0, BENCH_PERSIST_STAMP);
+	hamming_compress_run();
+	bad += bench_word_pass(queue, false, quarter, bio_pages, bench_persist_word, 0, BENCH_PERSIST_STAMP);
+	hamming_compress_run();
+	bench_persist_usage(before);
+	printf("%-16s dumping %lld filled, %lld compressed, %lld backed, %lld shared in %lld slots\n", "",
+	       (long long)before[0], (long long)before[1], (long long)atomic64_read(&hamming_alloc_stats.backed),
+	       (long long)before[2], (long long)before[3]);
+	bad += atomic64_read(&hamming_alloc_stats.backed) == 0 || before[1] == 0 || before[2] == 0;
+
+	dumped = atomic64_read(&hamming_persist_stats.dumped);
+	mark_start(&mark);
+	bad += hamming_persist_dump() != 0;
+	mark_end(&mark, "persist dump", "", 1, pages);
+	dumped = atomic64_read(&hamming_persist_stats.dumped) - dumped;
+	bad += dumped != pages;
+	hamming_tree_free();
+	restored = atomic64_read(&hamming_persist_stats.restored);
+	mark_start(&mark);
+	bad += hamming_persist_restore() != 0;
+	mark_end(&mark, "persist restore", "", 1, pages);
+	restored = atomic64_read(&hamming_persist_stats.restored) - restored;
+	bench_persist_usage(after);
+	printf("%-16s %llu pages dumped, %llu restored in %lld chunks\n", "", (unsigned long long)dumped,
+	       (unsigned long long)restored, (long long)atomic64_read(&hamming_persist_stats.chunks));
+	bad += restored != dumped || memcmp(before, after, sizeof(before)) != 0;
+	bad += atomic64_read(&hamming_alloc_stats.backed) != 0;
+	bad += bench_word_pass(queue, false, pages, bio_pages, bench_persist_word, 0, BENCH_PERSIST_STAMP);
+
+	// a bit flipped in a whole page in the dump is corrected
+	plain = bench_persist_find_plain(name);
+	bad += plain < 0 || !bench_persist_flip(name, plain + 40, 2);
+	hamming_tree_free();
+	corrected = atomic64_read(&hamming_persist_stats.corrected);
+	bad += hamming_persist_restore() != 0;
+	bad += atomic64_read(&hamming_persist_stats.corrected) - corrected != 1;
+	bad += bench_word_pass(queue, false, pages, bio_pages, bench_persist_word, 0, BENCH_PERSIST_STAMP);
+
+	// a chunk header that fails its checksum fails the restore
+	bad += !bench_persist_flip(name, PAGE_SIZE + offsetof(hamming_persist_chunk_header_t, reserved), 0);
+	hamming_tree_free();
+	failed = atomic64_read(&hamming_persist_stats.failed);
+	bad += hamming_persist_restore() != -EIO;
+	bad += atomic64_read(&hamming_persist_stats.failed) - failed != 1;
+	printf("%-16s %llu corrected, %llu failed\n", "",
+	       (unsigned long long)(atomic64_read(&hamming_persist_stats.corrected) - corrected),
+	       (unsigned long long)(atomic64_read(&hamming_persist_stats.failed) - failed));
+
+	bad += !bench_discard_bio(queue, REQ_OP_DISCARD, 0, hamming->capacity);
+	flush_workqueue(hamming_compress.wq);
+	persist_path = NULL;
+	unlink(name);
+	compress_age = age;
+	writeback_age = wb_age;
+	bench_wrong("pages or bios", bad);
+}
+
+/*
+  fio style threads, every thread is a CPU of its own (see hamming_shim.h)
+  submitting bios of bio_pages at random bio aligned offsets. Every page
+  written carries its page number and a stamp of the write, everything else
+  in it is derived from those two, so a read that sees two writes torn
+  together (or the wrong page) is caught.
+ */
+#define BENCH_THREADS_MAX 32
+
+enum{
+	BENCH_THREADS_POPULATE, // every thread writes the whole span in the same order
+	BENCH_THREADS_RANDRW, // 70% reads
+	BENCH_THREADS_RANDREAD
+};
+
+static const char *bench_threads_name[] = {"populate", "randrw 70/30", "randread"};
+
+typedef struct{
+	pthread_t thread;
+	int mode;
+	u64 pages;
+	u64 ops; // pages to read or write
+	int bio_pages;
+	u64 seed;
+	bool even; // only bios at even multiples of bio_pages, the odd ones are being discarded
+	u64 bad; // pages that read back torn or misplaced
+	u64 failed; // bios
+} bench_thread_t;
+
+static void bench_threads_fill(u64 *words, u64 page, u64 stamp){
+	uint i;
+
+	words[0] = page;
+	words[1] = stamp;
+	for(i = 2;i < PAGE_SIZE/sizeof(u64);i++){
+		words[i] = (page*0x9E3779B97F4A7C15ULL ^ stamp) + i;
+	}
+}
+
+static bool bench_threads_check(const u64 *words, u64 page){
+	uint i;
+
+	if(words[0] != page){
+		return false;
+	}
+	for(i = 2;i < PAGE_SIZE/sizeof(u64);i++){
+		if(words[i] != ((page*0x9E3779B97F4A7C15ULL ^ words[1]) + i)){
+			return false;
+		}
+	}
+	return true;
+}
+
+static void *bench_threads_run(void *arg){
+	bench_thread_t *thread = arg;
+	struct request_queue *queue = hamming->frontend.block_io.queue;
+	struct bio_vec *vec = calloc(thread->bio_pages, sizeof(struct bio_vec));
+	struct page *data;
+	struct bio bio;
+	bool write;
+	u64 op, page;
+	int i;
+
+	hamming_shim_cpu_online();
+	if(vec == NULL || posix_memalign((void**)&data, PAGE_SIZE, thread->bio_pages*sizeof(struct page))){
+		free(vec);
+		thread->failed++;
+		hamming_shim_cpu_offline();
+		return NULL;
+	}
+	for(i = 0;i < thread->bio_pages;i++){
+		vec[i].bv_page = &data[i];
+		vec[i].bv_len = PAGE_SIZE;
+		vec[i].bv_offset = 0;
+	}
+	for(op = 0;op < thread->ops/thread->bio_pages;op++){
+		if(thread->mode == BENCH_THREADS_POPULATE){
+			page = (op*thread->bio_pages) % thread->pages;
+			write = true;
+		}else{
+			page = xorshift(&thread->seed) % (thread->pages/thread->bio_pages);
+			page = (thread->even ? page & ~1ULL : page)*thread->bio_pages;
+			write = thread->mode == BENCH_THREADS_RANDRW && xorshift(&thread->seed) % 100 < 30;
+		}
+		if(write){
+			for(i = 0;i < thread->bio_pages;i++){
+				bench_threads_fill((u64*)data[i].data, page + i, xorshift(&thread->seed));
+			}
+		}
+		memset(&bio, 0, sizeof(bio));
+		bio.bi_opf = write ? REQ_OP_WRITE : REQ_OP_READ;
+		bio.bi_io_vec = vec;
+		bio.bi_vcnt = thread->bio_pages;
+		bio.bi_iter.bi_sector = page << 3;
+		bio.bi_iter.bi_size = thread->bio_pages*PAGE_SIZE;
+		hamming_shim_submit_bio(queue, &bio);
+		if(bio.bi_done == false || bio.bi_status != BLK_STS_OK){
+			thread->failed++;
+			continue;
+		}
+		for(i = 0;i < thread->bio_pages && !write;i++){
+			thread->bad += !bench_threads_check((u64*)data[i].data, page + i);
+		}
+	}
+	free(vec);
+	free(data);
+	hamming_shim_cpu_offline();
+	return NULL;
+}
+
+typedef struct{
+	pthread_t thread;
+	u64 pages;
+	int bio_pages;
+	bool stop;
+	u64 taken; // snapshots, or ranges discarded
+	u64 bad; // pages of a snapshot that read back torn or misplaced, or discarded ones that didn't read as zeroes
+	u64 failed; // snapshots and bios
+} bench_snapshot_thread_t;
+
+/**
+ * \brief Snapshot over and over while the other threads write, until stopped
+ *
+ * Every snapshot is read back in full, every page in it has to be one whole
+ * write, whatever the writers were doing when it was taken
+ */
+static void *bench_threads_snapshot(void *arg){
+	bench_snapshot_thread_t *snap = arg;
+	struct request_queue *queue;
+	struct bio_vec vec;
+	struct page *data;
+	struct bio bio;
+	u64 page;
+
+	hamming_shim_cpu_online();
+	if(posix_memalign((void**)&data, PAGE_SIZE, sizeof(struct page))){
+		snap->failed++;
+		hamming_shim_cpu_offline();
+		return NULL;
+	}
+	vec.bv_page = data;
+	vec.bv_len = PAGE_SIZE;
+	vec.bv_offset = 0;
+	while(!__atomic_load_n(&snap->stop, __ATOMIC_ACQUIRE)){
+		if(hamming_blkdev_snapshot(true) < 0){
+			snap->failed++;
+			continue;
+		}
+		snap->taken++;
+		queue = hamming->frontend.block_io.snap_queue;
+		for(page = 0;page < snap->pages/snap->bio_pages*snap->bio_pages;page++){
+			memset(&bio, 0, sizeof(bio));
+			bio.bi_opf = REQ_OP_READ;
+			bio.bi_io_vec = &vec;
+			bio.bi_vcnt = 1;
+			bio.bi_iter.bi_sector = page << 3;
+			bio.bi_iter.bi_size = PAGE_SIZE;
+			hamming_shim_submit_bio(queue, &bio);
+			if(bio.bi_done == false || bio.bi_status != BLK_STS_OK){
+				snap->failed++;
+			}else{
+				snap->bad += !bench_threads_check((u64*)data->data, page);
+			}
+		}
+	}
+	hamming_blkdev_snapshot(false);
+	free(data);
+	hamming_shim_cpu_offline();
+	return NULL;
+}
+
+// one bio over count pages from page, false if it failed
+static bool bench_threads_bio(struct request_queue *queue, struct bio_vec *vec, int count, int op, u64 page){
+	struct bio bio;
+
+	memset(&bio, 0, sizeof(bio));
+	bio.bi_opf = op;
+	bio.bi_io_vec = vec;
+	bio.bi_vcnt = count;
+	bio.bi_iter.bi_sector = PAGE_TO_SECTOR(page);
+	bio.bi_iter.bi_size = count*PAGE_SIZE;
+	hamming_shim_submit_bio(queue, &bio);
+	return bio.bi_done && bio.bi_status == BLK_STS_OK;
+}
+
+/**
+ * \brief Discard odd bios of the span over and over while the other threads use the even ones, until stopped
+ *
+ * The writers share leaf parents with what's discarded, so none of their
+ * pages may go missing. A discarded bio has to read back as zeroes, then it
+ * is written again so every page is there for whatever runs next.
+ */
+static void *bench_threads_discard(void *arg){
+	bench_snapshot_thread_t *discard = arg;
+	struct request_queue *queue = hamming->frontend.block_io.queue;
+	struct bio_vec *vec = calloc(discard->bio_pages, sizeof(struct bio_vec));
+	u64 seed = 0x9E3779B97F4A7C15ULL, page;
+	struct page *data;
+	uint i, j;
+
+	hamming_shim_cpu_online();
+	if(vec == NULL || posix_memalign((void**)&data, PAGE_SIZE, discard->bio_pages*sizeof(struct page))){
+		free(vec);
+		discard->failed++;
+		hamming_shim_cpu_offline();
+		return NULL;
+	}
+	for(i = 0;i < (uint)discard->bio_pages;i++){
+		vec[i].bv_page = &data[i];
+		vec[i].bv_len = PAGE_SIZE;
+		vec[i].bv_offset = 0;
+	}
+	while(!__atomic_load_n(&discard->stop, __ATOMIC_ACQUIRE)){
+		page = ((xorshift(&seed) % (discard->pages/discard->bio_pages/2))*2 + 1)*discard->bio_pages;
+		if(!bench_discard_bio(queue, REQ_OP_DISCARD, PAGE_TO_SECTOR(page), PAGE_TO_SECTOR(discard->bio_pages)) ||
+		   !bench_threads_bio(queue, vec, discard->bio_pages, REQ_OP_READ, page)){
+			discard->failed++;
+			continue;
+		}
+		for(i = 0;i < (uint)discard->bio_pages;i++){
+			for(j = 0;j < PAGE_SIZE/sizeof(u64) && ((u64*)data[i].data)[j] == 0;j++);
+			discard->bad += j != PAGE_SIZE/sizeof(u64);
+			bench_threads_fill((u64*)data[i].data, page + i, xorshift(&seed));
+		}
+		discard->failed += !bench_threads_bio(queue, vec, discard->bio_pages, REQ_OP_WRITE, page);
+		discard->taken++;
+	}
+	free(vec);
+	free(data);
+	hamming_shim_cpu_offline();
+	return NULL;
+}
+
+/**
+ * \brief Run a mode on count threads at once
+ *
+ * With snapshots set, one more thread keeps taking snapshots and reading them
+ * back while they run, see bench_threads_snapshot. With discards set, one
+ * more thread keeps discarding the odd bios of the span, the others only use
+ * the even ones, see bench_threads_discard.
+ *
+ * \return Pages read back wrong or bios failed, over every thread
+ */
+static u64 bench_threads_mode(int mode, int count, u64 pages, u64 ops, int bio_pages, bool snapshots, bool discards){
+	bench_thread_t threads[BENCH_THREADS_MAX];
+	bench_snapshot_thread_t snap;
+	bench_mark_t mark;
+	u64 bad = 0, failed = 0;
+	char name[32];
+	int i;
+
+	memset(threads, 0, sizeof(threads));
+	memset(&snap, 0, sizeof(snap));
+	mark_start(&mark);
+	if(snapshots){
+		snap.pages = pages;
+		snap.bio_pages = bio_pages;
+		pthread_create(&snap.thread, NULL, bench_threads_snapshot, &snap);
+	}else if(discards){
+		snap.pages = pages;
+		snap.bio_pages = bio_pages;
+		pthread_create(&snap.thread, NULL, bench_threads_discard, &snap);
+	}
+	for(i = 0;i < count;i++){
+		threads[i].mode = mode;
+		threads[i].pages = pages;
+		threads[i].ops = mode == BENCH_THREADS_POPULATE ? pages : ops/count;
+		threads[i].bio_pages = bio_pages;
+		threads[i].seed = 0x2545F4914F6CDD1DULL*(i + 1);
+		threads[i].even = discards;
+		pthread_create(&threads[i].thread, NULL, bench_threads_run, &threads[i]);
+	}
+	for(i = 0;i < count;i++){
+		pthread_join(threads[i].thread, NULL);
+		bad += threads[i].bad;
+		failed += threads[i].failed;
+	}
+	if(snapshots || discards){
+		__atomic_store_n(&snap.stop, true, __ATOMIC_RELEASE);
+		pthread_join(snap.thread, NULL);
+	}
+	snprintf(name, sizeof(name), "%s x%d%s", mode == BENCH_THREADS_POPULATE ? "populate" : "threads", count,
+		 snapshots ? " snap" : discards ? " trim" : "");
+	ops = mode == BENCH_THREADS_POPULATE ? pages*count : ops/count/bio_pages*bio_pages*count;
+	mark_end(&mark, name, mode == BENCH_THREADS_RANDREAD ? "rread" : mode == BENCH_THREADS_RANDRW ? "rrw" : "seq", ops, ops);
+	if(bad || failed){
+		printf("%-16s %s: %lu pages read back wrong, %lu bios failed\n", "", bench_threads_name[mode], bad, failed);
+	}
+	if(snapshots){
+		printf("%-16s %lu snapshots read back, %lu pages wrong, %lu failed\n", "", snap.taken, snap.bad, snap.failed);
+	}else if(discards){
+		printf("%-16s %lu ranges discarded and refilled, %lu pages not zeroed, %lu failed\n", "", snap.taken, snap.bad, snap.failed);
+	}
+	return bad + failed + snap.bad + snap.failed;
+}
+
+/**
+ * \brief Scaling over threads, into an empty tree
+ *
+ * First every thread writes the whole span at once, racing to create the
+ * same nodes and pages (only one of each may survive), then random mixed
+ * and read only I/O over it with 1, 2, 4 ... threads, the mixed one once more
+ * with snapshots taken under it and once with discards next to it. Needs real cores to
+ * show any scaling, on one it shows what the synchronization costs.
+ */
+static void bench_threads(u64 pages, u64 ops, int bio_pages, int max_threads){
+	s64 live;
+	int count;
+	u64 bad;
+
+	bad = bench_threads_mode(BENCH_THREADS_POPULATE, max_threads, pages, ops, bio_pages, false, false);
+	live = atomic64_read(&hamming_alloc_stats.pages) - hamming_alloc_reserved();
+	if(live != (s64)(pages/bio_pages*bio_pages)){
+		printf("%-16s %lld pages in the tree after racing creators, expected %llu\n", "",
+		       (long long)live, (unsigned long long)(pages/bio_pages*bio_pages));
+		failures++;
+	}
+	for(count = 1;count <= max_threads;count *= 2){
+		bad += bench_threads_mode(BENCH_THREADS_RANDRW, count, pages, ops, bio_pages, false, false);
+	}
+	bad += bench_threads_mode(BENCH_THREADS_RANDRW, max_threads, pages, ops, bio_pages, true, false);
+	if(pages/bio_pages >= 2){
+		bad += bench_threads_mode(BENCH_THREADS_RANDRW, max_threads, pages, ops, bio_pages, false, true);
+	}
+	live = atomic64_read(&hamming_alloc_stats.pages) - hamming_alloc_reserved();
+	if(live != (s64)(pages/bio_pages*bio_pages)){
+		printf("%-16s %lld pages in the tree after its snapshots and discards, expected %llu\n", "",
+		       (long long)live, (unsigned long long)(pages/bio_pages*bio_pages));
+		failures++;
+	}
+	for(count = 1;count <= max_threads;count *= 2){
+		bad += bench_threads_mode(BENCH_THREADS_RANDREAD, count, pages, ops, bio_pages, false, false);
+	}
+	flush_workqueue(hamming->frontend.block_io.readahead.wq);
+	failures += bad != 0; // bench_threads_mode printed what
+}
+
+int main(int argc, char **argv){
+	u64 pages = argc > 1 ? strtoull(argv[1], NULL, 0) : 65536;
+	u64 ops = argc > 2 ? strtoull(argv[2], NULL, 0) : 1000000;
+	int bio_pages = argc > 3 ? atoi(argv[3]) : 32;
+	alloc_mode = argc > 4 ? atoi(argv[4]) : HAMMING_ALLOC_ON_DEMAND;
+	capacity_mb = argc > 5 ? strtoul(argv[5], NULL, 0) : HAMMING_CAPACITY_MB;
+	hamming_shim_nodes = argc > 6 ? atoi(argv[6]) : 1;
+	numa_policy = argc > 7 ? atoi(argv[7]) : HAMMING_NUMA_INTERLEAVE;
+	alloc_arena = argc > 8 ? atoi(argv[8]) : false;
+	int threads = argc > 9 ? atoi(argv[9]) : 4;
+	char sysfs_buf[PAGE_SIZE], backing_name[] = "/tmp/hamming_backing.XXXXXX"; // a page, as sysfs shows get
+	int backing_fd;
+
+	if(pages < 256 || pages > (u64)capacity_mb << 8 || ops < 64 || bio_pages <= 0 || bio_pages > 64 ||
+	   hamming_shim_nodes <= 0 || hamming_shim_nodes > MAX_NUMNODES || threads <= 0 || threads > BENCH_THREADS_MAX){
+		printf("usage: %s [pages, 256..capacity] [ops] [pages per bio, 1..64] [alloc mode, 0..2] [capacity MB] "
+		       "[nodes, 1..%d] [numa policy, 0..1] [arena, 0..1] [threads, 1..%d]\n", argv[0], MAX_NUMNODES, BENCH_THREADS_MAX);
+		return 1;
+	}
+
+	hamming = kzalloc(sizeof(hamming_t), GFP_KERNEL);
+	init_rwsem(&hamming->lock);
+	if(hamming_blkdev_init() < 0){
+		return 1;
+	}
+	if(hamming_alloc_init() < 0){
+		return 1;
+	}
+	if(hamming_tree_init() < 0){
+		return 1;
+	}
+	if(hamming_dedup_init() < 0){
+		return 1;
+	}
+	if(hamming_compress_init() < 0){
+		return 1;
+	}
+	// a sparse file as large as the device, gone once the bench exits
+	backing_fd = mkstemp(backing_name);
+	if(backing_fd < 0 || ftruncate(backing_fd, (off_t)capacity_mb << 20) < 0){
+		printf("can't create a backing file\n");
+		return 1;
+	}
+	backing_path = backing_name;
+	if(hamming_writeback_init() < 0){
+		return 1;
+	}
+	if(hamming_sysfs_init_error() < 0){
+		return 1;
+	}
+	if(hamming_tests() != 0){
+		printf("self tests failed\n");
+		return 1;
+	}
+	if(hamming_blkdev_add() < 0){
+		return 1;
+	}
+
+	bench_sector_simple(pages, ops);
+	bench_resolve(pages, ops);
+	bench_bio(pages, ops, bio_pages);
+	bench_mq(pages, bio_pages);
+	bench_backend(ops/64);
+	bench_page_touch(pages, ops);
+	bench_page_correct(pages, ops/16);
+	bench_scrub(pages);
+	bench_snapshot(pages, bio_pages);
+	bench_discard(pages, bio_pages);
+	bench_fill(pages, bio_pages);
+	bench_dedup(pages, bio_pages);
+	bench_compress(pages, bio_pages);
+	bench_writeback(pages, bio_pages);
+	bench_persist(pages, bio_pages);
+	bench_sparse(pages);
+	hamming_tree_free();
+	bench_wide(ops); // alone in the tree, so its node count is its own
+	hamming_tree_free();
+	bench_bio_new(pages, bio_pages);
+	hamming_tree_free();
+	bench_threads(pages, ops/4, bio_pages, threads);
+
+	hamming_sysfs_cursor_hits_show(errors_obj, &hamming_sysfs_cursor_hits_attribute, sysfs_buf);
+	printf("cursor_hits %s", sysfs_buf);
+	hamming_sysfs_cursor_misses_show(errors_obj, &hamming_sysfs_cursor_misses_attribute, sysfs_buf);
+	printf("cursor_misses %s", sysfs_buf);
+	hamming_sysfs_readahead_verified_show(errors_obj, &hamming_sysfs_readahead_verified_attribute, sysfs_buf);
+	printf("readahead_verified %s", sysfs_buf);
+	hamming_sysfs_readahead_hits_show(errors_obj, &hamming_sysfs_readahead_hits_attribute, sysfs_buf);
+	printf("readahead_hits %s", sysfs_buf);
+	hamming_sysfs_numa_stat_show(errors_obj, &hamming_sysfs_numa_stat_attribute, sysfs_buf);
+	printf("numa_stat\n%s", sysfs_buf);
+	hamming_sysfs_queue_stat_show(errors_obj, &hamming_sysfs_queue_stat_attribute, sysfs_buf);
+	printf("queue_stat\n%s", sysfs_buf);
+	hamming_sysfs_alloc_arena_fallback_show(errors_obj, &hamming_sysfs_alloc_arena_fallback_attribute, sysfs_buf);
+	printf("alloc_arena_fallback %s", sysfs_buf);
+
+	hamming_sysfs_close_error();
+	hamming_blkdev_close();
+	hamming_compress_close();
+	hamming_writeback_close();
+	unlink(backing_name);
+	close(backing_fd);
+	hamming_tree_close();
+	hamming_dedup_close();
+	hamming_alloc_close();
+	printf("%lu allocations, %lu frees, %.1f MB requested\n",
+	       hamming_shim_stats.allocs, hamming_shim_stats.frees,
+	       hamming_shim_stats.bytes/1048576.0);
+	printf("hamming_bench: %s\n", failures ? "FAILED" : "ok");
+	return failures != 0;
+}
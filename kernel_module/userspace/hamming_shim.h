@@ -0,0 +1,1319 @@
+#ifndef _HAMMING_SHIM_H_
+#define _HAMMING_SHIM_H_
+
+/**
+ * \file hamming_shim.h
+ * \brief Just enough of the kernel API to build the module's core in userspace
+ *
+ * The module is a unity build (hamming.c includes the other .c files), so the
+ * bench does the same with this header standing in for the kernel headers.
+ * The stubs in include/linux/ only pull this in.
+ *
+ * Semantics are only as close as the tree and block paths need:
+ *  - kzalloc/kfree count allocations, so tree changes can report memory use
+ *  - a struct page is just PAGE_SIZE bytes, kmap_local_page hands back its address,
+ *    2MB and larger blocks ask for transparent huge pages like the direct map
+ *  - a bio is a flat array of bio_vecs, bio_for_each_segment walks it whole
+ *  - the block device setup calls only record what was asked of them, a
+ *    blk-mq queue gets its hardware contexts and the bench submits bios to
+ *    them itself (hamming_shim_submit_bios)
+ *  - a workqueue is one real thread, so work races the caller as it would
+ *  - every thread is a CPU of its own (hamming_shim_cpu_online), so per CPU
+ *    data needs no locking, and RCU grace periods wait for every CPU to
+ *    leave the read side section it was in
+ *  - NUMA nodes are pretend, hamming_shim_nodes of them, and the one CPU is
+ *    on whichever hamming_shim_node says
+ *  - a struct file is a file descriptor, reads and writes are pread/pwrite
+ *
+ * Only ever include this from one translation unit, everything is static.
+ */
+
+#define _GNU_SOURCE // recursive mutex initializer
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <time.h>
+#include <unistd.h>
+
+typedef uint8_t u8;
+typedef uint16_t u16;
+typedef uint32_t u32;
+typedef uint64_t u64;
+typedef int64_t s64;
+typedef u64 sector_t;
+typedef unsigned int gfp_t;
+typedef unsigned int fmode_t;
+typedef s64 ktime_t;
+typedef unsigned short umode_t;
+
+#define LINUX_VERSION_CODE KERNEL_VERSION(6, 11, 0)
+#define KERNEL_VERSION(a, b, c) (((a) << 16) + ((b) << 8) + (c))
+
+#define likely(x) __builtin_expect(!!(x), 1)
+#define unlikely(x) __builtin_expect(!!(x), 0)
+#define __maybe_unused __attribute__((unused))
+
+#define PAGE_SIZE 4096UL
+#define L1_CACHE_BYTES 64
+#define ____cacheline_aligned __attribute__((aligned(L1_CACHE_BYTES)))
+
+#define min_t(type, x, y) ((type)(x) < (type)(y) ? (type)(x) : (type)(y))
+#define max_t(type, x, y) ((type)(x) > (type)(y) ? (type)(x) : (type)(y))
+#define clamp_t(type, v, lo, hi) min_t(type, max_t(type, v, lo), hi)
+#define DIV_ROUND_UP(n, d) (((n) + (d) - 1)/(d))
+#define round_up(n, d) (DIV_ROUND_UP(n, d)*(d))
+#define ilog2(n) (63 - __builtin_clzll(n))
+
+static inline u64 rol64(u64 word, unsigned int shift){
+	return (word << (shift & 63)) | (word >> ((-shift) & 63));
+}
+
+static inline int scnprintf(char *buf, size_t size, const char *fmt, ...){
+	va_list args;
+	int len;
+	va_start(args, fmt);
+	len = vsnprintf(buf, size, fmt, args);
+	va_end(args);
+	if(len >= (int)size){
+		len = size ? size - 1 : 0; // what actually went into buf
+	}
+	return len;
+}
+#define container_of(ptr, type, member) ((type*)((char*)(ptr) - offsetof(type, member)))
+#define prefetch(x) __builtin_prefetch(x)
+#define READ_ONCE(x) __atomic_load_n(&(x), __ATOMIC_RELAXED)
+#define WRITE_ONCE(x, v) __atomic_store_n(&(x), (v), __ATOMIC_RELAXED)
+#define cpu_relax() sched_yield() // whoever we wait for may need this CPU
+
+typedef unsigned int uint;
+typedef unsigned long ulong;
+#define U32_MAX ((u32)~0U)
+
+#define smp_load_acquire(p) __atomic_load_n(p, __ATOMIC_ACQUIRE)
+#define smp_store_release(p, v) __atomic_store_n(p, v, __ATOMIC_RELEASE)
+#define cmpxchg(p, old, new) __sync_val_compare_and_swap(p, old, new)
+#define cond_resched() do{}while(0)
+
+// parameters are plain variables, set them before init
+#define module_param(name, type, perm)
+typedef char *charp;
+#define MODULE_PARM_DESC(name, desc)
+
+#define BUG() do{ printf("BUG at %s:%d\n", __FILE__, __LINE__); abort(); }while(0)
+#define BUG_ON(x) do{ if(unlikely(x)) BUG(); }while(0)
+#define VM_BUG_ON(x) BUG_ON(x) // as with CONFIG_DEBUG_VM
+
+/*
+  printk
+ */
+
+#define KERN_ERR ""
+#define KERN_WARNING ""
+#define KERN_INFO ""
+
+static bool hamming_shim_quiet; // set around timed loops
+
+#define printk(...) do{ if(!hamming_shim_quiet) printf(__VA_ARGS__); }while(0)
+#define pr_err(...) printk(__VA_ARGS__)
+#define pr_info(...) printk(__VA_ARGS__)
+
+/*
+  Allocation
+ */
+
+#define GFP_KERNEL 0
+#define GFP_ATOMIC 1
+#define GFP_NOIO 2
+#define GFP_NOWAIT 3
+
+static struct{
+	u64 allocs;
+	u64 frees;
+	u64 bytes; // requested, not live
+} hamming_shim_stats;
+
+// workqueue threads allocate too
+#define HAMMING_SHIM_COUNT(field, n) __atomic_fetch_add(&hamming_shim_stats.field, (n), __ATOMIC_RELAXED)
+
+// cache line aligned like the kmalloc caches, so node layout costs are real
+static inline void *kzalloc(size_t size, gfp_t flags){
+	void *ptr;
+	(void)flags;
+	if(posix_memalign(&ptr, L1_CACHE_BYTES, size)){
+		return NULL;
+	}
+	memset(ptr, 0, size);
+	HAMMING_SHIM_COUNT(allocs, 1);
+	HAMMING_SHIM_COUNT(bytes, size);
+	return ptr;
+}
+
+static inline void *kmalloc(size_t size, gfp_t flags){
+	return kzalloc(size, flags);
+}
+
+#define kcalloc(n, size, flags) kzalloc((n)*(size), flags)
+
+static inline void kfree(const void *ptr){
+	if(ptr){
+		HAMMING_SHIM_COUNT(frees, 1);
+		free((void*)ptr);
+	}
+}
+
+// bookkeeping arrays, not counted
+#define kvmalloc(size, flags) ((void)(flags), malloc(size))
+#define kvmalloc_array(n, size, flags) ((void)(flags), calloc((n), (size)))
+#define kvfree(ptr) free(ptr)
+
+struct page{
+	u8 data[PAGE_SIZE];
+} __attribute__((aligned(4096)));
+
+#define __GFP_ZERO 0x100u
+#define __GFP_NOWARN 0x200u
+#define __GFP_NORETRY 0x1000u
+#define SLAB_HWCACHE_ALIGN 0x2000u
+
+// a page is its own address, there's no mem_map, blocks are aligned to their size like the buddy allocator's
+static inline struct page *alloc_pages(gfp_t flags, unsigned int order){
+	size_t size = PAGE_SIZE << order;
+	void *ptr;
+	if(posix_memalign(&ptr, size, size)){
+		return NULL;
+	}
+	if(order >= 9){
+		madvise(ptr, size, MADV_HUGEPAGE);
+	}
+	if(flags & __GFP_ZERO){
+		memset(ptr, 0, size);
+	}
+	HAMMING_SHIM_COUNT(allocs, 1);
+	HAMMING_SHIM_COUNT(bytes, size);
+	return ptr;
+}
+
+#define alloc_page(flags) alloc_pages(flags, 0)
+
+#define page_address(page) ((void*)(page)->data)
+#define virt_to_page(addr) ((struct page*)(addr))
+
+static struct page hamming_shim_zero_page;
+#define ZERO_PAGE(vaddr) (&hamming_shim_zero_page)
+
+static inline void *memchr_inv(const void *start, int c, size_t bytes){
+	const u8 *ptr = start;
+	size_t i;
+
+	for(i = 0;i < bytes;i++){
+		if(ptr[i] != (u8)c){
+			return (void*)(ptr + i);
+		}
+	}
+	return NULL;
+}
+
+static inline void *memset64(uint64_t *s, uint64_t v, size_t count){
+	size_t i;
+
+	for(i = 0;i < count;i++){
+		s[i] = v;
+	}
+	return s;
+}
+
+static inline void __free_pages(struct page *page, unsigned int order){
+	(void)order;
+	HAMMING_SHIM_COUNT(frees, 1);
+	free(page);
+}
+
+#define __free_page(page) __free_pages(page, 0)
+
+struct kmem_cache{
+	size_t size; // rounded to the alignment, what the slab would hand out
+	size_t align;
+};
+
+static inline struct kmem_cache *kmem_cache_create(const char *name, size_t size, size_t align,
+						   unsigned long flags, void (*ctor)(void*)){
+	struct kmem_cache *cache = calloc(1, sizeof(struct kmem_cache));
+	(void)name;
+	(void)ctor;
+	if(cache == NULL){
+		return NULL;
+	}
+	cache->align = sizeof(void*);
+	if(flags & SLAB_HWCACHE_ALIGN && L1_CACHE_BYTES > cache->align){
+		cache->align = L1_CACHE_BYTES;
+	}
+	if(align > cache->align){
+		cache->align = align;
+	}
+	cache->size = (size + cache->align - 1) & ~(cache->align - 1);
+	return cache;
+}
+
+static inline void kmem_cache_destroy(struct kmem_cache *cache){
+	free(cache);
+}
+
+static inline void *kmem_cache_alloc(struct kmem_cache *cache, gfp_t flags){
+	void *ptr;
+	if(posix_memalign(&ptr, cache->align, cache->size)){
+		return NULL;
+	}
+	if(flags & __GFP_ZERO){
+		memset(ptr, 0, cache->size);
+	}
+	HAMMING_SHIM_COUNT(allocs, 1);
+	HAMMING_SHIM_COUNT(bytes, cache->size);
+	return ptr;
+}
+
+#define kmem_cache_zalloc(cache, flags) kmem_cache_alloc(cache, (flags) | __GFP_ZERO)
+
+static inline void kmem_cache_free(struct kmem_cache *cache, void *ptr){
+	(void)cache;
+	kfree(ptr);
+}
+
+static inline void *kmap_local_page(struct page *page){
+	return page->data;
+}
+
+static inline void kunmap_local(void *addr){
+	(void)addr;
+}
+
+/*
+  Time
+ */
+
+#define NSEC_PER_MSEC 1000000LL
+
+static inline ktime_t ktime_get(void){
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec*1000000000LL + ts.tv_nsec;
+}
+
+static inline void do_gettimeofday(struct timeval *tv){
+	gettimeofday(tv, NULL);
+}
+
+/*
+  Per CPU, a thread takes the lowest free CPU number when it comes online and
+  keeps it until it goes offline, the main thread is CPU 0. Nothing migrates,
+  so preemption doesn't need disabling.
+ */
+
+#define NR_CPUS 64
+#define nr_cpu_ids NR_CPUS
+
+static __thread int hamming_shim_cpu;
+static u64 hamming_shim_cpus_online = 1; // bit per CPU in use
+
+static inline void hamming_shim_cpu_online(void){
+	u64 online = __atomic_load_n(&hamming_shim_cpus_online, __ATOMIC_RELAXED);
+	do{
+		if(~online == 0){
+			printf("more than %d threads\n", NR_CPUS);
+			abort();
+		}
+		hamming_shim_cpu = __builtin_ctzll(~online);
+	}while(!__atomic_compare_exchange_n(&hamming_shim_cpus_online, &online, online | (1ULL << hamming_shim_cpu),
+					    false, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED));
+}
+
+// per CPU data is left as it is for the next thread
+static inline void hamming_shim_cpu_offline(void){
+	__atomic_fetch_and(&hamming_shim_cpus_online, ~(1ULL << hamming_shim_cpu), __ATOMIC_RELEASE);
+}
+
+#define DEFINE_PER_CPU(type, name) type name[NR_CPUS]
+#define per_cpu_ptr(ptr, cpu) (&(*(ptr))[cpu])
+#define this_cpu_ptr(ptr) per_cpu_ptr(ptr, hamming_shim_cpu)
+#define get_cpu_ptr(ptr) this_cpu_ptr(ptr)
+#define put_cpu_ptr(ptr) ((void)(ptr))
+#define smp_processor_id() hamming_shim_cpu
+#define for_each_possible_cpu(cpu) for((cpu) = 0;(cpu) < NR_CPUS;(cpu)++)
+
+/*
+  RCU, a read side section bumps its CPU's counter on the way in and out,
+  so it's odd inside one. A grace period waits for every CPU that was
+  inside one to move on.
+ */
+
+static u64 hamming_shim_rcu[NR_CPUS];
+
+#define rcu_read_lock() __atomic_fetch_add(&hamming_shim_rcu[hamming_shim_cpu], 1, __ATOMIC_SEQ_CST)
+#define rcu_read_unlock() __atomic_fetch_add(&hamming_shim_rcu[hamming_shim_cpu], 1, __ATOMIC_RELEASE)
+#define rcu_dereference(p) __atomic_load_n(&(p), __ATOMIC_ACQUIRE)
+#define rcu_dereference_protected(p, c) (p)
+#define rcu_assign_pointer(p, v) __atomic_store_n(&(p), (v), __ATOMIC_RELEASE)
+#define RCU_INIT_POINTER(p, v) ((p) = (v))
+
+static inline void synchronize_rcu(void){
+	u64 seen[NR_CPUS];
+	int cpu;
+
+	__atomic_thread_fence(__ATOMIC_SEQ_CST); // stores before it are seen by sections after it
+	for(cpu = 0;cpu < NR_CPUS;cpu++){
+		seen[cpu] = __atomic_load_n(&hamming_shim_rcu[cpu], __ATOMIC_SEQ_CST);
+	}
+	for(cpu = 0;cpu < NR_CPUS;cpu++){
+		while((seen[cpu] & 1) && cpu != hamming_shim_cpu &&
+		      __atomic_load_n(&hamming_shim_rcu[cpu], __ATOMIC_ACQUIRE) == seen[cpu]){
+			sched_yield();
+		}
+	}
+}
+
+/*
+  NUMA, nodes only change which counters and reserves things go to
+ */
+
+#define MAX_NUMNODES 64
+#define NUMA_NO_NODE (-1)
+#define N_MEMORY 0
+
+static int hamming_shim_nodes = 1;
+static int hamming_shim_node; // node of the CPU
+
+#define for_each_node_state(nid, state) for((nid) = 0;(nid) < hamming_shim_nodes;(nid)++)
+#define num_node_state(state) hamming_shim_nodes
+#define numa_mem_id() hamming_shim_node
+#define cpu_to_mem(cpu) ((void)(cpu), hamming_shim_node)
+
+#define kzalloc_node(size, flags, nid) ((void)(nid), kzalloc(size, flags))
+#define kmem_cache_alloc_node(cache, flags, nid) ((void)(nid), kmem_cache_alloc(cache, flags))
+#define alloc_pages_node(nid, flags, order) ((void)(nid), alloc_pages(flags, order))
+
+#define GOLDEN_RATIO_64 0x61C8864680B583EBull
+#define hash_64(val, bits) ((u64)((val)*GOLDEN_RATIO_64) >> (64 - (bits)))
+
+/*
+  Lists
+ */
+
+struct list_head{
+	struct list_head *next, *prev;
+};
+
+#define INIT_LIST_HEAD(head) do{ (head)->next = (head); (head)->prev = (head); }while(0)
+#define list_empty(head) ((head)->next == (head))
+#define LIST_HEAD(name) struct list_head name = { &(name), &(name) }
+#define list_first_entry(head, type, member) container_of((head)->next, type, member)
+#define list_for_each_entry_safe(pos, n, head, member)					\
+	for((pos) = container_of((head)->next, __typeof__(*(pos)), member),		\
+		    (n) = container_of((pos)->member.next, __typeof__(*(pos)), member);	\
+	    &(pos)->member != (head);							\
+	    (pos) = (n), (n) = container_of((n)->member.next, __typeof__(*(n)), member))
+
+static inline void list_add(struct list_head *entry, struct list_head *head){
+	entry->next = head->next;
+	entry->prev = head;
+	head->next->prev = entry;
+	head->next = entry;
+}
+
+static inline void list_add_tail(struct list_head *entry, struct list_head *head){
+	list_add(entry, head->prev);
+}
+
+static inline void list_del(struct list_head *entry){
+	entry->prev->next = entry->next;
+	entry->next->prev = entry->prev;
+	entry->next = entry->prev = NULL;
+}
+
+static inline void list_del_init(struct list_head *entry){
+	list_del(entry);
+	INIT_LIST_HEAD(entry);
+}
+
+// moves what's on list to the front of head, list is left empty
+static inline void list_splice_init(struct list_head *list, struct list_head *head){
+	if(!list_empty(list)){
+		list->next->prev = head;
+		list->prev->next = head->next;
+		head->next->prev = list->prev;
+		head->next = list->next;
+		INIT_LIST_HEAD(list);
+	}
+}
+
+/*
+  Locking
+ */
+
+struct rw_semaphore{
+	pthread_rwlock_t lock;
+};
+
+#define init_rwsem(sem) pthread_rwlock_init(&(sem)->lock, NULL)
+#define down_read(sem) pthread_rwlock_rdlock(&(sem)->lock)
+#define up_read(sem) pthread_rwlock_unlock(&(sem)->lock)
+#define down_write(sem) pthread_rwlock_wrlock(&(sem)->lock)
+#define up_write(sem) pthread_rwlock_unlock(&(sem)->lock)
+
+// writers are preferred, a waiting percpu_down_write holds new readers off like it does in the kernel
+struct percpu_rw_semaphore{
+	pthread_rwlock_t lock;
+};
+
+#define DEFINE_STATIC_PERCPU_RWSEM(name) struct percpu_rw_semaphore name = { PTHREAD_RWLOCK_WRITER_NONRECURSIVE_INITIALIZER_NP }
+#define percpu_down_read(sem) pthread_rwlock_rdlock(&(sem)->lock)
+#define percpu_up_read(sem) pthread_rwlock_unlock(&(sem)->lock)
+#define percpu_down_write(sem) pthread_rwlock_wrlock(&(sem)->lock)
+#define percpu_up_write(sem) pthread_rwlock_unlock(&(sem)->lock)
+
+typedef struct{
+	pthread_mutex_t lock;
+} spinlock_t;
+
+#define DEFINE_SPINLOCK(x) spinlock_t x = { PTHREAD_MUTEX_INITIALIZER }
+#define spin_lock_init(l) pthread_mutex_init(&(l)->lock, NULL)
+#define spin_lock(l) pthread_mutex_lock(&(l)->lock)
+#define spin_unlock(l) pthread_mutex_unlock(&(l)->lock)
+
+// odd while a write is in progress, writers are serialized by the caller
+typedef struct{
+	unsigned sequence;
+} seqcount_t;
+
+#define seqcount_init(s) ((s)->sequence = 0)
+
+static inline unsigned read_seqcount_begin(const seqcount_t *s){
+	unsigned seq;
+	while((seq = __atomic_load_n(&s->sequence, __ATOMIC_ACQUIRE)) & 1){
+		sched_yield();
+	}
+	return seq;
+}
+
+static inline int read_seqcount_retry(const seqcount_t *s, unsigned start){
+	__atomic_thread_fence(__ATOMIC_ACQUIRE);
+	return __atomic_load_n(&s->sequence, __ATOMIC_RELAXED) != start;
+}
+
+static inline unsigned raw_read_seqcount(const seqcount_t *s){
+	return __atomic_load_n(&s->sequence, __ATOMIC_ACQUIRE);
+}
+
+static inline void write_seqcount_begin(seqcount_t *s){
+	__atomic_store_n(&s->sequence, s->sequence + 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+static inline void write_seqcount_end(seqcount_t *s){
+	__atomic_store_n(&s->sequence, s->sequence + 1, __ATOMIC_RELEASE);
+}
+
+typedef struct{
+	s64 counter;
+} atomic64_t;
+
+#define atomic64_read(v) __atomic_load_n(&(v)->counter, __ATOMIC_RELAXED)
+#define atomic64_set(v, i) __atomic_store_n(&(v)->counter, (i), __ATOMIC_RELAXED)
+#define atomic64_add(i, v) ((void)__atomic_fetch_add(&(v)->counter, (i), __ATOMIC_RELAXED))
+#define atomic64_inc(v) atomic64_add(1, v)
+#define atomic64_dec(v) atomic64_add(-1, v)
+#define atomic64_sub(i, v) atomic64_add(-(s64)(i), v)
+
+typedef struct{
+	int counter;
+} atomic_t;
+
+#define atomic_read(v) __atomic_load_n(&(v)->counter, __ATOMIC_RELAXED)
+#define atomic_set(v, i) __atomic_store_n(&(v)->counter, (i), __ATOMIC_RELAXED)
+#define atomic_inc(v) ((void)__atomic_fetch_add(&(v)->counter, 1, __ATOMIC_RELAXED))
+#define atomic_dec_and_test(v) (__atomic_sub_fetch(&(v)->counter, 1, __ATOMIC_SEQ_CST) == 0)
+
+static inline bool atomic_inc_not_zero(atomic_t *v){
+	int old = __atomic_load_n(&v->counter, __ATOMIC_RELAXED);
+
+	do{
+		if(old == 0){
+			return false;
+		}
+	}while(!__atomic_compare_exchange_n(&v->counter, &old, old + 1, false, __ATOMIC_SEQ_CST, __ATOMIC_RELAXED));
+	return true;
+}
+
+/*
+  Workqueues, one thread each running work in queue order
+ */
+
+#define WQ_UNBOUND (1 << 1)
+#define WQ_MEM_RECLAIM (1 << 3)
+#define WQ_HIGHPRI (1 << 4)
+
+struct work_struct;
+typedef void (*work_func_t)(struct work_struct *work);
+
+struct work_struct{
+	work_func_t func;
+	bool pending;
+	struct work_struct *next;
+	struct workqueue_struct *wq; // last queued on, for flush_work
+};
+
+#define INIT_WORK(w, f) do{ (w)->func = (f); (w)->pending = false; (w)->next = NULL; (w)->wq = NULL; }while(0)
+
+struct workqueue_struct{
+	pthread_t thread;
+	pthread_mutex_t lock;
+	pthread_cond_t wake;
+	pthread_cond_t idle;
+	struct work_struct *head;
+	struct work_struct *tail;
+	bool running;
+	struct work_struct *current; // while running
+	bool stop;
+};
+
+static void *hamming_shim_worker(void *arg){
+	struct workqueue_struct *wq = arg;
+	struct work_struct *work;
+
+	hamming_shim_cpu_online();
+	pthread_mutex_lock(&wq->lock);
+	while(true){
+		while(wq->head == NULL && !wq->stop){
+			pthread_cond_wait(&wq->wake, &wq->lock);
+		}
+		if(wq->head == NULL){
+			break;
+		}
+		work = wq->head;
+		wq->head = work->next;
+		if(wq->head == NULL){
+			wq->tail = NULL;
+		}
+		work->pending = false; // can be queued again while it runs
+		wq->running = true;
+		wq->current = work;
+		pthread_mutex_unlock(&wq->lock);
+		work->func(work);
+		pthread_mutex_lock(&wq->lock);
+		wq->running = false;
+		wq->current = NULL;
+		pthread_cond_broadcast(&wq->idle);
+	}
+	pthread_mutex_unlock(&wq->lock);
+	hamming_shim_cpu_offline();
+	return NULL;
+}
+
+static inline struct workqueue_struct *alloc_workqueue(const char *name, unsigned int flags, int max_active){
+	struct workqueue_struct *wq = calloc(1, sizeof(struct workqueue_struct));
+	(void)name;
+	(void)flags;
+	(void)max_active;
+	if(wq == NULL){
+		return NULL;
+	}
+	pthread_mutex_init(&wq->lock, NULL);
+	pthread_cond_init(&wq->wake, NULL);
+	pthread_cond_init(&wq->idle, NULL);
+	if(pthread_create(&wq->thread, NULL, hamming_shim_worker, wq)){
+		free(wq);
+		return NULL;
+	}
+	return wq;
+}
+
+static inline bool queue_work(struct workqueue_struct *wq, struct work_struct *work){
+	bool queued = false;
+
+	pthread_mutex_lock(&wq->lock);
+	if(!work->pending){
+		work->pending = true;
+		work->next = NULL;
+		work->wq = wq;
+		if(wq->tail){
+			wq->tail->next = work;
+		}else{
+			wq->head = work;
+		}
+		wq->tail = work;
+		pthread_cond_signal(&wq->wake);
+		queued = true;
+	}
+	pthread_mutex_unlock(&wq->lock);
+	return queued;
+}
+
+static inline void flush_workqueue(struct workqueue_struct *wq){
+	pthread_mutex_lock(&wq->lock);
+	while(wq->head != NULL || wq->running){
+		pthread_cond_wait(&wq->idle, &wq->lock);
+	}
+	pthread_mutex_unlock(&wq->lock);
+}
+
+// waits for work to be neither queued nor running, false if it was idle already
+static inline bool flush_work(struct work_struct *work){
+	struct workqueue_struct *wq = work->wq;
+	bool busy = false;
+
+	if(wq == NULL){
+		return false;
+	}
+	pthread_mutex_lock(&wq->lock);
+	while(work->pending || wq->current == work){
+		busy = true;
+		pthread_cond_wait(&wq->idle, &wq->lock);
+	}
+	pthread_mutex_unlock(&wq->lock);
+	return busy;
+}
+
+static inline void destroy_workqueue(struct workqueue_struct *wq){
+	pthread_mutex_lock(&wq->lock);
+	wq->stop = true;
+	pthread_cond_signal(&wq->wake);
+	pthread_mutex_unlock(&wq->lock);
+	pthread_join(wq->thread, NULL); // drains what's queued first
+	free(wq);
+}
+
+/*
+  Errors as pointers, like the kernel's
+ */
+
+#define MAX_ERRNO 4095
+#define ERR_PTR(err) ((void*)(long)(err))
+#define PTR_ERR(ptr) ((long)(ptr))
+#define IS_ERR(ptr) ((unsigned long)(ptr) >= (unsigned long)-MAX_ERRNO)
+
+/*
+  Block IO
+ */
+
+#define REQ_OP_BITS 8
+#define REQ_OP_MASK ((1 << REQ_OP_BITS) - 1)
+enum req_opf{
+	REQ_OP_READ = 0,
+	REQ_OP_WRITE = 1,
+	REQ_OP_FLUSH = 2,
+	REQ_OP_DISCARD = 3,
+	REQ_OP_WRITE_ZEROES = 9
+};
+
+typedef u8 blk_status_t;
+#define BLK_STS_OK 0
+#define BLK_STS_IOERR 10
+
+struct bio_vec{
+	struct page *bv_page;
+	unsigned int bv_len;
+	unsigned int bv_offset;
+};
+
+struct bvec_iter{
+	sector_t bi_sector;
+	unsigned int bi_size;
+	unsigned int bi_idx;
+};
+
+struct bio{
+	unsigned int bi_opf;
+	u8 bi_status;
+	bool bi_done; // set by bio_endio
+	unsigned short bi_vcnt;
+	struct bio_vec *bi_io_vec;
+	struct bvec_iter bi_iter;
+	struct bio *bi_next; // in a request
+};
+
+#define bio_op(bio) ((bio)->bi_opf & REQ_OP_MASK)
+#define op_is_write(op) ((op) & 1)
+#define bio_for_each_segment(bvl, bio, iter)				\
+	for((iter) = (bio)->bi_iter;					\
+	    (iter).bi_idx < (bio)->bi_vcnt &&				\
+		    ((bvl) = (bio)->bi_io_vec[(iter).bi_idx], true);	\
+	    (iter).bi_idx++)
+
+static inline void bio_endio(struct bio *bio){
+	bio->bi_done = true;
+}
+
+static inline void bio_io_error(struct bio *bio){
+	bio->bi_status = BLK_STS_IOERR;
+	bio_endio(bio);
+}
+
+struct module;
+#define THIS_MODULE ((struct module*)NULL)
+
+struct block_device;
+struct block_device_operations{
+	struct module *owner;
+};
+
+struct queue_limits{
+	unsigned int features;
+	unsigned int logical_block_size;
+	unsigned int physical_block_size;
+	unsigned int io_min;
+	unsigned int io_opt;
+	unsigned int discard_granularity;
+	unsigned int max_hw_discard_sectors;
+	unsigned int max_write_zeroes_sectors;
+};
+
+struct request_queue;
+
+// what the block layer made of one or more bios, see hamming_shim_submit_bios
+struct request{
+	struct request_queue *q;
+	struct blk_mq_hw_ctx *mq_hctx;
+	unsigned int cmd_flags;
+	sector_t __sector;
+	unsigned int __data_len;
+	struct bio *bio; // chained through bi_next
+	struct list_head queuelist; // the driver's once dispatched
+};
+
+#define req_op(rq) ((rq)->cmd_flags & REQ_OP_MASK)
+#define blk_rq_pos(rq) ((rq)->__sector)
+#define blk_rq_bytes(rq) ((rq)->__data_len)
+
+struct req_iterator{
+	struct bvec_iter iter;
+	struct bio *bio;
+};
+
+#define rq_for_each_segment(bvl, rq, it)					\
+	for((it).bio = (rq)->bio;(it).bio != NULL;(it).bio = (it).bio->bi_next) \
+		bio_for_each_segment(bvl, (it).bio, (it).iter)
+
+struct blk_mq_hw_ctx{
+	struct request_queue *queue;
+	unsigned int queue_num;
+	void *driver_data;
+};
+
+struct blk_mq_queue_data{
+	struct request *rq;
+	bool last; // of what's dispatched together
+};
+
+struct blk_mq_ops{
+	blk_status_t (*queue_rq)(struct blk_mq_hw_ctx *hctx, const struct blk_mq_queue_data *bd);
+	void (*commit_rqs)(struct blk_mq_hw_ctx *hctx);
+	int (*init_hctx)(struct blk_mq_hw_ctx *hctx, void *data, unsigned int index);
+};
+
+#define BLK_MQ_F_SHOULD_MERGE (1 << 0)
+#define BLK_MQ_F_BLOCKING (1 << 5)
+#define BLK_MQ_MAX_DEPTH 10240
+
+struct blk_mq_tag_set{
+	const struct blk_mq_ops *ops;
+	unsigned int nr_hw_queues;
+	unsigned int queue_depth; // recorded, requests never wait for a tag
+	int numa_node;
+	unsigned int flags;
+	void *driver_data;
+	void *tags; // set once allocated
+};
+
+struct request_queue{
+	void *queuedata;
+	struct queue_limits limits;
+	struct blk_mq_tag_set *tag_set;
+	struct blk_mq_hw_ctx *hctx; // tag_set->nr_hw_queues of them
+};
+
+struct gendisk{
+	int major;
+	int first_minor;
+	const struct block_device_operations *fops;
+	struct request_queue *queue;
+	void *private_data;
+	char disk_name[32];
+	sector_t capacity;
+	int minors;
+	int read_only;
+};
+
+static inline int register_blkdev(unsigned int major, const char *name){
+	(void)name;
+	return major ? (int)major : 254;
+}
+
+static inline void unregister_blkdev(unsigned int major, const char *name){
+	(void)major;
+	(void)name;
+}
+
+static inline int blk_mq_alloc_tag_set(struct blk_mq_tag_set *set){
+	if(set->nr_hw_queues == 0 || set->queue_depth == 0 || set->queue_depth > BLK_MQ_MAX_DEPTH){
+		return -EINVAL;
+	}
+	set->tags = calloc(set->nr_hw_queues, sizeof(void*));
+	return set->tags ? 0 : -ENOMEM;
+}
+
+static inline void blk_mq_free_tag_set(struct blk_mq_tag_set *set){
+	free(set->tags);
+	set->tags = NULL;
+}
+
+// the disk and its queue, a hardware context per queue of the tag set
+static inline struct gendisk *blk_mq_alloc_disk(struct blk_mq_tag_set *set, struct queue_limits *lim, void *queuedata){
+	struct gendisk *disk = calloc(1, sizeof(struct gendisk));
+	struct request_queue *q = calloc(1, sizeof(struct request_queue));
+	unsigned int i;
+
+	if(disk == NULL || q == NULL || (q->hctx = calloc(set->nr_hw_queues, sizeof(struct blk_mq_hw_ctx))) == NULL){
+		free(disk);
+		free(q);
+		return ERR_PTR(-ENOMEM);
+	}
+	q->queuedata = queuedata;
+	if(lim != NULL){
+		q->limits = *lim;
+	}
+	q->tag_set = set;
+	for(i = 0;i < set->nr_hw_queues;i++){
+		q->hctx[i].queue = q;
+		q->hctx[i].queue_num = i;
+		if(set->ops->init_hctx && set->ops->init_hctx(&q->hctx[i], set->driver_data, i) < 0){
+			free(q->hctx);
+			free(q);
+			free(disk);
+			return ERR_PTR(-ENOMEM);
+		}
+	}
+	disk->queue = q;
+	return disk;
+}
+
+static inline int add_disk(struct gendisk *disk){
+	(void)disk;
+	return 0;
+}
+
+static inline void del_gendisk(struct gendisk *disk){
+	(void)disk;
+}
+
+// the queue goes with the disk
+static inline void put_disk(struct gendisk *disk){
+	if(disk->queue){
+		free(disk->queue->hctx);
+		free(disk->queue);
+	}
+	free(disk);
+}
+
+static inline void set_capacity(struct gendisk *disk, sector_t size){
+	disk->capacity = size;
+}
+
+static inline sector_t get_capacity(struct gendisk *disk){
+	return disk->capacity;
+}
+
+static inline void set_disk_ro(struct gendisk *disk, int flag){
+	disk->read_only = flag;
+}
+
+static inline void blk_mq_start_request(struct request *rq){
+	(void)rq;
+}
+
+static inline void blk_mq_end_request(struct request *rq, blk_status_t status){
+	struct bio *bio;
+
+	for(bio = rq->bio;bio != NULL;bio = bio->bi_next){
+		bio->bi_status = status;
+		bio_endio(bio);
+	}
+}
+
+#define HAMMING_SHIM_PLUG 64 // requests dispatched together at most
+
+/**
+ * \brief Submit bios like a plug being flushed
+ *
+ * Every bio is a request of its own (nothing is merged), queued on the
+ * hardware context of the submitting CPU, and up to HAMMING_SHIM_PLUG of
+ * them are dispatched together with the last one marked. Completion is
+ * whenever the driver ends the request, bi_done says whether it did.
+ *
+ * \param[in] q		Queue of the disk
+ * \param[in] bios		Bios to submit
+ * \param[in] count		How many
+ */
+static inline void hamming_shim_submit_bios(struct request_queue *q, struct bio **bios, int count){
+	struct blk_mq_hw_ctx *hctx = &q->hctx[hamming_shim_cpu % q->tag_set->nr_hw_queues];
+	struct request rqs[HAMMING_SHIM_PLUG];
+	struct blk_mq_queue_data bd;
+	blk_status_t status;
+	int i, n;
+
+	while(count > 0){
+		n = min_t(int, count, HAMMING_SHIM_PLUG);
+		for(i = 0;i < n;i++){
+			memset(&rqs[i], 0, sizeof(rqs[i]));
+			rqs[i].q = q;
+			rqs[i].mq_hctx = hctx;
+			rqs[i].cmd_flags = bios[i]->bi_opf;
+			rqs[i].__sector = bios[i]->bi_iter.bi_sector;
+			rqs[i].__data_len = bios[i]->bi_iter.bi_size;
+			rqs[i].bio = bios[i];
+			bd.rq = &rqs[i];
+			bd.last = i == n - 1;
+			status = q->tag_set->ops->queue_rq(hctx, &bd);
+			if(status != BLK_STS_OK){
+				blk_mq_end_request(&rqs[i], status);
+			}
+		}
+		bios += n;
+		count -= n;
+	}
+}
+
+static inline void hamming_shim_submit_bio(struct request_queue *q, struct bio *bio){
+	hamming_shim_submit_bios(q, &bio, 1);
+}
+
+/*
+  Files
+ */
+
+#ifndef O_LARGEFILE
+#define O_LARGEFILE 0
+#endif
+
+struct file{
+	int fd;
+};
+
+static inline struct file *filp_open(const char *path, int flags, umode_t mode){
+	struct file *file = malloc(sizeof(struct file));
+	if(!file){
+		return ERR_PTR(-ENOMEM);
+	}
+	file->fd = open(path, flags, mode);
+	if(file->fd < 0){
+		int err = errno;
+		free(file);
+		return ERR_PTR(-err);
+	}
+	return file;
+}
+
+static inline int filp_close(struct file *file, void *id){
+	(void)id;
+	close(file->fd);
+	free(file);
+	return 0;
+}
+
+static inline ssize_t kernel_read(struct file *file, void *buf, size_t count, loff_t *pos){
+	ssize_t ret = pread(file->fd, buf, count, *pos);
+	if(ret < 0){
+		return -errno;
+	}
+	*pos += ret;
+	return ret;
+}
+
+static inline ssize_t kernel_write(struct file *file, const void *buf, size_t count, loff_t *pos){
+	ssize_t ret = pwrite(file->fd, buf, count, *pos);
+	if(ret < 0){
+		return -errno;
+	}
+	*pos += ret;
+	return ret;
+}
+
+static inline loff_t vfs_llseek(struct file *file, loff_t offset, int whence){
+	loff_t ret = lseek(file->fd, offset, whence);
+	return ret < 0 ? -errno : ret;
+}
+
+static inline int vfs_fsync(struct file *file, int datasync){
+	return (datasync ? fdatasync(file->fd) : fsync(file->fd)) < 0 ? -errno : 0;
+}
+
+/*
+  Bitmaps, bit at a time, they're only walked by writeback
+ */
+
+#define BITS_PER_LONG (sizeof(long)*8)
+#define BITS_TO_LONGS(n) (((n) + BITS_PER_LONG - 1)/BITS_PER_LONG)
+
+static inline bool hamming_shim_test_bit(const unsigned long *map, unsigned long bit){
+	return (map[bit/BITS_PER_LONG] >> (bit % BITS_PER_LONG)) & 1;
+}
+
+static inline void bitmap_set(unsigned long *map, unsigned int start, int len){
+	for(; len > 0; start++, len--){
+		map[start/BITS_PER_LONG] |= 1UL << (start % BITS_PER_LONG);
+	}
+}
+
+static inline void bitmap_clear(unsigned long *map, unsigned int start, int len){
+	for(; len > 0; start++, len--){
+		map[start/BITS_PER_LONG] &= ~(1UL << (start % BITS_PER_LONG));
+	}
+}
+
+// first run of nr clear bits at or after start, past size if there's none, align_mask is ignored
+static inline unsigned long bitmap_find_next_zero_area(unsigned long *map, unsigned long size, unsigned long start,
+		unsigned int nr, unsigned long align_mask){
+	unsigned long run = 0;
+	(void)align_mask;
+	for(; start < size; start++){
+		if(hamming_shim_test_bit(map, start)){
+			run = 0;
+		}else if(++run == nr){
+			return start + 1 - nr;
+		}
+	}
+	return size + 1;
+}
+
+/*
+  CRC32C, a byte at a time off a table built on first use
+ */
+
+static u32 hamming_shim_crc32c_table[256];
+
+static inline u32 crc32c(u32 crc, const void *address, unsigned int length){
+	const u8 *p = address;
+	u32 i, j, c;
+
+	if(hamming_shim_crc32c_table[1] == 0){
+		for(i = 0;i < 256;i++){
+			for(c = i, j = 0;j < 8;j++){
+				c = (c >> 1) ^ (c & 1 ? 0x82F63B78 : 0);
+			}
+			hamming_shim_crc32c_table[i] = c;
+		}
+	}
+	while(length--){
+		crc = (crc >> 8) ^ hamming_shim_crc32c_table[(crc ^ *p++) & 0xFF];
+	}
+	return crc;
+}
+
+/*
+  LZ4 block format, greedy matching over a hash table of the last position
+  of every 4 byte sequence. Output is what the kernel's LZ4 decompresses,
+  not byte for byte what it compresses to.
+ */
+
+#define LZ4_MEM_COMPRESS (4096*sizeof(u32))
+#define LZ4_SHIM_HASH_BITS 12
+#define LZ4_SHIM_MIN_MATCH 4
+#define LZ4_SHIM_MFLIMIT 12 // the last match starts this far before the end
+#define LZ4_SHIM_LAST_LITERALS 5 // and ends this far before it
+#define LZ4_SHIM_MAX_DISTANCE 65535
+
+static inline u32 lz4_shim_read32(const u8 *p){
+	u32 word;
+	memcpy(&word, p, sizeof(word));
+	return word;
+}
+
+static inline u8 *lz4_shim_length(u8 *op, size_t len){
+	while(len >= 255){
+		*op++ = 255;
+		len -= 255;
+	}
+	*op++ = len;
+	return op;
+}
+
+static inline int LZ4_compress_default(const char *source, char *dest, int inputSize, int maxOutputSize, void *wrkmem){
+	const u8 *src = (const u8*)source, *ip = src, *anchor = src, *ref;
+	const u8 *end = src + inputSize, *mflimit = end - LZ4_SHIM_MFLIMIT, *matchlimit = end - LZ4_SHIM_LAST_LITERALS;
+	u8 *op = (u8*)dest, *oend = op + maxOutputSize, *token;
+	u32 *table = wrkmem, seq, hash;
+	size_t lit, match;
+
+	memset(table, 0, LZ4_MEM_COMPRESS);
+	while(inputSize > LZ4_SHIM_MFLIMIT && ip < mflimit){
+		seq = lz4_shim_read32(ip);
+		hash = (seq*2654435761U) >> (32 - LZ4_SHIM_HASH_BITS);
+		ref = src + table[hash];
+		table[hash] = ip - src;
+		if(ref >= ip || ip - ref > LZ4_SHIM_MAX_DISTANCE || lz4_shim_read32(ref) != seq){
+			ip++;
+			continue;
+		}
+		while(ip > anchor && ref > src && ip[-1] == ref[-1]){
+			ip--;
+			ref--;
+		}
+		match = LZ4_SHIM_MIN_MATCH;
+		while(ip + match < matchlimit && ip[match] == ref[match]){
+			match++;
+		}
+		lit = ip - anchor;
+		if(op + 1 + lit/255 + 1 + lit + 2 + (match - LZ4_SHIM_MIN_MATCH)/255 + 1 > oend){
+			return 0;
+		}
+		token = op++;
+		*token = min_t(size_t, lit, 15) << 4;
+		if(lit >= 15){
+			op = lz4_shim_length(op, lit - 15);
+		}
+		memcpy(op, anchor, lit);
+		op += lit;
+		*op++ = (ip - ref) & 0xff;
+		*op++ = (ip - ref) >> 8;
+		*token |= min_t(size_t, match - LZ4_SHIM_MIN_MATCH, 15);
+		if(match - LZ4_SHIM_MIN_MATCH >= 15){
+			op = lz4_shim_length(op, match - LZ4_SHIM_MIN_MATCH - 15);
+		}
+		ip += match;
+		anchor = ip;
+	}
+	lit = end - anchor;
+	if(op + 1 + lit/255 + 1 + lit > oend){
+		return 0;
+	}
+	token = op++;
+	*token = min_t(size_t, lit, 15) << 4;
+	if(lit >= 15){
+		op = lz4_shim_length(op, lit - 15);
+	}
+	memcpy(op, anchor, lit);
+	op += lit;
+	return op - (u8*)dest;
+}
+
+static inline int LZ4_decompress_safe(const char *source, char *dest, int compressedSize, int maxDecompressedSize){
+	const u8 *ip = (const u8*)source, *iend = ip + compressedSize, *ref;
+	u8 *op = (u8*)dest, *oend = op + maxDecompressedSize;
+	size_t lit, match, offset;
+	u8 token, byte;
+
+	while(ip < iend){
+		token = *ip++;
+		lit = token >> 4;
+		if(lit == 15){
+			do{
+				if(ip >= iend){
+					return -1;
+				}
+				byte = *ip++;
+				lit += byte;
+			}while(byte == 255);
+		}
+		if(lit > (size_t)(iend - ip) || lit > (size_t)(oend - op)){
+			return -1;
+		}
+		memcpy(op, ip, lit);
+		op += lit;
+		ip += lit;
+		if(ip == iend){
+			break; // the last sequence is literals only
+		}
+		if(iend - ip < 2){
+			return -1;
+		}
+		offset = ip[0] | ip[1] << 8;
+		ip += 2;
+		if(offset == 0 || offset > (size_t)(op - (u8*)dest)){
+			return -1;
+		}
+		match = token & 15;
+		if(match == 15){
+			do{
+				if(ip >= iend){
+					return -1;
+				}
+				byte = *ip++;
+				match += byte;
+			}while(byte == 255);
+		}
+		match += LZ4_SHIM_MIN_MATCH;
+		if(match > (size_t)(oend - op)){
+			return -1;
+		}
+		for(ref = op - offset;match > 0;match--){ // may overlap what it writes
+			*op++ = *ref++;
+		}
+	}
+	return op - (u8*)dest;
+}
+
+/*
+  sysfs, attributes are only collected so the bench can call show()
+ */
+
+#define S_IRUGO (S_IRUSR | S_IRGRP | S_IROTH)
+
+struct attribute{
+	const char *name;
+	umode_t mode;
+};
+
+struct kobject{
+	const char *name;
+	const struct attribute_group *group;
+};
+
+struct kobj_attribute{
+	struct attribute attr;
+	ssize_t (*show)(struct kobject *kobj, struct kobj_attribute *attr, char *buf);
+	ssize_t (*store)(struct kobject *kobj, struct kobj_attribute *attr, const char *buf, size_t count);
+};
+
+struct attribute_group{
+	struct attribute **attrs;
+};
+
+#define __ATTR(_name, _mode, _show, _store) { .attr = { .name = #_name, .mode = (_mode) }, .show = (_show), .store = (_store) }
+
+static struct kobject hamming_shim_kernel_kobj;
+#define kernel_kobj (&hamming_shim_kernel_kobj)
+
+static inline struct kobject *kobject_create_and_add(const char *name, struct kobject *parent){
+	struct kobject *kobj = calloc(1, sizeof(struct kobject));
+	(void)parent;
+	if(kobj){
+		kobj->name = name;
+	}
+	return kobj;
+}
+
+static inline void kobject_put(struct kobject *kobj){
+	free(kobj);
+}
+
+static inline int sysfs_create_group(struct kobject *kobj, const struct attribute_group *grp){
+	kobj->group = grp;
+	return 0;
+}
+
+static inline void sysfs_remove_group(struct kobject *kobj, const struct attribute_group *grp){
+	(void)grp;
+	kobj->group = NULL;
+}
+
+#endif